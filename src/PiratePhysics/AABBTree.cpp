@@ -1,379 +1,317 @@
 #include "AABBTree.hpp"
+#include <algorithm>
+#include <cassert>
 
 using namespace Eigen;
 using namespace std;
 using namespace PiratePhysics;
 
-static unsigned sDepth = 0;
-
-AABBTree::AABBTree(const Vector3f *vertices, unsigned numVerts,
-                   const unsigned *indices, unsigned numFaces) : mVertices(vertices), mNumVerts(numVerts),
-                                                                              mIndices(indices), mNumFaces(numFaces)
+AABBTree::AABBTree(VertexView vertices, unsigned numVerts,
+                   const unsigned *indices, unsigned numFaces, BuildMode mode,
+                   unsigned numThreads) : BVH(TriangleTraits{vertices, numVerts, indices, numFaces},
+                                              mode != BuildMode::SAH, kMaxFacesPerLeaf, DeferBuild()),
+                                          mBuildMode(mode)
 {
-    mFaces.reserve(mNumFaces);
-    mFaceBounds.reserve(mNumFaces);
-
-    for (unsigned i = 0; i < numFaces; ++i)
-    {
-        Bounds top;
-        CalculateFaceBounds(&i, 1, top.mMin, top.mMax);
-        mFaces.push_back(i);
-        mFaceBounds.push_back(top);
-    }
-
-    mNodes.reserve(static_cast<unsigned>(numFaces*1.5f));
-    mFreeNode = 1;
-
-    BuildRecursive(0, &mFaces[0], numFaces);
-    assert(sDepth == 0);
+    PrepareBuild(numThreads);
+    Build();
 }
 
-AABBTree::~AABBTree()
+AABBTree::AABBTree(VertexView vertices, unsigned numVerts,
+                   const unsigned *indices, unsigned numFaces, const void *image, size_t imageSize,
+                   BuildMode mode, unsigned numThreads) : BVH(TriangleTraits{vertices, numVerts, indices, numFaces},
+                                                              mode != BuildMode::SAH, kMaxFacesPerLeaf, DeferBuild()),
+                                                          mBuildMode(mode)
 {
-    mIndices = nullptr;
-    mVertices = nullptr;
+    PrepareBuild(numThreads);
+
+    mLoaded = LoadImage(image, imageSize);
+    if (!mLoaded)
+        Build();
 }
 
-void AABBTree::CalculateFaceBounds(unsigned *faces, unsigned numFaces,
-                                   Eigen::Vector3f &outMinExtents, Eigen::Vector3f &outMaxExtents)
+void AABBTree::PrepareBuild(unsigned numThreads)
 {
-    Vector3f minExtents(numeric_limits<float>::max(), numeric_limits<float>::max(), numeric_limits<float>::max());
-    Vector3f maxExtents(-numeric_limits<float>::max(), -numeric_limits<float>::max(), -numeric_limits<float>::max());
-
-    // calculate face bounds
-    for(unsigned i = 0; i < numFaces; ++i)
-    {
-        Vector3f a = mVertices[mIndices[faces[i]*3+0]];
-        Vector3f b = mVertices[mIndices[faces[i]*3+1]];
-        Vector3f c = mVertices[mIndices[faces[i]*3+2]];
-
-        minExtents[0] = min(a[0], minExtents[0]);
-        minExtents[1] = min(a[1], minExtents[1]);
-        minExtents[2] = min(a[2], minExtents[2]);
-        maxExtents[0] = max(a[0], maxExtents[0]);
-        maxExtents[1] = max(a[1], maxExtents[1]);
-        maxExtents[2] = max(a[2], maxExtents[2]);
-
-        minExtents[0] = min(b[0], minExtents[0]);
-        minExtents[1] = min(b[1], minExtents[1]);
-        minExtents[2] = min(b[2], minExtents[2]);
-        maxExtents[0] = max(b[0], maxExtents[0]);
-        maxExtents[1] = max(b[1], maxExtents[1]);
-        maxExtents[2] = max(b[2], maxExtents[2]);
-
-        minExtents[0] = min(c[0], minExtents[0]);
-        minExtents[1] = min(c[1], minExtents[1]);
-        minExtents[2] = min(c[2], minExtents[2]);
-        maxExtents[0] = max(c[0], maxExtents[0]);
-        maxExtents[1] = max(c[1], maxExtents[1]);
-        maxExtents[2] = max(c[2], maxExtents[2]);
-    }
+    GatherPrimitives();
 
-    outMinExtents = minExtents;
-    outMaxExtents = maxExtents;
+    mMaxParallelDepth = BVHBuilder::GetMaxParallelDepth(numThreads);
+    mNumThreads = numThreads;
 }
 
-void AABBTree::BuildRecursive(unsigned nodeIndex, unsigned *faces, unsigned numFaces)
+void AABBTree::Build()
 {
-    const unsigned kMaxFacesPerLeaf = 6;
+    if (mTraits.mNumFaces == 0)
+    {
+        mNodes.clear();
+        return;
+    }
 
-    // allocate more memory
-    if(nodeIndex >= mNodes.size())
+    if (mBuildMode == BuildMode::SAH || mBuildMode == BuildMode::BinnedSAH)
     {
-        unsigned s = max(static_cast<unsigned>(1.5f*mNodes.size()), 512U);
-        mNodes.resize(s);
+        // the object split builds are the ones every BVH has
+        BuildNodes();
     }
+    else if (mBuildMode == BuildMode::SBVH)
+    {
+        // the number of references is only known once the tree is built, so nodes and
+        // leaf entries are appended in depth first order instead of reserved up front
+        vector<Reference> refs(mTraits.mNumFaces);
+        Bounds rootBounds;
+        for (unsigned i = 0; i < mTraits.mNumFaces; ++i)
+        {
+            refs[i].mBounds = mBounds[i];
+            refs[i].mFace = i;
+            rootBounds.Union(mBounds[i]);
+        }
 
-    Node &n = mNodes[nodeIndex];
-    ++sDepth;
-    mTreeDepth = max(mTreeDepth, sDepth);
+        unsigned budget = static_cast<unsigned>(mTraits.mNumFaces * kSpatialSplitBudget);
 
-    CalculateFaceBounds(faces, numFaces, n.mMinExtents, n.mMaxExtents);
+        mPrimitives.clear();
+        mPrimitives.reserve(mTraits.mNumFaces + budget);
+        mNodes.clear();
+        mNodes.reserve(2 * (mTraits.mNumFaces + budget));
 
-    // calculate bounds of faces and add node
-    if(numFaces <= kMaxFacesPerLeaf)
-    {
-        n.mFaces = faces;
-        n.mNumFaces = numFaces;
-        ++mLeafNodes;
+        BuildStats stats;
+        BuildSpatialRecursive(refs, 1.0f / rootBounds.GetSurfaceArea(), 1, budget, stats);
+        mStats = stats;
+
+        mPrimitives.shrink_to_fit();
+        mNodes.shrink_to_fit();
     }
     else
     {
-        ++mInnerNodes;
+        // a binary tree with at least one face per leaf never needs more than 2n-1 nodes, every
+        // subtree gets that many slots reserved in depth first order so workers never share state
+        mNodes.resize(2 * mTraits.mNumFaces - 1);
 
-        // face counts for each branch
-        const unsigned leftCount = PartitionSAH(n, faces, numFaces);
-        const unsigned rightCount = numFaces - leftCount;
+        vector<uint64_t> codes;
+        SortMortonCodes(codes);
 
-        // alloc
-        mNodes[nodeIndex].mChildren = mFreeNode;
-        mFreeNode += 2;
+        BuildStats stats;
+        BuildLinearRecursive(0, codes.data(), mPrimitives.data(), mTraits.mNumFaces, 1, stats);
+        mStats = stats;
 
-        // split faces in half and build each side recursively
-        BuildRecursive(mNodes[nodeIndex].mChildren+0, faces, leftCount);
-        BuildRecursive(mNodes[nodeIndex].mChildren+1, faces+leftCount, rightCount);
+        BVHBuilder::CompactNodes(mNodes);
     }
 
-    --sDepth;
-    
+    mFreeNode = static_cast<unsigned>(mNodes.size());
+    mDuplicateReferences = mPrimitives.size() != mTraits.mNumFaces;
 }
 
-unsigned AABBTree::PartitionSAH(Node &n, unsigned *faces, unsigned numFaces)
+AABBTree::~AABBTree()
 {
-    unsigned bestAxis = 0;
-    unsigned bestIndex = 0;
-    float bestCost = numeric_limits<float>::max();
-
-    for(unsigned a = 0; a < 3; ++a)
-    {
-        // sort faces by centroids
-        		// sort faces by centroids
-		FaceSorter predicate(&mVertices[0], &mIndices[0], mNumFaces*3, a);
-		std::sort(faces, faces+numFaces, predicate);
-
-        		// two passes over data to calculate upper and lower bounds
-		vector<float> cumulativeLower(numFaces);
-		vector<float> cumulativeUpper(numFaces);
-
-		Bounds lower;
-		Bounds upper;
-
-		for (uint32_t i=0; i < numFaces; ++i)
-		{
-			lower.Union(mFaceBounds[faces[i]]);
-			upper.Union(mFaceBounds[faces[numFaces-i-1]]);
-
-			cumulativeLower[i] = lower.GetSurfaceArea();        
-			cumulativeUpper[numFaces-i-1] = upper.GetSurfaceArea();
-		}
-
-		float invTotalSA = 1.0f / cumulativeUpper[0];
-
-		// test all split positions
-		for (uint32_t i=0; i < numFaces-1; ++i)
-		{
-			float pBelow = cumulativeLower[i] * invTotalSA;
-			float pAbove = cumulativeUpper[i] * invTotalSA;
-
-			float cost = 0.125f + (pBelow*i + pAbove*(numFaces-i));
-			if (cost <= bestCost)
-			{
-				bestCost = cost;
-				bestIndex = i;
-				bestAxis = a;
-			}
-		}
-    }
-
-    // re-sort by best axis
-	FaceSorter predicate(&mVertices[0], &mIndices[0], mNumFaces*3, bestAxis);
-	std::sort(faces, faces+numFaces, predicate);
+    mTraits.mIndices = nullptr;
+    mTraits.mVertices = VertexView();
+}
 
-	return bestIndex+1;
+void AABBTree::BuildRecursive(vector<Node> &nodes, unsigned nodeIndex, unsigned *faces, unsigned numFaces,
+                              unsigned depth, BuildStats &stats)
+{
+    // linear and spatial split trees rebuild subtrees binned
+    const BVHBuilder builder(mBounds.data(), mCentroids.data(), mPrimitives.data(), mBinned,
+                             mMaxPrimitivesPerLeaf, mMaxParallelDepth);
+    builder.Build(nodes, nodeIndex, faces, numFaces, depth, stats);
 }
 
 bool AABBTree::TraceRay(const Eigen::Vector3f& start, const Vector3f& dir, float& outT,
-        float& u, float& v, float& w, float& faceSign, uint32_t& faceIndex) const
+        float& outU, float& outV, float& outW, float& faceSign, uint32_t& faceIndex) const
 {
-    Vector3f rcp_dir(1.0f/dir[0], 1.0f/dir[1], 1.0f/dir[2]);
-
     outT = numeric_limits<float>::max();
 
-    TraceRecursive(0, start, dir, outT, u, v, w, faceSign, faceIndex);
+    // the compressed nodes may be all that is left of the tree
+    if (mQuantizedBits == 8)
+        return TraceRayQuantized(mQuantizedNodes8, start, dir, outT, outU, outV, outW, faceSign, faceIndex);
+    if (mQuantizedBits == 16)
+        return TraceRayQuantized(mQuantizedNodes16, start, dir, outT, outU, outV, outW, faceSign, faceIndex);
+
+    if (mNodes.empty())
+        return false;
 
-    return outT != numeric_limits<float>::max();
+    if (mWideWidth == 4)
+        return TraceRayWide(mWideNodes4, start, dir, outT, outU, outV, outW, faceSign, faceIndex);
+    if (mWideWidth == 8)
+        return TraceRayWide(mWideNodes8, start, dir, outT, outU, outV, outW, faceSign, faceIndex);
+
+    return TraceBVH(mNodes.data(), start, dir, outT, [&](unsigned offset, unsigned numFaces) {
+        IntersectLeaf(offset, numFaces, start, dir, outT, outU, outV, outW, faceSign, faceIndex);
+    });
 }
 
-void AABBTree::TraceRecursive(uint32_t nodeIndex,
-    const Eigen::Vector3f& start, const Eigen::Vector3f& dir,
-    float& outT, float& outU, float& outV, float& outW,
-    float& faceSign, uint32_t& faceIndex) const
+unsigned AABBTree::TraceRayAll(const Vector3f &start, const Vector3f &dir, float maxT,
+                               RayHit *hits, unsigned maxHits) const
 {
-	const Node& node = mNodes[nodeIndex];
+    assert(!IsCompressedOnly());
+
+    if (mNodes.empty())
+        return 0;
 
-    if (node.mFaces == NULL)
+    const Vector3f rcpDir(1.0f/dir[0], 1.0f/dir[1], 1.0f/dir[2]);
+
+    unsigned numHits = 0;
+    unsigned numStored = 0;
+
+    // every box on the segment is visited, so the order children are pushed in does not matter
+    unsigned stack[kMaxTreeDepth];
+    unsigned stackSize = 0;
+
+    float dist;
+    if (IntersectRayBounds(start, rcpDir, mNodes[0].mMinExtents, mNodes[0].mMaxExtents, maxT, dist))
+        stack[stackSize++] = 0;
+
+    while (stackSize)
     {
-        // find closest node
-        const Node& leftChild = mNodes[node.mChildren+0];
-        const Node& rightChild = mNodes[node.mChildren+1];
-
-        float dist[2] = {numeric_limits<float>::max(), numeric_limits<float>::max()};
-
-        IntersectRayAABB(start, dir, leftChild.mMinExtents, leftChild.mMaxExtents, dist[0], NULL);
-        IntersectRayAABB(start, dir, rightChild.mMinExtents, rightChild.mMaxExtents, dist[1], NULL);
-        
-        uint32_t closest = 0;
-        uint32_t furthest = 1;
-		
-        if (dist[1] < dist[0])
+        const unsigned nodeIndex = stack[--stackSize];
+        const Node &node = mNodes[nodeIndex];
+
+        if (!node.IsLeaf())
         {
-            closest = 1;
-            furthest = 0;
-        }		
+            const unsigned left = node.GetLeft(nodeIndex);
+            const unsigned right = node.mOffset;
+
+            if (IntersectRayBounds(start, rcpDir, mNodes[right].mMinExtents, mNodes[right].mMaxExtents, maxT, dist))
+                stack[stackSize++] = right;
+            if (IntersectRayBounds(start, rcpDir, mNodes[left].mMinExtents, mNodes[left].mMaxExtents, maxT, dist))
+                stack[stackSize++] = left;
+            continue;
+        }
+
+        for (unsigned i = 0; i < node.mNumPrimitives; ++i)
+        {
+            const unsigned face = mPrimitives[node.mOffset + i];
+
+            RayHit hit;
+            if (!IntersectRayTriTwoSided(start, dir, mTraits.mVertices[mTraits.mIndices[face*3+0]], mTraits.mVertices[mTraits.mIndices[face*3+1]],
+                                         mTraits.mVertices[mTraits.mIndices[face*3+2]], hit.mT, hit.mU, hit.mV, hit.mW, hit.mFaceSign) ||
+                hit.mT > maxT)
+                continue;
 
-        if (dist[closest] < outT)
-            TraceRecursive(node.mChildren+closest, start, dir, outT, outU, outV, outW, faceSign, faceIndex);
+            hit.mFaceIndex = face;
+            ++numHits;
 
-        if (dist[furthest] < outT)
-            TraceRecursive(node.mChildren+furthest, start, dir, outT, outU, outV, outW, faceSign, faceIndex);
+            InsertHit(hit, hits, maxHits, numStored);
+        }
     }
-    else
-    {
-        Vector3f normal;
-        float t, u, v, w, s;
 
-        for (uint32_t i=0; i < node.mNumFaces; ++i)
-        {
-            uint32_t indexStart = node.mFaces[i]*3;
+    return numHits - (numStored - MergeHits(hits, numStored));
+}
 
-            const Vector3f& a = mVertices[mIndices[indexStart+0]];
-            const Vector3f& b = mVertices[mIndices[indexStart+1]];
-            const Vector3f& c = mVertices[mIndices[indexStart+2]];
+void AABBTree::InsertHit(const RayHit &hit, RayHit *hits, unsigned maxHits, unsigned &numStored)
+{
+    // insertion into the sorted buffer, once it is full the farthest hit falls off
+    if (numStored == maxHits && (maxHits == 0 || hits[maxHits - 1].mT <= hit.mT))
+        return;
 
+    unsigned j = numStored < maxHits ? numStored++ : maxHits - 1;
+    while (j > 0 && hits[j - 1].mT > hit.mT)
+    {
+        hits[j] = hits[j - 1];
+        --j;
+    }
+    hits[j] = hit;
+}
 
-            if (IntersectRayTriTwoSided(start, dir, a, b, c, t, u, v, w, s))
+unsigned AABBTree::MergeHits(RayHit *hits, unsigned numHits) const
+{
+    // faces sharing the edge or vertex the ray passes through all report the same crossing,
+    // only hits facing the same way are merged, an entry and exit at the same t both stay
+    const float mergeDistance = kHitMergeTolerance * (mNodes[0].mMaxExtents - mNodes[0].mMinExtents).norm();
+
+    unsigned numMerged = 0;
+    for (unsigned i = 0; i < numHits; ++i)
+    {
+        bool duplicate = false;
+        for (unsigned j = numMerged; j > 0 && hits[i].mT - hits[j - 1].mT <= mergeDistance; --j)
+        {
+            if ((hits[i].mFaceSign > 0.0f) == (hits[j - 1].mFaceSign > 0.0f))
             {
-                if (t < outT)
-                {
-                    outT = t;
-					outU = u;
-					outV = v;
-					outW = w;
-					faceSign = s;
-					faceIndex = node.mFaces[i];
-                }
+                duplicate = true;
+                break;
             }
         }
+
+        if (!duplicate)
+            hits[numMerged++] = hits[i];
     }
+
+    return numMerged;
 }
 
-bool AABBTree::IntersectRayAABB(const Vector3f& start, const Vector3f& dir,
-    const Vector3f& min, const Vector3f& max, float& t, Vector3f* normal) const
+bool AABBTree::TraceRayAny(const Vector3f &start, const Vector3f &dir, float maxT) const
 {
-	//! calculate candidate plane on each axis
-	float tx = -1.0f, ty = -1.0f, tz = -1.0f;
-	bool inside = true;
-			
-	//! use unrolled loops
-
-	//! x
-	if (start[0] < min[0])
-	{
-		if (dir[0] != 0.0f)
-			tx = (min[0]-start[0])/dir[0];
-		inside = false;
-	}
-	else if (start[0] > max[0])
-	{
-		if (dir[0] != 0.0f)
-			tx = (max[0]-start[0])/dir[0];
-		inside = false;
-	}
-
-	//! y
-	if (start[1] < min[1])
-	{
-		if (dir[1] != 0.0f)
-			ty = (min[1]-start[1])/dir[1];
-		inside = false;
-	}
-	else if (start[1] > max[1])
-	{
-		if (dir[1] != 0.0f)
-			ty = (max[1]-start[1])/dir[1];
-		inside = false;
-	}
-
-	//! z
-	if (start[2] < min[2])
-	{
-		if (dir[2] != 0.0f)
-			tz = (min[2]-start[2])/dir[2];
-		inside = false;
-	}
-	else if (start[2] > max[2])
-	{
-		if (dir[2] != 0.0f)
-			tz = (max[2]-start[2])/dir[2];
-		inside = false;
-	}
-
-	//! if point inside all planes
-	if (inside)
+    assert(!IsCompressedOnly());
+
+    if (mNodes.empty())
+        return false;
+
+    const Vector3f rcpDir(1.0f/dir[0], 1.0f/dir[1], 1.0f/dir[2]);
+
+    unsigned stack[kMaxTreeDepth];
+    unsigned stackSize = 0;
+
+    float dist;
+    if (IntersectRayBounds(start, rcpDir, mNodes[0].mMinExtents, mNodes[0].mMaxExtents, maxT, dist))
+        stack[stackSize++] = 0;
+
+    while (stackSize)
     {
-        t = 0.0f;
-		return true;
+        const unsigned nodeIndex = stack[--stackSize];
+        const Node &node = mNodes[nodeIndex];
+
+        if (!node.IsLeaf())
+        {
+            const unsigned left = node.GetLeft(nodeIndex);
+            const unsigned right = node.mOffset;
+
+            if (IntersectRayBounds(start, rcpDir, mNodes[right].mMinExtents, mNodes[right].mMaxExtents, maxT, dist))
+                stack[stackSize++] = right;
+            if (IntersectRayBounds(start, rcpDir, mNodes[left].mMinExtents, mNodes[left].mMaxExtents, maxT, dist))
+                stack[stackSize++] = left;
+            continue;
+        }
+
+        // any face in front of the end of the segment will do
+        float t = maxT, u, v, w, s;
+        uint32_t face;
+        IntersectLeaf(node.mOffset, node.mNumPrimitives, start, dir, t, u, v, w, s, face);
+        if (t < maxT)
+            return true;
     }
 
-	//! we now have t values for each of possible intersection planes
-	//! find the maximum to get the intersection point
-	float tmax = tx;
-	int taxis = 0;
-
-	if (ty > tmax)
-	{
-		tmax = ty;
-		taxis = 1;
-	}
-	if (tz > tmax)
-	{
-		tmax = tz;
-		taxis = 2;
-	}
-
-	if (tmax < 0.0f)
-		return false;
-
-	//! check that the intersection point lies on the plane we picked
-	//! we don't test the axis of closest intersection for precision reasons
-
-	//! no eps for now
-	float eps = 0.0f;
-
-	Vector3f hit = start + dir*tmax;
-
-	if ((hit[0] < min[0]-eps || hit[0] > max[0]+eps) && taxis != 0)
-		return false;
-	if ((hit[1] < min[1]-eps || hit[1] > max[1]+eps) && taxis != 1)
-		return false;
-	if ((hit[2] < min[2]-eps || hit[2] > max[2]+eps) && taxis != 2)
-		return false;
-
-	//! output results
-	t = tmax;
-			
-	return true;
+    return false;
 }
 
-
-bool AABBTree::IntersectRayTriTwoSided(const Vector3f& p, const Vector3f& dir, const Vector3f& a,
-        const Vector3f& b, const Vector3f& c, float& t, float& u, float& v, float& w,
-        float& sign) const
+void AABBTree::IntersectLeaf(unsigned offset, unsigned numFaces,
+    const Vector3f& start, const Vector3f& dir,
+    float& outT, float& outU, float& outV, float& outW, float& faceSign, uint32_t& faceIndex) const
 {
-    Vector3f ab = b - a;
-    Vector3f ac = c - a;
-    Vector3f n = ab.cross(ac);
+    if (!mLeafTriangles.empty())
+    {
+        IntersectLeafTriangles(mLeafTriangles[mLeafTriangleIndex[offset]], numFaces, start, dir,
+                               outT, outU, outV, outW, faceSign, faceIndex);
+        return;
+    }
 
-    float d = n.dot(-dir);
-    float ood = 1.0f / d; // No need to check for division by zero here as infinity aritmetic will save us...
-    Vector3f ap = p - a;
+    float t, u, v, w, s;
 
-    t = ap.dot(n) * ood;
-    if (t < 0.0f)
-        return false;
-
-    Vector3f e = (-dir).cross(ap);
-    v = ac.dot(e) * ood;
-    if (v < 0.0f || v > 1.0f) // ...here...
-        return false;
-    w = -ab.dot(e) * ood;
-    if (w < 0.0f || v + w > 1.0f) // ...and here
-        return false;
+    const unsigned *faces = &mPrimitives[offset];
+    for (uint32_t i=0; i < numFaces; ++i)
+    {
+        uint32_t indexStart = faces[i]*3;
 
-    u = 1.0f - v - w;
-    //if (normal)
-        //*normal = n;
-	sign = d;
+        const Vector3f& a = mTraits.mVertices[mTraits.mIndices[indexStart+0]];
+        const Vector3f& b = mTraits.mVertices[mTraits.mIndices[indexStart+1]];
+        const Vector3f& c = mTraits.mVertices[mTraits.mIndices[indexStart+2]];
 
-    return true;
+        if (IntersectRayTriTwoSided(start, dir, a, b, c, t, u, v, w, s))
+        {
+            if (t < outT)
+            {
+                outT = t;
+                outU = u;
+                outV = v;
+                outW = w;
+                faceSign = s;
+                faceIndex = faces[i];
+            }
+        }
+    }
 }
\ No newline at end of file
@@ -1,153 +1,606 @@
 #pragma once
 
 #include <array>
+#include <cstdint>
+#include <string>
 #include <vector>
 #include <limits>
+#include <utility>
 #include <Eigen/Eigen>
+#include "BVH.hpp"
+#include "BVHTraits.hpp"
+#include "VertexView.hpp"
 
 namespace PiratePhysics
 {
-    class AABBTree
+    /**
+     * N rays traced together by AABBTree::TraceRays, stored one lane per ray
+     */
+    template <int N>
+    struct RayPacket
+    {
+        float mStart[3][N];
+        float mDir[3][N];
+
+        // lanes that are not active are skipped and report no hit
+        bool mActive[N];
+    };
+
+    /**
+     * closest hit of every lane of a RayPacket, fields of lanes without a hit are undefined
+     * apart from mT which is left at the float maximum as in AABBTree::TraceRay
+     */
+    template <int N>
+    struct HitPacket
+    {
+        float mT[N];
+        float mU[N];
+        float mV[N];
+        float mW[N];
+        float mFaceSign[N];
+        uint32_t mFaceIndex[N];
+        bool mHit[N];
+    };
+
+    /**
+     * closest point on the mesh to a query point, u, v and w are the
+     * barycentric weights of the face's three vertices
+     */
+    struct ClosestPointHit
+    {
+        Eigen::Vector3f mPoint;
+        float mDistance;
+        uint32_t mFaceIndex;
+        float mU;
+        float mV;
+        float mW;
+        bool mHit;
+    };
+
+    /**
+     * one intersection of a ray with the mesh, u, v and w are the barycentric
+     * weights of the face's three vertices as in TraceRay
+     */
+    struct RayHit
+    {
+        float mT;
+        float mU;
+        float mV;
+        float mW;
+        float mFaceSign;
+        uint32_t mFaceIndex;
+    };
+
+    /**
+     * ray of a batch traced by AABBTree::TraceBatch
+     */
+    struct Ray
+    {
+        Eigen::Vector3f mStart;
+        Eigen::Vector3f mDir;
+    };
+
+    /**
+     * candidate pair of overlapping faces, mFaceA belongs to the tree the query
+     * was made on and mFaceB to the other tree
+     */
+    struct FacePair
+    {
+        uint32_t mFaceA;
+        uint32_t mFaceB;
+    };
+
+    /**
+     * BVH over the faces of a triangle mesh, the nodes, face list and per face bounds and
+     * centroids are those of BVH<TriangleTraits>, its SAH builds are two of the build modes
+     */
+    class AABBTree : protected BVH<TriangleTraits>
     {
-        struct Node
+    public:
+        /**
+         * Strategy used to pick the split plane of inner nodes
+         */
+        enum class BuildMode
         {
-            Node() : mNumFaces(0), mFaces(nullptr), mMinExtents(0.f, 0.f, 0.f), mMaxExtents(0.f, 0.f, 0.f)
-            {
-            }
-
-            union
-            {
-                unsigned mChildren;
-                unsigned mNumFaces;
-            };
-
-            unsigned *mFaces;
-            Eigen::Vector3f mMinExtents;
-            Eigen::Vector3f mMaxExtents;
+            SAH,       // sort centroids on every axis and test every split position
+            BinnedSAH, // bucket centroids into a fixed number of bins per axis
+            LBVH,      // sort centroids along a Morton curve and split where the codes differ
+            SBVH       // SAH that may also cut faces at a plane and reference them from both sides
         };
 
-        struct Bounds
+    private:
+        static constexpr unsigned kUnusedNode = BVHNode::kUnused;
+
+        // deepest tree the traversal stack can hold
+        static const unsigned kMaxTreeDepth = kMaxBVHDepth;
+
+        static const unsigned kMaxFacesPerLeaf = 6;
+
+        // the binary tree is a BVH over the faces, mNumPrimitives of a leaf counts its faces
+        using Node = BVHNode;
+        using Bounds = BVHBounds;
+        using Bin = BVHBin;
+        using BuildStats = BVHBuildStats;
+
+        /**
+         * Node of the optional 4 or 8 wide tree collapsed from the binary one,
+         * child bounds are stored as structure of arrays for one SIMD slab test
+         */
+        template <int W>
+        struct alignas(32) WideNode
+        {
+            float mMin[3][W];
+            float mMax[3][W];
+
+            // wide node for inner children, first entry in mPrimitives for leaf children
+            unsigned mChild[W];
+            // zero for inner children
+            unsigned mNumFaces[W];
+
+            unsigned mNumChildren;
+        };
+
+        /**
+         * Inner node of the optional compressed tree, the boxes of both children are
+         * stored as fractions of this node's own box, minimums rounded down and
+         * maximums up so the dequantized boxes always contain the real ones
+         */
+        template <typename T>
+        struct QuantizedNode
         {
-            Bounds() : mMin(std::numeric_limits<float>::max(), std::numeric_limits<float>::max(), std::numeric_limits<float>::max()),
-                       mMax(-std::numeric_limits<float>::max(), -std::numeric_limits<float>::max(), -std::numeric_limits<float>::max())
-            {
-            }
-
-            Bounds(const Bounds &rhs) : mMin(rhs.mMin), mMax(rhs.mMax)
-            {
-            }
-
-            Bounds(const Eigen::Vector3f &min, const Eigen::Vector3f &max) : mMin(min), mMax(max)
-            {
-            }
-
-            float GetVolume() const
-            {
-                Eigen::Vector3f e = mMax - mMin;
-                return e.prod();
-            }
-
-            float GetSurfaceArea() const
-            {
-                Eigen::Vector3f e = mMax - mMin;
-                return 2.0f * (e[0] * e[1] + e[0] * e[2] + e[1] * e[2]);
-            }
-
-            void Union(const Bounds &b)
-            {
-                mMin[0] = std::min(mMin[0], b.mMin[0]);
-                mMin[1] = std::min(mMin[1], b.mMin[1]);
-                mMin[2] = std::min(mMin[2], b.mMin[2]);
-
-                mMax[0] = std::max(mMax[0], b.mMax[0]);
-                mMax[1] = std::max(mMax[1], b.mMax[1]);
-                mMax[2] = std::max(mMax[2], b.mMax[2]);
-            }
-
-            Eigen::Vector3f mMin;
-            Eigen::Vector3f mMax;
+            T mMin[2][3];
+            T mMax[2][3];
+
+            // quantized node for inner children, first entry in mPrimitives for leaves
+            unsigned mChild[2];
+            // zero for inner children, a missing second child has kUnusedNode as its child
+            uint8_t mNumFaces[2];
+        };
+
+        static const unsigned kLeafTriangleLanes = 8;
+
+        // hits closer than this fraction of the tree's extent count as one crossing of a shared edge
+        static constexpr float kHitMergeTolerance = 1e-5f;
+
+        /**
+         * Faces of one leaf copied out of the mesh as a vertex and two edges,
+         * one SIMD lane per face so a leaf is tested in one kernel
+         */
+        struct alignas(32) LeafTriangles
+        {
+            float mA[3][kLeafTriangleLanes];
+            float mAB[3][kLeafTriangleLanes];
+            float mAC[3][kLeafTriangleLanes];
+            unsigned mFace[kLeafTriangleLanes];
         };
 
-        struct FaceSorter
+        /**
+         * face referenced by the spatial split build, bounds of the part of the face
+         * that falls inside the node the reference belongs to
+         */
+        struct Reference
         {
-            FaceSorter(const Eigen::Vector3f *positions, const unsigned *indices, unsigned n, unsigned axis)
-                : mVertices(positions), mIndices(indices), mNumIndices(n), mAxis(axis)
-            {
-            }
-
-            bool operator()(unsigned lhs, unsigned rhs) const
-            {
-                float a = GetCentroid(lhs);
-                float b = GetCentroid(rhs);
-
-                if (a == b)
-                    return lhs < rhs;
-                else
-                    return a < b;
-            }
-
-            float GetCentroid(unsigned face) const
-            {
-                const Eigen::Vector3f &a = mVertices[mIndices[face * 3 + 0]];
-                const Eigen::Vector3f &b = mVertices[mIndices[face * 3 + 1]];
-                const Eigen::Vector3f &c = mVertices[mIndices[face * 3 + 2]];
-
-                return (a[mAxis] + b[mAxis] + c[mAxis]) / 3.0f;
-            }
-
-            const Eigen::Vector3f *mVertices;
-            const unsigned *mIndices;
-            unsigned mNumIndices;
-            unsigned mAxis;
+            Bounds mBounds;
+            unsigned mFace;
         };
 
+        /**
+         * node with both children linked, the form the treelet optimization rewrites
+         * the tree in before it is laid out depth first again
+         */
+        struct LinkedNode
+        {
+            Bounds mBounds;
+            unsigned mLeft;
+            unsigned mRight;
+
+            // first entry in mPrimitives and number of faces for leaves, no faces for inner nodes
+            unsigned mOffset;
+            unsigned mNumFaces;
+
+            // SAH cost of the subtree, not relative to any area, and its number of nodes
+            float mCost;
+            unsigned mNumNodes;
+        };
+
+        // subtrees a treelet is made of, all 2^7 subsets of them are costed
+        static const unsigned kMaxTreeletLeaves = 7;
+
+        static const unsigned kNumSpatialBins = 32;
+
+        // spatial splits are only tried where the object split's children overlap by more than this fraction of the root area
+        static constexpr float kSpatialSplitAlpha = 1e-5f;
+
+        // spatial splits may add this many references per face of the mesh, on top of the faces themselves
+        static constexpr float kSpatialSplitBudget = 0.3f;
+
+        // subtrees smaller than this are always built on the calling thread
+        static const unsigned kMinParallelFaces = BVHBuilder::kMinParallelPrimitives;
+
+        // degraded subtrees smaller than this are left for an ancestor to rebuild
+        static const unsigned kMinRebuildFaces = 64;
+
     private:
-        const Eigen::Vector3f *mVertices = nullptr;
-        unsigned mNumVerts = 0;
-        const unsigned *mIndices = nullptr;
-        unsigned mNumFaces = 0;
+        BuildMode mBuildMode;
 
-        std::vector<unsigned> mFaces;
-        std::vector<Node> mNodes;
-        std::vector<Bounds> mFaceBounds;
+        // 0 while the binary nodes are traced, otherwise which wide tree is in use
+        unsigned mWideWidth = 0;
+        std::vector<WideNode<4>> mWideNodes4;
+        std::vector<WideNode<8>> mWideNodes8;
 
-        // track the next free node
-        unsigned mFreeNode;
+        // 0 unless the quantized nodes are traced, otherwise their bits per coordinate
+        unsigned mQuantizedBits = 0;
+        std::vector<QuantizedNode<uint8_t>> mQuantizedNodes8;
+        std::vector<QuantizedNode<uint16_t>> mQuantizedNodes16;
+        Eigen::Vector3f mQuantizedRootMin;
+        Eigen::Vector3f mQuantizedRootMax;
 
-        // stats
-        unsigned mTreeDepth = 0;
-        unsigned mInnerNodes = 0;
-        unsigned mLeafNodes = 0;
+        // threads builds and rebuilds use, subtrees are handed to them down to mMaxParallelDepth
+        unsigned mNumThreads = 1;
 
-        size_t GetNumFaces() const { return mNumFaces; }
-        size_t GetNumNodes() const { return mNodes.size(); }
+        // number of nodes in use
+        unsigned mFreeNode = 0;
 
-        void CalculateFaceBounds(unsigned *faces, unsigned numFaces,
-                                 Eigen::Vector3f &outMinExtents, Eigen::Vector3f &outMaxExtents);
+        // whether spatial splits referenced some faces from more than one leaf
+        bool mDuplicateReferences = false;
 
-        void BuildRecursive(unsigned nodeIndex, unsigned *faces, unsigned numFaces);
-        unsigned PartitionSAH(Node &n, unsigned *faces, unsigned numFaces);
+        // height of every subtree while the tree is edited by InsertFaces and RemoveFaces, empty
+        // as long as the nodes are laid out depth first, and the node slots and mPrimitives entries
+        // edits have left unused
+        std::vector<uint8_t> mNodeHeights;
+        std::vector<unsigned> mUnusedNodes;
+        unsigned mUnusedFaceEntries = 0;
 
-        /**
-     * Moller and Trumbore's method
-     */
-        bool IntersectRayTriTwoSided(const Eigen::Vector3f &p, const Eigen::Vector3f &dir, const Eigen::Vector3f &a,
-                                     const Eigen::Vector3f &b, const Eigen::Vector3f &c, float &t, float &u, float &v, float &w,
-                                     float &sign) const;
-        bool IntersectRayAABB(const Eigen::Vector3f &start, const Eigen::Vector3f &dir,
-                              const Eigen::Vector3f &min, const Eigen::Vector3f &max, float &t,
-                              Eigen::Vector3f *normal) const;
-        void TraceRecursive(uint32_t nodeIndex,
-                            const Eigen::Vector3f &start, const Eigen::Vector3f &dir,
-                            float &outT, float &u, float &v, float &w,
-                            float &faceSign, uint32_t &faceIndex) const;
+        // whether the nodes came from a serialized image instead of a build
+        bool mLoaded = false;
+
+        // optional copies of the leaf faces, and which one belongs to the leaf at a given mPrimitives offset
+        std::vector<LeafTriangles> mLeafTriangles;
+        std::vector<unsigned> mLeafTriangleIndex;
+
+        // SAH cost of every subtree relative to its own surface area, as of the last
+        // Refit and as it was when the subtree was built
+        std::vector<float> mSubtreeCost;
+        std::vector<float> mBuiltSubtreeCost;
+
+        template <typename T>
+        unsigned QuantizeRecursive(unsigned nodeIndex, const Eigen::Vector3f &min, const Eigen::Vector3f &max,
+                                   std::vector<QuantizedNode<T>> &quantizedNodes) const;
+        template <typename T>
+        bool TraceRayQuantized(const std::vector<QuantizedNode<T>> &quantizedNodes,
+                               const Eigen::Vector3f &start, const Eigen::Vector3f &dir, float &outT,
+                               float &u, float &v, float &w, float &faceSign, uint32_t &faceIndex) const;
+
+        void PrepareBuild(unsigned numThreads);
+        void Build();
+        bool LoadImage(const void *image, size_t imageSize);
+
+        void BuildRecursive(std::vector<Node> &nodes, unsigned nodeIndex, unsigned *faces, unsigned numFaces,
+                            unsigned depth, BuildStats &stats);
+
+        void BuildSpatialRecursive(std::vector<Reference> &refs, float invRootArea, unsigned depth,
+                                   unsigned &budget, BuildStats &stats);
+        float FindObjectSplit(std::vector<Reference> &refs, float invArea, unsigned &axis, unsigned &leftCount,
+                              Bounds &leftBounds, Bounds &rightBounds) const;
+        float FindSpatialSplit(const std::vector<Reference> &refs, const Bounds &bounds, float invArea,
+                               unsigned &axis, float &position) const;
+        void PerformSpatialSplit(const std::vector<Reference> &refs, unsigned axis, float position, unsigned &budget,
+                                 std::vector<Reference> &left, std::vector<Reference> &right) const;
+        void SplitReference(const Reference &ref, unsigned axis, float position, Reference &left, Reference &right) const;
+
+        void SortMortonCodes(std::vector<uint64_t> &codes);
+        void BuildLinearRecursive(unsigned nodeIndex, const uint64_t *codes, unsigned *faces, unsigned numFaces,
+                                  unsigned depth, BuildStats &stats);
+
+        void OptimizeTreeletsRecursive(std::vector<LinkedNode> &nodes, unsigned nodeIndex, unsigned depth) const;
+        static void OptimizeTreelet(std::vector<LinkedNode> &nodes, unsigned root);
+        static unsigned GetLinkedDepth(const std::vector<LinkedNode> &nodes, unsigned nodeIndex);
+        void LayoutLinked(const std::vector<LinkedNode> &linked, unsigned nodeIndex,
+                          std::vector<Node> &nodes, std::vector<unsigned> &faces) const;
+
+        // CompressNodes freed the full nodes, only the ray queries that walk the compressed ones still work
+        bool IsCompressedOnly() const { return mNodes.empty() && mQuantizedBits != 0; }
+
+        void BeginEdit();
+        void EndEdit();
+        unsigned UpdateHeights(unsigned nodeIndex);
+        unsigned AllocateNode();
+        void FreeNode(unsigned nodeIndex);
+        void MoveNode(unsigned from, unsigned to);
+        Bounds GetFaceBounds(unsigned face) const;
+        // bounds and centroids from the vertices for the faces appended after the last ones mBounds holds
+        void AppendFaceData();
+        Bounds GetNodeBounds(unsigned nodeIndex) const;
+        void InsertFace(unsigned face);
+        bool RemoveFace(unsigned face);
+        bool FindFace(unsigned nodeIndex, unsigned face, const Bounds &bounds, bool prune,
+                      unsigned *path, unsigned &pathLength, unsigned &entry) const;
+        void RefitPath(const unsigned *path, unsigned pathLength);
+        void UpdateNode(unsigned nodeIndex);
+        void RotateNode(unsigned nodeIndex);
+        void RebuildEdited();
+        void Compact();
+        void LayoutDepthFirst(unsigned nodeIndex, std::vector<Node> &nodes, std::vector<unsigned> &faces) const;
+
+        void RefitRecursive(unsigned nodeIndex, unsigned depth);
+        void UpdateSubtreeCosts(unsigned begin, unsigned end);
+        void FindDegradedSubtrees(unsigned nodeIndex, unsigned depth, float threshold,
+                                  std::vector<std::pair<unsigned, unsigned>> &subtrees) const;
+        void GetSubtreeRange(unsigned nodeIndex, unsigned &endNode, unsigned &firstFace, unsigned &numFaces) const;
+        void RebuildSubtree(unsigned nodeIndex, unsigned depth);
+        void UpdateStats(unsigned nodeIndex, unsigned depth, BuildStats &stats) const;
+
+        template <int W>
+        unsigned CollapseRecursive(unsigned nodeIndex, std::vector<WideNode<W>> &wideNodes) const;
+        template <int W>
+        bool TraceRayWide(const std::vector<WideNode<W>> &wideNodes,
+                          const Eigen::Vector3f &start, const Eigen::Vector3f &dir, float &outT,
+                          float &u, float &v, float &w, float &faceSign, uint32_t &faceIndex) const;
+
+        // closest hit among the faces of one leaf, only updates the outputs if it is closer than outT
+        void IntersectLeaf(unsigned offset, unsigned numFaces,
+                           const Eigen::Vector3f &start, const Eigen::Vector3f &dir,
+                           float &outT, float &u, float &v, float &w, float &faceSign, uint32_t &faceIndex) const;
+        void IntersectLeafTriangles(const LeafTriangles &tris, unsigned numFaces,
+                                    const Eigen::Vector3f &start, const Eigen::Vector3f &dir,
+                                    float &outT, float &u, float &v, float &w, float &faceSign, uint32_t &faceIndex) const;
+        void BuildLeafTriangles();
+        // vertex and edges of the i-th face of the leaf at offset, from the leaf triangles when there are any
+        unsigned GetLeafFace(unsigned offset, unsigned i, Eigen::Vector3f &a, Eigen::Vector3f &ab, Eigen::Vector3f &ac) const;
+
+        void TraceBatchBlock(const Ray *rays, const uint64_t *keys, const unsigned *order, unsigned numRays,
+                             RayHit *hits) const;
+
+        static void InsertHit(const RayHit &hit, RayHit *hits, unsigned maxHits, unsigned &numStored);
+        unsigned MergeHits(RayHit *hits, unsigned numHits) const;
+
+        void ClosestPointLeaf(unsigned offset, unsigned numFaces, const Eigen::Vector3f &point,
+                              float &bestDistSq, ClosestPointHit &hit) const;
+
+        void OverlapLeaves(const AABBTree &other, const Node &a, const Node &b,
+                           const Eigen::Matrix3f &rotation, const Eigen::Vector3f &translation,
+                           FacePair *pairs, unsigned maxPairs, unsigned &numPairs) const;
+        void SelfOverlapLeaves(const Node &a, const Node &b, bool sameLeaf,
+                               FacePair *pairs, unsigned maxPairs, unsigned &numPairs) const;
 
     public:
-        AABBTree(const Eigen::Vector3f *vertices, unsigned numVerts,
-                 const unsigned *indices, unsigned numFaces);
+        /**
+         * @param vertices, indices the mesh, both are read in place for as long as the tree
+         *        lives, the positions may be packed or strided as described by VertexView
+         */
+        AABBTree(VertexView vertices, unsigned numVerts,
+                 const unsigned *indices, unsigned numFaces, BuildMode mode = BuildMode::SAH,
+                 unsigned numThreads = 0);
+
+        /**
+         * Adopts a tree written by Serialize instead of building one. The image is
+         * rejected and the tree built as usual when it is truncated, of another
+         * format version or was made from a different mesh.
+         *
+         * @param image a serialized tree, for example a mapped file, it is not referenced after construction
+         */
+        AABBTree(VertexView vertices, unsigned numVerts,
+                 const unsigned *indices, unsigned numFaces, const void *image, size_t imageSize,
+                 BuildMode mode = BuildMode::SAH, unsigned numThreads = 0);
         ~AABBTree();
 
+        /**
+         * Writes the tree as a relocatable binary image, a fixed header followed by
+         * the nodes and the face permutation, every array located by a byte offset
+         * from the start of the image and aligned to its element
+         */
+        void Serialize(std::vector<uint8_t> &image) const;
+        bool Save(const std::string &path) const;
+
+        // whether the tree was taken from a serialized image
+        bool IsLoaded() const { return mLoaded; }
+
+        // hash of the vertex positions and indices a serialized tree is checked against
+        static uint64_t HashMesh(VertexView vertices, unsigned numVerts,
+                                 const unsigned *indices, unsigned numFaces);
+
+        // faces of the mesh the tree was built on or grown to, ones taken out by RemoveFaces included
+        size_t GetNumFaces() const { return mTraits.mNumFaces; }
+        // entries in the leaves, more than the faces once spatial splits referenced some of them twice
+        size_t GetNumFaceReferences() const { return mPrimitives.size() - mUnusedFaceEntries; }
+        size_t GetNumNodes() const { return mFreeNode; }
+        using BVH::GetTreeDepth;
+        using BVH::GetNumInnerNodes;
+        using BVH::GetNumLeafNodes;
+
+        /**
+         * surface area heuristic cost of the built tree, inner node traversal
+         * and triangle tests are weighted as in BVHBuilder
+         */
+        using BVH::GetSAHCost;
+
+        /**
+         * lowers the SAH cost of a finished tree for meshes that are built once and traced often,
+         * every node from the bottom up becomes the root of a treelet of up to 7 subtrees that is
+         * rewritten with the cheapest topology, found by dynamic programming over their subsets
+         *
+         * @param numPasses rounds over the whole tree, later ones pick up what earlier ones enabled
+         * @return SAH cost afterwards as given by GetSAHCost
+         */
+        float OptimizeTreelets(unsigned numPasses = 3);
+
+        /**
+         * collapses the binary tree into a 4 or 8 wide one that TraceRay uses from then on,
+         * every wide node tests all of its children's boxes in one SIMD slab test
+         *
+         * @param width 4 or 8, anything else switches back to the binary tree
+         */
+        void CollapseWide(unsigned width);
+
+        /**
+         * copies the faces of every leaf next to each other so ray queries skip the face,
+         * index and vertex lookups and test a whole leaf at once, Refit keeps the copies current
+         *
+         * @return bytes taken by the copies, 0 once disabled
+         */
+        size_t PrecomputeLeafTriangles(bool enable);
+        size_t GetLeafTrianglesMemory() const;
+
+        /**
+         * stores the tree a second time with every child box quantized to 8 or 16 bits
+         * inside its parent's box, TraceRay walks the compressed nodes from then on
+         *
+         * @param bits 8 or 16, anything else switches back to the full nodes
+         * @param keepFullNodes false frees the full nodes to save their memory, the tree can then
+         *        only be traced by TraceRay, TraceRays and TraceBatch, the other queries and Serialize
+         *        assert, edits and Refit do nothing, and the compression can no longer be changed
+         * @return bytes taken by the compressed nodes
+         */
+        size_t CompressNodes(unsigned bits, bool keepFullNodes = true);
+
+        /**
+         * frees the per face bounds and centroids that are only needed to build, Refit
+         * recreates them the next time it runs
+         *
+         * @return bytes freed
+         */
+        size_t ReleaseBuildData();
+
+        // bytes held by the tree, the mesh itself is not counted
+        size_t GetMemoryUsage() const;
+
+        /**
+         * inserts the faces appended to the mesh since the tree was built or last edited, each
+         * one becomes a leaf next to the node whose surface area grows least on the way down,
+         * and rotations on the way back up keep the SAH cost from drifting, O(log n) per face
+         * apart from the wide, quantized and leaf triangle layouts which are derived again once
+         * per call, so edits come in batches best
+         *
+         * @param vertices, indices the grown mesh, it may have moved while it grew
+         * @param numFaces faces of the grown mesh, those from GetNumFaces() on are inserted
+         * @return faces inserted, 0 once CompressNodes freed the full nodes
+         */
+        unsigned InsertFaces(VertexView vertices, unsigned numVerts,
+                             const unsigned *indices, unsigned numFaces);
+
+        /**
+         * puts faces of the current mesh back into the tree, faces below GetNumFaces() that
+         * RemoveFaces took out, so a delete can be undone without appending the mesh again,
+         * faces that are still in the tree are skipped, finding them walks the whole tree
+         * once the per face bounds were released
+         *
+         * @return faces inserted
+         */
+        unsigned InsertFaces(const unsigned *faces, unsigned numFaces);
+
+        /**
+         * takes faces out of the tree, the mesh keeps them and their indices stay valid, a leaf
+         * left empty is replaced by its sibling, call it before the faces' vertices change,
+         * InsertFaces with the same indices puts them back
+         *
+         * @return faces that were in the tree and are removed now
+         */
+        unsigned RemoveFaces(const unsigned *faces, unsigned numFaces);
+
+        /**
+         * recomputes all bounds bottom up from the current vertex positions keeping the
+         * topology, for meshes that deform in place, subtrees whose SAH cost has grown by
+         * more than rebuildThreshold times since they were built are rebuilt from scratch
+         *
+         * an edited tree is laid out depth first again before it is refitted and becomes
+         * the reference rebuilds are measured against
+         *
+         * @param rebuildThreshold cost growth that triggers a rebuild, 0 to only refit
+         * @return number of subtrees that were rebuilt
+         */
+        unsigned Refit(float rebuildThreshold = 1.5f);
+
         bool TraceRay(const Eigen::Vector3f &start, const Eigen::Vector3f &dir, float &outT,
                       float &u, float &v, float &w, float &faceSign, uint32_t &faceIndex) const;
+
+        /**
+         * every intersection of the segment from start to start + maxT * dir in one traversal,
+         * sorted by t, a crossing through a shared edge or vertex is reported once while a
+         * ray grazing a silhouette keeps both of its hits so parity is preserved
+         *
+         * @param hits caller owned buffer, the nearest maxHits are written
+         * @return number of hits, more than maxHits means the buffer was too small
+         */
+        unsigned TraceRayAll(const Eigen::Vector3f &start, const Eigen::Vector3f &dir, float maxT,
+                             RayHit *hits, unsigned maxHits) const;
+
+        /**
+         * whether the segment from start to start + maxT * dir hits any face, the traversal
+         * stops at the first one found instead of looking for the closest
+         */
+        bool TraceRayAny(const Eigen::Vector3f &start, const Eigen::Vector3f &dir, float maxT) const;
+
+        /**
+         * traces the active lanes of a packet in one traversal, boxes and triangles are
+         * tested against all lanes at once, instantiated for 4, 8 and 16 rays
+         *
+         * packets always walk the binary nodes, a wide tree from CollapseWide is left to TraceRay,
+         * leaf triangles are used when there are any, and once CompressNodes freed the full nodes
+         * the lanes are traced one at a time through the compressed ones
+         *
+         * @return whether any lane hit the mesh
+         */
+        template <int N>
+        bool TraceRays(const RayPacket<N> &rays, HitPacket<N> &hits) const;
+
+        /**
+         * TraceRayAll for the active lanes of a packet in one traversal, instantiated for 4, 8 and 16 rays
+         *
+         * @param hits maxHitsPerRay entries for every lane, lane l writes from hits + l * maxHitsPerRay
+         * @param numHits per lane result of TraceRayAll
+         */
+        template <int N>
+        void TraceRaysAll(const RayPacket<N> &rays, float maxT, RayHit *hits, unsigned maxHitsPerRay,
+                          unsigned *numHits) const;
+
+        /**
+         * closest hits of a large batch of independent rays, the rays are sorted by direction
+         * octant and the Morton order of their origin and direction so neighbours in the sorted
+         * batch take similar paths, workers then take blocks of it and trace them in packets
+         *
+         * @param hits one per ray in input order, mT is left at the float maximum for rays that
+         *        miss and the other fields are undefined
+         * @param numThreads 0 to use every hardware thread
+         */
+        void TraceBatch(const Ray *rays, unsigned numRays, RayHit *hits, unsigned numThreads = 0) const;
+
+        /**
+         * closest point on the mesh within maxDistance of point, the traversal visits
+         * the nearer child first and skips boxes farther away than the best face so far
+         *
+         * @return whether any face lies within maxDistance
+         */
+        bool ClosestPoint(const Eigen::Vector3f &point, float maxDistance, ClosestPointHit &hit) const;
+
+        /**
+         * ClosestPoint for many query points, split in contiguous chunks across threads
+         *
+         * @param numThreads 0 to use every hardware thread
+         */
+        void ClosestPoints(const Eigen::Vector3f *points, unsigned numPoints, float maxDistance,
+                           ClosestPointHit *hits, unsigned numThreads = 0) const;
+
+        /**
+         * pairs of faces from this tree and other whose bounds overlap, both trees are
+         * descended together and other's boxes are tested as oriented boxes, with spatial
+         * splits a pair whose bounds only overlap outside both faces' leaves may be skipped
+         *
+         * @param rotation, translation place other's vertices in this tree's space
+         * @param pairs caller owned buffer, at most maxPairs are written
+         * @return number of overlapping pairs, more than maxPairs means the buffer was too small,
+         *         a count that large may include repeats when a tree was built with spatial splits
+         */
+        unsigned Overlap(const AABBTree &other, const Eigen::Matrix3f &rotation, const Eigen::Vector3f &translation,
+                         FacePair *pairs, unsigned maxPairs) const;
+
+        /**
+         * pairs of faces of this tree whose bounds overlap, every pair is reported once
+         * and faces sharing a vertex are skipped, with spatial splits a pair whose bounds
+         * only overlap outside both faces' leaves may be skipped
+         *
+         * @return number of overlapping pairs, more than maxPairs means the buffer was too small,
+         *         a count that large may include repeats when the tree was built with spatial splits
+         */
+        unsigned SelfOverlap(FacePair *pairs, unsigned maxPairs) const;
     };
 } // namespace PiratePhysics
\ No newline at end of file
@@ -0,0 +1,240 @@
+#include "AABBTree.hpp"
+#include "Simd.hpp"
+#include <algorithm>
+#include <atomic>
+#include <future>
+#include <thread>
+
+using namespace std;
+using namespace PiratePhysics;
+
+// Eigen is left out of the using directives, its Select would hide the packet version
+
+namespace
+{
+    // rays per packet, at least 4 so a packet shares one traversal even without SIMD
+    const int kPacketSize = PIRATEPHYSICS_SIMD_WIDTH > 4 ? PIRATEPHYSICS_SIMD_WIDTH : 4;
+
+    // not worth a thread for fewer rays than this
+    const unsigned kMinRaysPerThread = 4096;
+
+    // sorted rays are handed out to the workers in blocks of this many
+    const unsigned kBatchBlockSize = 256;
+
+    // origin and direction are quantized to this many bits per axis inside the batch's bounds
+    const unsigned kKeyBitsPerAxis = 5;
+    const unsigned kKeyBits = 3 + 6 * kKeyBitsPerAxis;
+
+    const unsigned kRadixBits = 11;
+    const unsigned kRadixSize = 1U << kRadixBits;
+
+    // a packet is traced together if the keys of its first and last ray agree on this many bits,
+    // the octant and the top two levels of the origin and direction
+    const unsigned kCoherentKeyBits = 3 + 6 * 2;
+
+    // runs body(thread) on numThreads threads, the calling one included
+    template <typename Body>
+    void RunWorkers(unsigned numThreads, const Body &body)
+    {
+        vector<future<void>> tasks;
+        for (unsigned t = 1; t < numThreads; ++t)
+            tasks.push_back(async(launch::async, body, t));
+
+        body(0);
+
+        for (auto &task : tasks)
+            task.get();
+    }
+
+    // kKeyBitsPerAxis bits spread out to every sixth bit
+    struct SpreadTable
+    {
+        SpreadTable()
+        {
+            for (unsigned v = 0; v < (1U << kKeyBitsPerAxis); ++v)
+            {
+                mBits[v] = 0;
+                for (unsigned b = 0; b < kKeyBitsPerAxis; ++b)
+                    mBits[v] |= uint64_t((v >> b) & 1) << (6 * b);
+            }
+        }
+
+        uint64_t mBits[1U << kKeyBitsPerAxis];
+    };
+
+    const SpreadTable kSpread;
+} // namespace
+
+void AABBTree::TraceBatch(const Ray *rays, unsigned numRays, RayHit *hits, unsigned numThreads) const
+{
+    if (numRays == 0)
+        return;
+
+    if (numThreads == 0)
+        numThreads = max(thread::hardware_concurrency(), 1U);
+
+    numThreads = max(min(numThreads, numRays / kMinRaysPerThread), 1U);
+
+    // quantize origins and directions inside their own bounds so the whole grid is used, a
+    // direction counts by its components over its largest one, a point on the unit cube
+    Eigen::Vector3f minStart = rays[0].mStart;
+    Eigen::Vector3f maxStart = rays[0].mStart;
+    Eigen::Vector3f minDir(1.0f, 1.0f, 1.0f);
+    Eigen::Vector3f maxDir(-1.0f, -1.0f, -1.0f);
+
+    auto cubeDir = [](const Eigen::Vector3f &d) {
+        return Eigen::Vector3f(d / max(d.cwiseAbs().maxCoeff(), numeric_limits<float>::min()));
+    };
+
+    for (unsigned i = 0; i < numRays; ++i)
+    {
+        minStart = minStart.cwiseMin(rays[i].mStart);
+        maxStart = maxStart.cwiseMax(rays[i].mStart);
+
+        const Eigen::Vector3f d = cubeDir(rays[i].mDir);
+        minDir = minDir.cwiseMin(d);
+        maxDir = maxDir.cwiseMax(d);
+    }
+
+    const float cells = float((1U << kKeyBitsPerAxis) - 1);
+
+    Eigen::Vector3f startScale, dirScale;
+    for (int a = 0; a < 3; ++a)
+    {
+        startScale[a] = maxStart[a] > minStart[a] ? cells / (maxStart[a] - minStart[a]) : 0.0f;
+        dirScale[a] = maxDir[a] > minDir[a] ? cells / (maxDir[a] - minDir[a]) : 0.0f;
+    }
+
+    // every worker radix sorts its own contiguous share of the batch, a share of a few
+    // thousand rays is already coherent enough without merging it with the others
+    vector<uint64_t> keys(numRays), tmpKeys(numRays);
+    vector<unsigned> order(numRays), tmpOrder(numRays);
+    const unsigned chunk = (numRays + numThreads - 1) / numThreads;
+
+    RunWorkers(numThreads, [&](unsigned t) {
+        const unsigned begin = min(t * chunk, numRays);
+        const unsigned end = min(begin + chunk, numRays);
+
+        for (unsigned i = begin; i < end; ++i)
+        {
+            const Ray &r = rays[i];
+            const unsigned octant = (r.mDir[0] < 0.0f) | (r.mDir[1] < 0.0f) << 1 | (r.mDir[2] < 0.0f) << 2;
+
+            const Eigen::Vector3f o = (r.mStart - minStart).cwiseProduct(startScale);
+            const Eigen::Vector3f d = (cubeDir(r.mDir) - minDir).cwiseProduct(dirScale);
+
+            // octant first, then origin and direction interleaved level by level
+            uint64_t key = uint64_t(octant) << (6 * kKeyBitsPerAxis);
+            for (int a = 0; a < 3; ++a)
+            {
+                key |= kSpread.mBits[unsigned(o[a])] << (5 - a);
+                key |= kSpread.mBits[unsigned(d[a])] << (2 - a);
+            }
+
+            keys[i] = key;
+            order[i] = i;
+        }
+
+        // least significant digit first, the share's digits are counted before each scatter
+        // and the passes go back and forth between the two buffers
+        uint64_t *srcKeys = keys.data(), *dstKeys = tmpKeys.data();
+        unsigned *srcOrder = order.data(), *dstOrder = tmpOrder.data();
+
+        for (unsigned shift = 0; shift < kKeyBits; shift += kRadixBits)
+        {
+            unsigned offsets[kRadixSize] = {};
+            for (unsigned i = begin; i < end; ++i)
+                ++offsets[(srcKeys[i] >> shift) & (kRadixSize - 1)];
+
+            unsigned sum = begin;
+            for (unsigned d = 0; d < kRadixSize; ++d)
+            {
+                const unsigned count = offsets[d];
+                offsets[d] = sum;
+                sum += count;
+            }
+
+            for (unsigned i = begin; i < end; ++i)
+            {
+                const unsigned dst = offsets[(srcKeys[i] >> shift) & (kRadixSize - 1)]++;
+                dstKeys[dst] = srcKeys[i];
+                dstOrder[dst] = srcOrder[i];
+            }
+
+            swap(srcKeys, dstKeys);
+            swap(srcOrder, dstOrder);
+        }
+    });
+
+    // every share took the same number of passes so they all ended in the same buffer
+    if ((kKeyBits + kRadixBits - 1) / kRadixBits % 2)
+    {
+        keys.swap(tmpKeys);
+        order.swap(tmpOrder);
+    }
+
+    // blocks are taken in order by whichever worker is free, rays that miss early or
+    // hit dense parts of the mesh even out without any of them waiting on the others
+    atomic<unsigned> nextBlock(0);
+    const unsigned numBlocks = (numRays + kBatchBlockSize - 1) / kBatchBlockSize;
+
+    RunWorkers(numThreads, [&](unsigned) {
+        for (unsigned b = nextBlock++; b < numBlocks; b = nextBlock++)
+        {
+            const unsigned begin = b * kBatchBlockSize;
+            TraceBatchBlock(rays, &keys[begin], &order[begin], min(kBatchBlockSize, numRays - begin), hits);
+        }
+    });
+}
+
+void AABBTree::TraceBatchBlock(const Ray *rays, const uint64_t *keys, const unsigned *order, unsigned numRays,
+                               RayHit *hits) const
+{
+    // the packet traversal only knows the binary nodes
+    const bool packets = !mWideWidth && !mQuantizedBits && !mNodes.empty();
+
+    RayPacket<kPacketSize> packet;
+    HitPacket<kPacketSize> result;
+
+    for (unsigned i = 0; i < numRays; i += kPacketSize)
+    {
+        const unsigned last = min(i + kPacketSize, numRays) - 1;
+
+        // rays that only share a coarse cell of the key part ways too early to be worth a packet
+        if (!packets || (keys[i] ^ keys[last]) >> (kKeyBits - kCoherentKeyBits))
+        {
+            for (unsigned j = i; j <= last; ++j)
+            {
+                const Ray &r = rays[order[j]];
+                RayHit &h = hits[order[j]];
+                TraceRay(r.mStart, r.mDir, h.mT, h.mU, h.mV, h.mW, h.mFaceSign, h.mFaceIndex);
+            }
+            continue;
+        }
+
+        for (int l = 0; l < kPacketSize; ++l)
+        {
+            packet.mActive[l] = i + l < numRays;
+
+            const Ray &r = rays[order[packet.mActive[l] ? i + l : i]];
+            for (int a = 0; a < 3; ++a)
+            {
+                packet.mStart[a][l] = r.mStart[a];
+                packet.mDir[a][l] = r.mDir[a];
+            }
+        }
+
+        TraceRays(packet, result);
+
+        for (int l = 0; l < kPacketSize && i + l < numRays; ++l)
+        {
+            RayHit &h = hits[order[i + l]];
+            h.mT = result.mT[l];
+            h.mU = result.mU[l];
+            h.mV = result.mV[l];
+            h.mW = result.mW[l];
+            h.mFaceSign = result.mFaceSign[l];
+            h.mFaceIndex = result.mFaceIndex[l];
+        }
+    }
+}
@@ -0,0 +1,259 @@
+#include "AABBTree.hpp"
+#include "Simd.hpp"
+#include <algorithm>
+#include <cassert>
+#include <future>
+#include <thread>
+
+using namespace std;
+using namespace PiratePhysics;
+using namespace PiratePhysics::Simd;
+
+// Eigen is left out of the using directives, its Select would hide the packet version
+
+namespace
+{
+    float DistanceSqToAABB(const Eigen::Vector3f &p, const Eigen::Vector3f &min, const Eigen::Vector3f &max)
+    {
+        float d = 0.0f;
+        for (int a = 0; a < 3; ++a)
+        {
+            const float e = std::max(std::max(min[a] - p[a], p[a] - max[a]), 0.0f);
+            d += e * e;
+        }
+        return d;
+    }
+} // namespace
+
+bool AABBTree::ClosestPoint(const Eigen::Vector3f &point, float maxDistance, ClosestPointHit &hit) const
+{
+    hit.mHit = false;
+    hit.mDistance = maxDistance;
+
+    assert(!IsCompressedOnly());
+
+    if (mNodes.empty())
+        return false;
+
+    float bestDistSq = maxDistance * maxDistance;
+
+    struct StackEntry
+    {
+        unsigned mNode;
+        float mDistSq;
+    };
+
+    StackEntry stack[kMaxTreeDepth];
+    unsigned stackSize = 0;
+
+    stack[stackSize++] = {0, DistanceSqToAABB(point, mNodes[0].mMinExtents, mNodes[0].mMaxExtents)};
+
+    while (stackSize)
+    {
+        const StackEntry e = stack[--stackSize];
+        if (e.mDistSq > bestDistSq)
+            continue;
+
+        unsigned nodeIndex = e.mNode;
+
+        for (;;)
+        {
+            const Node &node = mNodes[nodeIndex];
+
+            if (node.IsLeaf())
+            {
+                ClosestPointLeaf(node.mOffset, node.mNumPrimitives, point, bestDistSq, hit);
+                break;
+            }
+
+            const unsigned left = node.GetLeft(nodeIndex);
+            const unsigned right = node.mOffset;
+
+            const float distLeft = DistanceSqToAABB(point, mNodes[left].mMinExtents, mNodes[left].mMaxExtents);
+            const float distRight = DistanceSqToAABB(point, mNodes[right].mMinExtents, mNodes[right].mMaxExtents);
+
+            const bool visitLeft = distLeft <= bestDistSq;
+            const bool visitRight = distRight <= bestDistSq;
+
+            // go to the nearer box first, the other one is culled later if the best face beats it
+            if (visitLeft && visitRight)
+            {
+                if (distRight < distLeft)
+                {
+                    stack[stackSize++] = {left, distLeft};
+                    nodeIndex = right;
+                }
+                else
+                {
+                    stack[stackSize++] = {right, distRight};
+                    nodeIndex = left;
+                }
+            }
+            else if (visitLeft)
+                nodeIndex = left;
+            else if (visitRight)
+                nodeIndex = right;
+            else
+                break;
+        }
+    }
+
+    if (hit.mHit)
+        hit.mDistance = sqrtf(bestDistSq);
+
+    return hit.mHit;
+}
+
+void AABBTree::ClosestPointLeaf(unsigned offset, unsigned numFaces, const Eigen::Vector3f &point,
+                                float &bestDistSq, ClosestPointHit &hit) const
+{
+    // one lane per face of the leaf
+    const int W = 8;
+    static_assert(kMaxFacesPerLeaf <= W, "a leaf has to fit in one point-triangle batch");
+
+    using F = FloatN<W>;
+
+    float pos[3][3][W];
+    for (unsigned i = 0; i < W; ++i)
+    {
+        // unused lanes repeat the last face so their results are valid but never better
+        const unsigned f = mPrimitives[offset + min(i, numFaces - 1)];
+        for (unsigned k = 0; k < 3; ++k)
+        {
+            const Eigen::Vector3f &v = mTraits.mVertices[mTraits.mIndices[f*3+k]];
+            pos[k][0][i] = v[0];
+            pos[k][1][i] = v[1];
+            pos[k][2][i] = v[2];
+        }
+    }
+
+    const Vec3N<W> a(F::Load(pos[0][0]), F::Load(pos[0][1]), F::Load(pos[0][2]));
+    const Vec3N<W> b(F::Load(pos[1][0]), F::Load(pos[1][1]), F::Load(pos[1][2]));
+    const Vec3N<W> c(F::Load(pos[2][0]), F::Load(pos[2][1]), F::Load(pos[2][2]));
+    const Vec3N<W> p(point[0], point[1], point[2]);
+
+    const F zero(0.0f);
+    const F one(1.0f);
+
+    // Ericson's closest point on triangle, every Voronoi region is evaluated and the
+    // barycentrics of the first matching region are selected, last region first
+    const Vec3N<W> ab = b - a;
+    const Vec3N<W> ac = c - a;
+    const Vec3N<W> ap = p - a;
+    const Vec3N<W> bp = p - b;
+    const Vec3N<W> cp = p - c;
+
+    const F d1 = Dot(ab, ap);
+    const F d2 = Dot(ac, ap);
+    const F d3 = Dot(ab, bp);
+    const F d4 = Dot(ac, bp);
+    const F d5 = Dot(ab, cp);
+    const F d6 = Dot(ac, cp);
+
+    const F va = d3 * d6 - d5 * d4;
+    const F vb = d5 * d2 - d1 * d6;
+    const F vc = d1 * d4 - d3 * d2;
+
+    // face interior
+    const F denom = one / (va + vb + vc);
+    F v = vb * denom;
+    F w = vc * denom;
+
+    // edge bc
+    const F d43 = d4 - d3;
+    const F d56 = d5 - d6;
+    const F inBC = (va <= zero) & (zero <= d43) & (zero <= d56);
+    const F wBC = d43 / (d43 + d56);
+    v = Select(inBC, one - wBC, v);
+    w = Select(inBC, wBC, w);
+
+    // edge ac
+    const F inAC = (vb <= zero) & (zero <= d2) & (d6 <= zero);
+    const F wAC = d2 / (d2 - d6);
+    v = Select(inAC, zero, v);
+    w = Select(inAC, wAC, w);
+
+    // vertex c
+    const F inC = (zero <= d6) & (d5 <= d6);
+    v = Select(inC, zero, v);
+    w = Select(inC, one, w);
+
+    // edge ab
+    const F inAB = (vc <= zero) & (zero <= d1) & (d3 <= zero);
+    const F vAB = d1 / (d1 - d3);
+    v = Select(inAB, vAB, v);
+    w = Select(inAB, zero, w);
+
+    // vertex b
+    const F inB = (zero <= d3) & (d4 <= d3);
+    v = Select(inB, one, v);
+    w = Select(inB, zero, w);
+
+    // vertex a
+    const F inA = (d1 <= zero) & (d2 <= zero);
+    v = Select(inA, zero, v);
+    w = Select(inA, zero, w);
+
+    const F qx = a.mX + ab.mX * v + ac.mX * w;
+    const F qy = a.mY + ab.mY * v + ac.mY * w;
+    const F qz = a.mZ + ab.mZ * v + ac.mZ * w;
+
+    const Vec3N<W> pq = p - Vec3N<W>(qx, qy, qz);
+    const F distSq = Dot(pq, pq);
+
+    float lanes[W], lanesV[W], lanesW[W], lanesX[W], lanesY[W], lanesZ[W];
+    distSq.Store(lanes);
+
+    int best = -1;
+    for (unsigned i = 0; i < numFaces; ++i)
+    {
+        if (lanes[i] <= bestDistSq)
+        {
+            bestDistSq = lanes[i];
+            best = static_cast<int>(i);
+        }
+    }
+
+    if (best < 0)
+        return;
+
+    v.Store(lanesV);
+    w.Store(lanesW);
+    qx.Store(lanesX);
+    qy.Store(lanesY);
+    qz.Store(lanesZ);
+
+    hit.mHit = true;
+    hit.mPoint = Eigen::Vector3f(lanesX[best], lanesY[best], lanesZ[best]);
+    hit.mFaceIndex = mPrimitives[offset + best];
+    hit.mV = lanesV[best];
+    hit.mW = lanesW[best];
+    hit.mU = 1.0f - hit.mV - hit.mW;
+}
+
+void AABBTree::ClosestPoints(const Eigen::Vector3f *points, unsigned numPoints, float maxDistance,
+                             ClosestPointHit *hits, unsigned numThreads) const
+{
+    if (numThreads == 0)
+        numThreads = max(thread::hardware_concurrency(), 1U);
+
+    // not worth a thread for fewer points than this
+    const unsigned kMinPointsPerThread = 256;
+    numThreads = max(min(numThreads, numPoints / kMinPointsPerThread), 1U);
+
+    const unsigned chunk = (numPoints + numThreads - 1) / numThreads;
+
+    auto query = [this, points, maxDistance, hits](unsigned begin, unsigned end) {
+        for (unsigned i = begin; i < end; ++i)
+            ClosestPoint(points[i], maxDistance, hits[i]);
+    };
+
+    vector<future<void>> tasks;
+    for (unsigned t = 1; t < numThreads; ++t)
+        tasks.push_back(async(launch::async, query, t * chunk, min((t + 1) * chunk, numPoints)));
+
+    query(0, min(chunk, numPoints));
+
+    for (auto &task : tasks)
+        task.get();
+}
@@ -0,0 +1,555 @@
+#include "AABBTree.hpp"
+#include <algorithm>
+
+using namespace Eigen;
+using namespace std;
+using namespace PiratePhysics;
+
+unsigned AABBTree::InsertFaces(VertexView vertices, unsigned numVerts, const unsigned *indices, unsigned numFaces)
+{
+    // nothing is left to edit once only the compressed nodes are kept
+    if (IsCompressedOnly())
+        return 0;
+
+    if (numFaces <= mTraits.mNumFaces)
+        return 0;
+
+    const unsigned first = mTraits.mNumFaces;
+
+    mTraits.mVertices = vertices;
+    mTraits.mNumVerts = numVerts;
+    mTraits.mIndices = indices;
+    mTraits.mNumFaces = numFaces;
+
+    // per face data covers the whole mesh unless it was released
+    if (!mBounds.empty())
+        AppendFaceData();
+
+    BeginEdit();
+
+    for (unsigned f = first; f < numFaces; ++f)
+        InsertFace(f);
+
+    EndEdit();
+
+    return numFaces - first;
+}
+
+unsigned AABBTree::InsertFaces(const unsigned *faces, unsigned numFaces)
+{
+    if (IsCompressedOnly())
+        return 0;
+
+    BeginEdit();
+
+    unsigned path[kMaxTreeDepth];
+    unsigned pathLength;
+    unsigned entry;
+
+    unsigned numInserted = 0;
+    for (unsigned i = 0; i < numFaces; ++i)
+    {
+        const unsigned f = faces[i];
+        if (f >= mTraits.mNumFaces)
+            continue;
+
+        // faces still in the tree are left alone, their leaves were fitted to the per face bounds if there are any
+        pathLength = 0;
+        if (!mNodes.empty() && FindFace(0, f, GetFaceBounds(f), !mBounds.empty(), path, pathLength, entry))
+            continue;
+
+        if (!mBounds.empty())
+        {
+            // the vertices may have moved since the face was taken out
+            mBounds[f] = mTraits.GetBounds(f);
+            mCentroids[f] = mTraits.GetCentroid(f);
+        }
+
+        InsertFace(f);
+        ++numInserted;
+    }
+
+    EndEdit();
+
+    return numInserted;
+}
+
+unsigned AABBTree::RemoveFaces(const unsigned *faces, unsigned numFaces)
+{
+    if (mNodes.empty())
+        return 0;
+
+    BeginEdit();
+
+    unsigned numRemoved = 0;
+    for (unsigned i = 0; i < numFaces; ++i)
+    {
+        if (faces[i] < mTraits.mNumFaces && RemoveFace(faces[i]))
+            ++numRemoved;
+    }
+
+    EndEdit();
+
+    return numRemoved;
+}
+
+void AABBTree::BeginEdit()
+{
+    // heights are only kept while the tree is edited, the first edit after a build pays for them once
+    if (mNodeHeights.empty() && !mNodes.empty())
+    {
+        mNodeHeights.resize(mNodes.size());
+        UpdateHeights(0);
+    }
+}
+
+void AABBTree::EndEdit()
+{
+    mFreeNode = static_cast<unsigned>(mNodes.size() - mUnusedNodes.size());
+    mStats.mTreeDepth = mNodes.empty() ? 0 : mNodeHeights[0];
+
+    // entries of removed faces are reclaimed once they outnumber the ones in use
+    if (mUnusedFaceEntries > mPrimitives.size() / 2)
+        Compact();
+
+    if (mWideWidth)
+        CollapseWide(mWideWidth);
+    if (mQuantizedBits)
+        CompressNodes(mQuantizedBits);
+
+    if (!mLeafTriangles.empty())
+        BuildLeafTriangles();
+}
+
+unsigned AABBTree::UpdateHeights(unsigned nodeIndex)
+{
+    const Node &n = mNodes[nodeIndex];
+
+    unsigned height = 1;
+    if (!n.IsLeaf())
+        height += max(UpdateHeights(n.GetLeft(nodeIndex)), UpdateHeights(n.mOffset));
+
+    mNodeHeights[nodeIndex] = static_cast<uint8_t>(height);
+    return height;
+}
+
+unsigned AABBTree::AllocateNode()
+{
+    if (!mUnusedNodes.empty())
+    {
+        const unsigned nodeIndex = mUnusedNodes.back();
+        mUnusedNodes.pop_back();
+        return nodeIndex;
+    }
+
+    mNodes.emplace_back();
+    mNodeHeights.push_back(0);
+    return static_cast<unsigned>(mNodes.size() - 1);
+}
+
+void AABBTree::FreeNode(unsigned nodeIndex)
+{
+    // an unused slot looks like an inner node without area, so sweeps over all nodes skip it
+    mNodes[nodeIndex] = Node();
+    mUnusedNodes.push_back(nodeIndex);
+}
+
+void AABBTree::MoveNode(unsigned from, unsigned to)
+{
+    Node n = mNodes[from];
+    if (!n.IsLeaf())
+        n.SetLeft(to, n.GetLeft(from));
+
+    mNodes[to] = n;
+    mNodeHeights[to] = mNodeHeights[from];
+}
+
+AABBTree::Bounds AABBTree::GetFaceBounds(unsigned face) const
+{
+    return face < mBounds.size() ? mBounds[face] : mTraits.GetBounds(face);
+}
+
+void AABBTree::AppendFaceData()
+{
+    for (unsigned f = static_cast<unsigned>(mBounds.size()); f < mTraits.mNumFaces; ++f)
+    {
+        mBounds.push_back(mTraits.GetBounds(f));
+        mCentroids.push_back(mTraits.GetCentroid(f));
+    }
+}
+
+AABBTree::Bounds AABBTree::GetNodeBounds(unsigned nodeIndex) const
+{
+    return Bounds(mNodes[nodeIndex].mMinExtents, mNodes[nodeIndex].mMaxExtents);
+}
+
+void AABBTree::InsertFace(unsigned face)
+{
+    // the traversal stacks hold kMaxTreeDepth entries and an insertion adds at most one level
+    if (!mNodes.empty() && mNodeHeights[0] >= kMaxTreeDepth)
+        RebuildEdited();
+
+    const Bounds bounds = GetFaceBounds(face);
+    const float leafArea = bounds.GetSurfaceArea();
+
+    const unsigned leaf = AllocateNode();
+    mNodes[leaf].mMinExtents = bounds.mMin;
+    mNodes[leaf].mMaxExtents = bounds.mMax;
+    mNodes[leaf].mOffset = static_cast<unsigned>(mPrimitives.size());
+    mNodes[leaf].mNumPrimitives = 1;
+    mNodeHeights[leaf] = 1;
+
+    mPrimitives.push_back(face);
+    ++mStats.mLeafNodes;
+
+    // the first face of an empty tree is the root
+    if (leaf == 0)
+        return;
+
+    // walk down to the node the new leaf becomes the sibling of, stopping where a new parent
+    // costs less than the cheapest way further down, ancestors grow by the same amount either way
+    unsigned path[kMaxTreeDepth];
+    unsigned pathLength = 0;
+    unsigned sibling = 0;
+
+    while (!mNodes[sibling].IsLeaf())
+    {
+        const Node &n = mNodes[sibling];
+
+        Bounds combined = GetNodeBounds(sibling);
+        const float area = combined.GetSurfaceArea();
+        combined.Union(bounds);
+        const float combinedArea = combined.GetSurfaceArea();
+
+        const float grown = combinedArea - area;
+
+        float childCost[2];
+        const unsigned children[2] = {n.GetLeft(sibling), n.mOffset};
+        for (unsigned i = 0; i < 2; ++i)
+        {
+            Bounds c = GetNodeBounds(children[i]);
+            const float childArea = c.GetSurfaceArea();
+            c.Union(bounds);
+
+            // below an inner child the new parent is at least as large as the leaf
+            if (mNodes[children[i]].IsLeaf())
+                childCost[i] = grown + c.GetSurfaceArea();
+            else
+                childCost[i] = grown + c.GetSurfaceArea() - childArea + leafArea;
+        }
+
+        if (combinedArea <= childCost[0] && combinedArea <= childCost[1])
+            break;
+
+        path[pathLength++] = sibling;
+        sibling = childCost[0] <= childCost[1] ? children[0] : children[1];
+    }
+
+    unsigned parent = AllocateNode();
+    ++mStats.mInnerNodes;
+
+    if (sibling == 0)
+    {
+        // the root has to stay at the start, the old root moves to the new slot instead
+        MoveNode(0, parent);
+        sibling = parent;
+        parent = 0;
+    }
+    else
+    {
+        const unsigned above = path[pathLength - 1];
+        Node &a = mNodes[above];
+        if (a.GetLeft(above) == sibling)
+            a.SetLeft(above, parent);
+        else
+            a.mOffset = parent;
+    }
+
+    mNodes[parent].SetLeft(parent, sibling);
+    mNodes[parent].mOffset = leaf;
+    UpdateNode(parent);
+
+    RefitPath(path, pathLength);
+}
+
+bool AABBTree::RemoveFace(unsigned face)
+{
+    const Bounds bounds = GetFaceBounds(face);
+
+    // the per face bounds are the ones the tree was fitted to, bounds taken from the vertices
+    // may have moved since and are only good for an exhaustive search
+    const bool prune = !mBounds.empty();
+
+    bool removed = false;
+
+    // a face cut by spatial splits sits in more than one leaf, any other is done after its first one
+    unsigned path[kMaxTreeDepth];
+    unsigned pathLength = 0;
+    unsigned entry;
+
+    while ((!removed || mDuplicateReferences) && !mNodes.empty() && FindFace(0, face, bounds, prune, path, pathLength, entry))
+    {
+        removed = true;
+        ++mUnusedFaceEntries;
+
+        const unsigned leaf = path[pathLength - 1];
+        Node &l = mNodes[leaf];
+
+        if (l.mNumPrimitives > 1)
+        {
+            // the last entry of the leaf takes the place of the removed one
+            --l.mNumPrimitives;
+            mPrimitives[entry] = mPrimitives[l.mOffset + l.mNumPrimitives];
+
+            Bounds b;
+            for (unsigned i = 0; i < l.mNumPrimitives; ++i)
+                b.Union(GetFaceBounds(mPrimitives[l.mOffset + i]));
+
+            l.mMinExtents = b.mMin;
+            l.mMaxExtents = b.mMax;
+
+            RefitPath(path, pathLength - 1);
+            pathLength = 0;
+            continue;
+        }
+
+        --mStats.mLeafNodes;
+
+        if (pathLength == 1)
+        {
+            // that was the last face
+            mNodes.clear();
+            mPrimitives.clear();
+            mNodeHeights.clear();
+            mUnusedNodes.clear();
+            mUnusedFaceEntries = 0;
+            mStats.mInnerNodes = 0;
+            break;
+        }
+
+        // the sibling takes the place of the parent
+        const unsigned parent = path[pathLength - 2];
+        const Node &p = mNodes[parent];
+        const unsigned sibling = p.GetLeft(parent) == leaf ? p.mOffset : p.GetLeft(parent);
+
+        FreeNode(leaf);
+        --mStats.mInnerNodes;
+
+        if (pathLength == 2)
+        {
+            MoveNode(sibling, 0);
+            FreeNode(sibling);
+        }
+        else
+        {
+            const unsigned above = path[pathLength - 3];
+            Node &a = mNodes[above];
+            if (a.GetLeft(above) == parent)
+                a.SetLeft(above, sibling);
+            else
+                a.mOffset = sibling;
+
+            FreeNode(parent);
+            RefitPath(path, pathLength - 2);
+        }
+
+        pathLength = 0;
+    }
+
+    return removed;
+}
+
+bool AABBTree::FindFace(unsigned nodeIndex, unsigned face, const Bounds &bounds, bool prune,
+                        unsigned *path, unsigned &pathLength, unsigned &entry) const
+{
+    const Node &n = mNodes[nodeIndex];
+
+    if (prune && ((bounds.mMin.array() > n.mMaxExtents.array()).any() ||
+                  (bounds.mMax.array() < n.mMinExtents.array()).any()))
+        return false;
+
+    path[pathLength++] = nodeIndex;
+
+    if (n.IsLeaf())
+    {
+        for (unsigned i = 0; i < n.mNumPrimitives; ++i)
+        {
+            if (mPrimitives[n.mOffset + i] == face)
+            {
+                entry = n.mOffset + i;
+                return true;
+            }
+        }
+    }
+    else if (FindFace(n.GetLeft(nodeIndex), face, bounds, prune, path, pathLength, entry) ||
+             FindFace(n.mOffset, face, bounds, prune, path, pathLength, entry))
+    {
+        return true;
+    }
+
+    --pathLength;
+    return false;
+}
+
+void AABBTree::RefitPath(const unsigned *path, unsigned pathLength)
+{
+    for (unsigned i = pathLength; i-- > 0;)
+    {
+        UpdateNode(path[i]);
+        RotateNode(path[i]);
+    }
+}
+
+void AABBTree::UpdateNode(unsigned nodeIndex)
+{
+    Node &n = mNodes[nodeIndex];
+    const unsigned left = n.GetLeft(nodeIndex);
+    const unsigned right = n.mOffset;
+
+    Bounds b = GetNodeBounds(left);
+    b.Union(GetNodeBounds(right));
+
+    n.mMinExtents = b.mMin;
+    n.mMaxExtents = b.mMax;
+    mNodeHeights[nodeIndex] = static_cast<uint8_t>(1 + max(mNodeHeights[left], mNodeHeights[right]));
+}
+
+void AABBTree::RotateNode(unsigned nodeIndex)
+{
+    const Node &n = mNodes[nodeIndex];
+    const unsigned children[2] = {n.GetLeft(nodeIndex), n.mOffset};
+
+    // swapping a child with one of its sibling's children only changes the sibling's box,
+    // take the swap that shrinks it most and does not make the subtree any taller
+    float bestGain = 0.0f;
+    unsigned bestChild = 0;
+    unsigned bestGrandchild = 0;
+
+    for (unsigned i = 0; i < 2; ++i)
+    {
+        const unsigned child = children[i];
+        const unsigned sibling = children[1 - i];
+
+        const Node &s = mNodes[sibling];
+        if (s.IsLeaf())
+            continue;
+
+        const unsigned grandchildren[2] = {s.GetLeft(sibling), s.mOffset};
+        const float siblingArea = GetNodeBounds(sibling).GetSurfaceArea();
+
+        for (unsigned j = 0; j < 2; ++j)
+        {
+            const unsigned moved = grandchildren[j];
+            const unsigned kept = grandchildren[1 - j];
+
+            // child drops below the sibling, the grandchild moves up in its place
+            const unsigned siblingHeight = 1 + max(mNodeHeights[child], mNodeHeights[kept]);
+            if (1 + max(siblingHeight, unsigned(mNodeHeights[moved])) > mNodeHeights[nodeIndex])
+                continue;
+
+            Bounds b = GetNodeBounds(child);
+            b.Union(GetNodeBounds(kept));
+
+            const float gain = siblingArea - b.GetSurfaceArea();
+            if (gain > bestGain)
+            {
+                bestGain = gain;
+                bestChild = i;
+                bestGrandchild = j;
+            }
+        }
+    }
+
+    if (bestGain <= 0.0f)
+        return;
+
+    const unsigned child = children[bestChild];
+    const unsigned sibling = children[1 - bestChild];
+
+    Node &s = mNodes[sibling];
+    const unsigned moved = bestGrandchild == 0 ? s.GetLeft(sibling) : s.mOffset;
+
+    if (bestGrandchild == 0)
+        s.SetLeft(sibling, child);
+    else
+        s.mOffset = child;
+
+    Node &m = mNodes[nodeIndex];
+    if (bestChild == 0)
+        m.SetLeft(nodeIndex, moved);
+    else
+        m.mOffset = moved;
+
+    UpdateNode(sibling);
+    UpdateNode(nodeIndex);
+}
+
+void AABBTree::RebuildEdited()
+{
+    Compact();
+
+    // every face gets its per face data back if it was released, the ones InsertFaces has
+    // still to insert as well, they would otherwise read the empty bounds of a resized vector
+    AppendFaceData();
+    RefitRecursive(0, 1);
+
+    const unsigned numFaces = static_cast<unsigned>(mPrimitives.size());
+
+    vector<Node> nodes(2 * numFaces - 1);
+    BuildStats stats;
+    BuildRecursive(nodes, 0, mPrimitives.data(), numFaces, 1, stats);
+    BVHBuilder::CompactNodes(nodes);
+
+    mNodes.swap(nodes);
+    mFreeNode = static_cast<unsigned>(mNodes.size());
+
+    mStats = stats;
+
+    BeginEdit();
+}
+
+void AABBTree::Compact()
+{
+    vector<Node> nodes;
+    vector<unsigned> faces;
+
+    if (!mNodes.empty())
+    {
+        nodes.reserve(mNodes.size() - mUnusedNodes.size());
+        faces.reserve(mPrimitives.size() - mUnusedFaceEntries);
+        LayoutDepthFirst(0, nodes, faces);
+    }
+
+    mNodes.swap(nodes);
+    mPrimitives.swap(faces);
+    mFreeNode = static_cast<unsigned>(mNodes.size());
+
+    mNodeHeights.clear();
+    mUnusedNodes.clear();
+    mUnusedFaceEntries = 0;
+
+    // node indices changed, Refit takes the compacted tree as its new reference
+    mSubtreeCost.clear();
+    mBuiltSubtreeCost.clear();
+}
+
+void AABBTree::LayoutDepthFirst(unsigned nodeIndex, vector<Node> &nodes, vector<unsigned> &faces) const
+{
+    const Node &n = mNodes[nodeIndex];
+
+    const unsigned index = static_cast<unsigned>(nodes.size());
+    nodes.push_back(n);
+
+    if (n.IsLeaf())
+    {
+        nodes[index].mOffset = static_cast<unsigned>(faces.size());
+        faces.insert(faces.end(), mPrimitives.begin() + n.mOffset, mPrimitives.begin() + n.mOffset + n.mNumPrimitives);
+        return;
+    }
+
+    nodes[index].mNumPrimitives = 0;
+    LayoutDepthFirst(n.GetLeft(nodeIndex), nodes, faces);
+
+    nodes[index].mOffset = static_cast<unsigned>(nodes.size());
+    LayoutDepthFirst(n.mOffset, nodes, faces);
+}
@@ -0,0 +1,135 @@
+#include "AABBTree.hpp"
+#include "Simd.hpp"
+
+using namespace std;
+using namespace PiratePhysics;
+using namespace PiratePhysics::Simd;
+
+// Eigen is left out of the using directives, its Select and Cross would hide the packet versions
+
+size_t AABBTree::PrecomputeLeafTriangles(bool enable)
+{
+    mLeafTriangles.clear();
+    mLeafTriangles.shrink_to_fit();
+    mLeafTriangleIndex.clear();
+    mLeafTriangleIndex.shrink_to_fit();
+
+    if (enable && !mNodes.empty())
+        BuildLeafTriangles();
+
+    return GetLeafTrianglesMemory();
+}
+
+size_t AABBTree::GetLeafTrianglesMemory() const
+{
+    return mLeafTriangles.capacity() * sizeof(LeafTriangles) + mLeafTriangleIndex.capacity() * sizeof(unsigned);
+}
+
+void AABBTree::BuildLeafTriangles()
+{
+    static_assert(kMaxFacesPerLeaf <= kLeafTriangleLanes, "a leaf has to fit in one block");
+
+    mLeafTriangles.resize(mStats.mLeafNodes);
+    mLeafTriangleIndex.assign(mPrimitives.size(), kUnusedNode);
+
+    // blocks follow the leaves in depth first order, the same order the traversal meets them in
+    unsigned numBlocks = 0;
+    for (const Node &node : mNodes)
+    {
+        if (!node.IsLeaf())
+            continue;
+
+        LeafTriangles &tris = mLeafTriangles[numBlocks];
+        mLeafTriangleIndex[node.mOffset] = numBlocks++;
+
+        for (unsigned i = 0; i < kLeafTriangleLanes; ++i)
+        {
+            if (i < node.mNumPrimitives)
+            {
+                const unsigned f = mPrimitives[node.mOffset + i];
+
+                const Eigen::Vector3f &a = mTraits.mVertices[mTraits.mIndices[f*3+0]];
+                const Eigen::Vector3f &b = mTraits.mVertices[mTraits.mIndices[f*3+1]];
+                const Eigen::Vector3f &c = mTraits.mVertices[mTraits.mIndices[f*3+2]];
+
+                for (unsigned k = 0; k < 3; ++k)
+                {
+                    tris.mA[k][i] = a[k];
+                    tris.mAB[k][i] = b[k] - a[k];
+                    tris.mAC[k][i] = c[k] - a[k];
+                }
+                tris.mFace[i] = f;
+            }
+            else
+            {
+                // empty lanes hold a degenerate triangle, their results are masked out
+                for (unsigned k = 0; k < 3; ++k)
+                {
+                    tris.mA[k][i] = 0.0f;
+                    tris.mAB[k][i] = 0.0f;
+                    tris.mAC[k][i] = 0.0f;
+                }
+                tris.mFace[i] = 0;
+            }
+        }
+    }
+
+    mLeafTriangles.resize(numBlocks);
+}
+
+void AABBTree::IntersectLeafTriangles(const LeafTriangles &tris, unsigned numFaces,
+                                      const Eigen::Vector3f &start, const Eigen::Vector3f &dir,
+                                      float &outT, float &outU, float &outV, float &outW, float &faceSign,
+                                      uint32_t &faceIndex) const
+{
+    const int W = kLeafTriangleLanes;
+    using F = FloatN<W>;
+
+    // Moller and Trumbore, as IntersectRayTriTwoSided but one face per lane
+    const Vec3N<W> a(F::Load(tris.mA[0]), F::Load(tris.mA[1]), F::Load(tris.mA[2]));
+    const Vec3N<W> ab(F::Load(tris.mAB[0]), F::Load(tris.mAB[1]), F::Load(tris.mAB[2]));
+    const Vec3N<W> ac(F::Load(tris.mAC[0]), F::Load(tris.mAC[1]), F::Load(tris.mAC[2]));
+
+    const Vec3N<W> negDir(-dir[0], -dir[1], -dir[2]);
+    const Vec3N<W> n = Cross(ab, ac);
+
+    const F d = Dot(n, negDir);
+    const F ood = F(1.0f) / d;
+    const Vec3N<W> ap = Vec3N<W>(start[0], start[1], start[2]) - a;
+
+    const F t = Dot(ap, n) * ood;
+    const Vec3N<W> e = Cross(negDir, ap);
+    const F v = Dot(ac, e) * ood;
+    const F w = (F(0.0f) - Dot(ab, e)) * ood;
+
+    const F zero(0.0f);
+    const F one(1.0f);
+    const F hit = (zero <= t) & (t < F(outT)) & (zero <= v) & (v <= one) & (zero <= w) & (v + w <= one);
+
+    const unsigned hitMask = MoveMask(hit) & ((1U << numFaces) - 1);
+    if (!hitMask)
+        return;
+
+    float ts[W];
+    t.Store(ts);
+
+    // nearest lane, the first one on ties like the scalar loop
+    int best = -1;
+    for (int i = 0; i < W; ++i)
+    {
+        if ((hitMask & (1U << i)) && (best < 0 || ts[i] < ts[best]))
+            best = i;
+    }
+
+    float vs[W], ws[W], ds[W];
+    v.Store(vs);
+    w.Store(ws);
+    d.Store(ds);
+
+    outT = ts[best];
+    outV = vs[best];
+    outW = ws[best];
+    outU = 1.0f - outV - outW;
+    faceSign = ds[best];
+    faceIndex = tris.mFace[best];
+}
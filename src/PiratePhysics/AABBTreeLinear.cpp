@@ -0,0 +1,191 @@
+#include "AABBTree.hpp"
+#include <algorithm>
+#include <future>
+
+using namespace Eigen;
+using namespace std;
+using namespace PiratePhysics;
+
+namespace
+{
+    // above this many faces 10 bits per axis leave too many centroids in the same cell
+    const unsigned kMaxFaces30BitCodes = 1U << 21;
+
+    const unsigned kRadixBits = 11;
+    const unsigned kRadixSize = 1U << kRadixBits;
+
+    // spreads the low 21 bits of v out to every third bit
+    uint64_t ExpandBits(uint64_t v)
+    {
+        v &= 0x1fffff;
+        v = (v | v << 32) & 0x1f00000000ffffULL;
+        v = (v | v << 16) & 0x1f0000ff0000ffULL;
+        v = (v | v << 8) & 0x100f00f00f00f00fULL;
+        v = (v | v << 4) & 0x10c30c30c30c30c3ULL;
+        v = (v | v << 2) & 0x1249249249249249ULL;
+        return v;
+    }
+
+    // runs body(begin, end) over numThreads contiguous chunks of [0, count)
+    template <typename Body>
+    void ParallelChunks(unsigned count, unsigned numThreads, const Body &body)
+    {
+        const unsigned chunk = (count + numThreads - 1) / numThreads;
+
+        vector<future<void>> tasks;
+        for (unsigned t = 1; t < numThreads; ++t)
+            tasks.push_back(async(launch::async, body, t, min(t * chunk, count), min((t + 1) * chunk, count)));
+
+        body(0, 0, min(chunk, count));
+
+        for (auto &task : tasks)
+            task.get();
+    }
+} // namespace
+
+void AABBTree::SortMortonCodes(vector<uint64_t> &codes)
+{
+    // quantize the centroids inside their own bounds, not the faces', so the whole grid is used
+    Vector3f minCentroid = mCentroids[0];
+    Vector3f maxCentroid = mCentroids[0];
+    for (const Vector3f &c : mCentroids)
+    {
+        minCentroid = minCentroid.cwiseMin(c);
+        maxCentroid = maxCentroid.cwiseMax(c);
+    }
+
+    const unsigned bitsPerAxis = mTraits.mNumFaces <= kMaxFaces30BitCodes ? 10 : 21;
+    const float cells = float((1U << bitsPerAxis) - 1);
+
+    Vector3f scale = maxCentroid - minCentroid;
+    for (int a = 0; a < 3; ++a)
+        scale[a] = scale[a] > 0.0f ? cells / scale[a] : 0.0f;
+
+    // only use as many workers as there are faces to keep them busy
+    const unsigned numThreads = max(min(mNumThreads, mTraits.mNumFaces / kMinParallelFaces), 1U);
+
+    codes.resize(mTraits.mNumFaces);
+    ParallelChunks(mTraits.mNumFaces, numThreads, [&](unsigned, unsigned begin, unsigned end) {
+        for (unsigned i = begin; i < end; ++i)
+        {
+            const Vector3f p = (mCentroids[mPrimitives[i]] - minCentroid).cwiseProduct(scale);
+            codes[i] = ExpandBits(uint64_t(p[0])) << 2 | ExpandBits(uint64_t(p[1])) << 1 | ExpandBits(uint64_t(p[2]));
+        }
+    });
+
+    // least significant digit radix sort of the codes together with the faces, every worker
+    // counts its own chunk so the scatter offsets of all chunks are known before any is written
+    vector<uint64_t> tmpCodes(mTraits.mNumFaces);
+    vector<unsigned> tmpFaces(mTraits.mNumFaces);
+    vector<unsigned> offsets(numThreads * kRadixSize);
+
+    const unsigned numPasses = (3 * bitsPerAxis + kRadixBits - 1) / kRadixBits;
+    for (unsigned pass = 0; pass < numPasses; ++pass)
+    {
+        const unsigned shift = pass * kRadixBits;
+
+        fill(offsets.begin(), offsets.end(), 0U);
+        ParallelChunks(mTraits.mNumFaces, numThreads, [&](unsigned t, unsigned begin, unsigned end) {
+            unsigned *count = &offsets[t * kRadixSize];
+            for (unsigned i = begin; i < end; ++i)
+                ++count[(codes[i] >> shift) & (kRadixSize - 1)];
+        });
+
+        unsigned sum = 0;
+        for (unsigned d = 0; d < kRadixSize; ++d)
+        {
+            for (unsigned t = 0; t < numThreads; ++t)
+            {
+                const unsigned count = offsets[t * kRadixSize + d];
+                offsets[t * kRadixSize + d] = sum;
+                sum += count;
+            }
+        }
+
+        ParallelChunks(mTraits.mNumFaces, numThreads, [&](unsigned t, unsigned begin, unsigned end) {
+            unsigned *offset = &offsets[t * kRadixSize];
+            for (unsigned i = begin; i < end; ++i)
+            {
+                const unsigned dst = offset[(codes[i] >> shift) & (kRadixSize - 1)]++;
+                tmpCodes[dst] = codes[i];
+                tmpFaces[dst] = mPrimitives[i];
+            }
+        });
+
+        codes.swap(tmpCodes);
+        mPrimitives.swap(tmpFaces);
+    }
+}
+
+void AABBTree::BuildLinearRecursive(unsigned nodeIndex, const uint64_t *codes, unsigned *faces, unsigned numFaces,
+                                    unsigned depth, BuildStats &stats)
+{
+    Node &n = mNodes[nodeIndex];
+    stats.mTreeDepth = max(stats.mTreeDepth, depth);
+
+    if (numFaces <= kMaxFacesPerLeaf)
+    {
+        Bounds bounds;
+        for (unsigned i = 0; i < numFaces; ++i)
+            bounds.Union(mBounds[faces[i]]);
+
+        n.mMinExtents = bounds.mMin;
+        n.mMaxExtents = bounds.mMax;
+        n.mOffset = static_cast<unsigned>(faces - mPrimitives.data());
+        n.mNumPrimitives = numFaces;
+
+        ++stats.mLeafNodes;
+        return;
+    }
+
+    ++stats.mInnerNodes;
+
+    // the faces are already sorted, split where the highest bit that differs inside the range flips,
+    // ranges sharing one code or near the stack limit are split in the middle
+    unsigned leftCount = numFaces / 2;
+
+    const uint64_t diff = codes[0] ^ codes[numFaces - 1];
+    if (diff && depth + BVHBuilder::Log2Ceil(numFaces) < kMaxTreeDepth)
+    {
+        unsigned bit = 63;
+        while (!(diff >> bit))
+            --bit;
+
+        leftCount = static_cast<unsigned>(partition_point(codes, codes + numFaces, [bit](uint64_t c) {
+                                              return !((c >> bit) & 1);
+                                          }) - codes);
+    }
+
+    const unsigned rightCount = numFaces - leftCount;
+
+    // same slot reservation as BuildRecursive
+    const unsigned left = nodeIndex + 1;
+    const unsigned right = nodeIndex + 2 * leftCount;
+    n.mOffset = right;
+    n.mNumPrimitives = 0;
+
+    if (depth < mMaxParallelDepth && leftCount >= kMinParallelFaces)
+    {
+        BuildStats leftStats;
+        future<void> task = async(launch::async, [&, left, codes, faces, leftCount, depth]() {
+            BuildLinearRecursive(left, codes, faces, leftCount, depth+1, leftStats);
+        });
+
+        BuildLinearRecursive(right, codes+leftCount, faces+leftCount, rightCount, depth+1, stats);
+
+        task.get();
+        stats.Merge(leftStats);
+    }
+    else
+    {
+        BuildLinearRecursive(left, codes, faces, leftCount, depth+1, stats);
+        BuildLinearRecursive(right, codes+leftCount, faces+leftCount, rightCount, depth+1, stats);
+    }
+
+    // bounds come up from the children once both are built
+    Bounds bounds(mNodes[left].mMinExtents, mNodes[left].mMaxExtents);
+    bounds.Union(Bounds(mNodes[right].mMinExtents, mNodes[right].mMaxExtents));
+
+    n.mMinExtents = bounds.mMin;
+    n.mMaxExtents = bounds.mMax;
+}
@@ -0,0 +1,318 @@
+#include "AABBTree.hpp"
+#include <algorithm>
+#include <cassert>
+
+using namespace Eigen;
+using namespace std;
+using namespace PiratePhysics;
+
+namespace
+{
+    // keeps the cross product axes meaningful when two edges are near parallel
+    const float kParallelEpsilon = 1e-6f;
+
+    void TriangleBounds(const Vector3f &a, const Vector3f &b, const Vector3f &c, Vector3f &min, Vector3f &max)
+    {
+        min = a.cwiseMin(b).cwiseMin(c);
+        max = a.cwiseMax(b).cwiseMax(c);
+    }
+
+    bool OverlapAABB(const Vector3f &minA, const Vector3f &maxA, const Vector3f &minB, const Vector3f &maxB)
+    {
+        return minA[0] <= maxB[0] && minB[0] <= maxA[0] &&
+               minA[1] <= maxB[1] && minB[1] <= maxA[1] &&
+               minA[2] <= maxB[2] && minB[2] <= maxA[2];
+    }
+
+    /**
+     * separating axis test of an axis aligned box against a box given in another frame,
+     * the columns of rotation are that frame's axes (Gottschalk's 15 axes)
+     */
+    bool OverlapOBB(const Vector3f &minA, const Vector3f &maxA, const Vector3f &minB, const Vector3f &maxB,
+                    const Matrix3f &rotation, const Matrix3f &absRotation, const Vector3f &translation)
+    {
+        const Vector3f ea = (maxA - minA) * 0.5f;
+        const Vector3f eb = (maxB - minB) * 0.5f;
+        const Vector3f t = rotation * ((minB + maxB) * 0.5f) + translation - (minA + maxA) * 0.5f;
+
+        // axes of a
+        for (int i = 0; i < 3; ++i)
+        {
+            if (fabsf(t[i]) > ea[i] + eb.dot(absRotation.row(i)))
+                return false;
+        }
+
+        // axes of b
+        for (int j = 0; j < 3; ++j)
+        {
+            if (fabsf(t.dot(rotation.col(j))) > ea.dot(absRotation.col(j)) + eb[j])
+                return false;
+        }
+
+        // cross products of an axis of a with an axis of b
+        for (int i = 0; i < 3; ++i)
+        {
+            const int i1 = (i + 1) % 3;
+            const int i2 = (i + 2) % 3;
+
+            for (int j = 0; j < 3; ++j)
+            {
+                const int j1 = (j + 1) % 3;
+                const int j2 = (j + 2) % 3;
+
+                const float ra = ea[i1] * absRotation(i2, j) + ea[i2] * absRotation(i1, j);
+                const float rb = eb[j1] * absRotation(i, j2) + eb[j2] * absRotation(i, j1);
+
+                if (fabsf(t[i2] * rotation(i1, j) - t[i1] * rotation(i2, j)) > ra + rb)
+                    return false;
+            }
+        }
+
+        return true;
+    }
+
+    void AddPair(uint32_t faceA, uint32_t faceB, FacePair *pairs, unsigned maxPairs, unsigned &numPairs)
+    {
+        // keep counting past the end of the buffer so the caller knows how much to grow it
+        if (numPairs < maxPairs)
+        {
+            pairs[numPairs].mFaceA = faceA;
+            pairs[numPairs].mFaceB = faceB;
+        }
+        ++numPairs;
+    }
+
+    /**
+     * a face referenced from several leaves meets the same face in several leaf pairs, only the
+     * first of each is kept, a count past the end of the buffer is left as the upper bound it is
+     */
+    unsigned RemoveDuplicatePairs(FacePair *pairs, unsigned maxPairs, unsigned numPairs, bool unordered)
+    {
+        if (numPairs > maxPairs)
+            return numPairs;
+
+        if (unordered)
+        {
+            for (unsigned i = 0; i < numPairs; ++i)
+            {
+                if (pairs[i].mFaceB < pairs[i].mFaceA)
+                    swap(pairs[i].mFaceA, pairs[i].mFaceB);
+            }
+        }
+
+        sort(pairs, pairs + numPairs, [](const FacePair &lhs, const FacePair &rhs) {
+            return lhs.mFaceA != rhs.mFaceA ? lhs.mFaceA < rhs.mFaceA : lhs.mFaceB < rhs.mFaceB;
+        });
+
+        FacePair *end = unique(pairs, pairs + numPairs, [](const FacePair &lhs, const FacePair &rhs) {
+            return lhs.mFaceA == rhs.mFaceA && lhs.mFaceB == rhs.mFaceB;
+        });
+
+        return static_cast<unsigned>(end - pairs);
+    }
+} // namespace
+
+unsigned AABBTree::Overlap(const AABBTree &other, const Matrix3f &rotation, const Vector3f &translation,
+                           FacePair *pairs, unsigned maxPairs) const
+{
+    unsigned numPairs = 0;
+
+    assert(!IsCompressedOnly() && !other.IsCompressedOnly());
+
+    if (mNodes.empty() || other.mNodes.empty())
+        return numPairs;
+
+    Matrix3f absRotation = rotation.cwiseAbs();
+    absRotation.array() += kParallelEpsilon;
+
+    struct StackEntry
+    {
+        unsigned mNodeA;
+        unsigned mNodeB;
+    };
+
+    // every descent defers one entry and goes one level deeper in one of the trees
+    StackEntry stack[kMaxTreeDepth * 2];
+    unsigned stackSize = 0;
+
+    stack[stackSize++] = {0, 0};
+
+    while (stackSize)
+    {
+        const StackEntry e = stack[--stackSize];
+
+        const Node &a = mNodes[e.mNodeA];
+        const Node &b = other.mNodes[e.mNodeB];
+
+        if (!OverlapOBB(a.mMinExtents, a.mMaxExtents, b.mMinExtents, b.mMaxExtents, rotation, absRotation, translation))
+            continue;
+
+        if (a.IsLeaf() && b.IsLeaf())
+        {
+            OverlapLeaves(other, a, b, rotation, translation, pairs, maxPairs, numPairs);
+            continue;
+        }
+
+        // split the larger box, rotation does not change the surface area of b
+        const bool descendA = b.IsLeaf() ||
+                              (!a.IsLeaf() && Bounds(a.mMinExtents, a.mMaxExtents).GetSurfaceArea() >=
+                                                  Bounds(b.mMinExtents, b.mMaxExtents).GetSurfaceArea());
+
+        if (descendA)
+        {
+            stack[stackSize++] = {a.mOffset, e.mNodeB};
+            stack[stackSize++] = {a.GetLeft(e.mNodeA), e.mNodeB};
+        }
+        else
+        {
+            stack[stackSize++] = {e.mNodeA, b.mOffset};
+            stack[stackSize++] = {e.mNodeA, b.GetLeft(e.mNodeB)};
+        }
+    }
+
+    if (mDuplicateReferences || other.mDuplicateReferences)
+        return RemoveDuplicatePairs(pairs, maxPairs, numPairs, false);
+
+    return numPairs;
+}
+
+void AABBTree::OverlapLeaves(const AABBTree &other, const Node &a, const Node &b,
+                             const Matrix3f &rotation, const Vector3f &translation,
+                             FacePair *pairs, unsigned maxPairs, unsigned &numPairs) const
+{
+    // b's faces are moved into this tree's space once and reused for every face of a
+    Vector3f minB[kMaxFacesPerLeaf], maxB[kMaxFacesPerLeaf];
+    for (unsigned j = 0; j < b.mNumPrimitives; ++j)
+    {
+        const unsigned f = other.mPrimitives[b.mOffset + j];
+        TriangleBounds(rotation * other.mTraits.mVertices[other.mTraits.mIndices[f*3+0]] + translation,
+                       rotation * other.mTraits.mVertices[other.mTraits.mIndices[f*3+1]] + translation,
+                       rotation * other.mTraits.mVertices[other.mTraits.mIndices[f*3+2]] + translation, minB[j], maxB[j]);
+    }
+
+    for (unsigned i = 0; i < a.mNumPrimitives; ++i)
+    {
+        const unsigned f = mPrimitives[a.mOffset + i];
+
+        Vector3f minA, maxA;
+        TriangleBounds(mTraits.mVertices[mTraits.mIndices[f*3+0]], mTraits.mVertices[mTraits.mIndices[f*3+1]], mTraits.mVertices[mTraits.mIndices[f*3+2]], minA, maxA);
+
+        for (unsigned j = 0; j < b.mNumPrimitives; ++j)
+        {
+            if (OverlapAABB(minA, maxA, minB[j], maxB[j]))
+                AddPair(f, other.mPrimitives[b.mOffset + j], pairs, maxPairs, numPairs);
+        }
+    }
+}
+
+unsigned AABBTree::SelfOverlap(FacePair *pairs, unsigned maxPairs) const
+{
+    unsigned numPairs = 0;
+
+    assert(!IsCompressedOnly());
+
+    if (mNodes.empty())
+        return numPairs;
+
+    // an entry with the same node twice stands for the pairs inside that subtree
+    struct StackEntry
+    {
+        unsigned mNodeA;
+        unsigned mNodeB;
+    };
+
+    // a subtree defers two entries per level on top of the descents of the pairs it spawns
+    StackEntry stack[kMaxTreeDepth * 4];
+    unsigned stackSize = 0;
+
+    stack[stackSize++] = {0, 0};
+
+    while (stackSize)
+    {
+        const StackEntry e = stack[--stackSize];
+
+        const Node &a = mNodes[e.mNodeA];
+
+        if (e.mNodeA == e.mNodeB)
+        {
+            if (a.IsLeaf())
+            {
+                SelfOverlapLeaves(a, a, true, pairs, maxPairs, numPairs);
+            }
+            else
+            {
+                const unsigned left = a.GetLeft(e.mNodeA);
+                stack[stackSize++] = {a.mOffset, a.mOffset};
+                stack[stackSize++] = {left, left};
+                stack[stackSize++] = {left, a.mOffset};
+            }
+            continue;
+        }
+
+        const Node &b = mNodes[e.mNodeB];
+
+        if (!OverlapAABB(a.mMinExtents, a.mMaxExtents, b.mMinExtents, b.mMaxExtents))
+            continue;
+
+        if (a.IsLeaf() && b.IsLeaf())
+        {
+            SelfOverlapLeaves(a, b, false, pairs, maxPairs, numPairs);
+            continue;
+        }
+
+        const bool descendA = b.IsLeaf() ||
+                              (!a.IsLeaf() && Bounds(a.mMinExtents, a.mMaxExtents).GetSurfaceArea() >=
+                                                  Bounds(b.mMinExtents, b.mMaxExtents).GetSurfaceArea());
+
+        if (descendA)
+        {
+            stack[stackSize++] = {a.mOffset, e.mNodeB};
+            stack[stackSize++] = {a.GetLeft(e.mNodeA), e.mNodeB};
+        }
+        else
+        {
+            stack[stackSize++] = {e.mNodeA, b.mOffset};
+            stack[stackSize++] = {e.mNodeA, b.GetLeft(e.mNodeB)};
+        }
+    }
+
+    if (mDuplicateReferences)
+        return RemoveDuplicatePairs(pairs, maxPairs, numPairs, true);
+
+    return numPairs;
+}
+
+void AABBTree::SelfOverlapLeaves(const Node &a, const Node &b, bool sameLeaf,
+                                 FacePair *pairs, unsigned maxPairs, unsigned &numPairs) const
+{
+    Vector3f minB[kMaxFacesPerLeaf], maxB[kMaxFacesPerLeaf];
+    for (unsigned j = 0; j < b.mNumPrimitives; ++j)
+    {
+        const unsigned f = mPrimitives[b.mOffset + j];
+        TriangleBounds(mTraits.mVertices[mTraits.mIndices[f*3+0]], mTraits.mVertices[mTraits.mIndices[f*3+1]], mTraits.mVertices[mTraits.mIndices[f*3+2]], minB[j], maxB[j]);
+    }
+
+    for (unsigned i = 0; i < a.mNumPrimitives; ++i)
+    {
+        const unsigned fa = mPrimitives[a.mOffset + i];
+        const unsigned *ia = &mTraits.mIndices[fa*3];
+
+        Vector3f minA, maxA;
+        TriangleBounds(mTraits.mVertices[ia[0]], mTraits.mVertices[ia[1]], mTraits.mVertices[ia[2]], minA, maxA);
+
+        // inside one leaf only the faces after i are paired so nothing is reported twice
+        for (unsigned j = sameLeaf ? i + 1 : 0; j < b.mNumPrimitives; ++j)
+        {
+            const unsigned fb = mPrimitives[b.mOffset + j];
+            const unsigned *ib = &mTraits.mIndices[fb*3];
+
+            // neighbours always touch, they are not contact candidates
+            bool adjacent = false;
+            for (int k = 0; k < 3; ++k)
+                adjacent |= ia[k] == ib[0] || ia[k] == ib[1] || ia[k] == ib[2];
+
+            if (!adjacent && OverlapAABB(minA, maxA, minB[j], maxB[j]))
+                AddPair(fa, fb, pairs, maxPairs, numPairs);
+        }
+    }
+}
@@ -0,0 +1,359 @@
+#include "AABBTree.hpp"
+#include "Simd.hpp"
+#include <cassert>
+
+using namespace std;
+using namespace PiratePhysics;
+using namespace PiratePhysics::Simd;
+
+// Eigen is left out of the using directives, its Select and Cross would hide the packet versions
+
+namespace
+{
+    /**
+     * slab test of every lane against one box, lanes whose closest hit so far is
+     * in front of the box or that are inactive (closest hit below zero) miss
+     */
+    template <int N>
+    FloatN<N> IntersectPacketAABB(const Vec3N<N> &start, const Vec3N<N> &rcpDir,
+                                  const Eigen::Vector3f &min, const Eigen::Vector3f &max,
+                                  const FloatN<N> &maxT, FloatN<N> &t)
+    {
+        const FloatN<N> tx0 = (FloatN<N>(min[0]) - start.mX) * rcpDir.mX;
+        const FloatN<N> tx1 = (FloatN<N>(max[0]) - start.mX) * rcpDir.mX;
+        const FloatN<N> ty0 = (FloatN<N>(min[1]) - start.mY) * rcpDir.mY;
+        const FloatN<N> ty1 = (FloatN<N>(max[1]) - start.mY) * rcpDir.mY;
+        const FloatN<N> tz0 = (FloatN<N>(min[2]) - start.mZ) * rcpDir.mZ;
+        const FloatN<N> tz1 = (FloatN<N>(max[2]) - start.mZ) * rcpDir.mZ;
+
+        FloatN<N> tmin(0.0f);
+        tmin = Max(Min(tx0, tx1), tmin);
+        tmin = Max(Min(ty0, ty1), tmin);
+        tmin = Max(Min(tz0, tz1), tmin);
+
+        FloatN<N> tmax = maxT;
+        tmax = Min(Max(tx0, tx1), tmax);
+        tmax = Min(Max(ty0, ty1), tmax);
+        tmax = Min(Max(tz0, tz1), tmax);
+
+        t = tmin;
+
+        return tmin <= tmax;
+    }
+
+    // smallest entry distance over the lanes set in mask
+    template <int N>
+    float MinLane(const FloatN<N> &t, unsigned mask)
+    {
+        float lanes[N];
+        t.Store(lanes);
+
+        float r = numeric_limits<float>::max();
+        for (int i = 0; i < N; ++i)
+        {
+            if ((mask & (1U << i)) && lanes[i] < r)
+                r = lanes[i];
+        }
+        return r;
+    }
+} // namespace
+
+unsigned AABBTree::GetLeafFace(unsigned offset, unsigned i, Eigen::Vector3f &a, Eigen::Vector3f &ab, Eigen::Vector3f &ac) const
+{
+    if (!mLeafTriangles.empty())
+    {
+        const LeafTriangles &tris = mLeafTriangles[mLeafTriangleIndex[offset]];
+
+        a = Eigen::Vector3f(tris.mA[0][i], tris.mA[1][i], tris.mA[2][i]);
+        ab = Eigen::Vector3f(tris.mAB[0][i], tris.mAB[1][i], tris.mAB[2][i]);
+        ac = Eigen::Vector3f(tris.mAC[0][i], tris.mAC[1][i], tris.mAC[2][i]);
+        return tris.mFace[i];
+    }
+
+    const unsigned face = mPrimitives[offset + i];
+
+    a = mTraits.mVertices[mTraits.mIndices[face*3+0]];
+    ab = mTraits.mVertices[mTraits.mIndices[face*3+1]] - a;
+    ac = mTraits.mVertices[mTraits.mIndices[face*3+2]] - a;
+    return face;
+}
+
+template <int N>
+bool AABBTree::TraceRays(const RayPacket<N> &rays, HitPacket<N> &hits) const
+{
+    // the compressed nodes are all that is left of the tree, they are walked one lane at a time
+    if (mNodes.empty() && mQuantizedBits)
+    {
+        bool anyHit = false;
+        for (int l = 0; l < N; ++l)
+        {
+            hits.mT[l] = numeric_limits<float>::max();
+            hits.mHit[l] = rays.mActive[l] &&
+                TraceRay(Eigen::Vector3f(rays.mStart[0][l], rays.mStart[1][l], rays.mStart[2][l]),
+                         Eigen::Vector3f(rays.mDir[0][l], rays.mDir[1][l], rays.mDir[2][l]),
+                         hits.mT[l], hits.mU[l], hits.mV[l], hits.mW[l], hits.mFaceSign[l], hits.mFaceIndex[l]);
+            anyHit |= hits.mHit[l];
+        }
+        return anyHit;
+    }
+
+    using F = FloatN<N>;
+
+    const Vec3N<N> start(F::Load(rays.mStart[0]), F::Load(rays.mStart[1]), F::Load(rays.mStart[2]));
+    const Vec3N<N> dir(F::Load(rays.mDir[0]), F::Load(rays.mDir[1]), F::Load(rays.mDir[2]));
+    const Vec3N<N> negDir(F(0.0f) - dir.mX, F(0.0f) - dir.mY, F(0.0f) - dir.mZ);
+    const Vec3N<N> rcpDir(F(1.0f) / dir.mX, F(1.0f) / dir.mY, F(1.0f) / dir.mZ);
+
+    // inactive lanes start with a negative closest hit so every box and triangle test rejects them
+    const F active = F::Mask(rays.mActive);
+    const F noHit(numeric_limits<float>::max());
+
+    F outT = Select(active, noHit, F(-1.0f));
+    F outU(0.0f), outV(0.0f), outW(0.0f), outSign(0.0f);
+
+    for (int i = 0; i < N; ++i)
+        hits.mFaceIndex[i] = 0;
+
+    struct StackEntry
+    {
+        unsigned mNode;
+        float mDist;
+    };
+
+    StackEntry stack[kMaxTreeDepth];
+    unsigned stackSize = 0;
+
+    F dist;
+    if (!mNodes.empty() && MoveMask(IntersectPacketAABB(start, rcpDir, mNodes[0].mMinExtents, mNodes[0].mMaxExtents, outT, dist)))
+        stack[stackSize++] = {0, 0.0f};
+
+    while (stackSize)
+    {
+        const StackEntry e = stack[--stackSize];
+
+        // skip nodes that are behind the closest hit of every lane
+        float farthest[N];
+        outT.Store(farthest);
+        float maxT = -1.0f;
+        for (int i = 0; i < N; ++i)
+            maxT = max(maxT, farthest[i]);
+
+        if (e.mDist >= maxT)
+            continue;
+
+        unsigned nodeIndex = e.mNode;
+
+        for (;;)
+        {
+            const Node &node = mNodes[nodeIndex];
+
+            if (node.IsLeaf())
+            {
+                for (uint32_t i = 0; i < node.mNumPrimitives; ++i)
+                {
+                    Eigen::Vector3f a, ab, ac;
+                    const unsigned face = GetLeafFace(node.mOffset, i, a, ab, ac);
+
+                    // Moller and Trumbore, as IntersectRayTriTwoSided but one triangle against all lanes
+                    const Eigen::Vector3f n = ab.cross(ac);
+
+                    const Vec3N<N> abN(ab[0], ab[1], ab[2]);
+                    const Vec3N<N> acN(ac[0], ac[1], ac[2]);
+                    const Vec3N<N> nN(n[0], n[1], n[2]);
+
+                    const F d = Dot(nN, negDir);
+                    const F ood = F(1.0f) / d;
+                    const Vec3N<N> ap = start - Vec3N<N>(a[0], a[1], a[2]);
+
+                    const F t = Dot(ap, nN) * ood;
+                    const Vec3N<N> e = Cross(negDir, ap);
+                    const F v = Dot(acN, e) * ood;
+                    const F w = (F(0.0f) - Dot(abN, e)) * ood;
+
+                    const F zero(0.0f);
+                    const F one(1.0f);
+                    const F hit = (zero <= t) & (t < outT) & (zero <= v) & (v <= one) & (zero <= w) & (v + w <= one);
+
+                    const unsigned hitMask = MoveMask(hit);
+                    if (!hitMask)
+                        continue;
+
+                    outT = Select(hit, t, outT);
+                    outU = Select(hit, one - v - w, outU);
+                    outV = Select(hit, v, outV);
+                    outW = Select(hit, w, outW);
+                    outSign = Select(hit, d, outSign);
+
+                    for (int l = 0; l < N; ++l)
+                    {
+                        if (hitMask & (1U << l))
+                            hits.mFaceIndex[l] = face;
+                    }
+                }
+                break;
+            }
+
+            const unsigned left = node.GetLeft(nodeIndex);
+            const unsigned right = node.mOffset;
+
+            F distLeft, distRight;
+            const unsigned hitLeft = MoveMask(IntersectPacketAABB(start, rcpDir, mNodes[left].mMinExtents, mNodes[left].mMaxExtents, outT, distLeft));
+            const unsigned hitRight = MoveMask(IntersectPacketAABB(start, rcpDir, mNodes[right].mMinExtents, mNodes[right].mMaxExtents, outT, distRight));
+
+            if (hitLeft && hitRight)
+            {
+                // visit the child the packet reaches first, defer the other one
+                const float nearLeft = MinLane(distLeft, hitLeft);
+                const float nearRight = MinLane(distRight, hitRight);
+
+                if (nearRight < nearLeft)
+                {
+                    stack[stackSize++] = {left, nearLeft};
+                    nodeIndex = right;
+                }
+                else
+                {
+                    stack[stackSize++] = {right, nearRight};
+                    nodeIndex = left;
+                }
+            }
+            else if (hitLeft)
+                nodeIndex = left;
+            else if (hitRight)
+                nodeIndex = right;
+            else
+                break;
+        }
+    }
+
+    const unsigned hitMask = MoveMask(active & (outT < noHit));
+
+    outT = Select(active, outT, noHit);
+    outT.Store(hits.mT);
+    outU.Store(hits.mU);
+    outV.Store(hits.mV);
+    outW.Store(hits.mW);
+    outSign.Store(hits.mFaceSign);
+
+    for (int i = 0; i < N; ++i)
+        hits.mHit[i] = (hitMask & (1U << i)) != 0;
+
+    return hitMask != 0;
+}
+
+template <int N>
+void AABBTree::TraceRaysAll(const RayPacket<N> &rays, float maxT, RayHit *hits, unsigned maxHitsPerRay,
+                            unsigned *numHits) const
+{
+    using F = FloatN<N>;
+
+    const Vec3N<N> start(F::Load(rays.mStart[0]), F::Load(rays.mStart[1]), F::Load(rays.mStart[2]));
+    const Vec3N<N> dir(F::Load(rays.mDir[0]), F::Load(rays.mDir[1]), F::Load(rays.mDir[2]));
+    const Vec3N<N> negDir(F(0.0f) - dir.mX, F(0.0f) - dir.mY, F(0.0f) - dir.mZ);
+    const Vec3N<N> rcpDir(F(1.0f) / dir.mX, F(1.0f) / dir.mY, F(1.0f) / dir.mZ);
+
+    // inactive lanes get a negative segment end so every box and triangle test rejects them
+    const F segmentEnd = Select(F::Mask(rays.mActive), F(maxT), F(-1.0f));
+
+    unsigned numStored[N];
+    for (int i = 0; i < N; ++i)
+    {
+        numHits[i] = 0;
+        numStored[i] = 0;
+    }
+
+    assert(!IsCompressedOnly());
+
+    if (mNodes.empty())
+        return;
+
+    // every box any lane crosses is visited, so children are pushed in any order
+    unsigned stack[kMaxTreeDepth];
+    unsigned stackSize = 0;
+
+    F dist;
+    if (MoveMask(IntersectPacketAABB(start, rcpDir, mNodes[0].mMinExtents, mNodes[0].mMaxExtents, segmentEnd, dist)))
+        stack[stackSize++] = 0;
+
+    while (stackSize)
+    {
+        const unsigned nodeIndex = stack[--stackSize];
+        const Node &node = mNodes[nodeIndex];
+
+        if (!node.IsLeaf())
+        {
+            const unsigned left = node.GetLeft(nodeIndex);
+            const unsigned right = node.mOffset;
+
+            if (MoveMask(IntersectPacketAABB(start, rcpDir, mNodes[right].mMinExtents, mNodes[right].mMaxExtents, segmentEnd, dist)))
+                stack[stackSize++] = right;
+            if (MoveMask(IntersectPacketAABB(start, rcpDir, mNodes[left].mMinExtents, mNodes[left].mMaxExtents, segmentEnd, dist)))
+                stack[stackSize++] = left;
+            continue;
+        }
+
+        for (uint32_t i = 0; i < node.mNumPrimitives; ++i)
+        {
+            Eigen::Vector3f a, ab, ac;
+            const unsigned face = GetLeafFace(node.mOffset, i, a, ab, ac);
+
+            // the same test as in TraceRays
+            const Eigen::Vector3f n = ab.cross(ac);
+
+            const Vec3N<N> abN(ab[0], ab[1], ab[2]);
+            const Vec3N<N> acN(ac[0], ac[1], ac[2]);
+            const Vec3N<N> nN(n[0], n[1], n[2]);
+
+            const F d = Dot(nN, negDir);
+            const F ood = F(1.0f) / d;
+            const Vec3N<N> ap = start - Vec3N<N>(a[0], a[1], a[2]);
+
+            const F t = Dot(ap, nN) * ood;
+            const Vec3N<N> e = Cross(negDir, ap);
+            const F v = Dot(acN, e) * ood;
+            const F w = (F(0.0f) - Dot(abN, e)) * ood;
+
+            const F zero(0.0f);
+            const F one(1.0f);
+            const F hit = (zero <= t) & (t <= segmentEnd) & (zero <= v) & (v <= one) & (zero <= w) & (v + w <= one);
+
+            const unsigned hitMask = MoveMask(hit);
+            if (!hitMask)
+                continue;
+
+            float ts[N], vs[N], ws[N], ds[N];
+            t.Store(ts);
+            v.Store(vs);
+            w.Store(ws);
+            d.Store(ds);
+
+            for (int l = 0; l < N; ++l)
+            {
+                if (!(hitMask & (1U << l)))
+                    continue;
+
+                RayHit h;
+                h.mT = ts[l];
+                h.mV = vs[l];
+                h.mW = ws[l];
+                h.mU = 1.0f - vs[l] - ws[l];
+                h.mFaceSign = ds[l];
+                h.mFaceIndex = face;
+
+                ++numHits[l];
+                InsertHit(h, hits + l * maxHitsPerRay, maxHitsPerRay, numStored[l]);
+            }
+        }
+    }
+
+    for (int l = 0; l < N; ++l)
+        numHits[l] -= numStored[l] - MergeHits(hits + l * maxHitsPerRay, numStored[l]);
+}
+
+template bool AABBTree::TraceRays<4>(const RayPacket<4> &, HitPacket<4> &) const;
+template bool AABBTree::TraceRays<8>(const RayPacket<8> &, HitPacket<8> &) const;
+template bool AABBTree::TraceRays<16>(const RayPacket<16> &, HitPacket<16> &) const;
+
+template void AABBTree::TraceRaysAll<4>(const RayPacket<4> &, float, RayHit *, unsigned, unsigned *) const;
+template void AABBTree::TraceRaysAll<8>(const RayPacket<8> &, float, RayHit *, unsigned, unsigned *) const;
+template void AABBTree::TraceRaysAll<16>(const RayPacket<16> &, float, RayHit *, unsigned, unsigned *) const;
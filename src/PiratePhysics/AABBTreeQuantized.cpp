@@ -0,0 +1,288 @@
+#include "AABBTree.hpp"
+#include <algorithm>
+
+using namespace Eigen;
+using namespace std;
+using namespace PiratePhysics;
+
+namespace
+{
+    template <typename T>
+    float GetLevels()
+    {
+        return float(numeric_limits<T>::max());
+    }
+
+    // child box corner q inside a parent box starting at min, shared by the build and the traversal
+    template <typename T>
+    Vector3f Dequantize(const Vector3f &min, const Vector3f &scale, const T q[3])
+    {
+        return Vector3f(min[0] + float(q[0]) * scale[0],
+                        min[1] + float(q[1]) * scale[1],
+                        min[2] + float(q[2]) * scale[2]);
+    }
+} // namespace
+
+size_t AABBTree::CompressNodes(unsigned bits, bool keepFullNodes)
+{
+    // without the full nodes there is nothing to compress again from
+    if (IsCompressedOnly())
+        return mQuantizedNodes8.capacity() * sizeof(QuantizedNode<uint8_t>) +
+               mQuantizedNodes16.capacity() * sizeof(QuantizedNode<uint16_t>);
+
+    mQuantizedNodes8.clear();
+    mQuantizedNodes8.shrink_to_fit();
+    mQuantizedNodes16.clear();
+    mQuantizedNodes16.shrink_to_fit();
+    mQuantizedBits = 0;
+
+    if (mNodes.empty() || (bits != 8 && bits != 16))
+        return 0;
+
+    // only one alternative layout is traced at a time
+    CollapseWide(0);
+
+    mQuantizedRootMin = mNodes[0].mMinExtents;
+    mQuantizedRootMax = mNodes[0].mMaxExtents;
+
+    // one quantized node per inner node, or one for a root that is a leaf
+    const unsigned numQuantized = max(mStats.mInnerNodes, 1U);
+
+    size_t bytes;
+    if (bits == 8)
+    {
+        mQuantizedNodes8.reserve(numQuantized);
+        QuantizeRecursive(0, mQuantizedRootMin, mQuantizedRootMax, mQuantizedNodes8);
+        bytes = mQuantizedNodes8.capacity() * sizeof(QuantizedNode<uint8_t>);
+    }
+    else
+    {
+        mQuantizedNodes16.reserve(numQuantized);
+        QuantizeRecursive(0, mQuantizedRootMin, mQuantizedRootMax, mQuantizedNodes16);
+        bytes = mQuantizedNodes16.capacity() * sizeof(QuantizedNode<uint16_t>);
+    }
+
+    mQuantizedBits = bits;
+
+    if (!keepFullNodes)
+    {
+        mNodes.clear();
+        mNodes.shrink_to_fit();
+        mSubtreeCost.clear();
+        mSubtreeCost.shrink_to_fit();
+        mBuiltSubtreeCost.clear();
+        mBuiltSubtreeCost.shrink_to_fit();
+        ReleaseBuildData();
+    }
+
+    return bytes;
+}
+
+template <typename T>
+unsigned AABBTree::QuantizeRecursive(unsigned nodeIndex, const Vector3f &min, const Vector3f &max,
+                                     vector<QuantizedNode<T>> &quantizedNodes) const
+{
+    const float levels = GetLevels<T>();
+    const Vector3f scale = (max - min) * (1.0f / levels);
+
+    // a little slack against rounding differences between here and the traversal
+    const float eps = 1e-6f * (min.cwiseAbs().maxCoeff() + (max - min).maxCoeff());
+
+    unsigned children[2];
+    unsigned numChildren = 0;
+
+    const Node &node = mNodes[nodeIndex];
+    if (node.IsLeaf())
+    {
+        // only happens for the root of a tree that fits in one leaf
+        children[numChildren++] = nodeIndex;
+    }
+    else
+    {
+        children[numChildren++] = node.GetLeft(nodeIndex);
+        children[numChildren++] = node.mOffset;
+    }
+
+    // reserve the slot first so quantized nodes come out in depth first order
+    const unsigned quantizedIndex = static_cast<unsigned>(quantizedNodes.size());
+    quantizedNodes.emplace_back();
+
+    QuantizedNode<T> quantized;
+    for (unsigned i = 0; i < 2; ++i)
+    {
+        for (unsigned a = 0; a < 3; ++a)
+        {
+            quantized.mMin[i][a] = 0;
+            quantized.mMax[i][a] = 0;
+        }
+        quantized.mChild[i] = kUnusedNode;
+        quantized.mNumFaces[i] = 0;
+    }
+
+    for (unsigned i = 0; i < numChildren; ++i)
+    {
+        const Node &c = mNodes[children[i]];
+
+        for (unsigned a = 0; a < 3; ++a)
+        {
+            float qMin = 0.0f;
+            float qMax = levels;
+            if (scale[a] > 0.0f)
+            {
+                qMin = std::max(floorf((c.mMinExtents[a] - min[a]) / scale[a]), 0.0f);
+                qMax = std::min(ceilf((c.mMaxExtents[a] - min[a]) / scale[a]), levels);
+            }
+
+            quantized.mMin[i][a] = static_cast<T>(qMin);
+            quantized.mMax[i][a] = static_cast<T>(qMax);
+        }
+
+        // widen until the dequantized box really contains the child
+        for (unsigned a = 0; a < 3; ++a)
+        {
+            while (quantized.mMin[i][a] > 0 &&
+                   Dequantize(min, scale, quantized.mMin[i])[a] > c.mMinExtents[a] - eps)
+                --quantized.mMin[i][a];
+            while (quantized.mMax[i][a] < numeric_limits<T>::max() &&
+                   Dequantize(min, scale, quantized.mMax[i])[a] < c.mMaxExtents[a] + eps)
+                ++quantized.mMax[i][a];
+        }
+
+        if (c.IsLeaf())
+        {
+            quantized.mChild[i] = c.mOffset;
+            quantized.mNumFaces[i] = static_cast<uint8_t>(c.mNumPrimitives);
+        }
+        else
+        {
+            // children of the child are quantized inside its dequantized box, the one the traversal sees
+            quantized.mChild[i] = QuantizeRecursive(children[i], Dequantize(min, scale, quantized.mMin[i]),
+                                                    Dequantize(min, scale, quantized.mMax[i]), quantizedNodes);
+        }
+    }
+
+    quantizedNodes[quantizedIndex] = quantized;
+
+    return quantizedIndex;
+}
+
+template <typename T>
+bool AABBTree::TraceRayQuantized(const vector<QuantizedNode<T>> &quantizedNodes,
+                                 const Vector3f &start, const Vector3f &dir, float &outT,
+                                 float &outU, float &outV, float &outW, float &faceSign, uint32_t &faceIndex) const
+{
+    const Vector3f rcpDir(1.0f/dir[0], 1.0f/dir[1], 1.0f/dir[2]);
+    const float invLevels = 1.0f / GetLevels<T>();
+
+    // a stack entry is a quantized node together with its dequantized box, or a leaf range of mPrimitives
+    struct StackEntry
+    {
+        unsigned mChild;
+        unsigned mNumFaces;
+        float mDist;
+        Vector3f mMin;
+        Vector3f mMax;
+    };
+
+    StackEntry stack[kMaxTreeDepth];
+    unsigned stackSize = 0;
+
+    float dist;
+    if (!IntersectRayBounds(start, rcpDir, mQuantizedRootMin, mQuantizedRootMax, outT, dist))
+        return false;
+
+    StackEntry e = {0, 0, dist, mQuantizedRootMin, mQuantizedRootMax};
+
+    for (;;)
+    {
+        if (!e.mNumFaces)
+        {
+            const QuantizedNode<T> &node = quantizedNodes[e.mChild];
+            const Vector3f scale = (e.mMax - e.mMin) * invLevels;
+
+            StackEntry hits[2];
+            unsigned numHits = 0;
+
+            for (unsigned i = 0; i < 2; ++i)
+            {
+                if (node.mChild[i] == kUnusedNode)
+                    continue;
+
+                const Vector3f min = Dequantize(e.mMin, scale, node.mMin[i]);
+                const Vector3f max = Dequantize(e.mMin, scale, node.mMax[i]);
+
+                if (IntersectRayBounds(start, rcpDir, min, max, outT, dist))
+                    hits[numHits++] = {node.mChild[i], node.mNumFaces[i], dist, min, max};
+            }
+
+            // descend into the closest child first and defer the other one
+            if (numHits == 2)
+            {
+                const unsigned nearest = hits[1].mDist < hits[0].mDist ? 1 : 0;
+                stack[stackSize++] = hits[1 - nearest];
+                e = hits[nearest];
+                continue;
+            }
+            else if (numHits == 1)
+            {
+                e = hits[0];
+                continue;
+            }
+        }
+        else
+        {
+            IntersectLeaf(e.mChild, e.mNumFaces, start, dir, outT, outU, outV, outW, faceSign, faceIndex);
+        }
+
+        // pop the next deferred node that is still in front of the closest hit
+        for (;;)
+        {
+            if (stackSize == 0)
+                return outT != numeric_limits<float>::max();
+
+            if (stack[--stackSize].mDist < outT)
+            {
+                e = stack[stackSize];
+                break;
+            }
+        }
+    }
+}
+
+template unsigned AABBTree::QuantizeRecursive<uint8_t>(unsigned, const Vector3f &, const Vector3f &,
+                                                       vector<QuantizedNode<uint8_t>> &) const;
+template unsigned AABBTree::QuantizeRecursive<uint16_t>(unsigned, const Vector3f &, const Vector3f &,
+                                                        vector<QuantizedNode<uint16_t>> &) const;
+template bool AABBTree::TraceRayQuantized<uint8_t>(const vector<QuantizedNode<uint8_t>> &, const Vector3f &,
+                                                   const Vector3f &, float &, float &, float &, float &, float &,
+                                                   uint32_t &) const;
+template bool AABBTree::TraceRayQuantized<uint16_t>(const vector<QuantizedNode<uint16_t>> &, const Vector3f &,
+                                                    const Vector3f &, float &, float &, float &, float &, float &,
+                                                    uint32_t &) const;
+
+size_t AABBTree::ReleaseBuildData()
+{
+    const size_t bytes = mBounds.capacity() * sizeof(Bounds) + mCentroids.capacity() * sizeof(Vector3f);
+
+    mBounds.clear();
+    mBounds.shrink_to_fit();
+    mCentroids.clear();
+    mCentroids.shrink_to_fit();
+
+    return bytes;
+}
+
+size_t AABBTree::GetMemoryUsage() const
+{
+    return mPrimitives.capacity() * sizeof(unsigned) +
+           mNodes.capacity() * sizeof(Node) +
+           mBounds.capacity() * sizeof(Bounds) +
+           mCentroids.capacity() * sizeof(Vector3f) +
+           mWideNodes4.capacity() * sizeof(WideNode<4>) +
+           mWideNodes8.capacity() * sizeof(WideNode<8>) +
+           mQuantizedNodes8.capacity() * sizeof(QuantizedNode<uint8_t>) +
+           mQuantizedNodes16.capacity() * sizeof(QuantizedNode<uint16_t>) +
+           mSubtreeCost.capacity() * sizeof(float) +
+           mBuiltSubtreeCost.capacity() * sizeof(float) +
+           GetLeafTrianglesMemory();
+}
@@ -0,0 +1,247 @@
+#include "AABBTree.hpp"
+#include <algorithm>
+#include <functional>
+#include <future>
+
+using namespace Eigen;
+using namespace std;
+using namespace PiratePhysics;
+
+unsigned AABBTree::Refit(float rebuildThreshold)
+{
+    if (mNodes.empty())
+        return 0;
+
+    // subtree costs and rebuilds rely on the depth first layout that edits give up
+    if (!mNodeHeights.empty())
+        Compact();
+
+    // the first refit takes the bounds the tree was built with as the reference
+    if (mBuiltSubtreeCost.size() != mNodes.size())
+    {
+        UpdateSubtreeCosts(0, static_cast<unsigned>(mNodes.size()));
+        mBuiltSubtreeCost = mSubtreeCost;
+    }
+
+    // face data dropped by ReleaseBuildData is filled in again for the faces the leaves reference, faces
+    // RemoveFaces took out keep whatever they had and InsertFaces recomputes theirs before they go back in
+    mBounds.resize(mTraits.mNumFaces);
+    mCentroids.resize(mTraits.mNumFaces);
+
+    RefitRecursive(0, 1);
+    UpdateSubtreeCosts(0, static_cast<unsigned>(mNodes.size()));
+
+    unsigned numRebuilt = 0;
+
+    if (rebuildThreshold > 0.0f)
+    {
+        vector<pair<unsigned, unsigned>> subtrees;
+        FindDegradedSubtrees(0, 1, rebuildThreshold, subtrees);
+
+        // back to front, splicing a subtree only moves the nodes that come after it
+        sort(subtrees.begin(), subtrees.end(), greater<pair<unsigned, unsigned>>());
+        for (const auto &s : subtrees)
+            RebuildSubtree(s.first, s.second);
+
+        numRebuilt = static_cast<unsigned>(subtrees.size());
+
+        if (numRebuilt)
+        {
+            UpdateSubtreeCosts(0, static_cast<unsigned>(mNodes.size()));
+
+            BuildStats stats;
+            UpdateStats(0, 1, stats);
+
+            mStats = stats;
+            mFreeNode = static_cast<unsigned>(mNodes.size());
+        }
+    }
+
+    if (mWideWidth)
+        CollapseWide(mWideWidth);
+    if (mQuantizedBits)
+        CompressNodes(mQuantizedBits);
+
+    if (!mLeafTriangles.empty())
+        BuildLeafTriangles();
+
+    return numRebuilt;
+}
+
+void AABBTree::RefitRecursive(unsigned nodeIndex, unsigned depth)
+{
+    Node &n = mNodes[nodeIndex];
+
+    if (n.IsLeaf())
+    {
+        Bounds b;
+        for (unsigned i = 0; i < n.mNumPrimitives; ++i)
+        {
+            unsigned f = mPrimitives[n.mOffset + i];
+
+            mBounds[f] = mTraits.GetBounds(f);
+            mCentroids[f] = mTraits.GetCentroid(f);
+
+            b.Union(mBounds[f]);
+        }
+
+        n.mMinExtents = b.mMin;
+        n.mMaxExtents = b.mMax;
+        return;
+    }
+
+    const unsigned left = n.GetLeft(nodeIndex);
+    const unsigned right = n.mOffset;
+
+    // the left subtree spans the nodes up to the right child, a rough measure of its size, a face
+    // referenced from both subtrees after a spatial split would have its bounds written by two threads
+    if (depth < mMaxParallelDepth && right - left >= kMinParallelFaces && !mDuplicateReferences)
+    {
+        future<void> task = async(launch::async, [this, left, depth]() {
+            RefitRecursive(left, depth+1);
+        });
+
+        RefitRecursive(right, depth+1);
+        task.get();
+    }
+    else
+    {
+        RefitRecursive(left, depth+1);
+        RefitRecursive(right, depth+1);
+    }
+
+    Bounds b(mNodes[left].mMinExtents, mNodes[left].mMaxExtents);
+    b.Union(Bounds(mNodes[right].mMinExtents, mNodes[right].mMaxExtents));
+
+    n.mMinExtents = b.mMin;
+    n.mMaxExtents = b.mMax;
+}
+
+void AABBTree::UpdateSubtreeCosts(unsigned begin, unsigned end)
+{
+    mSubtreeCost.resize(mNodes.size());
+
+    // children always come after their parent so a reverse sweep is bottom up
+    for (unsigned i = end; i-- > begin;)
+    {
+        const Node &n = mNodes[i];
+        if (n.IsLeaf())
+        {
+            mSubtreeCost[i] = static_cast<float>(n.mNumPrimitives);
+            continue;
+        }
+
+        const Node &l = mNodes[i + 1];
+        const Node &r = mNodes[n.mOffset];
+
+        const float area = Bounds(n.mMinExtents, n.mMaxExtents).GetSurfaceArea();
+        const float areaLeft = Bounds(l.mMinExtents, l.mMaxExtents).GetSurfaceArea();
+        const float areaRight = Bounds(r.mMinExtents, r.mMaxExtents).GetSurfaceArea();
+
+        if (area > 0.0f)
+            mSubtreeCost[i] = 0.125f + (areaLeft * mSubtreeCost[i + 1] + areaRight * mSubtreeCost[n.mOffset]) / area;
+        else
+            mSubtreeCost[i] = 0.125f + mSubtreeCost[i + 1] + mSubtreeCost[n.mOffset];
+    }
+}
+
+void AABBTree::FindDegradedSubtrees(unsigned nodeIndex, unsigned depth, float threshold,
+                                    vector<pair<unsigned, unsigned>> &subtrees) const
+{
+    const Node &n = mNodes[nodeIndex];
+    if (n.IsLeaf())
+        return;
+
+    unsigned endNode, firstFace, numFaces;
+    GetSubtreeRange(nodeIndex, endNode, firstFace, numFaces);
+
+    if (numFaces < kMinRebuildFaces)
+        return;
+
+    // take the topmost degraded subtree, its descendants are rebuilt along with it
+    if (mSubtreeCost[nodeIndex] > threshold * mBuiltSubtreeCost[nodeIndex])
+    {
+        subtrees.push_back(make_pair(nodeIndex, depth));
+        return;
+    }
+
+    FindDegradedSubtrees(nodeIndex + 1, depth + 1, threshold, subtrees);
+    FindDegradedSubtrees(n.mOffset, depth + 1, threshold, subtrees);
+}
+
+void AABBTree::GetSubtreeRange(unsigned nodeIndex, unsigned &endNode, unsigned &firstFace, unsigned &numFaces) const
+{
+    // leftmost and rightmost leaves bound both the node range and the face range
+    unsigned first = nodeIndex;
+    while (!mNodes[first].IsLeaf())
+        ++first;
+
+    unsigned last = nodeIndex;
+    while (!mNodes[last].IsLeaf())
+        last = mNodes[last].mOffset;
+
+    endNode = last + 1;
+    firstFace = mNodes[first].mOffset;
+    numFaces = mNodes[last].mOffset + mNodes[last].mNumPrimitives - firstFace;
+}
+
+void AABBTree::RebuildSubtree(unsigned nodeIndex, unsigned depth)
+{
+    unsigned endNode, firstFace, numFaces;
+    GetSubtreeRange(nodeIndex, endNode, firstFace, numFaces);
+
+    // the faces of a subtree are contiguous in mPrimitives so they can be rebuilt in place
+    vector<Node> nodes(2 * numFaces - 1);
+    BuildStats stats;
+    BuildRecursive(nodes, 0, &mPrimitives[firstFace], numFaces, depth, stats);
+    BVHBuilder::CompactNodes(nodes);
+
+    const unsigned oldCount = endNode - nodeIndex;
+    const unsigned newCount = static_cast<unsigned>(nodes.size());
+
+    for (Node &n : nodes)
+    {
+        if (!n.IsLeaf())
+            n.mOffset += nodeIndex;
+    }
+
+    // right children behind the subtree move with it
+    if (newCount != oldCount)
+    {
+        for (size_t i = 0; i < mNodes.size(); ++i)
+        {
+            Node &n = mNodes[i];
+            if ((i < nodeIndex || i >= endNode) && !n.IsLeaf() && n.mOffset >= endNode)
+                n.mOffset = n.mOffset + newCount - oldCount;
+        }
+    }
+
+    mNodes.erase(mNodes.begin() + nodeIndex, mNodes.begin() + endNode);
+    mNodes.insert(mNodes.begin() + nodeIndex, nodes.begin(), nodes.end());
+
+    // fresh subtree is its own new reference, ancestors keep theirs and get
+    // their current cost updated once every subtree has been rebuilt
+    mSubtreeCost.erase(mSubtreeCost.begin() + nodeIndex, mSubtreeCost.begin() + endNode);
+    mSubtreeCost.insert(mSubtreeCost.begin() + nodeIndex, newCount, 0.0f);
+    UpdateSubtreeCosts(nodeIndex, nodeIndex + newCount);
+
+    mBuiltSubtreeCost.erase(mBuiltSubtreeCost.begin() + nodeIndex, mBuiltSubtreeCost.begin() + endNode);
+    mBuiltSubtreeCost.insert(mBuiltSubtreeCost.begin() + nodeIndex,
+                             mSubtreeCost.begin() + nodeIndex, mSubtreeCost.begin() + nodeIndex + newCount);
+}
+
+void AABBTree::UpdateStats(unsigned nodeIndex, unsigned depth, BuildStats &stats) const
+{
+    const Node &n = mNodes[nodeIndex];
+    stats.mTreeDepth = max(stats.mTreeDepth, depth);
+
+    if (n.IsLeaf())
+    {
+        ++stats.mLeafNodes;
+        return;
+    }
+
+    ++stats.mInnerNodes;
+    UpdateStats(n.GetLeft(nodeIndex), depth + 1, stats);
+    UpdateStats(n.mOffset, depth + 1, stats);
+}
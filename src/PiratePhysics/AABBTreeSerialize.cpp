@@ -0,0 +1,230 @@
+#include "AABBTree.hpp"
+#include <cassert>
+#include <cstring>
+#include <fstream>
+
+using namespace Eigen;
+using namespace std;
+using namespace PiratePhysics;
+
+namespace
+{
+    const uint32_t kImageMagic = 0x48564250; // "PBVH" read as little endian
+    // 2 added the reference count for trees with spatial splits
+    const uint32_t kImageVersion = 2;
+
+    /**
+     * start of a serialized tree, offsets count bytes from the start of the image
+     */
+    struct ImageHeader
+    {
+        uint32_t mMagic;
+        uint32_t mVersion;
+        uint64_t mMeshHash;
+        uint64_t mImageSize;
+
+        uint32_t mNumVerts;
+        uint32_t mNumFaces;
+        uint32_t mNumReferences;
+        uint32_t mNumNodes;
+        uint32_t mBuildMode;
+        uint32_t mWideWidth;
+
+        uint32_t mNodeOffset;
+        uint32_t mFaceOffset;
+    };
+
+    size_t AlignUp(size_t offset, size_t alignment)
+    {
+        return (offset + alignment - 1) / alignment * alignment;
+    }
+
+    // FNV-1a
+    uint64_t HashBytes(uint64_t hash, const void *data, size_t size)
+    {
+        const uint8_t *bytes = static_cast<const uint8_t *>(data);
+        for (size_t i = 0; i < size; ++i)
+        {
+            hash ^= bytes[i];
+            hash *= 0x100000001b3ULL;
+        }
+        return hash;
+    }
+} // namespace
+
+uint64_t AABBTree::HashMesh(VertexView vertices, unsigned numVerts, const unsigned *indices, unsigned numFaces)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    hash = HashBytes(hash, &numVerts, sizeof(numVerts));
+    hash = HashBytes(hash, &numFaces, sizeof(numFaces));
+
+    for (unsigned i = 0; i < numVerts; ++i)
+        hash = HashBytes(hash, vertices[i].data(), 3 * sizeof(float));
+
+    return HashBytes(hash, indices, size_t(numFaces) * 3 * sizeof(unsigned));
+}
+
+void AABBTree::Serialize(vector<uint8_t> &image) const
+{
+    // the image format only holds the full nodes
+    assert(!IsCompressedOnly());
+
+    // an edited tree is written in the depth first layout a build produces
+    vector<Node> compactNodes;
+    vector<unsigned> compactFaces;
+    if (!mNodeHeights.empty())
+        LayoutDepthFirst(0, compactNodes, compactFaces);
+
+    const vector<Node> &nodes = mNodeHeights.empty() ? mNodes : compactNodes;
+    const vector<unsigned> &faces = mNodeHeights.empty() ? mPrimitives : compactFaces;
+
+    const uint32_t numNodes = static_cast<uint32_t>(nodes.size());
+
+    const size_t nodeOffset = AlignUp(sizeof(ImageHeader), alignof(Node));
+    const size_t faceOffset = AlignUp(nodeOffset + numNodes * sizeof(Node), alignof(unsigned));
+    const size_t imageSize = faceOffset + faces.size() * sizeof(unsigned);
+
+    image.assign(imageSize, 0);
+
+    ImageHeader header;
+    memset(&header, 0, sizeof(header));
+    header.mMagic = kImageMagic;
+    header.mVersion = kImageVersion;
+    header.mMeshHash = HashMesh(mTraits.mVertices, mTraits.mNumVerts, mTraits.mIndices, mTraits.mNumFaces);
+    header.mImageSize = imageSize;
+    header.mNumVerts = mTraits.mNumVerts;
+    header.mNumFaces = mTraits.mNumFaces;
+    header.mNumReferences = static_cast<uint32_t>(faces.size());
+    header.mNumNodes = numNodes;
+    header.mBuildMode = static_cast<uint32_t>(mBuildMode);
+    header.mWideWidth = mWideWidth;
+    header.mNodeOffset = static_cast<uint32_t>(nodeOffset);
+    header.mFaceOffset = static_cast<uint32_t>(faceOffset);
+
+    memcpy(image.data(), &header, sizeof(header));
+    if (numNodes)
+        memcpy(image.data() + nodeOffset, nodes.data(), numNodes * sizeof(Node));
+    if (!faces.empty())
+        memcpy(image.data() + faceOffset, faces.data(), faces.size() * sizeof(unsigned));
+}
+
+bool AABBTree::Save(const string &path) const
+{
+    vector<uint8_t> image;
+    Serialize(image);
+
+    ofstream file(path, ios::binary);
+    file.write(reinterpret_cast<const char *>(image.data()), image.size());
+
+    return file.good();
+}
+
+bool AABBTree::LoadImage(const void *image, size_t imageSize)
+{
+    if (!image || imageSize < sizeof(ImageHeader))
+        return false;
+
+    ImageHeader header;
+    memcpy(&header, image, sizeof(header));
+
+    if (header.mMagic != kImageMagic || header.mVersion != kImageVersion || header.mImageSize > imageSize)
+        return false;
+
+    if (header.mNumVerts != mTraits.mNumVerts || header.mNumFaces != mTraits.mNumFaces)
+        return false;
+
+    // spatial splits reference some faces twice, but never more often than their budget allows,
+    // and a tree that had faces removed references fewer than the mesh has
+    const unsigned numRefs = header.mNumReferences;
+    if (numRefs > mTraits.mNumFaces + static_cast<unsigned>(mTraits.mNumFaces * kSpatialSplitBudget))
+        return false;
+
+    const size_t nodeEnd = size_t(header.mNodeOffset) + size_t(header.mNumNodes) * sizeof(Node);
+    const size_t faceEnd = size_t(header.mFaceOffset) + size_t(numRefs) * sizeof(unsigned);
+    if (header.mNodeOffset < sizeof(ImageHeader) || nodeEnd > header.mImageSize || faceEnd > header.mImageSize)
+        return false;
+
+    if (header.mNumNodes > max(2 * numRefs, 1U) - 1 || (numRefs && !header.mNumNodes))
+        return false;
+
+    if (header.mMeshHash != HashMesh(mTraits.mVertices, mTraits.mNumVerts, mTraits.mIndices, mTraits.mNumFaces))
+        return false;
+
+    const uint8_t *bytes = static_cast<const uint8_t *>(image);
+
+    // the arrays are stored exactly as they are kept in memory, one copy each
+    vector<Node> nodes(header.mNumNodes);
+    if (header.mNumNodes)
+        memcpy(static_cast<void *>(nodes.data()), bytes + header.mNodeOffset, header.mNumNodes * sizeof(Node));
+
+    vector<unsigned> faces(numRefs);
+    if (numRefs)
+        memcpy(faces.data(), bytes + header.mFaceOffset, numRefs * sizeof(unsigned));
+
+    // a damaged image must not send the traversal outside the arrays or past its stack, a well
+    // formed one lists the nodes in exactly the depth first order this walk visits them
+    struct StackEntry
+    {
+        unsigned mNode;
+        unsigned mDepth;
+    };
+
+    vector<StackEntry> stack;
+    if (header.mNumNodes)
+        stack.push_back({0, 1});
+
+    unsigned next = 0;
+    BuildStats stats;
+
+    while (!stack.empty())
+    {
+        const StackEntry e = stack.back();
+        stack.pop_back();
+
+        if (e.mNode != next++ || e.mDepth > kMaxTreeDepth)
+            return false;
+
+        const Node &n = nodes[e.mNode];
+        stats.mTreeDepth = max(stats.mTreeDepth, e.mDepth);
+
+        if (n.IsLeaf())
+        {
+            if (n.mNumPrimitives > kMaxFacesPerLeaf || size_t(n.mOffset) + n.mNumPrimitives > numRefs)
+                return false;
+
+            ++stats.mLeafNodes;
+            continue;
+        }
+
+        if (n.mNumPrimitives || n.mOffset <= e.mNode + 1 || n.mOffset >= header.mNumNodes)
+            return false;
+
+        ++stats.mInnerNodes;
+        stack.push_back({n.mOffset, e.mDepth + 1});
+        stack.push_back({e.mNode + 1, e.mDepth + 1});
+    }
+
+    if (next != header.mNumNodes)
+        return false;
+
+    for (unsigned f : faces)
+    {
+        if (f >= mTraits.mNumFaces)
+            return false;
+    }
+
+    mNodes.swap(nodes);
+    mPrimitives.swap(faces);
+    mFreeNode = header.mNumNodes;
+
+    mBuildMode = static_cast<BuildMode>(header.mBuildMode);
+
+    // with faces removed the reference count no longer tells whether some are repeated
+    mDuplicateReferences = mBuildMode == BuildMode::SBVH;
+    mStats = stats;
+
+    if (header.mWideWidth)
+        CollapseWide(header.mWideWidth);
+
+    return true;
+}
@@ -0,0 +1,379 @@
+#include "AABBTree.hpp"
+#include <algorithm>
+
+using namespace Eigen;
+using namespace std;
+using namespace PiratePhysics;
+
+namespace
+{
+    float GetCentroid(const Vector3f &min, const Vector3f &max, unsigned axis)
+    {
+        return (min[axis] + max[axis]) * 0.5f;
+    }
+} // namespace
+
+void AABBTree::BuildSpatialRecursive(vector<Reference> &refs, float invRootArea, unsigned depth,
+                                     unsigned &budget, BuildStats &stats)
+{
+    // children append after this node, so it is only ever addressed by index
+    const unsigned nodeIndex = static_cast<unsigned>(mNodes.size());
+    mNodes.emplace_back();
+
+    stats.mTreeDepth = max(stats.mTreeDepth, depth);
+
+    const unsigned numRefs = static_cast<unsigned>(refs.size());
+
+    Bounds bounds;
+    for (const Reference &r : refs)
+        bounds.Union(r.mBounds);
+
+    mNodes[nodeIndex].mMinExtents = bounds.mMin;
+    mNodes[nodeIndex].mMaxExtents = bounds.mMax;
+
+    if (numRefs <= kMaxFacesPerLeaf)
+    {
+        mNodes[nodeIndex].mOffset = static_cast<unsigned>(mPrimitives.size());
+        mNodes[nodeIndex].mNumPrimitives = numRefs;
+
+        for (const Reference &r : refs)
+            mPrimitives.push_back(r.mFace);
+
+        ++stats.mLeafNodes;
+        return;
+    }
+
+    ++stats.mInnerNodes;
+
+    const float invArea = 1.0f / bounds.GetSurfaceArea();
+
+    unsigned objectAxis, leftCount;
+    Bounds objectLeft, objectRight;
+    const float objectCost = FindObjectSplit(refs, invArea, objectAxis, leftCount, objectLeft, objectRight);
+
+    vector<Reference> left, right;
+
+    // fall back to a median split if the tree would otherwise outgrow the traversal stack,
+    // spatial splits never shrink the larger child so they are not tried that deep either
+    if (depth + BVHBuilder::Log2Ceil(numRefs) >= kMaxTreeDepth)
+    {
+        leftCount = numRefs / 2;
+    }
+    else if (budget)
+    {
+        // only worth cutting faces where the children of the best object split overlap
+        Bounds overlap(objectLeft.mMin.cwiseMax(objectRight.mMin), objectLeft.mMax.cwiseMin(objectRight.mMax));
+        const bool overlapping = (overlap.mMax - overlap.mMin).minCoeff() >= 0.0f;
+
+        if (overlapping && overlap.GetSurfaceArea() * invRootArea > kSpatialSplitAlpha)
+        {
+            unsigned spatialAxis;
+            float position;
+            const float spatialCost = FindSpatialSplit(refs, bounds, invArea, spatialAxis, position);
+
+            if (spatialCost < objectCost)
+            {
+                PerformSpatialSplit(refs, spatialAxis, position, budget, left, right);
+
+                // every reference ended up on one side, the object split does better
+                if (left.empty() || right.empty())
+                {
+                    left.clear();
+                    right.clear();
+                }
+            }
+        }
+    }
+
+    if (left.empty())
+    {
+        left.assign(refs.begin(), refs.begin() + leftCount);
+        right.assign(refs.begin() + leftCount, refs.end());
+    }
+
+    // the children own the references from here on
+    refs.clear();
+    refs.shrink_to_fit();
+
+    BuildSpatialRecursive(left, invRootArea, depth+1, budget, stats);
+
+    mNodes[nodeIndex].mOffset = static_cast<unsigned>(mNodes.size());
+    mNodes[nodeIndex].mNumPrimitives = 0;
+
+    BuildSpatialRecursive(right, invRootArea, depth+1, budget, stats);
+}
+
+float AABBTree::FindObjectSplit(vector<Reference> &refs, float invArea, unsigned &axis, unsigned &leftCount,
+                                Bounds &leftBounds, Bounds &rightBounds) const
+{
+    const unsigned numRefs = static_cast<unsigned>(refs.size());
+
+    float bestCost = numeric_limits<float>::max();
+    unsigned bestAxis = 0;
+    unsigned bestIndex = 0;
+
+    vector<float> cumulativeUpper(numRefs);
+
+    for (unsigned a = 0; a < 3; ++a)
+    {
+        // the same sweep as BVHBuilder::PartitionSAH, on the centroids of the clipped bounds
+        sort(refs.begin(), refs.end(), [a](const Reference &lhs, const Reference &rhs) {
+            const float cl = GetCentroid(lhs.mBounds.mMin, lhs.mBounds.mMax, a);
+            const float cr = GetCentroid(rhs.mBounds.mMin, rhs.mBounds.mMax, a);
+            return cl == cr ? lhs.mFace < rhs.mFace : cl < cr;
+        });
+
+        Bounds upper;
+        for (unsigned i = numRefs; i > 0; --i)
+        {
+            upper.Union(refs[i - 1].mBounds);
+            cumulativeUpper[i - 1] = upper.GetSurfaceArea();
+        }
+
+        Bounds lower;
+        for (unsigned i = 0; i < numRefs - 1; ++i)
+        {
+            lower.Union(refs[i].mBounds);
+
+            const float pBelow = lower.GetSurfaceArea() * invArea;
+            const float pAbove = cumulativeUpper[i + 1] * invArea;
+
+            const float cost = 0.125f + (pBelow*(i + 1) + pAbove*(numRefs - i - 1));
+            if (cost <= bestCost)
+            {
+                bestCost = cost;
+                bestIndex = i;
+                bestAxis = a;
+            }
+        }
+    }
+
+    // leave the references sorted on the best axis
+    if (bestAxis != 2)
+    {
+        sort(refs.begin(), refs.end(), [bestAxis](const Reference &lhs, const Reference &rhs) {
+            const float cl = GetCentroid(lhs.mBounds.mMin, lhs.mBounds.mMax, bestAxis);
+            const float cr = GetCentroid(rhs.mBounds.mMin, rhs.mBounds.mMax, bestAxis);
+            return cl == cr ? lhs.mFace < rhs.mFace : cl < cr;
+        });
+    }
+
+    axis = bestAxis;
+    leftCount = bestIndex + 1;
+
+    leftBounds = Bounds();
+    rightBounds = Bounds();
+    for (unsigned i = 0; i < numRefs; ++i)
+    {
+        if (i < leftCount)
+            leftBounds.Union(refs[i].mBounds);
+        else
+            rightBounds.Union(refs[i].mBounds);
+    }
+
+    return bestCost;
+}
+
+float AABBTree::FindSpatialSplit(const vector<Reference> &refs, const Bounds &bounds, float invArea,
+                                 unsigned &axis, float &position) const
+{
+    const Vector3f extents = bounds.mMax - bounds.mMin;
+
+    float bestCost = numeric_limits<float>::max();
+
+    for (unsigned a = 0; a < 3; ++a)
+    {
+        if (extents[a] <= 0.0f)
+            continue;
+
+        const float binWidth = extents[a] / kNumSpatialBins;
+        const float invBinWidth = 1.0f / binWidth;
+
+        auto getBin = [&](float x) {
+            const float b = (x - bounds.mMin[a]) * invBinWidth;
+            return min(static_cast<unsigned>(max(b, 0.0f)), kNumSpatialBins - 1);
+        };
+
+        // a bin counts the references that start and end in it, its bounds
+        // hold the parts of every reference that cross it
+        Bin bins[kNumSpatialBins];
+        unsigned exits[kNumSpatialBins] = {};
+
+        for (const Reference &ref : refs)
+        {
+            const unsigned first = getBin(ref.mBounds.mMin[a]);
+            const unsigned last = max(getBin(ref.mBounds.mMax[a]), first);
+
+            Reference rest = ref;
+            for (unsigned b = first; b < last; ++b)
+            {
+                Reference part, next;
+                SplitReference(rest, a, bounds.mMin[a] + (b + 1) * binWidth, part, next);
+                bins[b].mBounds.Union(part.mBounds);
+                rest = next;
+            }
+            bins[last].mBounds.Union(rest.mBounds);
+
+            ++bins[first].mCount;
+            ++exits[last];
+        }
+
+        // sweep from the right to get the area and count above each split plane
+        float areaAbove[kNumSpatialBins];
+        unsigned countAbove[kNumSpatialBins];
+
+        Bounds upper;
+        unsigned count = 0;
+        for (unsigned b = kNumSpatialBins - 1; b > 0; --b)
+        {
+            upper.Union(bins[b].mBounds);
+            count += exits[b];
+
+            areaAbove[b] = count ? upper.GetSurfaceArea() : 0.0f;
+            countAbove[b] = count;
+        }
+
+        // sweep from the left and test the plane between bin b-1 and b
+        Bounds lower;
+        count = 0;
+        for (unsigned b = 1; b < kNumSpatialBins; ++b)
+        {
+            lower.Union(bins[b - 1].mBounds);
+            count += bins[b - 1].mCount;
+
+            if (count == 0 || countAbove[b] == 0)
+                continue;
+
+            const float pBelow = lower.GetSurfaceArea() * invArea;
+            const float pAbove = areaAbove[b] * invArea;
+
+            const float cost = 0.125f + (pBelow*count + pAbove*countAbove[b]);
+            if (cost < bestCost)
+            {
+                bestCost = cost;
+                axis = a;
+                position = bounds.mMin[a] + b * binWidth;
+            }
+        }
+    }
+
+    return bestCost;
+}
+
+void AABBTree::PerformSpatialSplit(const vector<Reference> &refs, unsigned axis, float position, unsigned &budget,
+                                   vector<Reference> &left, vector<Reference> &right) const
+{
+    Bounds leftBounds, rightBounds;
+    vector<unsigned> straddling;
+
+    for (unsigned i = 0; i < refs.size(); ++i)
+    {
+        const Reference &ref = refs[i];
+
+        if (ref.mBounds.mMax[axis] <= position)
+        {
+            left.push_back(ref);
+            leftBounds.Union(ref.mBounds);
+        }
+        else if (ref.mBounds.mMin[axis] >= position)
+        {
+            right.push_back(ref);
+            rightBounds.Union(ref.mBounds);
+        }
+        else
+        {
+            straddling.push_back(i);
+        }
+    }
+
+    // with both halves of every straddling reference counted on its side, a reference
+    // is only cut if that is cheaper than moving it whole to either side (Stich et al.)
+    vector<Reference> leftParts(straddling.size()), rightParts(straddling.size());
+    for (unsigned i = 0; i < straddling.size(); ++i)
+    {
+        SplitReference(refs[straddling[i]], axis, position, leftParts[i], rightParts[i]);
+        leftBounds.Union(leftParts[i].mBounds);
+        rightBounds.Union(rightParts[i].mBounds);
+    }
+
+    float numLeft = float(left.size() + straddling.size());
+    float numRight = float(right.size() + straddling.size());
+
+    for (unsigned i = 0; i < straddling.size(); ++i)
+    {
+        const Reference &ref = refs[straddling[i]];
+
+        Bounds leftUnsplit(leftBounds);
+        leftUnsplit.Union(ref.mBounds);
+        Bounds rightUnsplit(rightBounds);
+        rightUnsplit.Union(ref.mBounds);
+
+        const float leftArea = leftBounds.GetSurfaceArea();
+        const float rightArea = rightBounds.GetSurfaceArea();
+
+        const float splitCost = leftArea * numLeft + rightArea * numRight;
+        const float leftCost = leftUnsplit.GetSurfaceArea() * numLeft + rightArea * (numRight - 1.0f);
+        const float rightCost = leftArea * (numLeft - 1.0f) + rightUnsplit.GetSurfaceArea() * numRight;
+
+        // once the budget is spent every straddling reference goes whole to one side
+        if (budget && splitCost < leftCost && splitCost < rightCost)
+        {
+            left.push_back(leftParts[i]);
+            right.push_back(rightParts[i]);
+            --budget;
+        }
+        else if (leftCost <= rightCost)
+        {
+            left.push_back(ref);
+            leftBounds = leftUnsplit;
+            numRight -= 1.0f;
+        }
+        else
+        {
+            right.push_back(ref);
+            rightBounds = rightUnsplit;
+            numLeft -= 1.0f;
+        }
+    }
+}
+
+void AABBTree::SplitReference(const Reference &ref, unsigned axis, float position, Reference &left, Reference &right) const
+{
+    left.mFace = ref.mFace;
+    right.mFace = ref.mFace;
+    left.mBounds = Bounds();
+    right.mBounds = Bounds();
+
+    const unsigned *indices = &mTraits.mIndices[ref.mFace*3];
+
+    // the triangle's vertices on each side of the plane, plus the points where its edges cross it
+    for (unsigned i = 0; i < 3; ++i)
+    {
+        const Vector3f &v0 = mTraits.mVertices[indices[i]];
+        const Vector3f &v1 = mTraits.mVertices[indices[(i + 1) % 3]];
+
+        if (v0[axis] <= position)
+            left.mBounds.Union(Bounds(v0, v0));
+        if (v0[axis] >= position)
+            right.mBounds.Union(Bounds(v0, v0));
+
+        if ((v0[axis] < position && position < v1[axis]) || (v1[axis] < position && position < v0[axis]))
+        {
+            const float t = (position - v0[axis]) / (v1[axis] - v0[axis]);
+            Vector3f p = v0 + (v1 - v0) * t;
+            p[axis] = position;
+
+            left.mBounds.Union(Bounds(p, p));
+            right.mBounds.Union(Bounds(p, p));
+        }
+    }
+
+    // the reference may already have been cut on other planes, keep only what lies inside it
+    left.mBounds.mMax[axis] = position;
+    right.mBounds.mMin[axis] = position;
+
+    left.mBounds.mMin = left.mBounds.mMin.cwiseMax(ref.mBounds.mMin);
+    left.mBounds.mMax = left.mBounds.mMax.cwiseMin(ref.mBounds.mMax);
+    right.mBounds.mMin = right.mBounds.mMin.cwiseMax(ref.mBounds.mMin);
+    right.mBounds.mMax = right.mBounds.mMax.cwiseMin(ref.mBounds.mMax);
+}
@@ -0,0 +1,318 @@
+#include "AABBTree.hpp"
+#include <algorithm>
+#include <future>
+
+using namespace Eigen;
+using namespace std;
+using namespace PiratePhysics;
+
+namespace
+{
+    // index of the only subtree in a subset of one
+    unsigned GetSubtreeIndex(unsigned subset)
+    {
+        unsigned i = 0;
+        while (!(subset & (1U << i)))
+            ++i;
+        return i;
+    }
+} // namespace
+
+float AABBTree::OptimizeTreelets(unsigned numPasses)
+{
+    if (mNodes.empty())
+        return 0.0f;
+
+    // children are expected after their parent
+    if (!mNodeHeights.empty())
+        Compact();
+
+    const unsigned numNodes = static_cast<unsigned>(mNodes.size());
+
+    // link both children explicitly so a treelet can be rewired without moving any subtree
+    vector<LinkedNode> linked(numNodes);
+    for (unsigned i = numNodes; i-- > 0;)
+    {
+        const Node &n = mNodes[i];
+        LinkedNode &l = linked[i];
+
+        l.mBounds = Bounds(n.mMinExtents, n.mMaxExtents);
+        const float area = l.mBounds.GetSurfaceArea();
+
+        if (n.IsLeaf())
+        {
+            l.mLeft = kUnusedNode;
+            l.mRight = kUnusedNode;
+            l.mOffset = n.mOffset;
+            l.mNumFaces = n.mNumPrimitives;
+            l.mCost = area * n.mNumPrimitives;
+            l.mNumNodes = 1;
+        }
+        else
+        {
+            // children come after their parent, so their costs are known already
+            l.mLeft = i + 1;
+            l.mRight = n.mOffset;
+            l.mOffset = 0;
+            l.mNumFaces = 0;
+            l.mCost = 0.125f * area + linked[l.mLeft].mCost + linked[l.mRight].mCost;
+            l.mNumNodes = 1 + linked[l.mLeft].mNumNodes + linked[l.mRight].mNumNodes;
+        }
+    }
+
+    for (unsigned pass = 0; pass < numPasses; ++pass)
+    {
+        const float cost = linked[0].mCost;
+        vector<LinkedNode> previous(linked);
+
+        OptimizeTreeletsRecursive(linked, 0, 1);
+
+        // cheaper topologies can be deeper ones, the traversal stacks only hold kMaxTreeDepth entries
+        if (GetLinkedDepth(linked, 0) > kMaxTreeDepth)
+        {
+            linked.swap(previous);
+            break;
+        }
+
+        if (linked[0].mCost >= cost * 0.999f)
+            break;
+    }
+
+    // lay the tree out depth first again, faces in leaf order so every subtree keeps a contiguous range
+    vector<Node> nodes;
+    nodes.reserve(numNodes);
+    vector<unsigned> faces;
+    faces.reserve(mPrimitives.size());
+
+    LayoutLinked(linked, 0, nodes, faces);
+
+    mNodes.swap(nodes);
+    mPrimitives.swap(faces);
+    mFreeNode = numNodes;
+
+    BuildStats stats;
+    UpdateStats(0, 1, stats);
+
+    mStats = stats;
+
+    // the optimized tree is the new reference for the degradation Refit measures
+    mSubtreeCost.clear();
+    mBuiltSubtreeCost.clear();
+
+    if (mWideWidth)
+        CollapseWide(mWideWidth);
+    if (mQuantizedBits)
+        CompressNodes(mQuantizedBits);
+
+    if (!mLeafTriangles.empty())
+        BuildLeafTriangles();
+
+    return GetSAHCost();
+}
+
+void AABBTree::OptimizeTreeletsRecursive(vector<LinkedNode> &nodes, unsigned nodeIndex, unsigned depth) const
+{
+    const LinkedNode &n = nodes[nodeIndex];
+    if (n.mNumFaces)
+        return;
+
+    const unsigned left = n.mLeft;
+    const unsigned right = n.mRight;
+
+    // bottom up, a treelet is only formed once the subtrees below it are as good as they get,
+    // the subtrees are disjoint so they can be rewritten at the same time
+    if (depth < mMaxParallelDepth && nodes[left].mNumNodes >= kMinParallelFaces)
+    {
+        future<void> task = async(launch::async, [this, &nodes, left, depth]() {
+            OptimizeTreeletsRecursive(nodes, left, depth+1);
+        });
+
+        OptimizeTreeletsRecursive(nodes, right, depth+1);
+        task.get();
+    }
+    else
+    {
+        OptimizeTreeletsRecursive(nodes, left, depth+1);
+        OptimizeTreeletsRecursive(nodes, right, depth+1);
+    }
+
+    // the subtrees below may have become cheaper
+    LinkedNode &m = nodes[nodeIndex];
+    m.mCost = 0.125f * m.mBounds.GetSurfaceArea() + nodes[left].mCost + nodes[right].mCost;
+
+    OptimizeTreelet(nodes, nodeIndex);
+}
+
+void AABBTree::OptimizeTreelet(vector<LinkedNode> &nodes, unsigned root)
+{
+    const unsigned kNumSubsets = 1 << kMaxTreeletLeaves;
+
+    // grow the treelet by opening the leaf with the largest area, the one most likely to be misplaced
+    unsigned leaves[kMaxTreeletLeaves];
+    unsigned inner[kMaxTreeletLeaves - 1];
+    unsigned numLeaves = 0;
+    unsigned numInner = 0;
+
+    inner[numInner++] = root;
+    leaves[numLeaves++] = nodes[root].mLeft;
+    leaves[numLeaves++] = nodes[root].mRight;
+
+    while (numLeaves < kMaxTreeletLeaves)
+    {
+        unsigned best = kUnusedNode;
+        float bestArea = -1.0f;
+
+        for (unsigned i = 0; i < numLeaves; ++i)
+        {
+            const LinkedNode &l = nodes[leaves[i]];
+            if (l.mNumFaces)
+                continue;
+
+            const float area = l.mBounds.GetSurfaceArea();
+            if (area > bestArea)
+            {
+                best = i;
+                bestArea = area;
+            }
+        }
+
+        if (best == kUnusedNode)
+            break;
+
+        const unsigned opened = leaves[best];
+        inner[numInner++] = opened;
+        leaves[best] = nodes[opened].mLeft;
+        leaves[numLeaves++] = nodes[opened].mRight;
+    }
+
+    // two subtrees can only be joined one way
+    if (numLeaves < 3)
+        return;
+
+    const unsigned full = (1 << numLeaves) - 1;
+
+    float area[kNumSubsets];
+    float cost[kNumSubsets];
+    unsigned split[kNumSubsets];
+
+    for (unsigned s = 1; s <= full; ++s)
+    {
+        Bounds b;
+        for (unsigned i = 0; i < numLeaves; ++i)
+        {
+            if (s & (1 << i))
+                b.Union(nodes[leaves[i]].mBounds);
+        }
+        area[s] = b.GetSurfaceArea();
+    }
+
+    // subsets of a set are smaller numbers, so they are always costed before the set itself
+    for (unsigned s = 1; s <= full; ++s)
+    {
+        if (!(s & (s - 1)))
+        {
+            cost[s] = nodes[leaves[GetSubtreeIndex(s)]].mCost;
+            split[s] = 0;
+            continue;
+        }
+
+        // each partition once, the half holding the lowest subtree is the left one
+        const unsigned lowest = s & (~s + 1);
+        const unsigned rest = s ^ lowest;
+
+        float bestCost = numeric_limits<float>::max();
+        unsigned bestSplit = 0;
+
+        for (unsigned p = (rest - 1) & rest;; p = (p - 1) & rest)
+        {
+            const unsigned l = p | lowest;
+            const float c = cost[l] + cost[s ^ l];
+            if (c < bestCost)
+            {
+                bestCost = c;
+                bestSplit = l;
+            }
+
+            if (!p)
+                break;
+        }
+
+        cost[s] = 0.125f * area[s] + bestCost;
+        split[s] = bestSplit;
+    }
+
+    // keep the tree as it is unless the gain is more than rounding
+    if (cost[full] >= nodes[root].mCost * 0.9999f)
+        return;
+
+    // rewire the inner nodes of the treelet to the new topology, the root keeps its slot
+    struct Builder
+    {
+        vector<LinkedNode> &mNodes;
+        const unsigned *mLeaves;
+        const unsigned *mInner;
+        const unsigned *mSplit;
+        unsigned mNextInner;
+
+        unsigned Emit(unsigned s)
+        {
+            if (!(s & (s - 1)))
+                return mLeaves[GetSubtreeIndex(s)];
+
+            const unsigned index = mInner[mNextInner++];
+            const unsigned left = Emit(mSplit[s]);
+            const unsigned right = Emit(s ^ mSplit[s]);
+
+            const LinkedNode &l = mNodes[left];
+            const LinkedNode &r = mNodes[right];
+
+            LinkedNode &n = mNodes[index];
+            n.mLeft = left;
+            n.mRight = right;
+            n.mBounds = l.mBounds;
+            n.mBounds.Union(r.mBounds);
+            n.mCost = 0.125f * n.mBounds.GetSurfaceArea() + l.mCost + r.mCost;
+            n.mNumNodes = 1 + l.mNumNodes + r.mNumNodes;
+
+            return index;
+        }
+    };
+
+    Builder builder = {nodes, leaves, inner, split, 0};
+    builder.Emit(full);
+}
+
+unsigned AABBTree::GetLinkedDepth(const vector<LinkedNode> &nodes, unsigned nodeIndex)
+{
+    const LinkedNode &n = nodes[nodeIndex];
+    if (n.mNumFaces)
+        return 1;
+
+    return 1 + max(GetLinkedDepth(nodes, n.mLeft), GetLinkedDepth(nodes, n.mRight));
+}
+
+void AABBTree::LayoutLinked(const vector<LinkedNode> &linked, unsigned nodeIndex,
+                            vector<Node> &nodes, vector<unsigned> &faces) const
+{
+    const LinkedNode &l = linked[nodeIndex];
+
+    const unsigned index = static_cast<unsigned>(nodes.size());
+    nodes.emplace_back();
+
+    Node &n = nodes[index];
+    n.mMinExtents = l.mBounds.mMin;
+    n.mMaxExtents = l.mBounds.mMax;
+
+    if (l.mNumFaces)
+    {
+        n.mOffset = static_cast<unsigned>(faces.size());
+        n.mNumPrimitives = l.mNumFaces;
+        faces.insert(faces.end(), mPrimitives.begin() + l.mOffset, mPrimitives.begin() + l.mOffset + l.mNumFaces);
+        return;
+    }
+
+    LayoutLinked(linked, l.mLeft, nodes, faces);
+
+    nodes[index].mOffset = static_cast<unsigned>(nodes.size());
+    LayoutLinked(linked, l.mRight, nodes, faces);
+}
@@ -0,0 +1,212 @@
+#include "AABBTree.hpp"
+#include "Simd.hpp"
+
+using namespace std;
+using namespace PiratePhysics;
+using namespace PiratePhysics::Simd;
+
+void AABBTree::CollapseWide(unsigned width)
+{
+    mWideNodes4.clear();
+    mWideNodes8.clear();
+    mWideWidth = 0;
+
+    if (mNodes.empty())
+        return;
+
+    if (width == 4)
+        CollapseRecursive(0, mWideNodes4);
+    else if (width == 8)
+        CollapseRecursive(0, mWideNodes8);
+    else
+        return;
+
+    mWideWidth = width;
+
+    // only one alternative layout is traced at a time
+    CompressNodes(0);
+}
+
+template <int W>
+unsigned AABBTree::CollapseRecursive(unsigned nodeIndex, vector<WideNode<W>> &wideNodes) const
+{
+    unsigned children[W];
+    unsigned numChildren = 0;
+
+    const Node &node = mNodes[nodeIndex];
+    if (node.IsLeaf())
+    {
+        // only happens for the root of a tree that fits in one leaf
+        children[numChildren++] = nodeIndex;
+    }
+    else
+    {
+        children[numChildren++] = node.GetLeft(nodeIndex);
+        children[numChildren++] = node.mOffset;
+    }
+
+    // pull grandchildren up by opening the inner child with the largest surface area until the node is full
+    while (numChildren < W)
+    {
+        int best = -1;
+        float bestArea = -1.0f;
+
+        for (unsigned i = 0; i < numChildren; ++i)
+        {
+            const Node &c = mNodes[children[i]];
+            if (c.IsLeaf())
+                continue;
+
+            const float area = Bounds(c.mMinExtents, c.mMaxExtents).GetSurfaceArea();
+            if (area > bestArea)
+            {
+                bestArea = area;
+                best = static_cast<int>(i);
+            }
+        }
+
+        if (best < 0)
+            break;
+
+        const unsigned opened = children[best];
+        children[best] = mNodes[opened].GetLeft(opened);
+        children[numChildren++] = mNodes[opened].mOffset;
+    }
+
+    // reserve the slot first so wide nodes come out in depth first order
+    const unsigned wideIndex = static_cast<unsigned>(wideNodes.size());
+    wideNodes.emplace_back();
+
+    WideNode<W> wide;
+    wide.mNumChildren = numChildren;
+
+    for (unsigned i = 0; i < W; ++i)
+    {
+        for (unsigned a = 0; a < 3; ++a)
+        {
+            wide.mMin[a][i] = 0.0f;
+            wide.mMax[a][i] = 0.0f;
+        }
+        wide.mChild[i] = 0;
+        wide.mNumFaces[i] = 0;
+    }
+
+    for (unsigned i = 0; i < numChildren; ++i)
+    {
+        const Node &c = mNodes[children[i]];
+
+        for (unsigned a = 0; a < 3; ++a)
+        {
+            wide.mMin[a][i] = c.mMinExtents[a];
+            wide.mMax[a][i] = c.mMaxExtents[a];
+        }
+
+        if (c.IsLeaf())
+        {
+            wide.mChild[i] = c.mOffset;
+            wide.mNumFaces[i] = c.mNumPrimitives;
+        }
+        else
+        {
+            wide.mChild[i] = CollapseRecursive(children[i], wideNodes);
+        }
+    }
+
+    wideNodes[wideIndex] = wide;
+
+    return wideIndex;
+}
+
+template <int W>
+bool AABBTree::TraceRayWide(const vector<WideNode<W>> &wideNodes,
+                            const Eigen::Vector3f &start, const Eigen::Vector3f &dir, float &outT,
+                            float &outU, float &outV, float &outW, float &faceSign, uint32_t &faceIndex) const
+{
+    using F = FloatN<W>;
+
+    const F startX(start[0]), startY(start[1]), startZ(start[2]);
+    const F rcpX(1.0f / dir[0]), rcpY(1.0f / dir[1]), rcpZ(1.0f / dir[2]);
+    const F zero(0.0f);
+
+    // a stack entry is either a wide node or a leaf range of mPrimitives
+    struct StackEntry
+    {
+        unsigned mChild;
+        unsigned mNumFaces;
+        float mDist;
+    };
+
+    // every level pushes at most W-1 more entries than it pops
+    StackEntry stack[kMaxTreeDepth * W];
+    unsigned stackSize = 0;
+
+    stack[stackSize++] = {0, 0, 0.0f};
+
+    while (stackSize)
+    {
+        const StackEntry e = stack[--stackSize];
+        if (e.mDist >= outT)
+            continue;
+
+        if (e.mNumFaces)
+        {
+            IntersectLeaf(e.mChild, e.mNumFaces, start, dir, outT, outU, outV, outW, faceSign, faceIndex);
+            continue;
+        }
+
+        const WideNode<W> &node = wideNodes[e.mChild];
+
+        // slab test of all children at once
+        const F tx0 = (F::Load(node.mMin[0]) - startX) * rcpX;
+        const F tx1 = (F::Load(node.mMax[0]) - startX) * rcpX;
+        const F ty0 = (F::Load(node.mMin[1]) - startY) * rcpY;
+        const F ty1 = (F::Load(node.mMax[1]) - startY) * rcpY;
+        const F tz0 = (F::Load(node.mMin[2]) - startZ) * rcpZ;
+        const F tz1 = (F::Load(node.mMax[2]) - startZ) * rcpZ;
+
+        F tmin = Max(Min(tx0, tx1), zero);
+        tmin = Max(Min(ty0, ty1), tmin);
+        tmin = Max(Min(tz0, tz1), tmin);
+
+        F tmax = Min(Max(tx0, tx1), F(outT));
+        tmax = Min(Max(ty0, ty1), tmax);
+        tmax = Min(Max(tz0, tz1), tmax);
+
+        unsigned hitMask = MoveMask(tmin <= tmax) & ((1U << node.mNumChildren) - 1);
+        if (!hitMask)
+            continue;
+
+        float dist[W];
+        tmin.Store(dist);
+
+        // order the hit children by entry distance, farthest first so the nearest is popped next
+        unsigned order[W];
+        unsigned numHits = 0;
+        for (unsigned i = 0; i < W; ++i)
+        {
+            if (!(hitMask & (1U << i)))
+                continue;
+
+            unsigned j = numHits++;
+            while (j > 0 && dist[order[j - 1]] < dist[i])
+            {
+                order[j] = order[j - 1];
+                --j;
+            }
+            order[j] = i;
+        }
+
+        for (unsigned k = 0; k < numHits; ++k)
+        {
+            const unsigned i = order[k];
+            stack[stackSize++] = {node.mChild[i], node.mNumFaces[i], dist[i]};
+        }
+    }
+
+    return outT != numeric_limits<float>::max();
+}
+
+template bool AABBTree::TraceRayWide<4>(const vector<WideNode<4>> &, const Eigen::Vector3f &, const Eigen::Vector3f &,
+                                        float &, float &, float &, float &, float &, uint32_t &) const;
+template bool AABBTree::TraceRayWide<8>(const vector<WideNode<8>> &, const Eigen::Vector3f &, const Eigen::Vector3f &,
+                                        float &, float &, float &, float &, float &, uint32_t &) const;
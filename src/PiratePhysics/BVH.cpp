@@ -0,0 +1,260 @@
+#include "BVH.hpp"
+#include <algorithm>
+#include <future>
+#include <thread>
+
+using namespace Eigen;
+using namespace std;
+using namespace PiratePhysics;
+
+unsigned BVHBuilder::GetMaxParallelDepth(unsigned &numThreads)
+{
+    if (numThreads == 0)
+        numThreads = max(thread::hardware_concurrency(), 1U);
+
+    // spawn one level deeper than the thread count strictly needs to even out unbalanced splits
+    unsigned depth = Log2Ceil(numThreads);
+    if (numThreads > 1)
+        ++depth;
+
+    return depth;
+}
+
+void BVHBuilder::Build(vector<BVHNode> &nodes, unsigned nodeIndex, unsigned *primitives, unsigned numPrimitives,
+                       unsigned depth, BVHBuildStats &stats) const
+{
+    BVHNode &n = nodes[nodeIndex];
+    stats.mTreeDepth = max(stats.mTreeDepth, depth);
+
+    BVHBounds bounds;
+    for (unsigned i = 0; i < numPrimitives; ++i)
+        bounds.Union(mBounds[primitives[i]]);
+
+    n.mMinExtents = bounds.mMin;
+    n.mMaxExtents = bounds.mMax;
+
+    if (numPrimitives <= mMaxPrimitivesPerLeaf)
+    {
+        n.mOffset = static_cast<unsigned>(primitives - mPrimitives);
+        n.mNumPrimitives = numPrimitives;
+        ++stats.mLeafNodes;
+        return;
+    }
+
+    ++stats.mInnerNodes;
+
+    // primitive counts for each branch, fall back to a median split if the tree
+    // would otherwise outgrow the traversal stack
+    unsigned leftCount;
+    if (depth + Log2Ceil(numPrimitives) >= kMaxBVHDepth)
+        leftCount = numPrimitives / 2;
+    else if (mBinned)
+        leftCount = PartitionBinnedSAH(bounds, primitives, numPrimitives);
+    else
+        leftCount = PartitionSAH(primitives, numPrimitives);
+    const unsigned rightCount = numPrimitives - leftCount;
+
+    // the left subtree owns the 2*leftCount-1 slots after this node, the right one follows
+    const unsigned left = nodeIndex + 1;
+    const unsigned right = nodeIndex + 2 * leftCount;
+    n.mOffset = right;
+    n.mNumPrimitives = 0;
+
+    // split in half and build each side recursively, large left
+    // halves go to a worker while this thread carries on with the right
+    if (depth < mMaxParallelDepth && leftCount >= kMinParallelPrimitives)
+    {
+        BVHBuildStats leftStats;
+        future<void> task = async(launch::async, [&, left, primitives, leftCount, depth]() {
+            Build(nodes, left, primitives, leftCount, depth+1, leftStats);
+        });
+
+        Build(nodes, right, primitives+leftCount, rightCount, depth+1, stats);
+
+        task.get();
+        stats.Merge(leftStats);
+    }
+    else
+    {
+        Build(nodes, left, primitives, leftCount, depth+1, stats);
+        Build(nodes, right, primitives+leftCount, rightCount, depth+1, stats);
+    }
+}
+
+void BVHBuilder::CompactNodes(vector<BVHNode> &nodes)
+{
+    // leaves leave part of their reserved range unused, squeeze the gaps out, since
+    // the reservations are already in depth first order relative order is preserved
+    vector<unsigned> remap(nodes.size());
+
+    unsigned count = 0;
+    for (size_t i = 0; i < nodes.size(); ++i)
+    {
+        remap[i] = count;
+        if (nodes[i].mOffset != BVHNode::kUnused)
+            ++count;
+    }
+
+    for (size_t i = 0; i < nodes.size(); ++i)
+    {
+        BVHNode n = nodes[i];
+        if (n.mOffset == BVHNode::kUnused)
+            continue;
+
+        if (!n.IsLeaf())
+            n.mOffset = remap[n.mOffset];
+
+        nodes[remap[i]] = n;
+    }
+
+    nodes.resize(count);
+    nodes.shrink_to_fit();
+}
+
+unsigned BVHBuilder::PartitionSAH(unsigned *primitives, unsigned numPrimitives) const
+{
+    unsigned bestAxis = 0;
+    unsigned bestIndex = 0;
+    float bestCost = numeric_limits<float>::max();
+
+    // ties are broken by index so the order does not depend on the sort
+    auto sortAxis = [&](unsigned axis) {
+        sort(primitives, primitives + numPrimitives, [&](unsigned lhs, unsigned rhs) {
+            const float a = mCentroids[lhs][axis];
+            const float b = mCentroids[rhs][axis];
+            return a == b ? lhs < rhs : a < b;
+        });
+    };
+
+    vector<float> cumulativeLower(numPrimitives);
+    vector<float> cumulativeUpper(numPrimitives);
+
+    for (unsigned a = 0; a < 3; ++a)
+    {
+        sortAxis(a);
+
+        // two passes over data to calculate upper and lower bounds
+        BVHBounds lower;
+        BVHBounds upper;
+
+        for (unsigned i = 0; i < numPrimitives; ++i)
+        {
+            lower.Union(mBounds[primitives[i]]);
+            upper.Union(mBounds[primitives[numPrimitives-i-1]]);
+
+            cumulativeLower[i] = lower.GetSurfaceArea();
+            cumulativeUpper[numPrimitives-i-1] = upper.GetSurfaceArea();
+        }
+
+        const float invTotalSA = 1.0f / cumulativeUpper[0];
+
+        // test all split positions
+        for (unsigned i = 0; i < numPrimitives-1; ++i)
+        {
+            const float pBelow = cumulativeLower[i] * invTotalSA;
+            const float pAbove = cumulativeUpper[i] * invTotalSA;
+
+            const float cost = 0.125f + (pBelow*i + pAbove*(numPrimitives-i));
+            if (cost <= bestCost)
+            {
+                bestCost = cost;
+                bestIndex = i;
+                bestAxis = a;
+            }
+        }
+    }
+
+    // re-sort by best axis
+    if (bestAxis != 2)
+        sortAxis(bestAxis);
+
+    return bestIndex+1;
+}
+
+unsigned BVHBuilder::PartitionBinnedSAH(const BVHBounds &bounds, unsigned *primitives, unsigned numPrimitives) const
+{
+    // bin on centroid bounds, the bounds of the node may be much larger
+    BVHBounds centroidBounds;
+    for (unsigned i = 0; i < numPrimitives; ++i)
+    {
+        const Vector3f &c = mCentroids[primitives[i]];
+        centroidBounds.Union(BVHBounds(c, c));
+    }
+
+    const Vector3f extents = centroidBounds.mMax - centroidBounds.mMin;
+    const float invTotalSA = 1.0f / bounds.GetSurfaceArea();
+
+    unsigned bestAxis = 0;
+    unsigned bestBin = 0;
+    float bestCost = numeric_limits<float>::max();
+
+    for (unsigned a = 0; a < 3; ++a)
+    {
+        // all centroids on one plane, no split possible on this axis
+        if (extents[a] <= 0.0f)
+            continue;
+
+        const float binScale = kNumBins / extents[a];
+
+        BVHBin bins[kNumBins];
+        for (unsigned i = 0; i < numPrimitives; ++i)
+        {
+            const unsigned p = primitives[i];
+            const unsigned b = min(static_cast<unsigned>((mCentroids[p][a] - centroidBounds.mMin[a]) * binScale), kNumBins - 1);
+
+            bins[b].mBounds.Union(mBounds[p]);
+            ++bins[b].mCount;
+        }
+
+        // sweep from the right to get the area and count above each split plane
+        float areaAbove[kNumBins];
+        unsigned countAbove[kNumBins];
+
+        BVHBounds upper;
+        unsigned count = 0;
+        for (unsigned b = kNumBins - 1; b > 0; --b)
+        {
+            upper.Union(bins[b].mBounds);
+            count += bins[b].mCount;
+
+            areaAbove[b] = count ? upper.GetSurfaceArea() : 0.0f;
+            countAbove[b] = count;
+        }
+
+        // sweep from the left and test the plane between bin b-1 and b
+        BVHBounds lower;
+        count = 0;
+        for (unsigned b = 1; b < kNumBins; ++b)
+        {
+            lower.Union(bins[b - 1].mBounds);
+            count += bins[b - 1].mCount;
+
+            if (count == 0 || countAbove[b] == 0)
+                continue;
+
+            const float pBelow = lower.GetSurfaceArea() * invTotalSA;
+            const float pAbove = areaAbove[b] * invTotalSA;
+
+            const float cost = 0.125f + (pBelow*count + pAbove*countAbove[b]);
+            if (cost <= bestCost)
+            {
+                bestCost = cost;
+                bestBin = b;
+                bestAxis = a;
+            }
+        }
+    }
+
+    // degenerate case, every centroid falls in the same place so split in the middle
+    if (bestCost == numeric_limits<float>::max())
+        return numPrimitives / 2;
+
+    const float binScale = kNumBins / extents[bestAxis];
+    const float minCentroid = centroidBounds.mMin[bestAxis];
+
+    unsigned *mid = std::partition(primitives, primitives + numPrimitives, [&](unsigned p) {
+        return min(static_cast<unsigned>((mCentroids[p][bestAxis] - minCentroid) * binScale), kNumBins - 1) < bestBin;
+    });
+
+    return static_cast<unsigned>(mid - primitives);
+}
@@ -0,0 +1,622 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+#include <vector>
+#include <Eigen/Eigen>
+
+namespace PiratePhysics
+{
+    // deepest tree the traversal stacks can hold, builds fall back to median splits before they get there
+    static const unsigned kMaxBVHDepth = 64;
+
+    struct BVHBounds
+    {
+        BVHBounds() : mMin(std::numeric_limits<float>::max(), std::numeric_limits<float>::max(), std::numeric_limits<float>::max()),
+                      mMax(-std::numeric_limits<float>::max(), -std::numeric_limits<float>::max(), -std::numeric_limits<float>::max())
+        {
+        }
+
+        BVHBounds(const Eigen::Vector3f &min, const Eigen::Vector3f &max) : mMin(min), mMax(max)
+        {
+        }
+
+        float GetVolume() const
+        {
+            Eigen::Vector3f e = mMax - mMin;
+            return e.prod();
+        }
+
+        float GetSurfaceArea() const
+        {
+            Eigen::Vector3f e = mMax - mMin;
+            return 2.0f * (e[0] * e[1] + e[0] * e[2] + e[1] * e[2]);
+        }
+
+        void Union(const BVHBounds &b)
+        {
+            mMin[0] = std::min(mMin[0], b.mMin[0]);
+            mMin[1] = std::min(mMin[1], b.mMin[1]);
+            mMin[2] = std::min(mMin[2], b.mMin[2]);
+
+            mMax[0] = std::max(mMax[0], b.mMax[0]);
+            mMax[1] = std::max(mMax[1], b.mMax[1]);
+            mMax[2] = std::max(mMax[2], b.mMax[2]);
+        }
+
+        bool Overlaps(const BVHBounds &b) const
+        {
+            return mMin[0] <= b.mMax[0] && b.mMin[0] <= mMax[0] &&
+                   mMin[1] <= b.mMax[1] && b.mMin[1] <= mMax[1] &&
+                   mMin[2] <= b.mMax[2] && b.mMin[2] <= mMax[2];
+        }
+
+        Eigen::Vector3f mMin;
+        Eigen::Vector3f mMax;
+    };
+
+    /**
+     * Nodes are stored depth first, the left child of an inner node
+     * directly follows its parent so only the right child is linked,
+     * nodes placed by AABBTree::InsertFaces and RemoveFaces link both children
+     */
+    struct alignas(32) BVHNode
+    {
+        static constexpr unsigned kUnused = ~0U;
+
+        // marks an inner node whose left child is linked explicitly instead of following it
+        static constexpr unsigned kLinkedLeft = 0x80000000U;
+
+        BVHNode() : mMinExtents(0.f, 0.f, 0.f), mMaxExtents(0.f, 0.f, 0.f), mOffset(kUnused), mNumPrimitives(0)
+        {
+        }
+
+        bool IsLeaf() const { return static_cast<int32_t>(mNumPrimitives) > 0; }
+
+        // left child of the inner node stored at nodeIndex
+        unsigned GetLeft(unsigned nodeIndex) const { return mNumPrimitives ? mNumPrimitives & ~kLinkedLeft : nodeIndex + 1; }
+        void SetLeft(unsigned nodeIndex, unsigned left) { mNumPrimitives = left == nodeIndex + 1 ? 0 : left | kLinkedLeft; }
+
+        Eigen::Vector3f mMinExtents;
+        Eigen::Vector3f mMaxExtents;
+
+        // right child for inner nodes, first entry in the primitive list for leaves
+        unsigned mOffset;
+        // primitive count of leaves, 0 or the linked left child for inner nodes
+        unsigned mNumPrimitives;
+    };
+
+    static_assert(sizeof(BVHNode) == 32, "a node should fill exactly one 32 byte slot");
+
+    struct BVHBin
+    {
+        BVHBin() : mCount(0)
+        {
+        }
+
+        BVHBounds mBounds;
+        unsigned mCount;
+    };
+
+    struct BVHBuildStats
+    {
+        BVHBuildStats() : mTreeDepth(0), mInnerNodes(0), mLeafNodes(0)
+        {
+        }
+
+        void Merge(const BVHBuildStats &rhs)
+        {
+            mTreeDepth = std::max(mTreeDepth, rhs.mTreeDepth);
+            mInnerNodes += rhs.mInnerNodes;
+            mLeafNodes += rhs.mLeafNodes;
+        }
+
+        unsigned mTreeDepth;
+        unsigned mInnerNodes;
+        unsigned mLeafNodes;
+    };
+
+    /**
+     * Top down SAH builder shared by every BVH, it only ever looks at the bounds and centroids
+     * of the primitives, computed once up front, so it is compiled once for all primitive types
+     */
+    class BVHBuilder
+    {
+    public:
+        static const unsigned kNumBins = 16;
+
+        // subtrees smaller than this are always built on the calling thread
+        static const unsigned kMinParallelPrimitives = 2048;
+
+        /**
+         * @param bounds, centroids per primitive, indexed by the entries of the primitive list
+         * @param primitives start of the primitive list, leaves store their offset from it
+         * @param binned bucket centroids into kNumBins bins per axis instead of sorting them
+         */
+        BVHBuilder(const BVHBounds *bounds, const Eigen::Vector3f *centroids, const unsigned *primitives,
+                   bool binned, unsigned maxPrimitivesPerLeaf, unsigned maxParallelDepth)
+            : mBounds(bounds), mCentroids(centroids), mPrimitives(primitives), mBinned(binned),
+              mMaxPrimitivesPerLeaf(maxPrimitivesPerLeaf), mMaxParallelDepth(maxParallelDepth)
+        {
+        }
+
+        /**
+         * builds the subtree over numPrimitives entries of the primitive list into the 2n-1
+         * slots from nodeIndex on, reordering the entries so every leaf owns a contiguous range
+         */
+        void Build(std::vector<BVHNode> &nodes, unsigned nodeIndex, unsigned *primitives, unsigned numPrimitives,
+                   unsigned depth, BVHBuildStats &stats) const;
+
+        // squeezes out the slots Build reserved but did not use
+        static void CompactNodes(std::vector<BVHNode> &nodes);
+
+        static unsigned Log2Ceil(unsigned x)
+        {
+            unsigned n = 0;
+            while ((1U << n) < x)
+                ++n;
+            return n;
+        }
+
+        // depth down to which subtrees are handed to worker threads, 0 for every hardware thread
+        static unsigned GetMaxParallelDepth(unsigned &numThreads);
+
+    private:
+        unsigned PartitionSAH(unsigned *primitives, unsigned numPrimitives) const;
+        unsigned PartitionBinnedSAH(const BVHBounds &bounds, unsigned *primitives, unsigned numPrimitives) const;
+
+        const BVHBounds *mBounds;
+        const Eigen::Vector3f *mCentroids;
+        const unsigned *mPrimitives;
+        bool mBinned;
+        unsigned mMaxPrimitivesPerLeaf;
+        unsigned mMaxParallelDepth;
+    };
+
+    /**
+     * slab test, returns the entry distance clamped to zero if the ray
+     * enters the box before maxT
+     */
+    inline bool IntersectRayBounds(const Eigen::Vector3f &start, const Eigen::Vector3f &rcpDir,
+                                   const Eigen::Vector3f &min, const Eigen::Vector3f &max, float maxT, float &t)
+    {
+        float tmin = 0.0f;
+        float tmax = maxT;
+
+        for (int a = 0; a < 3; ++a)
+        {
+            const float t0 = (min[a] - start[a]) * rcpDir[a];
+            const float t1 = (max[a] - start[a]) * rcpDir[a];
+
+            // written so that a NaN from a ray lying in a slab plane leaves the interval alone
+            const float tnear = t0 < t1 ? t0 : t1;
+            const float tfar = t0 < t1 ? t1 : t0;
+
+            if (tnear > tmin)
+                tmin = tnear;
+            if (tfar < tmax)
+                tmax = tfar;
+        }
+
+        t = tmin;
+
+        return tmin <= tmax;
+    }
+
+    /**
+     * closest hit traversal of a depth first node array, nearer children are visited first and
+     * deferred ones are dropped once they lie behind the closest hit
+     *
+     * @param intersectLeaf called with the offset and count of every leaf the ray reaches, it
+     *        lowers outT when it finds a closer hit
+     * @return whether outT was lowered below the float maximum
+     */
+    template <typename IntersectLeaf>
+    bool TraceBVH(const BVHNode *nodes, const Eigen::Vector3f &start, const Eigen::Vector3f &dir, float &outT,
+                  IntersectLeaf &&intersectLeaf)
+    {
+        const Eigen::Vector3f rcpDir(1.0f/dir[0], 1.0f/dir[1], 1.0f/dir[2]);
+
+        float dist;
+        if (!IntersectRayBounds(start, rcpDir, nodes[0].mMinExtents, nodes[0].mMaxExtents, outT, dist))
+            return false;
+
+        // far children waiting to be visited together with their entry distance
+        struct StackEntry
+        {
+            unsigned mNode;
+            float mDist;
+        };
+
+        StackEntry stack[kMaxBVHDepth];
+        unsigned stackSize = 0;
+
+        unsigned nodeIndex = 0;
+
+        for (;;)
+        {
+            const BVHNode &node = nodes[nodeIndex];
+
+            if (!node.IsLeaf())
+            {
+                const unsigned left = node.GetLeft(nodeIndex);
+                const unsigned right = node.mOffset;
+
+                float distLeft, distRight;
+                const bool hitLeft = IntersectRayBounds(start, rcpDir, nodes[left].mMinExtents, nodes[left].mMaxExtents, outT, distLeft);
+                const bool hitRight = IntersectRayBounds(start, rcpDir, nodes[right].mMinExtents, nodes[right].mMaxExtents, outT, distRight);
+
+                // descend into the closest child first and defer the other one
+                if (hitLeft && hitRight)
+                {
+                    if (distRight < distLeft)
+                    {
+                        stack[stackSize++] = {left, distLeft};
+                        nodeIndex = right;
+                    }
+                    else
+                    {
+                        stack[stackSize++] = {right, distRight};
+                        nodeIndex = left;
+                    }
+                    continue;
+                }
+                else if (hitLeft)
+                {
+                    nodeIndex = left;
+                    continue;
+                }
+                else if (hitRight)
+                {
+                    nodeIndex = right;
+                    continue;
+                }
+            }
+            else
+            {
+                intersectLeaf(node.mOffset, node.mNumPrimitives);
+            }
+
+            // pop the next deferred node that is still in front of the closest hit
+            for (;;)
+            {
+                if (stackSize == 0)
+                    return outT != std::numeric_limits<float>::max();
+
+                const StackEntry &e = stack[--stackSize];
+                if (e.mDist < outT)
+                {
+                    nodeIndex = e.mNode;
+                    break;
+                }
+            }
+        }
+    }
+
+    /**
+     * calls visitLeaf with the offset and count of every leaf whose box overlaps the query box
+     */
+    template <typename VisitLeaf>
+    void QueryBVH(const BVHNode *nodes, const BVHBounds &bounds, VisitLeaf &&visitLeaf)
+    {
+        unsigned stack[kMaxBVHDepth];
+        unsigned stackSize = 0;
+
+        if (bounds.Overlaps(BVHBounds(nodes[0].mMinExtents, nodes[0].mMaxExtents)))
+            stack[stackSize++] = 0;
+
+        while (stackSize)
+        {
+            const unsigned nodeIndex = stack[--stackSize];
+            const BVHNode &node = nodes[nodeIndex];
+
+            if (node.IsLeaf())
+            {
+                visitLeaf(node.mOffset, node.mNumPrimitives);
+                continue;
+            }
+
+            const unsigned left = node.GetLeft(nodeIndex);
+            const unsigned right = node.mOffset;
+
+            if (bounds.Overlaps(BVHBounds(nodes[right].mMinExtents, nodes[right].mMaxExtents)))
+                stack[stackSize++] = right;
+            if (bounds.Overlaps(BVHBounds(nodes[left].mMinExtents, nodes[left].mMaxExtents)))
+                stack[stackSize++] = left;
+        }
+    }
+
+    /**
+     * Bounding volume hierarchy over any kind of primitive, Traits describes them with
+     *
+     *   unsigned GetNumPrimitives() const
+     *   BVHBounds GetBounds(unsigned i) const
+     *   Eigen::Vector3f GetCentroid(unsigned i) const
+     *   bool IntersectRay(unsigned i, const Eigen::Vector3f &start, const Eigen::Vector3f &dir, float &t) const
+     *
+     * where IntersectRay only lowers t for a hit closer than it and is only needed by TraceRay,
+     * the calls are resolved at compile time so the leaf loops are specialized per primitive
+     *
+     * AABBTree is BVH<TriangleTraits>, it derives from it and works on its nodes, primitive list
+     * and per primitive data directly for the build modes, layouts and edits only it has
+     */
+    template <typename Traits>
+    class BVH
+    {
+    public:
+        /**
+         * @param traits copied, it usually just points at the primitives
+         * @param binned bucket centroids into bins instead of sorting them, much faster to build
+         * @param numThreads 0 to use every hardware thread
+         */
+        explicit BVH(const Traits &traits, bool binned = true, unsigned maxPrimitivesPerLeaf = 4, unsigned numThreads = 0)
+            : BVH(traits, binned, maxPrimitivesPerLeaf, DeferBuild())
+        {
+            mMaxParallelDepth = BVHBuilder::GetMaxParallelDepth(numThreads);
+            Build();
+        }
+
+        const Traits &GetTraits() const { return mTraits; }
+
+        /**
+         * builds the tree again from scratch, for when primitives were added or removed
+         */
+        void Build()
+        {
+            GatherPrimitives();
+            BuildNodes();
+        }
+
+        /**
+         * recomputes all bounds bottom up keeping the topology, for primitives that moved,
+         * the number of primitives must not have changed since the last Build
+         */
+        void Refit()
+        {
+            // children always come after their parent so a reverse sweep is bottom up
+            for (unsigned i = static_cast<unsigned>(mNodes.size()); i-- > 0;)
+            {
+                BVHNode &n = mNodes[i];
+
+                BVHBounds b;
+                if (n.IsLeaf())
+                {
+                    for (unsigned j = 0; j < n.mNumPrimitives; ++j)
+                    {
+                        const unsigned p = mPrimitives[n.mOffset + j];
+                        mBounds[p] = mTraits.GetBounds(p);
+                        b.Union(mBounds[p]);
+                    }
+                }
+                else
+                {
+                    const BVHNode &l = mNodes[n.GetLeft(i)];
+                    const BVHNode &r = mNodes[n.mOffset];
+                    b = BVHBounds(l.mMinExtents, l.mMaxExtents);
+                    b.Union(BVHBounds(r.mMinExtents, r.mMaxExtents));
+                }
+
+                n.mMinExtents = b.mMin;
+                n.mMaxExtents = b.mMax;
+            }
+        }
+
+        /**
+         * closest primitive along the ray, outT is left at the float maximum on a miss
+         */
+        bool TraceRay(const Eigen::Vector3f &start, const Eigen::Vector3f &dir, float &outT, unsigned &outPrimitive) const
+        {
+            outT = std::numeric_limits<float>::max();
+
+            if (mNodes.empty())
+                return false;
+
+            return TraceBVH(mNodes.data(), start, dir, outT, [&](unsigned offset, unsigned count) {
+                for (unsigned i = 0; i < count; ++i)
+                {
+                    const unsigned p = mPrimitives[offset + i];
+                    if (mTraits.IntersectRay(p, start, dir, outT))
+                        outPrimitive = p;
+                }
+            });
+        }
+
+        /**
+         * calls callback(primitive) for every primitive whose bounds overlap the box
+         */
+        template <typename Callback>
+        void QueryBounds(const BVHBounds &bounds, Callback &&callback) const
+        {
+            if (mNodes.empty())
+                return;
+
+            QueryBVH(mNodes.data(), bounds, [&](unsigned offset, unsigned count) {
+                for (unsigned i = 0; i < count; ++i)
+                {
+                    const unsigned p = mPrimitives[offset + i];
+                    if (bounds.Overlaps(mBounds[p]))
+                        callback(p);
+                }
+            });
+        }
+
+        /**
+         * calls callback(a, b) once for every pair of primitives whose bounds overlap, a broadphase
+         */
+        template <typename Callback>
+        void SelfOverlap(Callback &&callback) const
+        {
+            if (mNodes.empty())
+                return;
+
+            // node pairs left to test, a node paired with itself stands for the pairs inside it
+            struct StackEntry
+            {
+                unsigned mA;
+                unsigned mB;
+            };
+
+            std::vector<StackEntry> stack;
+            stack.reserve(4 * kMaxBVHDepth);
+            stack.push_back({0, 0});
+
+            while (!stack.empty())
+            {
+                const StackEntry e = stack.back();
+                stack.pop_back();
+
+                const BVHNode &a = mNodes[e.mA];
+                const BVHNode &b = mNodes[e.mB];
+
+                if (e.mA == e.mB)
+                {
+                    if (a.IsLeaf())
+                    {
+                        for (unsigned i = 0; i < a.mNumPrimitives; ++i)
+                        {
+                            for (unsigned j = i + 1; j < a.mNumPrimitives; ++j)
+                            {
+                                const unsigned p = mPrimitives[a.mOffset + i];
+                                const unsigned q = mPrimitives[a.mOffset + j];
+                                if (mBounds[p].Overlaps(mBounds[q]))
+                                    callback(p, q);
+                            }
+                        }
+                        continue;
+                    }
+
+                    const unsigned left = a.GetLeft(e.mA);
+                    stack.push_back({left, left});
+                    stack.push_back({a.mOffset, a.mOffset});
+                    stack.push_back({left, a.mOffset});
+                    continue;
+                }
+
+                if (!BVHBounds(a.mMinExtents, a.mMaxExtents).Overlaps(BVHBounds(b.mMinExtents, b.mMaxExtents)))
+                    continue;
+
+                if (a.IsLeaf() && b.IsLeaf())
+                {
+                    for (unsigned i = 0; i < a.mNumPrimitives; ++i)
+                    {
+                        const unsigned p = mPrimitives[a.mOffset + i];
+                        for (unsigned j = 0; j < b.mNumPrimitives; ++j)
+                        {
+                            const unsigned q = mPrimitives[b.mOffset + j];
+                            if (mBounds[p].Overlaps(mBounds[q]))
+                                callback(p, q);
+                        }
+                    }
+                    continue;
+                }
+
+                // open the larger of the two boxes
+                const bool openA = b.IsLeaf() || (!a.IsLeaf() &&
+                    BVHBounds(a.mMinExtents, a.mMaxExtents).GetSurfaceArea() > BVHBounds(b.mMinExtents, b.mMaxExtents).GetSurfaceArea());
+
+                if (openA)
+                {
+                    stack.push_back({a.GetLeft(e.mA), e.mB});
+                    stack.push_back({a.mOffset, e.mB});
+                }
+                else
+                {
+                    stack.push_back({e.mA, b.GetLeft(e.mB)});
+                    stack.push_back({e.mA, b.mOffset});
+                }
+            }
+        }
+
+        /**
+         * surface area heuristic cost of the tree, inner node traversal
+         * and primitive tests are weighted as in the builder
+         */
+        float GetSAHCost() const
+        {
+            if (mNodes.empty())
+                return 0.0f;
+
+            const float invRootSA = 1.0f / BVHBounds(mNodes[0].mMinExtents, mNodes[0].mMaxExtents).GetSurfaceArea();
+
+            float cost = 0.0f;
+            for (const BVHNode &node : mNodes)
+            {
+                const float p = BVHBounds(node.mMinExtents, node.mMaxExtents).GetSurfaceArea() * invRootSA;
+                cost += node.IsLeaf() ? p * node.mNumPrimitives : 0.125f * p;
+            }
+
+            return cost;
+        }
+
+        const std::vector<BVHNode> &GetNodes() const { return mNodes; }
+        // primitive of every leaf entry, leaves index it with their offset
+        const std::vector<unsigned> &GetPrimitives() const { return mPrimitives; }
+
+        size_t GetNumNodes() const { return mNodes.size(); }
+        unsigned GetTreeDepth() const { return mStats.mTreeDepth; }
+        unsigned GetNumInnerNodes() const { return mStats.mInnerNodes; }
+        unsigned GetNumLeafNodes() const { return mStats.mLeafNodes; }
+
+    protected:
+        // for trees derived from this one that fill in the primitive list and nodes themselves
+        struct DeferBuild
+        {
+        };
+
+        BVH(const Traits &traits, bool binned, unsigned maxPrimitivesPerLeaf, DeferBuild)
+            : mTraits(traits), mBinned(binned), mMaxPrimitivesPerLeaf(std::max(maxPrimitivesPerLeaf, 1U))
+        {
+        }
+
+        // every primitive in order in the primitive list, with its bounds and centroid
+        void GatherPrimitives()
+        {
+            const unsigned numPrimitives = mTraits.GetNumPrimitives();
+
+            mPrimitives.resize(numPrimitives);
+            mBounds.resize(numPrimitives);
+            mCentroids.resize(numPrimitives);
+
+            for (unsigned i = 0; i < numPrimitives; ++i)
+            {
+                mPrimitives[i] = i;
+                mBounds[i] = mTraits.GetBounds(i);
+                mCentroids[i] = mTraits.GetCentroid(i);
+            }
+        }
+
+        // nodes over the whole primitive list with BVHBuilder, the list is reordered into the leaves
+        void BuildNodes()
+        {
+            const unsigned numPrimitives = static_cast<unsigned>(mPrimitives.size());
+
+            mStats = BVHBuildStats();
+            mNodes.clear();
+
+            if (numPrimitives == 0)
+                return;
+
+            mNodes.resize(2 * numPrimitives - 1);
+
+            BVHBuilder builder(mBounds.data(), mCentroids.data(), mPrimitives.data(), mBinned,
+                               mMaxPrimitivesPerLeaf, mMaxParallelDepth);
+            builder.Build(mNodes, 0, mPrimitives.data(), numPrimitives, 1, mStats);
+
+            BVHBuilder::CompactNodes(mNodes);
+        }
+
+        Traits mTraits;
+
+        bool mBinned;
+        unsigned mMaxPrimitivesPerLeaf;
+        unsigned mMaxParallelDepth = 0;
+
+        std::vector<BVHNode> mNodes;
+        std::vector<unsigned> mPrimitives;
+        std::vector<BVHBounds> mBounds;
+        std::vector<Eigen::Vector3f> mCentroids;
+
+        BVHBuildStats mStats;
+    };
+} // namespace PiratePhysics
@@ -0,0 +1,259 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <limits>
+#include <vector>
+#include <Eigen/Eigen>
+#include "BVH.hpp"
+#include "CollisionShapes/CollisionShape.hpp"
+#include "SparseVoxelVolume.hpp"
+#include "VertexView.hpp"
+
+namespace PiratePhysics
+{
+    /**
+     * collision shapes by their world space boxes, BVH<ShapeTraits>::SelfOverlap is a broadphase,
+     * getAabb is only called while the tree is built or refitted
+     */
+    struct ShapeTraits
+    {
+        const CollisionShape *const *mShapes;
+        unsigned mNumShapes;
+
+        unsigned GetNumPrimitives() const { return mNumShapes; }
+
+        BVHBounds GetBounds(unsigned i) const
+        {
+            const std::pair<Eigen::Vector3f, Eigen::Vector3f> aabb = mShapes[i]->getAabb();
+            return BVHBounds(aabb.first.cwiseMin(aabb.second), aabb.first.cwiseMax(aabb.second));
+        }
+
+        Eigen::Vector3f GetCentroid(unsigned i) const
+        {
+            const std::pair<Eigen::Vector3f, Eigen::Vector3f> aabb = mShapes[i]->getAabb();
+            return 0.5f * (aabb.first + aabb.second);
+        }
+    };
+
+    /**
+     * particles as spheres of one radius, for neighbour queries and ray picking
+     */
+    struct SphereTraits
+    {
+        const Eigen::Vector3f *mCenters;
+        unsigned mNumSpheres;
+        float mRadius;
+
+        unsigned GetNumPrimitives() const { return mNumSpheres; }
+
+        BVHBounds GetBounds(unsigned i) const
+        {
+            const Eigen::Vector3f r(mRadius, mRadius, mRadius);
+            return BVHBounds(mCenters[i] - r, mCenters[i] + r);
+        }
+
+        Eigen::Vector3f GetCentroid(unsigned i) const { return mCenters[i]; }
+
+        bool IntersectRay(unsigned i, const Eigen::Vector3f &start, const Eigen::Vector3f &dir, float &t) const
+        {
+            // |start + t dir - center| = radius, the far root is taken for a ray starting inside
+            const Eigen::Vector3f m = start - mCenters[i];
+            const float a = dir.dot(dir);
+            const float b = dir.dot(m);
+            const float c = m.dot(m) - mRadius * mRadius;
+
+            const float disc = b * b - a * c;
+            if (disc < 0.0f)
+                return false;
+
+            const float root = std::sqrt(disc);
+            float hit = (-b - root) / a;
+            if (hit < 0.0f)
+                hit = (-b + root) / a;
+
+            if (hit < 0.0f || hit >= t)
+                return false;
+
+            t = hit;
+            return true;
+        }
+    };
+
+    /**
+     * Moller and Trumbore's method
+     */
+    inline bool IntersectRayTriTwoSided(const Eigen::Vector3f &p, const Eigen::Vector3f &dir, const Eigen::Vector3f &a,
+                                        const Eigen::Vector3f &b, const Eigen::Vector3f &c, float &t, float &u, float &v, float &w,
+                                        float &sign)
+    {
+        Eigen::Vector3f ab = b - a;
+        Eigen::Vector3f ac = c - a;
+        Eigen::Vector3f n = ab.cross(ac);
+
+        float d = n.dot(-dir);
+        float ood = 1.0f / d; // No need to check for division by zero here as infinity aritmetic will save us...
+        Eigen::Vector3f ap = p - a;
+
+        t = ap.dot(n) * ood;
+        if (t < 0.0f)
+            return false;
+
+        Eigen::Vector3f e = (-dir).cross(ap);
+        v = ac.dot(e) * ood;
+        if (v < 0.0f || v > 1.0f) // ...here...
+            return false;
+        w = -ab.dot(e) * ood;
+        if (w < 0.0f || v + w > 1.0f) // ...and here
+            return false;
+
+        u = 1.0f - v - w;
+        sign = d;
+
+        return true;
+    }
+
+    /**
+     * faces of an indexed triangle mesh read in place, AABBTree is a BVH<TriangleTraits> with
+     * its own build modes, node layouts, edits and queries on top
+     */
+    struct TriangleTraits
+    {
+        VertexView mVertices;
+        unsigned mNumVerts;
+        const unsigned *mIndices;
+        unsigned mNumFaces;
+
+        unsigned GetNumPrimitives() const { return mNumFaces; }
+
+        BVHBounds GetBounds(unsigned i) const
+        {
+            const Eigen::Vector3f &a = mVertices[mIndices[i*3+0]];
+            const Eigen::Vector3f &b = mVertices[mIndices[i*3+1]];
+            const Eigen::Vector3f &c = mVertices[mIndices[i*3+2]];
+            return BVHBounds(a.cwiseMin(b).cwiseMin(c), a.cwiseMax(b).cwiseMax(c));
+        }
+
+        Eigen::Vector3f GetCentroid(unsigned i) const
+        {
+            return (mVertices[mIndices[i*3+0]] + mVertices[mIndices[i*3+1]] + mVertices[mIndices[i*3+2]]) / 3.0f;
+        }
+
+        bool IntersectRay(unsigned i, const Eigen::Vector3f &start, const Eigen::Vector3f &dir, float &t) const
+        {
+            // a face without area gives a NaN distance, which fails the comparison
+            float hit, u, v, w, sign;
+            if (!IntersectRayTriTwoSided(start, dir, mVertices[mIndices[i*3+0]], mVertices[mIndices[i*3+1]],
+                                         mVertices[mIndices[i*3+2]], hit, u, v, w, sign) || !(hit < t))
+                return false;
+
+            t = hit;
+            return true;
+        }
+    };
+
+    /**
+     * the bricks of a SparseVoxelVolume that are not empty, placed in the world as the grid
+     * Voxelize filled, a ray stops at the first solid voxel it meets inside a brick
+     */
+    struct BrickTraits
+    {
+        BrickTraits(const SparseVoxelVolume &volume, const Eigen::Vector3f &minExtents, const Eigen::Vector3f &maxExtents)
+            : mVolume(&volume), mMinExtents(minExtents),
+              mCellSize((maxExtents - minExtents).cwiseQuotient(Eigen::Vector3f(float(volume.GetWidth()), float(volume.GetHeight()), float(volume.GetDepth()))))
+        {
+            volume.ForEachBrick([this](unsigned bx, unsigned by, unsigned bz) { mBricks.push_back({bx, by, bz}); });
+        }
+
+        const SparseVoxelVolume *mVolume;
+        Eigen::Vector3f mMinExtents;
+        Eigen::Vector3f mCellSize;
+
+        // brick coordinates, a snapshot taken when the traits were made
+        std::vector<std::array<unsigned, 3>> mBricks;
+
+        unsigned GetNumPrimitives() const { return static_cast<unsigned>(mBricks.size()); }
+
+        BVHBounds GetBounds(unsigned i) const
+        {
+            unsigned lo[3], hi[3];
+            GetVoxelRange(i, lo, hi);
+
+            return BVHBounds(mMinExtents + mCellSize.cwiseProduct(Eigen::Vector3f(float(lo[0]), float(lo[1]), float(lo[2]))),
+                             mMinExtents + mCellSize.cwiseProduct(Eigen::Vector3f(float(hi[0]), float(hi[1]), float(hi[2]))));
+        }
+
+        Eigen::Vector3f GetCentroid(unsigned i) const
+        {
+            const BVHBounds b = GetBounds(i);
+            return 0.5f * (b.mMin + b.mMax);
+        }
+
+        bool IntersectRay(unsigned i, const Eigen::Vector3f &start, const Eigen::Vector3f &dir, float &t) const
+        {
+            const Eigen::Vector3f rcpDir(1.0f / dir[0], 1.0f / dir[1], 1.0f / dir[2]);
+            const BVHBounds b = GetBounds(i);
+
+            float entry;
+            if (!IntersectRayBounds(start, rcpDir, b.mMin, b.mMax, t, entry))
+                return false;
+
+            unsigned lo[3], hi[3];
+            GetVoxelRange(i, lo, hi);
+
+            // voxel by voxel through the brick from where the ray enters it, 3D DDA
+            const Eigen::Vector3f p = (start + entry * dir - mMinExtents).cwiseQuotient(mCellSize);
+
+            int voxel[3], step[3];
+            float next[3], delta[3];
+            for (int a = 0; a < 3; ++a)
+            {
+                voxel[a] = std::min(std::max(int(std::floor(p[a])), int(lo[a])), int(hi[a]) - 1);
+                step[a] = dir[a] > 0.0f ? 1 : -1;
+
+                if (dir[a] == 0.0f)
+                {
+                    next[a] = delta[a] = std::numeric_limits<float>::max();
+                    continue;
+                }
+
+                const float boundary = mMinExtents[a] + float(voxel[a] + (step[a] > 0)) * mCellSize[a];
+                next[a] = (boundary - start[a]) * rcpDir[a];
+                delta[a] = mCellSize[a] * std::fabs(rcpDir[a]);
+            }
+
+            float current = entry;
+            while (current < t)
+            {
+                if (mVolume->Get(unsigned(voxel[0]), unsigned(voxel[1]), unsigned(voxel[2])))
+                {
+                    t = current;
+                    return true;
+                }
+
+                const int a = next[0] < next[1] ? (next[0] < next[2] ? 0 : 2) : (next[1] < next[2] ? 1 : 2);
+                current = next[a];
+                next[a] += delta[a];
+                voxel[a] += step[a];
+
+                if (voxel[a] < int(lo[a]) || voxel[a] >= int(hi[a]))
+                    return false;
+            }
+
+            return false;
+        }
+
+    private:
+        // voxels of brick i from lo up to hi, bricks on the far sides of the grid are cut short
+        void GetVoxelRange(unsigned i, unsigned lo[3], unsigned hi[3]) const
+        {
+            const unsigned size[3] = {mVolume->GetWidth(), mVolume->GetHeight(), mVolume->GetDepth()};
+            for (int a = 0; a < 3; ++a)
+            {
+                lo[a] = mBricks[i][a] * SparseVoxelVolume::kBrickSize;
+                hi[a] = std::min(lo[a] + SparseVoxelVolume::kBrickSize, size[a]);
+            }
+        }
+    };
+} // namespace PiratePhysics
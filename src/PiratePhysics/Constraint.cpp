@@ -272,4 +272,36 @@ void ShapeMatchingConstraint::solveConstraint()
 		Vector3f goal = cm + R * (mX0[i] - mRestCM);
 		mCorr[i] = (goal - mX[i]);
 	}
+}
+
+SDFCollision::SDFCollision(PositionBasedDynamics &pbd, shared_ptr<const SignedDistanceField> sdf,
+    const vector<int> &bodies, float radius) : Constraint(pbd), mSDF(move(sdf)), mRadius(radius)
+{
+    mBodyIndexes = bodies;
+}
+
+SDFCollision::~SDFCollision()
+{
+}
+
+void SDFCollision::solveConstraint()
+{
+    for (int i : mBodyIndexes)
+    {
+        RigidBody &rb = mPBD.mRigiBodies[i];
+        if (rb.mInvMass == 0.f)
+            continue;
+
+        Vector3f gradient;
+        const float d = mSDF->GetDistance(rb.mBaryCenter, gradient) - mRadius;
+        const float gradientN = gradient.norm();
+        if (d >= 0.f || gradientN == 0.f)
+            continue;
+
+        // straight out along the gradient by the penetration depth
+        Vector3f deltaX = -d / gradientN * gradient;
+
+        rb.mVelocity += deltaX / mPBD.dt;
+        rb.mBaryCenter += deltaX;
+    }
 }
\ No newline at end of file
@@ -1,8 +1,10 @@
 #pragma once
 
+#include <memory>
 #include <vector>
 #include <Eigen/Eigen>
 #include "PositionBasedDynamics.hpp"
+#include "SignedDistanceField.hpp"
 
 namespace PiratePhysics
 {
@@ -50,4 +52,21 @@ namespace PiratePhysics
         std::vector<float> mW;
         std::vector<unsigned> indices;
     };
+
+    /**
+     * keeps bodies of a radius out of a static mesh, the distance and the way out are one
+     * trilinear lookup in the mesh's signed distance field per body
+     */
+    class SDFCollision : public Constraint
+    {
+    public:
+        SDFCollision(PositionBasedDynamics &, std::shared_ptr<const SignedDistanceField> sdf,
+            const std::vector<int> &bodies, float radius);
+        virtual ~SDFCollision();
+
+        void solveConstraint() override;
+
+        std::shared_ptr<const SignedDistanceField> mSDF;
+        float mRadius;
+    };
 }
\ No newline at end of file
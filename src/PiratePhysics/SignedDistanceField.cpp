@@ -0,0 +1,298 @@
+#include "SignedDistanceField.hpp"
+#include "AABBTree.hpp"
+#include "Voxelize.hpp"
+#include <algorithm>
+#include <cmath>
+#include <future>
+#include <limits>
+#include <thread>
+
+using namespace std;
+using namespace Eigen;
+using namespace PiratePhysics;
+
+namespace
+{
+    const float kUnknown = numeric_limits<float>::max();
+
+    // samples of a grid in contiguous chunks across threads, body(begin, end)
+    template <typename Body>
+    void ParallelFor(size_t count, unsigned numThreads, const Body &body)
+    {
+        const size_t chunk = (count + numThreads - 1) / numThreads;
+
+        vector<future<void>> tasks;
+        for (unsigned t = 1; t < numThreads; ++t)
+            tasks.push_back(async(launch::async, body, min(t * chunk, count), min((t + 1) * chunk, count)));
+
+        body(0, min(chunk, count));
+
+        for (auto &task : tasks)
+            task.get();
+    }
+
+    /**
+     * Godunov update of |grad d| = 1 from the smaller neighbour along each axis, a is the neighbour
+     * values, h the spacings and w their inverse squares, the one sided solution is widened to two
+     * and three axes while it still exceeds the next neighbour
+     */
+    float SolveEikonal(float a[3], float h[3], float w[3])
+    {
+        // ascending by neighbour value
+        for (int i : {0, 1, 0})
+        {
+            if (a[i] > a[i + 1])
+            {
+                swap(a[i], a[i + 1]);
+                swap(h[i], h[i + 1]);
+                swap(w[i], w[i + 1]);
+            }
+        }
+
+        float d = a[0] + h[0];
+        if (d <= a[1])
+            return d;
+
+        // sum over the used axes of (d - a_i)^2 / h_i^2 = 1, an unknown third neighbour is never reached
+        float sumW = w[0] + w[1];
+        float sumWA = w[0] * a[0] + w[1] * a[1];
+        float sumWA2 = w[0] * a[0] * a[0] + w[1] * a[1] * a[1];
+        float disc = sumWA * sumWA - sumW * (sumWA2 - 1.0f);
+        d = (sumWA + sqrtf(max(disc, 0.0f))) / sumW;
+        if (d <= a[2])
+            return d;
+
+        sumW += w[2];
+        sumWA += w[2] * a[2];
+        sumWA2 += w[2] * a[2] * a[2];
+        disc = sumWA * sumWA - sumW * (sumWA2 - 1.0f);
+        return (sumWA + sqrtf(max(disc, 0.0f))) / sumW;
+    }
+
+    /**
+     * one Gauss-Seidel pass over the grid in the order given by the signs of dir,
+     * fixed samples keep their value
+     */
+    void Sweep(vector<float> &dist, const vector<uint8_t> &fixed, unsigned width, unsigned height, unsigned depth,
+               const Vector3f &cellSize, int dir)
+    {
+        const int sx = dir & 1 ? -1 : 1;
+        const int sy = dir & 2 ? -1 : 1;
+        const int sz = dir & 4 ? -1 : 1;
+
+        const size_t strideY = width;
+        const size_t strideZ = size_t(width) * height;
+        const Vector3f weight = cellSize.cwiseProduct(cellSize).cwiseInverse();
+
+        for (unsigned iz = 0; iz < depth; ++iz)
+        {
+            const unsigned z = sz > 0 ? iz : depth - 1 - iz;
+            for (unsigned iy = 0; iy < height; ++iy)
+            {
+                const unsigned y = sy > 0 ? iy : height - 1 - iy;
+                for (unsigned ix = 0; ix < width; ++ix)
+                {
+                    const unsigned x = sx > 0 ? ix : width - 1 - ix;
+                    const size_t i = z * strideZ + y * strideY + x;
+                    if (fixed[i])
+                        continue;
+
+                    float a[3] = {kUnknown, kUnknown, kUnknown};
+                    if (x > 0) a[0] = dist[i - 1];
+                    if (x + 1 < width) a[0] = min(a[0], dist[i + 1]);
+                    if (y > 0) a[1] = dist[i - strideY];
+                    if (y + 1 < height) a[1] = min(a[1], dist[i + strideY]);
+                    if (z > 0) a[2] = dist[i - strideZ];
+                    if (z + 1 < depth) a[2] = min(a[2], dist[i + strideZ]);
+
+                    // the update never goes below its smallest neighbour
+                    if (min(a[0], min(a[1], a[2])) >= dist[i])
+                        continue;
+
+                    float h[3] = {cellSize[0], cellSize[1], cellSize[2]};
+                    float w[3] = {weight[0], weight[1], weight[2]};
+                    dist[i] = min(dist[i], SolveEikonal(a, h, w));
+                }
+            }
+        }
+    }
+} // namespace
+
+void SignedDistanceField::Build(const AABBTree &tree, unsigned width, unsigned height, unsigned depth,
+                                const Vector3f &minExtents, const Vector3f &maxExtents, float narrowBand, unsigned numThreads)
+{
+    mWidth = width;
+    mHeight = height;
+    mDepth = depth;
+    mMinExtents = minExtents;
+    mCellSize = (maxExtents - minExtents).cwiseQuotient(Vector3f(float(width), float(height), float(depth)));
+
+    const size_t numSamples = size_t(width) * height * depth;
+    mSamples.assign(numSamples, kUnknown);
+    if (numSamples == 0)
+        return;
+
+    if (numThreads == 0)
+        numThreads = max(thread::hardware_concurrency(), 1U);
+
+    // the sign, a sample is inside where the parity volume holds its voxel
+    VoxelVolume inside(width, height, depth);
+    Voxelize(tree, inside, minExtents, maxExtents, numThreads);
+
+    // samples with a neighbour on the other side of the surface take the distance to their closest point
+    vector<Vector3f> points;
+    vector<size_t> indices;
+    for (unsigned z = 0; z < depth; ++z)
+    {
+        for (unsigned y = 0; y < height; ++y)
+        {
+            for (unsigned x = 0; x < width; ++x)
+            {
+                const bool in = inside.Get(x, y, z);
+                const bool crossing = (x > 0 && inside.Get(x - 1, y, z) != in) || (x + 1 < width && inside.Get(x + 1, y, z) != in) ||
+                                      (y > 0 && inside.Get(x, y - 1, z) != in) || (y + 1 < height && inside.Get(x, y + 1, z) != in) ||
+                                      (z > 0 && inside.Get(x, y, z - 1) != in) || (z + 1 < depth && inside.Get(x, y, z + 1) != in);
+                if (!crossing)
+                    continue;
+
+                points.push_back(GetSamplePoint(x, y, z));
+                indices.push_back(GetIndex(x, y, z));
+            }
+        }
+    }
+
+    vector<ClosestPointHit> hits(points.size());
+    tree.ClosestPoints(points.data(), unsigned(points.size()), kUnknown, hits.data(), numThreads);
+
+    vector<uint8_t> fixed(numSamples, 0);
+    for (size_t i = 0; i < indices.size(); ++i)
+    {
+        if (!hits[i].mHit)
+            continue;
+
+        mSamples[indices[i]] = hits[i].mDistance;
+        fixed[indices[i]] = 1;
+    }
+
+    /**
+     * the far field by fast sweeping, every thread runs its share of the eight orderings on a copy
+     * of its own and the copies are merged by their minimum, with a single thread this is the usual
+     * in place Gauss-Seidel sweep, a second round of orderings changed nothing the collisions see
+     */
+    const unsigned numCopies = min(numThreads, 8U);
+    vector<vector<float>> copies(numCopies - 1);
+
+    for (auto &copy : copies)
+        copy = mSamples;
+
+    ParallelFor(numCopies, numCopies, [&](size_t begin, size_t end) {
+        for (size_t c = begin; c < end; ++c)
+        {
+            vector<float> &dist = c == 0 ? mSamples : copies[c - 1];
+            for (unsigned dir = unsigned(c); dir < 8; dir += numCopies)
+                Sweep(dist, fixed, width, height, depth, mCellSize, int(dir));
+        }
+    });
+
+    for (const auto &copy : copies)
+        for (size_t i = 0; i < numSamples; ++i)
+            mSamples[i] = min(mSamples[i], copy[i]);
+
+    // samples near the surface are queried exactly, collisions only ever look at these
+    const float band = narrowBand * mCellSize.maxCoeff();
+
+    points.clear();
+    indices.clear();
+    for (unsigned z = 0; z < depth; ++z)
+    {
+        for (unsigned y = 0; y < height; ++y)
+        {
+            for (unsigned x = 0; x < width; ++x)
+            {
+                const size_t i = GetIndex(x, y, z);
+                if (fixed[i] || mSamples[i] > band)
+                    continue;
+
+                points.push_back(GetSamplePoint(x, y, z));
+                indices.push_back(i);
+            }
+        }
+    }
+
+    hits.resize(points.size());
+    tree.ClosestPoints(points.data(), unsigned(points.size()), band, hits.data(), numThreads);
+
+    for (size_t i = 0; i < indices.size(); ++i)
+        if (hits[i].mHit)
+            mSamples[indices[i]] = hits[i].mDistance;
+
+    // negative inside
+    ParallelFor(depth, numThreads, [&](size_t begin, size_t end) {
+        for (unsigned z = unsigned(begin); z < end; ++z)
+            for (unsigned y = 0; y < height; ++y)
+                for (unsigned x = 0; x < width; ++x)
+                    if (inside.Get(x, y, z))
+                        mSamples[GetIndex(x, y, z)] = -mSamples[GetIndex(x, y, z)];
+    });
+}
+
+float SignedDistanceField::GetDistance(const Vector3f &point) const
+{
+    Vector3f gradient;
+    return GetDistance(point, gradient);
+}
+
+float SignedDistanceField::GetDistance(const Vector3f &point, Vector3f &gradient) const
+{
+    if (mSamples.empty())
+    {
+        gradient.setZero();
+        return kUnknown;
+    }
+
+    const unsigned size[3] = {mWidth, mHeight, mDepth};
+
+    // grid coordinates with sample x, y, z at x, y, z, clamped to the samples
+    const Vector3f g = (point - mMinExtents).cwiseQuotient(mCellSize) - Vector3f::Constant(0.5f);
+
+    unsigned i0[3];
+    Vector3f f, clamped;
+    for (int a = 0; a < 3; ++a)
+    {
+        clamped[a] = min(max(g[a], 0.0f), float(size[a] - 1));
+        i0[a] = min(unsigned(clamped[a]), size[a] > 1 ? size[a] - 2 : 0U);
+        f[a] = size[a] > 1 ? clamped[a] - float(i0[a]) : 0.0f;
+    }
+
+    const unsigned i1[3] = {min(i0[0] + 1, mWidth - 1), min(i0[1] + 1, mHeight - 1), min(i0[2] + 1, mDepth - 1)};
+
+    const float c000 = GetSample(i0[0], i0[1], i0[2]);
+    const float c100 = GetSample(i1[0], i0[1], i0[2]);
+    const float c010 = GetSample(i0[0], i1[1], i0[2]);
+    const float c110 = GetSample(i1[0], i1[1], i0[2]);
+    const float c001 = GetSample(i0[0], i0[1], i1[2]);
+    const float c101 = GetSample(i1[0], i0[1], i1[2]);
+    const float c011 = GetSample(i0[0], i1[1], i1[2]);
+    const float c111 = GetSample(i1[0], i1[1], i1[2]);
+
+    const float gx = f[0], gy = f[1], gz = f[2];
+    const float hx = 1.0f - gx, hy = 1.0f - gy, hz = 1.0f - gz;
+
+    float distance = ((c000 * hx + c100 * gx) * hy + (c010 * hx + c110 * gx) * gy) * hz +
+                     ((c001 * hx + c101 * gx) * hy + (c011 * hx + c111 * gx) * gy) * gz;
+
+    gradient[0] = ((c100 - c000) * hy * hz + (c110 - c010) * gy * hz + (c101 - c001) * hy * gz + (c111 - c011) * gy * gz) / mCellSize[0];
+    gradient[1] = ((c010 - c000) * hx * hz + (c110 - c100) * gx * hz + (c011 - c001) * hx * gz + (c111 - c101) * gx * gz) / mCellSize[1];
+    gradient[2] = ((c001 - c000) * hx * hy + (c101 - c100) * gx * hy + (c011 - c010) * hx * gy + (c111 - c110) * gx * gy) / mCellSize[2];
+
+    // off the grid the distance to its samples is added on, away from the grid
+    const Vector3f offGrid = (g - clamped).cwiseProduct(mCellSize);
+    const float outside = offGrid.norm();
+    if (outside > 0.0f)
+    {
+        distance += outside;
+        gradient = offGrid / outside;
+    }
+
+    return distance;
+}
@@ -0,0 +1,81 @@
+#pragma once
+
+#include <cstddef>
+#include <vector>
+#include <Eigen/Eigen>
+
+namespace PiratePhysics
+{
+    class AABBTree;
+
+    /**
+     * Signed distance to a closed mesh sampled at the voxel centers of a grid, negative inside,
+     * so the distance and the direction out of the mesh at any point are one trilinear lookup
+     * of eight samples instead of a closest point query on the tree
+     */
+    class SignedDistanceField
+    {
+    public:
+        // samples around the surface whose distance is exact, in cells, the ones farther out are propagated
+        static constexpr float kDefaultNarrowBand = 3.0f;
+
+        SignedDistanceField() = default;
+
+        /**
+         * samples the field of the mesh in tree on a width x height x depth grid over minExtents to
+         * maxExtents, the sign is the parity Voxelize volume of the same grid, samples where it changes
+         * take their closest point from the tree and fast sweeping hands those on to the rest, samples
+         * within narrowBand cells of the surface are then queried exactly
+         *
+         * @param numThreads 0 to use every hardware thread
+         */
+        void Build(const AABBTree &tree, unsigned width, unsigned height, unsigned depth,
+                   const Eigen::Vector3f &minExtents, const Eigen::Vector3f &maxExtents,
+                   float narrowBand = kDefaultNarrowBand, unsigned numThreads = 0);
+
+        /**
+         * trilinear distance at point, a point off the grid adds its distance to the grid's samples
+         */
+        float GetDistance(const Eigen::Vector3f &point) const;
+
+        /**
+         * the same with the gradient of the trilinear interpolant, which points out of the mesh,
+         * off the grid it points back toward the grid's samples from outside
+         */
+        float GetDistance(const Eigen::Vector3f &point, Eigen::Vector3f &gradient) const;
+
+        // the sample at voxel x, y, z
+        float GetSample(unsigned x, unsigned y, unsigned z) const { return mSamples[GetIndex(x, y, z)]; }
+
+        unsigned GetWidth() const { return mWidth; }
+        unsigned GetHeight() const { return mHeight; }
+        unsigned GetDepth() const { return mDepth; }
+
+        const Eigen::Vector3f &GetMinExtents() const { return mMinExtents; }
+        const Eigen::Vector3f &GetCellSize() const { return mCellSize; }
+
+        const std::vector<float> &GetSamples() const { return mSamples; }
+        size_t GetMemoryUsage() const { return mSamples.capacity() * sizeof(float); }
+
+    private:
+        size_t GetIndex(unsigned x, unsigned y, unsigned z) const
+        {
+            return (size_t(z) * mHeight + y) * mWidth + x;
+        }
+
+        Eigen::Vector3f GetSamplePoint(unsigned x, unsigned y, unsigned z) const
+        {
+            return mMinExtents + mCellSize.cwiseProduct(Eigen::Vector3f(x + 0.5f, y + 0.5f, z + 0.5f));
+        }
+
+        unsigned mWidth = 0;
+        unsigned mHeight = 0;
+        unsigned mDepth = 0;
+
+        Eigen::Vector3f mMinExtents = Eigen::Vector3f::Zero();
+        Eigen::Vector3f mCellSize = Eigen::Vector3f::Ones();
+
+        // x fastest, then y, then z, as the unsigned volume of Voxelize
+        std::vector<float> mSamples;
+    };
+} // namespace PiratePhysics
@@ -0,0 +1,259 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+
+#if defined(__AVX__)
+#include <immintrin.h>
+#define PIRATEPHYSICS_SIMD_WIDTH 8
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define PIRATEPHYSICS_SIMD_WIDTH 4
+#else
+#define PIRATEPHYSICS_SIMD_WIDTH 1
+#endif
+
+namespace PiratePhysics
+{
+    namespace Simd
+    {
+        /**
+         * thin wrappers around one hardware register, masks are stored in the
+         * same type with all bits of a lane set for true
+         */
+        template <int W>
+        struct Reg;
+
+        template <>
+        struct Reg<1>
+        {
+            using Type = float;
+
+            static Type Set1(float a) { return a; }
+            static Type Load(const float *p) { return *p; }
+            static void Store(float *p, Type a) { *p = a; }
+
+            static Type Add(Type a, Type b) { return a + b; }
+            static Type Sub(Type a, Type b) { return a - b; }
+            static Type Mul(Type a, Type b) { return a * b; }
+            static Type Div(Type a, Type b) { return a / b; }
+            static Type Min(Type a, Type b) { return a < b ? a : b; }
+            static Type Max(Type a, Type b) { return a > b ? a : b; }
+
+            static Type FromBool(bool b)
+            {
+                uint32_t bits = b ? ~0U : 0U;
+                float f;
+                std::memcpy(&f, &bits, sizeof(f));
+                return f;
+            }
+            static Type Lt(Type a, Type b) { return FromBool(a < b); }
+            static Type Le(Type a, Type b) { return FromBool(a <= b); }
+
+            static uint32_t Bits(Type a)
+            {
+                uint32_t bits;
+                std::memcpy(&bits, &a, sizeof(bits));
+                return bits;
+            }
+            static Type And(Type a, Type b) { return FromBool(Bits(a) && Bits(b)); }
+            static Type Or(Type a, Type b) { return FromBool(Bits(a) || Bits(b)); }
+            static Type AndNot(Type mask, Type b) { return Bits(mask) ? 0.0f : b; }
+            static Type Select(Type mask, Type a, Type b) { return Bits(mask) ? a : b; }
+            static unsigned MoveMask(Type mask) { return Bits(mask) ? 1U : 0U; }
+        };
+
+#if PIRATEPHYSICS_SIMD_WIDTH >= 4
+        template <>
+        struct Reg<4>
+        {
+            using Type = __m128;
+
+            static Type Set1(float a) { return _mm_set1_ps(a); }
+            static Type Load(const float *p) { return _mm_loadu_ps(p); }
+            static void Store(float *p, Type a) { _mm_storeu_ps(p, a); }
+
+            static Type Add(Type a, Type b) { return _mm_add_ps(a, b); }
+            static Type Sub(Type a, Type b) { return _mm_sub_ps(a, b); }
+            static Type Mul(Type a, Type b) { return _mm_mul_ps(a, b); }
+            static Type Div(Type a, Type b) { return _mm_div_ps(a, b); }
+            static Type Min(Type a, Type b) { return _mm_min_ps(a, b); }
+            static Type Max(Type a, Type b) { return _mm_max_ps(a, b); }
+
+            static Type Lt(Type a, Type b) { return _mm_cmplt_ps(a, b); }
+            static Type Le(Type a, Type b) { return _mm_cmple_ps(a, b); }
+
+            static Type And(Type a, Type b) { return _mm_and_ps(a, b); }
+            static Type Or(Type a, Type b) { return _mm_or_ps(a, b); }
+            static Type AndNot(Type mask, Type b) { return _mm_andnot_ps(mask, b); }
+            static Type Select(Type mask, Type a, Type b) { return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b)); }
+            static unsigned MoveMask(Type mask) { return static_cast<unsigned>(_mm_movemask_ps(mask)); }
+        };
+#endif
+
+#if PIRATEPHYSICS_SIMD_WIDTH >= 8
+        template <>
+        struct Reg<8>
+        {
+            using Type = __m256;
+
+            static Type Set1(float a) { return _mm256_set1_ps(a); }
+            static Type Load(const float *p) { return _mm256_loadu_ps(p); }
+            static void Store(float *p, Type a) { _mm256_storeu_ps(p, a); }
+
+            static Type Add(Type a, Type b) { return _mm256_add_ps(a, b); }
+            static Type Sub(Type a, Type b) { return _mm256_sub_ps(a, b); }
+            static Type Mul(Type a, Type b) { return _mm256_mul_ps(a, b); }
+            static Type Div(Type a, Type b) { return _mm256_div_ps(a, b); }
+            static Type Min(Type a, Type b) { return _mm256_min_ps(a, b); }
+            static Type Max(Type a, Type b) { return _mm256_max_ps(a, b); }
+
+            static Type Lt(Type a, Type b) { return _mm256_cmp_ps(a, b, _CMP_LT_OQ); }
+            static Type Le(Type a, Type b) { return _mm256_cmp_ps(a, b, _CMP_LE_OQ); }
+
+            static Type And(Type a, Type b) { return _mm256_and_ps(a, b); }
+            static Type Or(Type a, Type b) { return _mm256_or_ps(a, b); }
+            static Type AndNot(Type mask, Type b) { return _mm256_andnot_ps(mask, b); }
+            static Type Select(Type mask, Type a, Type b) { return _mm256_blendv_ps(b, a, mask); }
+            static unsigned MoveMask(Type mask) { return static_cast<unsigned>(_mm256_movemask_ps(mask)); }
+        };
+#endif
+
+        /**
+         * N floats processed in the widest registers that divide N
+         */
+        template <int N>
+        class FloatN
+        {
+        public:
+            static const int kWidth = N >= PIRATEPHYSICS_SIMD_WIDTH ? PIRATEPHYSICS_SIMD_WIDTH
+                                                                    : (N >= 4 && PIRATEPHYSICS_SIMD_WIDTH >= 4 ? 4 : 1);
+            static const int kNumRegs = N / kWidth;
+            static_assert(N % kWidth == 0, "packet size must be a multiple of the register width");
+
+            using R = Reg<kWidth>;
+
+            FloatN()
+            {
+            }
+
+            explicit FloatN(float a)
+            {
+                for (int i = 0; i < kNumRegs; ++i)
+                    mV[i] = R::Set1(a);
+            }
+
+            static FloatN Load(const float *p)
+            {
+                FloatN r;
+                for (int i = 0; i < kNumRegs; ++i)
+                    r.mV[i] = R::Load(p + i * kWidth);
+                return r;
+            }
+
+            void Store(float *p) const
+            {
+                for (int i = 0; i < kNumRegs; ++i)
+                    R::Store(p + i * kWidth, mV[i]);
+            }
+
+            static FloatN Mask(const bool *lanes)
+            {
+                float bits[N];
+                const uint32_t allSet = ~0U;
+                for (int i = 0; i < N; ++i)
+                {
+                    if (lanes[i])
+                        std::memcpy(&bits[i], &allSet, sizeof(float));
+                    else
+                        bits[i] = 0.0f;
+                }
+                return Load(bits);
+            }
+
+#define PIRATEPHYSICS_SIMD_BINARY(NAME, FUNC)            \
+    friend FloatN NAME(const FloatN &a, const FloatN &b) \
+    {                                                    \
+        FloatN r;                                        \
+        for (int i = 0; i < kNumRegs; ++i)               \
+            r.mV[i] = R::FUNC(a.mV[i], b.mV[i]);         \
+        return r;                                        \
+    }
+
+            PIRATEPHYSICS_SIMD_BINARY(operator+, Add)
+            PIRATEPHYSICS_SIMD_BINARY(operator-, Sub)
+            PIRATEPHYSICS_SIMD_BINARY(operator*, Mul)
+            PIRATEPHYSICS_SIMD_BINARY(operator/, Div)
+            PIRATEPHYSICS_SIMD_BINARY(operator<, Lt)
+            PIRATEPHYSICS_SIMD_BINARY(operator<=, Le)
+            PIRATEPHYSICS_SIMD_BINARY(operator&, And)
+            PIRATEPHYSICS_SIMD_BINARY(operator|, Or)
+            PIRATEPHYSICS_SIMD_BINARY(Min, Min)
+            PIRATEPHYSICS_SIMD_BINARY(Max, Max)
+            PIRATEPHYSICS_SIMD_BINARY(AndNot, AndNot)
+
+#undef PIRATEPHYSICS_SIMD_BINARY
+
+            friend FloatN Select(const FloatN &mask, const FloatN &a, const FloatN &b)
+            {
+                FloatN r;
+                for (int i = 0; i < kNumRegs; ++i)
+                    r.mV[i] = R::Select(mask.mV[i], a.mV[i], b.mV[i]);
+                return r;
+            }
+
+            // one bit per lane, lane 0 in the lowest bit
+            friend unsigned MoveMask(const FloatN &mask)
+            {
+                unsigned bits = 0;
+                for (int i = 0; i < kNumRegs; ++i)
+                    bits |= R::MoveMask(mask.mV[i]) << (i * kWidth);
+                return bits;
+            }
+
+        private:
+            typename R::Type mV[kNumRegs];
+        };
+
+        /**
+         * three component vector with one lane per element of a packet
+         */
+        template <int N>
+        struct Vec3N
+        {
+            Vec3N()
+            {
+            }
+
+            Vec3N(const FloatN<N> &x, const FloatN<N> &y, const FloatN<N> &z) : mX(x), mY(y), mZ(z)
+            {
+            }
+
+            // broadcast a single vector to every lane
+            Vec3N(float x, float y, float z) : mX(x), mY(y), mZ(z)
+            {
+            }
+
+            friend Vec3N operator-(const Vec3N &a, const Vec3N &b)
+            {
+                return Vec3N(a.mX - b.mX, a.mY - b.mY, a.mZ - b.mZ);
+            }
+
+            friend FloatN<N> Dot(const Vec3N &a, const Vec3N &b)
+            {
+                return a.mX * b.mX + a.mY * b.mY + a.mZ * b.mZ;
+            }
+
+            friend Vec3N Cross(const Vec3N &a, const Vec3N &b)
+            {
+                return Vec3N(a.mY * b.mZ - a.mZ * b.mY,
+                             a.mZ * b.mX - a.mX * b.mZ,
+                             a.mX * b.mY - a.mY * b.mX);
+            }
+
+            FloatN<N> mX;
+            FloatN<N> mY;
+            FloatN<N> mZ;
+        };
+    } // namespace Simd
+} // namespace PiratePhysics
@@ -0,0 +1,313 @@
+#include "SparseVoxelVolume.hpp"
+#include <algorithm>
+
+using namespace std;
+using namespace PiratePhysics;
+
+namespace
+{
+    const uint64_t kFullWord = ~uint64_t(0);
+
+    bool IsEmpty(const SparseVoxelVolume::Brick &brick)
+    {
+        for (uint64_t w : brick.mWords)
+            if (w)
+                return false;
+
+        return true;
+    }
+
+    bool IsFull(const SparseVoxelVolume::Brick &brick)
+    {
+        for (uint64_t w : brick.mWords)
+            if (w != kFullWord)
+                return false;
+
+        return true;
+    }
+} // namespace
+
+SparseVoxelVolume::SparseVoxelVolume(unsigned width, unsigned height, unsigned depth)
+{
+    Resize(width, height, depth);
+}
+
+void SparseVoxelVolume::Resize(unsigned width, unsigned height, unsigned depth)
+{
+    mWidth = width;
+    mHeight = height;
+    mDepth = depth;
+
+    const unsigned nodeWidth = kBrickSize * kNodeSize;
+    mNodesX = (width + nodeWidth - 1) / nodeWidth;
+    mNodesY = (height + nodeWidth - 1) / nodeWidth;
+    mNodesZ = (depth + nodeWidth - 1) / nodeWidth;
+
+    mRoot.assign(size_t(mNodesX) * mNodesY * mNodesZ, kEmptyTile);
+
+    vector<Node>().swap(mNodes);
+    vector<unsigned>().swap(mFreeNodes);
+    vector<Brick>().swap(mBricks);
+    vector<unsigned>().swap(mFreeBricks);
+}
+
+void SparseVoxelVolume::Clear()
+{
+    // the pools keep their capacity for the next fill
+    fill(mRoot.begin(), mRoot.end(), kEmptyTile);
+    mNodes.clear();
+    mFreeNodes.clear();
+    mBricks.clear();
+    mFreeBricks.clear();
+}
+
+bool SparseVoxelVolume::Get(unsigned x, unsigned y, unsigned z) const
+{
+    const unsigned tile = GetTile(x / kBrickSize, y / kBrickSize, z / kBrickSize);
+    if (IsUniform(tile))
+        return tile == kSolidTile;
+
+    return (mBricks[tile].mWords[y % kBrickSize] >> ((x % kBrickSize) * 8 + z % kBrickSize)) & 1;
+}
+
+void SparseVoxelVolume::Set(unsigned x, unsigned y, unsigned z)
+{
+    const unsigned bx = x / kBrickSize;
+    const unsigned by = y / kBrickSize;
+    const unsigned bz = z / kBrickSize;
+
+    if (GetTile(bx, by, bz) == kSolidTile)
+        return;
+
+    GetBrick(bx, by, bz).mWords[y % kBrickSize] |= uint64_t(1) << ((x % kBrickSize) * 8 + z % kBrickSize);
+    ReleaseIfUniform(bx, by, bz);
+}
+
+void SparseVoxelVolume::FillColumn(unsigned x, unsigned y, unsigned zBegin, unsigned zEnd)
+{
+    zEnd = min(zEnd, mDepth);
+    if (zBegin >= zEnd)
+        return;
+
+    const unsigned bx = x / kBrickSize;
+    const unsigned by = y / kBrickSize;
+    const unsigned shift = (x % kBrickSize) * 8;
+
+    // a brick the column passes through is only collapsed once its other 63 columns are filled too
+    for (unsigned bz = zBegin / kBrickSize; bz <= (zEnd - 1) / kBrickSize; ++bz)
+    {
+        if (GetTile(bx, by, bz) == kSolidTile)
+            continue;
+
+        const unsigned lo = max(zBegin, bz * kBrickSize) - bz * kBrickSize;
+        const unsigned hi = min(zEnd, bz * kBrickSize + kBrickSize) - bz * kBrickSize;
+
+        GetBrick(bx, by, bz).mWords[y % kBrickSize] |= (((uint64_t(1) << (hi - lo)) - 1) << lo) << shift;
+        ReleaseIfUniform(bx, by, bz);
+    }
+}
+
+void SparseVoxelVolume::SetBrick(unsigned bx, unsigned by, unsigned bz, const Brick &brick)
+{
+    if (IsEmpty(brick) || IsFull(brick))
+    {
+        const unsigned tile = GetTile(bx, by, bz);
+        if (!IsUniform(tile))
+            mFreeBricks.push_back(tile);
+
+        SetTile(bx, by, bz, IsEmpty(brick) ? kEmptyTile : kSolidTile);
+        return;
+    }
+
+    GetBrick(bx, by, bz) = brick;
+}
+
+size_t SparseVoxelVolume::Count() const
+{
+    size_t count = 0;
+    ForEachTile([&](unsigned, unsigned, unsigned, unsigned tile) {
+        if (tile == kSolidTile)
+        {
+            count += kBrickSize * kBrickSize * kBrickSize;
+            return;
+        }
+
+        for (uint64_t w : mBricks[tile].mWords)
+            count += VoxelVolume::PopCount(w);
+    });
+
+    return count;
+}
+
+SparseVoxelVolume::Brick SparseVoxelVolume::ReadBrick(const VoxelVolume &dense, unsigned x0, unsigned y0, unsigned z0)
+{
+    Brick brick = {};
+
+    const unsigned width = min(kBrickSize, dense.GetWidth() - min(x0, dense.GetWidth()));
+    const unsigned height = min(kBrickSize, dense.GetHeight() - min(y0, dense.GetHeight()));
+    const unsigned depth = min(kBrickSize, dense.GetDepth() - min(z0, dense.GetDepth()));
+
+    if (depth && dense.GetLayout() == VoxelVolume::Layout::Columns)
+    {
+        // z0 is a multiple of 8, so the brick's part of a column is one byte of one word
+        const vector<uint64_t> &words = dense.GetWords();
+        const unsigned wordsPerColumn = (dense.GetDepth() + 63) / 64;
+
+        for (unsigned ly = 0; ly < height; ++ly)
+        {
+            for (unsigned lx = 0; lx < width; ++lx)
+            {
+                const size_t column = (size_t(y0 + ly) * dense.GetWidth() + x0 + lx) * wordsPerColumn;
+                const uint64_t bits = (words[column + (z0 >> 6)] >> (z0 & 63)) & 0xff;
+                brick.mWords[ly] |= bits << (lx * 8);
+            }
+        }
+
+        return brick;
+    }
+
+    for (unsigned ly = 0; ly < height; ++ly)
+        for (unsigned lx = 0; lx < width; ++lx)
+            for (unsigned lz = 0; lz < depth; ++lz)
+                if (dense.Get(x0 + lx, y0 + ly, z0 + lz))
+                    brick.mWords[ly] |= uint64_t(1) << (lx * 8 + lz);
+
+    return brick;
+}
+
+void SparseVoxelVolume::FromDense(const VoxelVolume &dense)
+{
+    Resize(dense.GetWidth(), dense.GetHeight(), dense.GetDepth());
+
+    const unsigned bricksX = (mWidth + kBrickSize - 1) / kBrickSize;
+    const unsigned bricksY = (mHeight + kBrickSize - 1) / kBrickSize;
+    const unsigned bricksZ = (mDepth + kBrickSize - 1) / kBrickSize;
+
+    for (unsigned by = 0; by < bricksY; ++by)
+        for (unsigned bx = 0; bx < bricksX; ++bx)
+            for (unsigned bz = 0; bz < bricksZ; ++bz)
+                SetBrick(bx, by, bz, ReadBrick(dense, bx * kBrickSize, by * kBrickSize, bz * kBrickSize));
+}
+
+void SparseVoxelVolume::ToDense(VoxelVolume &dense) const
+{
+    dense.Resize(mWidth, mHeight, mDepth, dense.GetLayout());
+
+    ForEachTile([&](unsigned bx, unsigned by, unsigned bz, unsigned tile) {
+        const unsigned x0 = bx * kBrickSize;
+        const unsigned y0 = by * kBrickSize;
+        const unsigned z0 = bz * kBrickSize;
+
+        for (unsigned ly = 0; ly < kBrickSize; ++ly)
+        {
+            for (unsigned lx = 0; lx < kBrickSize; ++lx)
+            {
+                // a column's byte is written as runs of set voxels
+                unsigned bits = tile == kSolidTile ? 0xff : unsigned(mBricks[tile].mWords[ly] >> (lx * 8)) & 0xff;
+                while (bits)
+                {
+                    const unsigned lo = VoxelVolume::CountTrailingZeros(bits);
+                    const unsigned hi = lo + VoxelVolume::CountTrailingZeros(~(bits >> lo));
+                    dense.FillColumn(x0 + lx, y0 + ly, z0 + lo, z0 + hi);
+                    bits &= ~(((1U << (hi - lo)) - 1) << lo);
+                }
+            }
+        }
+    });
+}
+
+size_t SparseVoxelVolume::GetNumSolidTiles() const
+{
+    size_t count = 0;
+    ForEachTile([&](unsigned, unsigned, unsigned, unsigned tile) {
+        count += tile == kSolidTile;
+    });
+
+    return count;
+}
+
+size_t SparseVoxelVolume::GetMemoryUsage() const
+{
+    return mRoot.capacity() * sizeof(unsigned) + mNodes.capacity() * sizeof(Node) + mFreeNodes.capacity() * sizeof(unsigned) +
+           mBricks.capacity() * sizeof(Brick) + mFreeBricks.capacity() * sizeof(unsigned);
+}
+
+void SparseVoxelVolume::SetTile(unsigned bx, unsigned by, unsigned bz, unsigned tile)
+{
+    unsigned &root = mRoot[GetRootIndex(bx, by, bz)];
+    if (IsUniform(root) && root == tile)
+        return;
+
+    if (IsUniform(root))
+    {
+        const unsigned value = root;
+        if (mFreeNodes.empty())
+        {
+            root = static_cast<unsigned>(mNodes.size());
+            mNodes.emplace_back();
+        }
+        else
+        {
+            root = mFreeNodes.back();
+            mFreeNodes.pop_back();
+        }
+
+        Node &node = mNodes[root];
+        fill(begin(node.mTiles), end(node.mTiles), value);
+        node.mNumEmpty = value == kEmptyTile ? kTilesPerNode : 0;
+        node.mNumSolid = value == kSolidTile ? kTilesPerNode : 0;
+    }
+
+    Node &node = mNodes[root];
+    unsigned &entry = node.mTiles[GetTileIndex(bx, by, bz)];
+
+    node.mNumEmpty += (tile == kEmptyTile) - (entry == kEmptyTile);
+    node.mNumSolid += (tile == kSolidTile) - (entry == kSolidTile);
+    entry = tile;
+
+    // a node whose bricks are all empty or all solid goes back to being one root entry
+    if (node.mNumEmpty == kTilesPerNode || node.mNumSolid == kTilesPerNode)
+    {
+        mFreeNodes.push_back(root);
+        root = node.mNumEmpty == kTilesPerNode ? kEmptyTile : kSolidTile;
+    }
+}
+
+SparseVoxelVolume::Brick &SparseVoxelVolume::GetBrick(unsigned bx, unsigned by, unsigned bz)
+{
+    const unsigned tile = GetTile(bx, by, bz);
+    if (!IsUniform(tile))
+        return mBricks[tile];
+
+    unsigned slot;
+    if (mFreeBricks.empty())
+    {
+        slot = static_cast<unsigned>(mBricks.size());
+        mBricks.emplace_back();
+    }
+    else
+    {
+        slot = mFreeBricks.back();
+        mFreeBricks.pop_back();
+    }
+
+    SetTile(bx, by, bz, slot);
+
+    Brick &brick = mBricks[slot];
+    fill(begin(brick.mWords), end(brick.mWords), tile == kSolidTile ? kFullWord : 0);
+    return brick;
+}
+
+void SparseVoxelVolume::ReleaseIfUniform(unsigned bx, unsigned by, unsigned bz)
+{
+    const unsigned tile = GetTile(bx, by, bz);
+    if (IsUniform(tile))
+        return;
+
+    const Brick &brick = mBricks[tile];
+    if (!IsEmpty(brick) && !IsFull(brick))
+        return;
+
+    mFreeBricks.push_back(tile);
+    SetTile(bx, by, bz, IsEmpty(brick) ? kEmptyTile : kSolidTile);
+}
@@ -0,0 +1,205 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include "VoxelVolume.hpp"
+
+namespace PiratePhysics
+{
+    /**
+     * Solid voxels of a grid too large to store densely, a shallow tree whose root has one entry
+     * per 64x64x64 node and every node one per 8x8x8 brick, an entry is empty, solid throughout
+     * or the index of a node or bit brick in a pool, so only the parts the surface passes
+     * through take memory
+     */
+    class SparseVoxelVolume
+    {
+    public:
+        static constexpr unsigned kBrickSize = 8;
+        static constexpr unsigned kNodeSize = 8;
+
+        /**
+         * 512 voxels as one word per y row of the brick, bit x * 8 + z of it,
+         * so the eight voxels of a z column are one byte
+         */
+        struct Brick
+        {
+            uint64_t mWords[kBrickSize];
+        };
+
+        SparseVoxelVolume() = default;
+        SparseVoxelVolume(unsigned width, unsigned height, unsigned depth);
+
+        // changes the dimensions, every voxel is cleared and the pools released
+        void Resize(unsigned width, unsigned height, unsigned depth);
+        void Clear();
+
+        bool Get(unsigned x, unsigned y, unsigned z) const;
+        void Set(unsigned x, unsigned y, unsigned z);
+
+        // sets the voxels from zBegin up to but not including zEnd in the column at x, y
+        void FillColumn(unsigned x, unsigned y, unsigned zBegin, unsigned zEnd);
+
+        /**
+         * replaces a whole brick, bx, by and bz count bricks, an empty or completely solid
+         * brick only takes an entry of its node and returns its pool slot if it had one
+         */
+        void SetBrick(unsigned bx, unsigned by, unsigned bz, const Brick &brick);
+
+        // the brick of a dense volume starting at x0, y0, z0, multiples of kBrickSize, voxels past its edges are clear
+        static Brick ReadBrick(const VoxelVolume &dense, unsigned x0, unsigned y0, unsigned z0);
+
+        // number of set voxels
+        size_t Count() const;
+
+        /**
+         * calls visit(x, y, z) for every set voxel, brick by brick
+         */
+        template <typename Visit>
+        void ForEachSet(Visit &&visit) const
+        {
+            ForEachTile([&](unsigned bx, unsigned by, unsigned bz, unsigned tile) {
+                const unsigned x0 = bx * kBrickSize;
+                const unsigned y0 = by * kBrickSize;
+                const unsigned z0 = bz * kBrickSize;
+
+                // only a brick that lies entirely inside the grid can be solid
+                if (tile == kSolidTile)
+                {
+                    for (unsigned y = y0; y < y0 + kBrickSize; ++y)
+                        for (unsigned x = x0; x < x0 + kBrickSize; ++x)
+                            for (unsigned z = z0; z < z0 + kBrickSize; ++z)
+                                visit(x, y, z);
+                    return;
+                }
+
+                const Brick &brick = mBricks[tile];
+                for (unsigned ly = 0; ly < kBrickSize; ++ly)
+                {
+                    for (uint64_t w = brick.mWords[ly]; w; w &= w - 1)
+                    {
+                        const unsigned bit = VoxelVolume::CountTrailingZeros(w);
+                        visit(x0 + (bit >> 3), y0 + ly, z0 + (bit & 7));
+                    }
+                }
+            });
+        }
+
+        // calls visit(bx, by, bz) for every brick that is not empty, bx, by and bz count bricks
+        template <typename Visit>
+        void ForEachBrick(Visit &&visit) const
+        {
+            ForEachTile([&](unsigned bx, unsigned by, unsigned bz, unsigned) { visit(bx, by, bz); });
+        }
+
+        // copies of a dense volume of the same dimensions, in either direction
+        void FromDense(const VoxelVolume &dense);
+        void ToDense(VoxelVolume &dense) const;
+
+        unsigned GetWidth() const { return mWidth; }
+        unsigned GetHeight() const { return mHeight; }
+        unsigned GetDepth() const { return mDepth; }
+
+        // nodes and bricks in use, and bricks that are solid throughout
+        size_t GetNumNodes() const { return mNodes.size() - mFreeNodes.size(); }
+        size_t GetNumBricks() const { return mBricks.size() - mFreeBricks.size(); }
+        size_t GetNumSolidTiles() const;
+
+        size_t GetMemoryUsage() const;
+
+    private:
+        static constexpr unsigned kEmptyTile = ~0U;
+        static constexpr unsigned kSolidTile = ~0U - 1;
+        static constexpr unsigned kTilesPerNode = kNodeSize * kNodeSize * kNodeSize;
+
+        // the bricks of a 64x64x64 region, ordered z then x then y, and how many of them are uniform
+        struct Node
+        {
+            unsigned mTiles[kTilesPerNode];
+            unsigned mNumEmpty;
+            unsigned mNumSolid;
+        };
+
+        static bool IsUniform(unsigned tile) { return tile == kEmptyTile || tile == kSolidTile; }
+
+        size_t GetRootIndex(unsigned bx, unsigned by, unsigned bz) const
+        {
+            return (size_t(by / kNodeSize) * mNodesX + bx / kNodeSize) * mNodesZ + bz / kNodeSize;
+        }
+
+        static unsigned GetTileIndex(unsigned bx, unsigned by, unsigned bz)
+        {
+            return ((by % kNodeSize) * kNodeSize + bx % kNodeSize) * kNodeSize + bz % kNodeSize;
+        }
+
+        // kEmptyTile, kSolidTile or the pool slot of the brick at bx, by, bz
+        unsigned GetTile(unsigned bx, unsigned by, unsigned bz) const
+        {
+            const unsigned root = mRoot[GetRootIndex(bx, by, bz)];
+            return IsUniform(root) ? root : mNodes[root].mTiles[GetTileIndex(bx, by, bz)];
+        }
+
+        // splits a uniform node before the write and collapses it again once all its bricks agree
+        void SetTile(unsigned bx, unsigned by, unsigned bz, unsigned tile);
+
+        // pool slot of the brick at bx, by, bz, allocated and filled in from its tile if it has none
+        Brick &GetBrick(unsigned bx, unsigned by, unsigned bz);
+        void ReleaseIfUniform(unsigned bx, unsigned by, unsigned bz);
+
+        /**
+         * calls visit(bx, by, bz, tile) for every brick that is not empty,
+         * the bricks of a solid node one by one
+         */
+        template <typename Visit>
+        void ForEachTile(Visit &&visit) const
+        {
+            for (unsigned ny = 0; ny < mNodesY; ++ny)
+            {
+                for (unsigned nx = 0; nx < mNodesX; ++nx)
+                {
+                    for (unsigned nz = 0; nz < mNodesZ; ++nz)
+                    {
+                        const unsigned root = mRoot[(size_t(ny) * mNodesX + nx) * mNodesZ + nz];
+                        if (root == kEmptyTile)
+                            continue;
+
+                        const Node *node = root == kSolidTile ? nullptr : &mNodes[root];
+
+                        unsigned i = 0;
+                        for (unsigned by = ny * kNodeSize; by < (ny + 1) * kNodeSize; ++by)
+                        {
+                            for (unsigned bx = nx * kNodeSize; bx < (nx + 1) * kNodeSize; ++bx)
+                            {
+                                for (unsigned bz = nz * kNodeSize; bz < (nz + 1) * kNodeSize; ++bz, ++i)
+                                {
+                                    const unsigned tile = node ? node->mTiles[i] : kSolidTile;
+                                    if (tile != kEmptyTile)
+                                        visit(bx, by, bz, tile);
+                                }
+                            }
+                        }
+                    }
+                }
+            }
+        }
+
+        unsigned mWidth = 0;
+        unsigned mHeight = 0;
+        unsigned mDepth = 0;
+
+        unsigned mNodesX = 0;
+        unsigned mNodesY = 0;
+        unsigned mNodesZ = 0;
+
+        // kEmptyTile, kSolidTile or the pool slot of every node, ordered z then x then y
+        std::vector<unsigned> mRoot;
+
+        // pools of nodes and bit bricks, slots of ones that became uniform are reused
+        std::vector<Node> mNodes;
+        std::vector<unsigned> mFreeNodes;
+
+        std::vector<Brick> mBricks;
+        std::vector<unsigned> mFreeBricks;
+    };
+} // namespace PiratePhysics
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <Eigen/Eigen>
+
+namespace PiratePhysics
+{
+    /**
+     * Vertex positions read in place from someone else's buffer, a base pointer to the
+     * first position and the byte stride between consecutive ones, so packed
+     * Eigen::Vector3f or std::array<float, 3> arrays and interleaved render vertices
+     * can all be handed to the physics without a copy
+     */
+    class VertexView
+    {
+    public:
+        VertexView() = default;
+
+        VertexView(const Eigen::Vector3f *positions) : mBase(reinterpret_cast<const uint8_t *>(positions)), mStride(sizeof(Eigen::Vector3f))
+        {
+        }
+
+        VertexView(const std::array<float, 3> *positions) : mBase(reinterpret_cast<const uint8_t *>(positions)), mStride(sizeof(std::array<float, 3>))
+        {
+        }
+
+        // x, y and z of a vertex are consecutive floats, stride is in bytes
+        VertexView(const float *positions, size_t stride) : mBase(reinterpret_cast<const uint8_t *>(positions)), mStride(stride)
+        {
+        }
+
+        /**
+         * position member of an array of vertex structs, for example
+         * VertexView(mesh.data.data(), &MeshBase::Vertex::position)
+         */
+        template <typename Vertex>
+        VertexView(const Vertex *vertices, const Eigen::Vector3f Vertex::*position)
+            : mBase(vertices ? reinterpret_cast<const uint8_t *>(&(vertices->*position)) : nullptr), mStride(sizeof(Vertex))
+        {
+        }
+
+        // the three floats of a position have no alignment requirement beyond a float's
+        const Eigen::Vector3f &operator[](size_t i) const
+        {
+            return *reinterpret_cast<const Eigen::Vector3f *>(mBase + i * mStride);
+        }
+
+        const uint8_t *GetBase() const { return mBase; }
+        size_t GetStride() const { return mStride; }
+
+    private:
+        const uint8_t *mBase = nullptr;
+        size_t mStride = sizeof(Eigen::Vector3f);
+    };
+
+    static_assert(sizeof(Eigen::Vector3f) == 3 * sizeof(float), "a position is read as three packed floats");
+} // namespace PiratePhysics
@@ -0,0 +1,101 @@
+#include "VoxelVolume.hpp"
+#include <algorithm>
+
+using namespace std;
+using namespace PiratePhysics;
+
+VoxelVolume::VoxelVolume(unsigned width, unsigned height, unsigned depth, Layout layout)
+{
+    Resize(width, height, depth, layout);
+}
+
+void VoxelVolume::Resize(unsigned width, unsigned height, unsigned depth, Layout layout)
+{
+    mWidth = width;
+    mHeight = height;
+    mDepth = depth;
+    mLayout = layout;
+
+    mWordsPerColumn = (depth + 63) / 64;
+    mBricksX = (width + 3) / 4;
+    mBricksZ = (depth + 3) / 4;
+
+    // padding voxels past the last row, column or slice are never set
+    if (layout == Layout::Columns)
+        mWords.assign(size_t(width) * height * mWordsPerColumn, 0);
+    else
+        mWords.assign(size_t(mBricksX) * ((height + 3) / 4) * mBricksZ, 0);
+}
+
+void VoxelVolume::Clear()
+{
+    fill(mWords.begin(), mWords.end(), 0);
+}
+
+void VoxelVolume::FillColumn(unsigned x, unsigned y, unsigned zBegin, unsigned zEnd)
+{
+    zEnd = min(zEnd, mDepth);
+    if (zBegin >= zEnd)
+        return;
+
+    if (mLayout == Layout::Columns)
+    {
+        uint64_t *column = &mWords[(size_t(y) * mWidth + x) * mWordsPerColumn];
+
+        const unsigned first = zBegin >> 6;
+        const unsigned last = (zEnd - 1) >> 6;
+
+        // bits from zBegin on in the first word, below zEnd in the last one, all of them in between
+        const uint64_t firstMask = ~uint64_t(0) << (zBegin & 63);
+        const uint64_t lastMask = ~uint64_t(0) >> (63 - ((zEnd - 1) & 63));
+
+        if (first == last)
+        {
+            column[first] |= firstMask & lastMask;
+            return;
+        }
+
+        column[first] |= firstMask;
+        for (unsigned i = first + 1; i < last; ++i)
+            column[i] = ~uint64_t(0);
+        column[last] |= lastMask;
+        return;
+    }
+
+    // the column's four bits in every brick it crosses
+    uint64_t *bricks = &mWords[(size_t(y >> 2) * mBricksX + (x >> 2)) * mBricksZ];
+    const unsigned shift = 4 * ((x & 3) + 4 * (y & 3));
+
+    for (unsigned b = zBegin >> 2; b <= (zEnd - 1) >> 2; ++b)
+    {
+        const unsigned lo = max(zBegin, b * 4) - b * 4;
+        const unsigned hi = min(zEnd, b * 4 + 4) - b * 4;
+        bricks[b] |= ((uint64_t(1) << (hi - lo)) - 1) << (shift + lo);
+    }
+}
+
+size_t VoxelVolume::Count() const
+{
+    size_t count = 0;
+    for (uint64_t w : mWords)
+        count += PopCount(w);
+
+    return count;
+}
+
+void VoxelVolume::GetVoxel(size_t word, unsigned bit, unsigned &x, unsigned &y, unsigned &z) const
+{
+    if (mLayout == Layout::Columns)
+    {
+        const size_t column = word / mWordsPerColumn;
+        x = static_cast<unsigned>(column % mWidth);
+        y = static_cast<unsigned>(column / mWidth);
+        z = static_cast<unsigned>(word % mWordsPerColumn) * 64 + bit;
+        return;
+    }
+
+    const size_t brickColumn = word / mBricksZ;
+    x = static_cast<unsigned>(brickColumn % mBricksX) * 4 + ((bit >> 2) & 3);
+    y = static_cast<unsigned>(brickColumn / mBricksX) * 4 + (bit >> 4);
+    z = static_cast<unsigned>(word % mBricksZ) * 4 + (bit & 3);
+}
@@ -0,0 +1,145 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+namespace PiratePhysics
+{
+    /**
+     * Solid voxels as one bit each, 32 times smaller than an unsigned per voxel, the inside
+     * spans Voxelize finds are written a 64 bit word at a time and set voxels are visited
+     * by skipping empty words and counting trailing zeros
+     */
+    class VoxelVolume
+    {
+    public:
+        enum class Layout
+        {
+            Columns, // every z column packed into whole 64 bit words of its own, columns ordered x then y
+            Bricks   // 4x4x4 bricks of one 64 bit word each, ordered z then x then y, neighbours in
+                     // all three axes are a few words apart
+        };
+
+        VoxelVolume() = default;
+        VoxelVolume(unsigned width, unsigned height, unsigned depth, Layout layout = Layout::Columns);
+
+        // changes the dimensions or layout, every voxel is cleared
+        void Resize(unsigned width, unsigned height, unsigned depth, Layout layout = Layout::Columns);
+        void Clear();
+
+        bool Get(unsigned x, unsigned y, unsigned z) const
+        {
+            size_t word;
+            unsigned bit;
+            GetBit(x, y, z, word, bit);
+            return (mWords[word] >> bit) & 1;
+        }
+
+        void Set(unsigned x, unsigned y, unsigned z)
+        {
+            size_t word;
+            unsigned bit;
+            GetBit(x, y, z, word, bit);
+            mWords[word] |= uint64_t(1) << bit;
+        }
+
+        /**
+         * sets the voxels from zBegin up to but not including zEnd in the column at x, y, whole
+         * words at once, two columns never share a word in the column layout and in the brick
+         * layout only the columns of one 4x4 brick column do
+         */
+        void FillColumn(unsigned x, unsigned y, unsigned zBegin, unsigned zEnd);
+
+        // number of set voxels
+        size_t Count() const;
+
+        /**
+         * calls visit(x, y, z) for every set voxel, in storage order
+         */
+        template <typename Visit>
+        void ForEachSet(Visit &&visit) const
+        {
+            for (size_t i = 0; i < mWords.size(); ++i)
+            {
+                uint64_t w = mWords[i];
+                if (!w)
+                    continue;
+
+                // the first voxel of the word, the others are offsets from it
+                unsigned x, y, z;
+                GetVoxel(i, 0, x, y, z);
+
+                for (; w; w &= w - 1)
+                {
+                    const unsigned bit = CountTrailingZeros(w);
+                    if (mLayout == Layout::Columns)
+                        visit(x, y, z + bit);
+                    else
+                        visit(x + ((bit >> 2) & 3), y + (bit >> 4), z + (bit & 3));
+                }
+            }
+        }
+
+        unsigned GetWidth() const { return mWidth; }
+        unsigned GetHeight() const { return mHeight; }
+        unsigned GetDepth() const { return mDepth; }
+        Layout GetLayout() const { return mLayout; }
+
+        const std::vector<uint64_t> &GetWords() const { return mWords; }
+        size_t GetMemoryUsage() const { return mWords.capacity() * sizeof(uint64_t); }
+
+        static unsigned CountTrailingZeros(uint64_t w)
+        {
+#if defined(_MSC_VER)
+            unsigned long i;
+            _BitScanForward64(&i, w);
+            return static_cast<unsigned>(i);
+#else
+            return static_cast<unsigned>(__builtin_ctzll(w));
+#endif
+        }
+
+        static unsigned PopCount(uint64_t w)
+        {
+#if defined(_MSC_VER)
+            return static_cast<unsigned>(__popcnt64(w));
+#else
+            return static_cast<unsigned>(__builtin_popcountll(w));
+#endif
+        }
+
+    private:
+        void GetBit(unsigned x, unsigned y, unsigned z, size_t &word, unsigned &bit) const
+        {
+            if (mLayout == Layout::Columns)
+            {
+                word = (size_t(y) * mWidth + x) * mWordsPerColumn + (z >> 6);
+                bit = z & 63;
+            }
+            else
+            {
+                word = (size_t(y >> 2) * mBricksX + (x >> 2)) * mBricksZ + (z >> 2);
+                bit = (z & 3) + 4 * ((x & 3) + 4 * (y & 3));
+            }
+        }
+
+        void GetVoxel(size_t word, unsigned bit, unsigned &x, unsigned &y, unsigned &z) const;
+
+        unsigned mWidth = 0;
+        unsigned mHeight = 0;
+        unsigned mDepth = 0;
+        Layout mLayout = Layout::Columns;
+
+        // words of one column in the column layout, bricks per row and column in the brick layout
+        unsigned mWordsPerColumn = 0;
+        unsigned mBricksX = 0;
+        unsigned mBricksZ = 0;
+
+        std::vector<uint64_t> mWords;
+    };
+} // namespace PiratePhysics
@@ -1,77 +1,329 @@
 #include "Voxelize.hpp"
 #include "AABBTree.hpp"
+#include "Simd.hpp"
+#include <algorithm>
+#include <atomic>
+#include <future>
+#include <limits>
+#include <mutex>
+#include <thread>
 
 using namespace std;
 using namespace Eigen;
 using namespace PiratePhysics;
 
-namespace PiratePhysics
+namespace
 {
-	void Voxelize(const Eigen::Vector3f *vertices, int numVertices,
-				  const unsigned *indices, unsigned numFaces, unsigned width, unsigned height,
-				  unsigned depth, vector<unsigned> &volume, Vector3f minExtents, Vector3f maxExtents)
-	{
-		volume.resize(width * height * depth);
+	// neighbouring columns along y are traced together, one packet lane per column
+	const int kPacketSize = PIRATEPHYSICS_SIMD_WIDTH > 4 ? PIRATEPHYSICS_SIMD_WIDTH : 4;
 
-		// build an aabb tree of the mesh
-		AABBTree tree(vertices, numVertices, (const uint32_t *)indices, numFaces);
+	// columns are handed out to the threads in tiles of this many along x, and this many packets along y
+	const unsigned kTileWidth = 8;
+	const unsigned kTilePackets = 4;
+
+	// not worth a thread for fewer tiles than this
+	const unsigned kMinTilesPerThread = 4;
+
+	static_assert(kTileWidth % 4 == 0 && kPacketSize % 4 == 0, "tiles must cover whole bricks of a VoxelVolume");
+	static_assert(kTileWidth % SparseVoxelVolume::kBrickSize == 0 && (kTilePackets * kPacketSize) % SparseVoxelVolume::kBrickSize == 0,
+				  "tiles must cover whole bricks of a SparseVoxelVolume");
+
+	/**
+	 * traces the columns of the grid, every thread takes a writer from makeWriter() and calls
+	 * writer.FillSpan(x, y, z, zend) for the cells of every inside span and writer.EndTile(x0, y0, x1, y1)
+	 * once the columns from x0, y0 up to x1, y1 are done, only the rows from rowBegin up to rowEnd are traced
+	 */
+	template <typename MakeWriter>
+	void TraceTiles(const AABBTree &tree, unsigned width, unsigned height, unsigned depth,
+					const Vector3f &minExtents, const Vector3f &maxExtents, unsigned numThreads, const MakeWriter &makeWriter,
+					uint32_t rowBegin = 0, uint32_t rowEnd = ~0U)
+	{
+		rowEnd = min(rowEnd, uint32_t(height));
+		if (rowBegin >= rowEnd)
+			return;
 
 		// parity count method, single pass
 		const Vector3f extents(maxExtents - minExtents);
 		const Vector3f delta(extents[0] / width, extents[1] / height, extents[2] / depth);
 		const Vector3f offset(0.5f * delta[0], 0.5f * delta[1], 0.5f * delta[2]);
 
-		// this is the bias we apply to step 'off' a triangle we hit, not very robust
-		const float eps = 0.00001f * extents[0];
+		const unsigned tileHeight = kTilePackets * kPacketSize;
+		const unsigned tilesX = (width + kTileWidth - 1) / kTileWidth;
+		const unsigned tilesY = (rowEnd - rowBegin + tileHeight - 1) / tileHeight;
+		const unsigned numTiles = tilesX * tilesY;
 
-		for (uint32_t x = 0; x < width; ++x)
-		{
-			for (uint32_t y = 0; y < height; ++y)
+		if (numThreads == 0)
+			numThreads = max(thread::hardware_concurrency(), 1U);
+
+		numThreads = max(min(numThreads, numTiles / kMinTilesPerThread), 1U);
+
+		// every column writes its own voxels, so tiles can be traced in any order by any thread
+		atomic<unsigned> nextTile(0);
+
+		auto worker = [&]() {
+			auto writer = makeWriter();
+
+			RayPacket<kPacketSize> rays;
+			unsigned numHits[kPacketSize];
+			unsigned maxHits = 64;
+			vector<RayHit> hits(kPacketSize * maxHits);
+
+			for (int l = 0; l < kPacketSize; ++l)
 			{
-				bool inside = false;
+				rays.mStart[2][l] = minExtents[2];
+				rays.mDir[0][l] = 0.0f;
+				rays.mDir[1][l] = 0.0f;
+				rays.mDir[2][l] = 1.0f;
+			}
 
-				Vector3f rayDir = Vector3f(0.0f, 0.0f, 1.0f);
-				Vector3f rayStart = minExtents + Vector3f(x * delta[0] + offset[0], y * delta[1] + offset[1], 0.0f);
+			for (unsigned tile = nextTile++; tile < numTiles; tile = nextTile++)
+			{
+				const uint32_t x0 = (tile % tilesX) * kTileWidth;
+				const uint32_t y0 = rowBegin + (tile / tilesX) * tileHeight;
+				const uint32_t x1 = min(x0 + kTileWidth, width);
+				const uint32_t y1 = min(y0 + tileHeight, rowEnd);
 
-				uint32_t lastTri = uint32_t(-1);
-				for (;;)
+				for (uint32_t x = x0; x < x1; ++x)
 				{
-					// calculate ray start
-					float t, u, v, w, s;
-					uint32_t tri;
-
-					if (tree.TraceRay(rayStart, rayDir, t, u, v, w, s, tri))
+					for (uint32_t yp = y0; yp < y1; yp += kPacketSize)
 					{
-						// calculate cell in which intersection occurred
-						const float zpos = rayStart[2] + t * rayDir[2];
-						const float zhit = (zpos - minExtents[2]) / delta[2];
+						for (int l = 0; l < kPacketSize; ++l)
+						{
+							rays.mStart[0][l] = minExtents[0] + x * delta[0] + offset[0];
+							rays.mStart[1][l] = minExtents[1] + (yp + l) * delta[1] + offset[1];
+							rays.mActive[l] = yp + l < y1;
+						}
 
-						uint32_t z = uint32_t(floorf((rayStart[2] - minExtents[2]) / delta[2] + 0.5f));
-						uint32_t zend = std::min(uint32_t(floorf(zhit + 0.5f)), depth - 1);
+						// every crossing of a column comes out of one traversal sorted front to back, the rays
+						// are not cut off at the top of the grid so the exits of spans that leave it are kept
+						tree.TraceRaysAll(rays, numeric_limits<float>::max(), hits.data(), maxHits, numHits);
 
-						if (inside)
+						const unsigned mostHits = *max_element(numHits, numHits + kPacketSize);
+						if (mostHits > maxHits)
 						{
-							// march along column setting bits
-							for (uint32_t k = z; k < zend; ++k)
+							maxHits = mostHits;
+							hits.resize(kPacketSize * maxHits);
+							tree.TraceRaysAll(rays, numeric_limits<float>::max(), hits.data(), maxHits, numHits);
+						}
+
+						for (int l = 0; l < kPacketSize; ++l)
+						{
+							const uint32_t y = yp + l;
+							const RayHit *column = &hits[l * maxHits];
+
+							// parity count, every entry is followed by its exit
+							for (unsigned i = 1; i < numHits[l]; i += 2)
 							{
-								//volume[k * width * height + y * width + x] = uint32_t(-1);
-								volume[k * width * height + y * width + x] = uint32_t(1);
+								// calculate cells in which the intersections occurred
+								const uint32_t z = std::min(uint32_t(floorf(column[i - 1].mT / delta[2] + 0.5f)), depth - 1);
+								const uint32_t zend = std::min(uint32_t(floorf(column[i].mT / delta[2] + 0.5f)), depth - 1);
+
+								writer.FillSpan(x, y, z, zend);
 							}
 						}
+					}
+				}
+
+				writer.EndTile(x0, y0, x1, y1);
+			}
+		};
+
+		vector<future<void>> tasks;
+		for (unsigned t = 1; t < numThreads; ++t)
+			tasks.push_back(async(launch::async, worker));
+
+		worker();
+
+		for (auto &task : tasks)
+			task.get();
+	}
+
+	// writes every span straight into the volume through fillSpan(x, y, z, zend)
+	template <typename Fill>
+	struct SpanWriter
+	{
+		const Fill &mFillSpan;
+
+		void FillSpan(uint32_t x, uint32_t y, uint32_t z, uint32_t zend) const { mFillSpan(x, y, z, zend); }
+		void EndTile(uint32_t, uint32_t, uint32_t, uint32_t) const {}
+	};
+
+	template <typename FillSpan>
+	void TraceColumns(const AABBTree &tree, unsigned width, unsigned height, unsigned depth,
+					  const Vector3f &minExtents, const Vector3f &maxExtents, unsigned numThreads, const FillSpan &fillSpan,
+					  uint32_t rowBegin = 0, uint32_t rowEnd = ~0U)
+	{
+		TraceTiles(tree, width, height, depth, minExtents, maxExtents, numThreads,
+				   [&]() { return SpanWriter<FillSpan>{fillSpan}; }, rowBegin, rowEnd);
+	}
+
+	/**
+	 * fills a dense tile of its own and moves it into the sparse volume brick by brick once the tile is
+	 * done, so only bricks the surface crosses are ever allocated and the pool is touched under the lock
+	 */
+	class BrickWriter
+	{
+	public:
+		BrickWriter(SparseVoxelVolume &volume, mutex &lock, unsigned tileWidth, unsigned tileHeight)
+			: mVolume(volume), mLock(lock), mTile(tileWidth, tileHeight, volume.GetDepth())
+		{
+		}
+
+		void FillSpan(uint32_t x, uint32_t y, uint32_t z, uint32_t zend)
+		{
+			mTile.FillColumn(x % mTile.GetWidth(), y % mTile.GetHeight(), z, zend);
+		}
 
-						inside = !inside;
+		void EndTile(uint32_t x0, uint32_t y0, uint32_t x1, uint32_t y1)
+		{
+			const unsigned brickSize = SparseVoxelVolume::kBrickSize;
 
-						// we hit the tri we started from
-						if (tri == lastTri)
-							printf("Error self-intersect\n");
-						lastTri = tri;
+			mBricks.clear();
+			for (uint32_t y = 0; y < y1 - y0; y += brickSize)
+			{
+				for (uint32_t x = 0; x < x1 - x0; x += brickSize)
+				{
+					for (uint32_t z = 0; z < mTile.GetDepth(); z += brickSize)
+					{
+						const SparseVoxelVolume::Brick brick = SparseVoxelVolume::ReadBrick(mTile, x, y, z);
 
-						rayStart += rayDir * (t + eps);
+						// the volume was cleared, empty bricks are already in place
+						if (any_of(begin(brick.mWords), end(brick.mWords), [](uint64_t w) { return w != 0; }))
+							mBricks.push_back({(x0 + x) / brickSize, (y0 + y) / brickSize, z / brickSize, brick});
 					}
-					else
-						break;
 				}
 			}
+
+			if (!mBricks.empty())
+			{
+				lock_guard<mutex> guard(mLock);
+				for (const TileBrick &b : mBricks)
+					mVolume.SetBrick(b.mX, b.mY, b.mZ, b.mBrick);
+			}
+
+			mTile.Clear();
+		}
+
+	private:
+		struct TileBrick
+		{
+			uint32_t mX, mY, mZ;
+			SparseVoxelVolume::Brick mBrick;
+		};
+
+		SparseVoxelVolume &mVolume;
+		mutex &mLock;
+
+		VoxelVolume mTile;
+		vector<TileBrick> mBricks;
+	};
+} // namespace
+
+namespace PiratePhysics
+{
+	void Voxelize(VertexView vertices, int numVertices,
+				  const unsigned *indices, unsigned numFaces, unsigned width, unsigned height,
+				  unsigned depth, vector<unsigned> &volume, Vector3f minExtents, Vector3f maxExtents,
+				  unsigned numThreads)
+	{
+		// build an aabb tree of the mesh
+		AABBTree tree(vertices, numVertices, (const uint32_t *)indices, numFaces, AABBTree::BuildMode::SAH, numThreads);
+
+		Voxelize(tree, width, height, depth, volume, minExtents, maxExtents, numThreads);
+	}
+
+	void Voxelize(const AABBTree &tree, unsigned width, unsigned height, unsigned depth,
+				  vector<unsigned> &volume, Vector3f minExtents, Vector3f maxExtents, unsigned numThreads)
+	{
+		// a volume reused from an earlier call must not keep its old voxels
+		volume.assign(width * height * depth, 0);
+
+		TraceColumns(tree, width, height, depth, minExtents, maxExtents, numThreads,
+					 [&](uint32_t x, uint32_t y, uint32_t z, uint32_t zend) {
+						 // march along column setting bits
+						 for (uint32_t k = z; k < zend; ++k)
+						 {
+							 volume[k * width * height + y * width + x] = uint32_t(1);
+						 }
+					 });
+	}
+
+	void Voxelize(VertexView vertices, int numVertices, const unsigned *indices, unsigned numFaces,
+				  VoxelVolume &volume, Vector3f minExtents, Vector3f maxExtents, unsigned numThreads)
+	{
+		AABBTree tree(vertices, numVertices, (const uint32_t *)indices, numFaces, AABBTree::BuildMode::SAH, numThreads);
+
+		Voxelize(tree, volume, minExtents, maxExtents, numThreads);
+	}
+
+	void Voxelize(const AABBTree &tree, VoxelVolume &volume, Vector3f minExtents, Vector3f maxExtents,
+				  unsigned numThreads)
+	{
+		volume.Clear();
+
+		// tiles are whole 4x4 brick columns, so no two threads ever write the same word
+		TraceColumns(tree, volume.GetWidth(), volume.GetHeight(), volume.GetDepth(), minExtents, maxExtents, numThreads,
+					 [&](uint32_t x, uint32_t y, uint32_t z, uint32_t zend) {
+						 volume.FillColumn(x, y, z, zend);
+					 });
+	}
+
+	void Voxelize(VertexView vertices, int numVertices, const unsigned *indices, unsigned numFaces,
+				  SparseVoxelVolume &volume, Vector3f minExtents, Vector3f maxExtents, unsigned numThreads)
+	{
+		AABBTree tree(vertices, numVertices, (const uint32_t *)indices, numFaces, AABBTree::BuildMode::SAH, numThreads);
+
+		Voxelize(tree, volume, minExtents, maxExtents, numThreads);
+	}
+
+	void Voxelize(const AABBTree &tree, SparseVoxelVolume &volume, Vector3f minExtents, Vector3f maxExtents,
+				  unsigned numThreads)
+	{
+		volume.Clear();
+
+		mutex lock;
+		TraceTiles(tree, volume.GetWidth(), volume.GetHeight(), volume.GetDepth(), minExtents, maxExtents, numThreads,
+				   [&]() { return BrickWriter(volume, lock, kTileWidth, kTilePackets * kPacketSize); });
+	}
+
+	void VoxelizeSlabs(VertexView vertices, int numVertices, const unsigned *indices, unsigned numFaces,
+					   unsigned width, unsigned height, unsigned depth, Vector3f minExtents, Vector3f maxExtents,
+					   unsigned slabHeight, const VoxelSlabSink &sink, VoxelVolume::Layout layout, unsigned numThreads)
+	{
+		AABBTree tree(vertices, numVertices, (const uint32_t *)indices, numFaces, AABBTree::BuildMode::SAH, numThreads);
+
+		VoxelizeSlabs(tree, width, height, depth, minExtents, maxExtents, slabHeight, sink, layout, numThreads);
+	}
+
+	void VoxelizeSlabs(const AABBTree &tree, unsigned width, unsigned height, unsigned depth,
+					   Vector3f minExtents, Vector3f maxExtents, unsigned slabHeight, const VoxelSlabSink &sink,
+					   VoxelVolume::Layout layout, unsigned numThreads)
+	{
+		// whole rows of tiles, so every slab starts on a brick row of either layout
+		const unsigned tileHeight = kTilePackets * kPacketSize;
+		slabHeight = max((slabHeight + tileHeight - 1) / tileHeight, 1U) * tileHeight;
+
+		// the one slab that is ever held, the last may be shorter
+		VoxelVolume slab;
+		size_t firstWord = 0;
+
+		for (unsigned y0 = 0; y0 < height; y0 += slabHeight)
+		{
+			const unsigned y1 = min(y0 + slabHeight, height);
+			if (slab.GetHeight() == y1 - y0)
+				slab.Clear();
+			else
+				slab.Resize(width, y1 - y0, depth, layout);
+
+			// the slab's columns are traced exactly as the ones of a whole volume, each column once
+			TraceColumns(tree, width, height, depth, minExtents, maxExtents, numThreads,
+						 [&](uint32_t x, uint32_t y, uint32_t z, uint32_t zend) {
+							 slab.FillColumn(x, y - y0, z, zend);
+						 },
+						 y0, y1);
+
+			sink(slab, y0, firstWord);
+			firstWord += slab.GetWords().size();
 		}
 	}
-} // namespace PiratePhysics
\ No newline at end of file
+} // namespace PiratePhysics
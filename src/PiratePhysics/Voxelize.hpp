@@ -1,13 +1,65 @@
 #pragma once
 
 #include <array>
+#include <functional>
 #include <vector>
 #include <Eigen/Eigen>
+#include "SparseVoxelVolume.hpp"
+#include "VertexView.hpp"
+#include "VoxelVolume.hpp"
 
 namespace PiratePhysics
 {
-    // voxelizes a mesh using a single pass parity algorithm
-    void Voxelize(const Eigen::Vector3f *vertices, int numVertices,
+    class AABBTree;
+
+    // voxelizes a mesh using a single pass parity algorithm, the vertices are read in place,
+    // numThreads 0 uses every hardware thread
+    void Voxelize(VertexView vertices, int numVertices,
                   const unsigned *indices, unsigned numFaces, unsigned width, unsigned height,
-                  unsigned depth, std::vector<unsigned> &volume, Eigen::Vector3f minExtents, Eigen::Vector3f maxExtents);
+                  unsigned depth, std::vector<unsigned> &volume, Eigen::Vector3f minExtents, Eigen::Vector3f maxExtents,
+                  unsigned numThreads = 0);
+
+    // the same with a tree of the mesh the caller keeps, so repeated calls do not build one every time,
+    // tiles of columns are traced by numThreads threads that share the tree
+    void Voxelize(const AABBTree &tree, unsigned width, unsigned height, unsigned depth,
+                  std::vector<unsigned> &volume, Eigen::Vector3f minExtents, Eigen::Vector3f maxExtents,
+                  unsigned numThreads = 0);
+
+    // one bit per voxel, the grid is the one volume was sized to and its layout is kept
+    void Voxelize(VertexView vertices, int numVertices, const unsigned *indices, unsigned numFaces,
+                  VoxelVolume &volume, Eigen::Vector3f minExtents, Eigen::Vector3f maxExtents,
+                  unsigned numThreads = 0);
+    void Voxelize(const AABBTree &tree, VoxelVolume &volume, Eigen::Vector3f minExtents, Eigen::Vector3f maxExtents,
+                  unsigned numThreads = 0);
+
+    // 8x8x8 bricks allocated only where the surface passes, for grids too large to hold densely
+    void Voxelize(VertexView vertices, int numVertices, const unsigned *indices, unsigned numFaces,
+                  SparseVoxelVolume &volume, Eigen::Vector3f minExtents, Eigen::Vector3f maxExtents,
+                  unsigned numThreads = 0);
+    void Voxelize(const AABBTree &tree, SparseVoxelVolume &volume, Eigen::Vector3f minExtents, Eigen::Vector3f maxExtents,
+                  unsigned numThreads = 0);
+
+    /**
+     * receives a finished slab of rows y0 up to y0 + slab.GetHeight(), its words are the words of the
+     * whole volume's layout from firstWord on, so a writer can copy them straight into a file mapping
+     */
+    using VoxelSlabSink = std::function<void(const VoxelVolume &slab, unsigned y0, size_t firstWord)>;
+
+    // streams the volume out in slabs of whole rows instead of holding it, for grids too large to fit in memory,
+    // only one slab of slabHeight rows is held at a time and every column is traced once, slabHeight is rounded
+    // up to whole tiles, 4 packets of PIRATEPHYSICS_SIMD_WIDTH rays but at least 16 rows, 32 with AVX
+    void VoxelizeSlabs(VertexView vertices, int numVertices, const unsigned *indices, unsigned numFaces,
+                       unsigned width, unsigned height, unsigned depth, Eigen::Vector3f minExtents, Eigen::Vector3f maxExtents,
+                       unsigned slabHeight, const VoxelSlabSink &sink,
+                       VoxelVolume::Layout layout = VoxelVolume::Layout::Columns, unsigned numThreads = 0);
+    void VoxelizeSlabs(const AABBTree &tree, unsigned width, unsigned height, unsigned depth,
+                       Eigen::Vector3f minExtents, Eigen::Vector3f maxExtents, unsigned slabHeight, const VoxelSlabSink &sink,
+                       VoxelVolume::Layout layout = VoxelVolume::Layout::Columns, unsigned numThreads = 0);
+
+    // rasterizes the triangles straight into volume instead, no tree is built and the mesh need not be closed,
+    // every voxel a triangle passes through is set, conservative sets every voxel it touches at all instead of
+    // a 6-separating shell, solid fills in what the shell encloses with a scanline flood fill from outside
+    void VoxelizeTriangles(VertexView vertices, int numVertices, const unsigned *indices, unsigned numFaces,
+                           VoxelVolume &volume, Eigen::Vector3f minExtents, Eigen::Vector3f maxExtents,
+                           bool conservative = false, bool solid = true, unsigned numThreads = 0);
 } // namespace PiratePhysics
\ No newline at end of file
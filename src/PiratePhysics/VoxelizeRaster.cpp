@@ -0,0 +1,430 @@
+#include "Voxelize.hpp"
+#include "Simd.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <future>
+#include <thread>
+
+using namespace std;
+using namespace PiratePhysics;
+using namespace PiratePhysics::Simd;
+
+// Eigen is left out of the using directives, its Select and Cross would hide the packet versions
+
+namespace
+{
+	// voxels of a column tested together, one lane each
+	const int kLanes = 8;
+
+	// the diamond of a 6-separating test is grown by this much, where a crossing lands on the tip two neighbouring
+	// diamonds share rounding could otherwise miss both and open a crack in the shell
+	const float kDiamondSlack = 1e-3f;
+
+	// triangles are binned into tiles of this many columns along x and y, a tile is rasterized by one thread
+	const unsigned kRasterTileSize = 16;
+
+	// not worth a thread for fewer tiles than this
+	const unsigned kMinTilesPerThread = 4;
+
+	using F = FloatN<kLanes>;
+
+	/**
+	 * one edge of a triangle projected onto an axis plane, a point p of the plane passes
+	 * while mNormal . p + mOffset >= 0, the offset already holds the voxel's support
+	 */
+	struct Edge2D
+	{
+		float mNormal[2];
+		float mOffset;
+	};
+
+	/**
+	 * a triangle in grid space, where voxel x, y, z is the unit box from x, y, z, set up for
+	 * the separating axis tests of Schwarz and Seidel against every voxel it might touch,
+	 * conservative tests the voxel's box, otherwise the diamond inside it for a 6-separating shell
+	 */
+	struct RasterTriangle
+	{
+		RasterTriangle(const Eigen::Vector3f &v0, const Eigen::Vector3f &v1, const Eigen::Vector3f &v2, bool conservative)
+		{
+			mMin = v0.cwiseMin(v1).cwiseMin(v2);
+			mMax = v0.cwiseMax(v1).cwiseMax(v2);
+
+			const Eigen::Vector3f v[3] = {v0, v1, v2};
+			const Eigen::Vector3f e[3] = {v1 - v0, v2 - v1, v0 - v2};
+
+			mNormal = e[0].cross(e[1]);
+			mDegenerate = mNormal.squaredNorm() == 0.0f;
+
+			// the voxel is tested at its center, half a voxel in every direction
+			auto support = [conservative](float a, float b, float c) {
+				if (conservative)
+					return 0.5f * (fabsf(a) + fabsf(b) + fabsf(c));
+
+				return (0.5f + kDiamondSlack) * max(fabsf(a), max(fabsf(b), fabsf(c)));
+			};
+
+			mPlaneOffset = -mNormal.dot(v0);
+			mPlaneSupport = support(mNormal[0], mNormal[1], mNormal[2]);
+
+			// projections onto xy, yz and zx, edges wind counter clockwise seen from the side the normal faces
+			for (int p = 0; p < 3; ++p)
+			{
+				const int a = p;
+				const int b = (p + 1) % 3;
+				const float sign = mNormal[(p + 2) % 3] < 0.0f ? -1.0f : 1.0f;
+
+				for (int i = 0; i < 3; ++i)
+				{
+					Edge2D &edge = mEdges[p][i];
+					edge.mNormal[0] = -e[i][b] * sign;
+					edge.mNormal[1] = e[i][a] * sign;
+					edge.mOffset = -(edge.mNormal[0] * v[i][a] + edge.mNormal[1] * v[i][b]) + support(edge.mNormal[0], edge.mNormal[1], 0.0f);
+				}
+			}
+		}
+
+		// the projection onto the xy plane, once per column
+		bool OverlapsColumn(float cx, float cy) const
+		{
+			for (const Edge2D &edge : mEdges[0])
+				if (edge.mNormal[0] * cx + edge.mNormal[1] * cy + edge.mOffset < 0.0f)
+					return false;
+
+			return true;
+		}
+
+		// the plane and the yz and zx projections of kLanes voxels of a column from z on, a bit per voxel that overlaps
+		unsigned OverlapsVoxels(float cx, float cy, unsigned z) const
+		{
+			float lanes[kLanes];
+			for (int l = 0; l < kLanes; ++l)
+				lanes[l] = float(z + l) + 0.5f;
+
+			const F cz = F::Load(lanes);
+			const F zero(0.0f);
+
+			const F plane = F(mNormal[0] * cx + mNormal[1] * cy + mPlaneOffset) + F(mNormal[2]) * cz;
+			F mask = (plane <= F(mPlaneSupport)) & (F(-mPlaneSupport) <= plane);
+
+			for (const Edge2D &edge : mEdges[1])
+				mask = mask & (zero <= F(edge.mNormal[0] * cy + edge.mOffset) + F(edge.mNormal[1]) * cz);
+
+			for (const Edge2D &edge : mEdges[2])
+				mask = mask & (zero <= F(edge.mNormal[1] * cx + edge.mOffset) + F(edge.mNormal[0]) * cz);
+
+			return MoveMask(mask);
+		}
+
+		/**
+		 * the voxels of the column at cx, cy the plane test can pass, from zBegin up to but not
+		 * including zEnd, so the lanes only run where the triangle actually crosses the column
+		 */
+		void GetColumnRange(float cx, float cy, int &zBegin, int &zEnd) const
+		{
+			if (mNormal[2] == 0.0f)
+				return;
+
+			// |k + n.z cz| <= support with cz = z + 0.5
+			const float k = mNormal[0] * cx + mNormal[1] * cy + mPlaneOffset;
+			float lo = (-mPlaneSupport - k) / mNormal[2];
+			float hi = (mPlaneSupport - k) / mNormal[2];
+			if (lo > hi)
+				swap(lo, hi);
+
+			// a voxel of slack either side, the lanes test the plane again exactly
+			zBegin = max(zBegin, int(ceilf(lo - 0.5f)) - 1);
+			zEnd = min(zEnd, int(floorf(hi - 0.5f)) + 2);
+		}
+
+		Eigen::Vector3f mMin;
+		Eigen::Vector3f mMax;
+
+		Eigen::Vector3f mNormal;
+		float mPlaneOffset;
+		float mPlaneSupport;
+		bool mDegenerate;
+
+		Edge2D mEdges[3][3];
+	};
+
+	// voxels of the grid a triangle's bounds touch along one axis, from begin up to but not including end
+	void GetVoxelRange(float min, float max, unsigned size, int &begin, int &end)
+	{
+		begin = std::max(int(floorf(min)), 0);
+		end = std::min(int(floorf(max)) + 1, int(size));
+	}
+
+	/**
+	 * sets every voxel the triangles touch in shell, a columns layout volume, tiles of columns
+	 * are handed out to the threads and every tile only rasterizes the triangles binned to it
+	 */
+	void RasterizeTriangles(const vector<RasterTriangle> &triangles, VoxelVolume &shell, unsigned numThreads)
+	{
+		const unsigned width = shell.GetWidth();
+		const unsigned height = shell.GetHeight();
+		const unsigned depth = shell.GetDepth();
+
+		const unsigned tilesX = (width + kRasterTileSize - 1) / kRasterTileSize;
+		const unsigned tilesY = (height + kRasterTileSize - 1) / kRasterTileSize;
+		const unsigned numTiles = tilesX * tilesY;
+
+		// a triangle goes in the bin of every tile its bounds overlap, counted first and then filled in
+		vector<unsigned> binStart(numTiles + 1, 0);
+		auto forEachTile = [&](const RasterTriangle &tri, auto &&visit) {
+			int x0, x1, y0, y1;
+			GetVoxelRange(tri.mMin[0], tri.mMax[0], width, x0, x1);
+			GetVoxelRange(tri.mMin[1], tri.mMax[1], height, y0, y1);
+			if (x0 >= x1 || y0 >= y1)
+				return;
+
+			for (int ty = y0 / int(kRasterTileSize); ty * int(kRasterTileSize) < y1; ++ty)
+				for (int tx = x0 / int(kRasterTileSize); tx * int(kRasterTileSize) < x1; ++tx)
+					visit(ty * tilesX + tx);
+		};
+
+		for (const RasterTriangle &tri : triangles)
+			if (!tri.mDegenerate)
+				forEachTile(tri, [&](unsigned tile) { ++binStart[tile + 1]; });
+
+		for (unsigned t = 0; t < numTiles; ++t)
+			binStart[t + 1] += binStart[t];
+
+		vector<unsigned> bins(binStart[numTiles]);
+		vector<unsigned> binEnd(binStart.begin(), binStart.end() - 1);
+		for (unsigned i = 0; i < triangles.size(); ++i)
+			if (!triangles[i].mDegenerate)
+				forEachTile(triangles[i], [&](unsigned tile) { bins[binEnd[tile]++] = i; });
+
+		if (numThreads == 0)
+			numThreads = max(thread::hardware_concurrency(), 1U);
+
+		numThreads = max(min(numThreads, numTiles / kMinTilesPerThread), 1U);
+
+		// a tile's columns are its own words of the shell, tiles can be rasterized in any order by any thread
+		atomic<unsigned> nextTile(0);
+
+		auto worker = [&]() {
+			for (unsigned tile = nextTile++; tile < numTiles; tile = nextTile++)
+			{
+				const int tileX0 = (tile % tilesX) * kRasterTileSize;
+				const int tileY0 = (tile / tilesX) * kRasterTileSize;
+				const int tileX1 = min(tileX0 + int(kRasterTileSize), int(width));
+				const int tileY1 = min(tileY0 + int(kRasterTileSize), int(height));
+
+				for (unsigned b = binStart[tile]; b < binStart[tile + 1]; ++b)
+				{
+					const RasterTriangle &tri = triangles[bins[b]];
+
+					int x0, x1, y0, y1, z0, z1;
+					GetVoxelRange(tri.mMin[0], tri.mMax[0], width, x0, x1);
+					GetVoxelRange(tri.mMin[1], tri.mMax[1], height, y0, y1);
+					GetVoxelRange(tri.mMin[2], tri.mMax[2], depth, z0, z1);
+
+					for (int x = max(x0, tileX0); x < min(x1, tileX1); ++x)
+					{
+						const float cx = float(x) + 0.5f;
+
+						for (int y = max(y0, tileY0); y < min(y1, tileY1); ++y)
+						{
+							const float cy = float(y) + 0.5f;
+							if (!tri.OverlapsColumn(cx, cy))
+								continue;
+
+							int zBegin = z0, zEnd = z1;
+							tri.GetColumnRange(cx, cy, zBegin, zEnd);
+
+							for (int z = zBegin; z < zEnd; z += kLanes)
+							{
+								unsigned bits = tri.OverlapsVoxels(cx, cy, unsigned(z));
+								if (zEnd - z < kLanes)
+									bits &= (1U << (zEnd - z)) - 1;
+
+								for (; bits; bits &= bits - 1)
+									shell.Set(unsigned(x), unsigned(y), unsigned(z) + VoxelVolume::CountTrailingZeros(bits));
+							}
+						}
+					}
+				}
+			}
+		};
+
+		vector<future<void>> tasks;
+		for (unsigned t = 1; t < numThreads; ++t)
+			tasks.push_back(async(launch::async, worker));
+
+		worker();
+
+		for (auto &task : tasks)
+			task.get();
+	}
+
+	// the first voxel from z on in a column of the shell that is set, or clear when set is false, depth if there is none
+	unsigned FindNext(const uint64_t *column, unsigned z, unsigned depth, bool set)
+	{
+		while (z < depth)
+		{
+			const uint64_t w = (set ? column[z >> 6] : ~column[z >> 6]) >> (z & 63);
+			if (w)
+				return min(z + VoxelVolume::CountTrailingZeros(w), depth);
+
+			z = (z | 63) + 1;
+		}
+
+		return depth;
+	}
+
+	/**
+	 * fills in everything the shell encloses, a scanline flood fill from the grid's faces through the
+	 * runs of empty voxels along z, a run reaches the runs it overlaps in the four neighbouring columns,
+	 * every voxel outside the runs it reached is solid and written to volume
+	 */
+	void FillInterior(const VoxelVolume &shell, VoxelVolume &volume)
+	{
+		const unsigned width = shell.GetWidth();
+		const unsigned height = shell.GetHeight();
+		const unsigned depth = shell.GetDepth();
+		const unsigned wordsPerColumn = (depth + 63) / 64;
+		const vector<uint64_t> &words = shell.GetWords();
+
+		struct Run
+		{
+			unsigned mBegin;
+			unsigned mEnd;
+		};
+
+		// the empty runs of every column, ordered along z
+		vector<Run> runs;
+		vector<unsigned> columnStart(size_t(width) * height + 1, 0);
+
+		for (size_t c = 0; c < size_t(width) * height; ++c)
+		{
+			const uint64_t *column = &words[c * wordsPerColumn];
+			for (unsigned z = FindNext(column, 0, depth, false); z < depth;)
+			{
+				const unsigned end = FindNext(column, z, depth, true);
+				runs.push_back({z, end});
+				z = FindNext(column, end, depth, false);
+			}
+
+			columnStart[c + 1] = static_cast<unsigned>(runs.size());
+		}
+
+		vector<uint8_t> outside(runs.size(), 0);
+		vector<unsigned> stack;
+
+		auto reach = [&](unsigned r) {
+			if (!outside[r])
+			{
+				outside[r] = 1;
+				stack.push_back(r);
+			}
+		};
+
+		// runs on a face of the grid are outside
+		for (unsigned y = 0; y < height; ++y)
+		{
+			for (unsigned x = 0; x < width; ++x)
+			{
+				const size_t c = size_t(y) * width + x;
+				const bool side = x == 0 || y == 0 || x == width - 1 || y == height - 1;
+
+				for (unsigned r = columnStart[c]; r < columnStart[c + 1]; ++r)
+					if (side || runs[r].mBegin == 0 || runs[r].mEnd == depth)
+						reach(r);
+			}
+		}
+
+		while (!stack.empty())
+		{
+			const unsigned r = stack.back();
+			stack.pop_back();
+
+			const size_t c = upper_bound(columnStart.begin(), columnStart.end(), r) - columnStart.begin() - 1;
+			const unsigned x = static_cast<unsigned>(c % width);
+			const unsigned y = static_cast<unsigned>(c / width);
+
+			const size_t neighbours[4] = {x > 0 ? c - 1 : c, x + 1 < width ? c + 1 : c,
+										  y > 0 ? c - width : c, y + 1 < height ? c + width : c};
+
+			for (size_t n : neighbours)
+			{
+				if (n == c)
+					continue;
+
+				for (unsigned o = columnStart[n]; o < columnStart[n + 1] && runs[o].mBegin < runs[r].mEnd; ++o)
+					if (runs[o].mEnd > runs[r].mBegin)
+						reach(o);
+			}
+		}
+
+		// the gaps between a column's outside runs are solid
+		for (unsigned y = 0; y < height; ++y)
+		{
+			for (unsigned x = 0; x < width; ++x)
+			{
+				const size_t c = size_t(y) * width + x;
+
+				unsigned z = 0;
+				for (unsigned r = columnStart[c]; r < columnStart[c + 1]; ++r)
+				{
+					if (!outside[r])
+						continue;
+
+					volume.FillColumn(x, y, z, runs[r].mBegin);
+					z = runs[r].mEnd;
+				}
+
+				volume.FillColumn(x, y, z, depth);
+			}
+		}
+	}
+} // namespace
+
+namespace PiratePhysics
+{
+	void VoxelizeTriangles(VertexView vertices, int numVertices, const unsigned *indices, unsigned numFaces,
+						   VoxelVolume &volume, Eigen::Vector3f minExtents, Eigen::Vector3f maxExtents,
+						   bool conservative, bool solid, unsigned numThreads)
+	{
+		volume.Clear();
+
+		const unsigned width = volume.GetWidth();
+		const unsigned height = volume.GetHeight();
+		const unsigned depth = volume.GetDepth();
+		if (width == 0 || height == 0 || depth == 0)
+			return;
+
+		// grid space, voxel x, y, z is the unit box from x, y, z
+		const Eigen::Vector3f extents(maxExtents - minExtents);
+		const Eigen::Vector3f scale(width / extents[0], height / extents[1], depth / extents[2]);
+
+		vector<Eigen::Vector3f> positions(numVertices);
+		for (int i = 0; i < numVertices; ++i)
+			positions[i] = (vertices[i] - minExtents).cwiseProduct(scale);
+
+		vector<RasterTriangle> triangles;
+		triangles.reserve(numFaces);
+		for (unsigned i = 0; i < numFaces; ++i)
+			triangles.emplace_back(positions[indices[i * 3]], positions[indices[i * 3 + 1]], positions[indices[i * 3 + 2]], conservative);
+
+		// the shell is always traced in columns, the fill walks it run by run
+		if (!solid && volume.GetLayout() == VoxelVolume::Layout::Columns)
+		{
+			RasterizeTriangles(triangles, volume, numThreads);
+			return;
+		}
+
+		VoxelVolume shell(width, height, depth);
+		RasterizeTriangles(triangles, shell, numThreads);
+
+		if (solid)
+		{
+			FillInterior(shell, volume);
+			return;
+		}
+
+		shell.ForEachSet([&](unsigned x, unsigned y, unsigned z) { volume.Set(x, y, z); });
+	}
+} // namespace PiratePhysics
@@ -185,14 +185,6 @@ void Scene::initTeapot()
 	renderTeapot.setCamera(&camera);
 	renderTeapot.setRender();
 
-	vector<Vector3f> testVertices(x.size());
-	for (size_t i = 0; i < x.size(); ++i)
-	{
-		testVertices[i][0] = x[i][0];
-		testVertices[i][1] = x[i][1];
-		testVertices[i][2] = x[i][2];
-	}
-
 	Eigen::Vector3f maxExtents(-numeric_limits<float>::max(),
 							   -numeric_limits<float>::max(),
 							   -numeric_limits<float>::max());
@@ -200,8 +192,9 @@ void Scene::initTeapot()
 	Eigen::Vector3f minExtents(numeric_limits<float>::max(),
 							   numeric_limits<float>::max(),
 							   numeric_limits<float>::max());
-	for (auto &v : testVertices)
+	for (auto &d : teapot.data)
 	{
+		const Vector3f &v = d.position;
 		maxExtents[0] = maxExtents[0] > v[0] ? maxExtents[0] : v[0];
 		maxExtents[1] = maxExtents[1] > v[1] ? maxExtents[1] : v[1];
 		maxExtents[2] = maxExtents[2] > v[2] ? maxExtents[2] : v[2];
@@ -213,33 +206,24 @@ void Scene::initTeapot()
 	unsigned width = 20;
 	unsigned height = 20;
 	unsigned depth = 20;
-	vector<unsigned> volume;
-	Voxelize(testVertices.data(), testVertices.size(),
-			 teapot.indices.data(), faces.size(), width, height,
-			 depth, volume, minExtents, maxExtents);
+	VoxelVolume volume(width, height, depth);
+	// the render vertices are voxelized in place, positions interleaved with the other attributes
+	Voxelize(VertexView(teapot.data.data(), &MeshBase::Vertex::position), teapot.data.size(),
+			 teapot.indices.data(), faces.size(), volume, minExtents, maxExtents);
 
 	Vector3f extents(maxExtents - minExtents);
 	Vector3f delta(extents[0] / width, extents[1] / height, extents[2] / depth);
 	Vector3f offset(0.5f * delta[0], 0.5f * delta[1], 0.5f * delta[2]);
-	for(size_t x = 0; x < width; ++x)
-	{
-		for(size_t y = 0; y < height; ++y)
-		{
-			for(size_t z = 0; z < depth; ++z)
-			{
-				if(volume[z * width * height + y * width + x] == 1)
-				{
-					Matrix4f modelVoxT;
-					modelVoxT.setIdentity();
-					Vector3f pos = minExtents + Vector3f(x * delta[0] + offset[0], 
-														 y * delta[1] + offset[1] + 3.0f,
-														 z * delta[2] + offset[2]);
-					modelVoxT.block<3, 1>(0, 3) = pos;
-					modelVoxs.push_back(modelVoxT);
-				}
-			}
-		}
-	}
+	modelVoxs.reserve(modelVoxs.size() + volume.Count());
+	volume.ForEachSet([&](unsigned x, unsigned y, unsigned z) {
+		Matrix4f modelVoxT;
+		modelVoxT.setIdentity();
+		Vector3f pos = minExtents + Vector3f(x * delta[0] + offset[0], 
+											 y * delta[1] + offset[1] + 3.0f,
+											 z * delta[2] + offset[2]);
+		modelVoxT.block<3, 1>(0, 3) = pos;
+		modelVoxs.push_back(modelVoxT);
+	});
 	delta = delta * 0.5f * 0.8f;
 	vox1.setVertices([&delta](unsigned i, MeshBase::Vertex &d) {d.position[0] *= delta[0];
 																d.position[1] *= delta[1];
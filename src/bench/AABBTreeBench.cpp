@@ -0,0 +1,1106 @@
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <random>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+#include <Eigen/Eigen>
+#include "PiratePhysics/AABBTree.hpp"
+#include "BenchCommon.hpp"
+
+using namespace std;
+using namespace Eigen;
+using namespace PiratePhysics;
+using namespace Bench;
+
+/**
+ * Build times, SAH costs, memory and ray throughput of AABBTree for every build mode and
+ * node layout, and every other query and edit against brute force or a rebuilt tree, over
+ * the meshes in data and optionally a generated sphere
+ *
+ *   AABBTreeBench [dataDir] [numRays] [sphereFaces]
+ *
+ * every timing is the best of a few runs on one thread unless a table says otherwise,
+ * numbers are only meaningful in a Release build
+ */
+namespace
+{
+    // brute force checks test every face for this many rays or points, a tenth of them above kMaxBruteForceFaces
+    const unsigned kNumCheckedQueries = 500;
+
+    // pair checks against brute force grow with the square of the faces and are skipped above this
+    const unsigned kMaxBruteForceFaces = 100000;
+
+    // the sorted SAH and spatial split builds take minutes above this, tables that build often leave them out
+    const unsigned kMaxSortedBuildFaces = 500000;
+
+    // edits, refits and the other queries run on fewer rays than the build and layout tables
+    const unsigned kNumQueryRays = 50000;
+
+    // a pinhole camera image looking at the mesh, its pixels shuffled so the coherence is only there to be found
+    vector<Ray> MakeCameraRays(const Mesh &mesh, unsigned numRays)
+    {
+        Vector3f lower, upper;
+        GetBounds(mesh, lower, upper);
+
+        const Vector3f center = 0.5f * (lower + upper);
+        const float radius = 0.5f * (upper - lower).norm();
+        const Vector3f eye = center + Vector3f(0.3f, 0.4f, 1.0f).normalized() * 2.5f * radius;
+
+        const Vector3f forward = (center - eye).normalized();
+        const Vector3f right = forward.cross(Vector3f::UnitY()).normalized();
+        const Vector3f up = right.cross(forward);
+
+        const unsigned side = max(unsigned(sqrtf(float(numRays))), 1U);
+
+        vector<Ray> rays;
+        rays.reserve(side * side);
+        for (unsigned y = 0; y < side; ++y)
+        {
+            for (unsigned x = 0; x < side; ++x)
+            {
+                const float u = (x + 0.5f) / side * 2.0f - 1.0f;
+                const float v = (y + 0.5f) / side * 2.0f - 1.0f;
+                rays.push_back({eye, (forward + 0.45f * (u * right + v * up)).normalized()});
+            }
+        }
+
+        shuffle(rays.begin(), rays.end(), mt19937(11));
+        return rays;
+    }
+
+    // rays along +z from below the mesh on a square grid over its xy bounds, neighbours take nearly the same path
+    vector<Ray> MakeColumnRays(const Mesh &mesh, unsigned numRays)
+    {
+        Vector3f lower, upper;
+        GetBounds(mesh, lower, upper);
+
+        const unsigned side = max(unsigned(sqrtf(float(numRays))), 1U);
+        const float below = lower[2] - 0.01f * (upper[2] - lower[2]);
+
+        vector<Ray> rays;
+        rays.reserve(side * side);
+        for (unsigned x = 0; x < side; ++x)
+        {
+            for (unsigned y = 0; y < side; ++y)
+            {
+                const Vector3f start(lower[0] + (x + 0.5f) * (upper[0] - lower[0]) / side,
+                                     lower[1] + (y + 0.5f) * (upper[1] - lower[1]) / side, below);
+                rays.push_back({start, Vector3f::UnitZ()});
+            }
+        }
+
+        return rays;
+    }
+
+    // closest face of every ray through the tree's current layout, ~0 for a miss, the packet and
+    // compressed paths may round the hit distance differently so the faces are what is compared
+    void TraceAll(const AABBTree &tree, const vector<Ray> &rays, vector<uint32_t> &faces)
+    {
+        faces.resize(rays.size());
+        for (size_t i = 0; i < rays.size(); ++i)
+        {
+            float t, u, v, w, sign;
+            uint32_t face;
+            faces[i] = tree.TraceRay(rays[i].mStart, rays[i].mDir, t, u, v, w, sign, face) ? face : ~0U;
+        }
+    }
+
+    // million rays per second of single ray TraceRay
+    double GetRayRate(const AABBTree &tree, const vector<Ray> &rays, vector<uint32_t> &faces)
+    {
+        const double ms = Time([&]() { TraceAll(tree, rays, faces); });
+        return rays.size() / (ms * 1e3);
+    }
+
+    unsigned CountMismatches(const vector<uint32_t> &a, const vector<uint32_t> &b)
+    {
+        unsigned count = 0;
+        for (size_t i = 0; i < a.size(); ++i)
+            count += a[i] != b[i];
+        return count;
+    }
+
+    // whether two hit distances agree up to the rounding of different traversals, misses are the float maximum
+    bool IsSameDistance(float a, float b)
+    {
+        return fabsf(a - b) <= 1e-4f * max(1.0f, fabsf(a));
+    }
+
+    // distance to the closest hit of every ray through the tree, the float maximum for a miss
+    void TraceDistances(const AABBTree &tree, const vector<Ray> &rays, vector<float> &ts)
+    {
+        ts.resize(rays.size());
+        for (size_t i = 0; i < rays.size(); ++i)
+        {
+            float u, v, w, sign;
+            uint32_t face;
+            if (!tree.TraceRay(rays[i].mStart, rays[i].mDir, ts[i], u, v, w, sign, face))
+                ts[i] = numeric_limits<float>::max();
+        }
+    }
+
+    // closest hit over every face of the mesh, the reference for the tree's distances
+    float TraceBruteForce(const TriangleTraits &triangles, const Ray &ray)
+    {
+        float t = numeric_limits<float>::max();
+        for (unsigned f = 0; f < triangles.GetNumPrimitives(); ++f)
+            triangles.IntersectRay(f, ray.mStart, ray.mDir, t);
+        return t;
+    }
+
+    unsigned GetNumChecked(const Mesh &mesh)
+    {
+        return mesh.GetNumFaces() > kMaxBruteForceFaces ? kNumCheckedQueries / 10 : kNumCheckedQueries;
+    }
+
+    TriangleTraits GetTriangles(const Mesh &mesh)
+    {
+        return TriangleTraits{mesh.mVertices.data(), mesh.GetNumVertices(), mesh.mIndices.data(), mesh.GetNumFaces()};
+    }
+
+    const char *GetModeName(AABBTree::BuildMode mode)
+    {
+        switch (mode)
+        {
+        case AABBTree::BuildMode::SAH:
+            return "SAH";
+        case AABBTree::BuildMode::BinnedSAH:
+            return "binned";
+        case AABBTree::BuildMode::LBVH:
+            return "LBVH";
+        case AABBTree::BuildMode::SBVH:
+            return "SBVH";
+        }
+        return "";
+    }
+
+    unique_ptr<AABBTree> BuildTree(const Mesh &mesh, AABBTree::BuildMode mode, unsigned numThreads = 1)
+    {
+        return unique_ptr<AABBTree>(new AABBTree(mesh.mVertices.data(), mesh.GetNumVertices(), mesh.mIndices.data(),
+                                                 mesh.GetNumFaces(), mode, numThreads));
+    }
+
+    /**
+     * build time and SAH cost of every build mode, the sorted SAH builder is skipped above
+     * half a million faces where it takes minutes, the tree built on every hardware thread
+     * has to be the one built on one, refs are the leaf entries spatial splits add
+     */
+    void BenchBuild(const Mesh &mesh, const vector<Ray> &rays)
+    {
+        printf("\n%s, %u faces, build on one thread and on all threads\n", mesh.mName.c_str(), mesh.GetNumFaces());
+        printf("  mode      build ms   threads ms   same tree   SAH cost   nodes    refs    depth   Mrays/s\n");
+
+        vector<uint32_t> faces;
+        for (AABBTree::BuildMode mode : {AABBTree::BuildMode::SAH, AABBTree::BuildMode::BinnedSAH,
+                                         AABBTree::BuildMode::LBVH, AABBTree::BuildMode::SBVH})
+        {
+            if (mode == AABBTree::BuildMode::SAH && mesh.GetNumFaces() > kMaxSortedBuildFaces)
+                continue;
+
+            unique_ptr<AABBTree> tree, threaded;
+            const double ms = Time([&]() { tree = BuildTree(mesh, mode); });
+            const double threadedMs = Time([&]() { threaded = BuildTree(mesh, mode, 0); });
+
+            const bool same = threaded->GetSAHCost() == tree->GetSAHCost() && threaded->GetNumNodes() == tree->GetNumNodes() &&
+                              threaded->GetTreeDepth() == tree->GetTreeDepth();
+            const double refs = 100.0 * (double(tree->GetNumFaceReferences()) / tree->GetNumFaces() - 1.0);
+
+            printf("  %-8s %9.1f %12.1f %11s %10.2f %8zu %+6.0f%% %6u %9.2f\n", GetModeName(mode), ms, threadedMs,
+                   same ? "yes" : "no", tree->GetSAHCost(), tree->GetNumNodes(), refs, tree->GetTreeDepth(),
+                   GetRayRate(*tree, rays, faces));
+        }
+    }
+
+    /**
+     * throughput and memory of the node layouts, each on a binned tree of its own, bytes per node
+     * are the layout's bytes over the nodes of the binary tree it was derived from
+     */
+    void BenchLayouts(const Mesh &mesh, const vector<Ray> &rays)
+    {
+        printf("\n%s, node layouts of the binned tree\n", mesh.mName.c_str());
+        printf("  layout              setup ms   Mrays/s   layout KB   B/node   total KB   mismatches\n");
+
+        vector<uint32_t> reference, faces;
+
+        // setup(tree) switches the layout on and returns its bytes
+        auto row = [&](const char *name, const function<size_t(AABBTree &)> &setup) {
+            unique_ptr<AABBTree> tree = BuildTree(mesh, AABBTree::BuildMode::BinnedSAH);
+            const size_t numNodes = tree->GetNumNodes();
+
+            const double start = Now();
+            const size_t bytes = setup(*tree);
+            const double setupMs = (Now() - start) * 1e3;
+
+            const double rate = GetRayRate(*tree, rays, faces);
+            if (reference.empty())
+                reference = faces;
+
+            printf("  %-18s %9.2f %9.2f %11.1f %8.1f %10.1f %12u\n", name, setupMs, rate, bytes / 1024.0,
+                   double(bytes) / numNodes, tree->GetMemoryUsage() / 1024.0, CountMismatches(reference, faces));
+        };
+
+        row("binary", [](AABBTree &tree) { return tree.GetNumNodes() * sizeof(BVHNode); });
+
+        for (unsigned width : {4U, 8U})
+        {
+            row(width == 4 ? "BVH4" : "BVH8", [width](AABBTree &tree) {
+                const size_t before = tree.GetMemoryUsage();
+                tree.CollapseWide(width);
+                return tree.GetMemoryUsage() - before;
+            });
+        }
+
+        row("quantized 16", [](AABBTree &tree) { return tree.CompressNodes(16); });
+        row("quantized 8", [](AABBTree &tree) { return tree.CompressNodes(8); });
+        row("leaf triangles", [](AABBTree &tree) { return tree.PrecomputeLeafTriangles(true); });
+
+        row("BVH4, leaf tris", [](AABBTree &tree) {
+            const size_t before = tree.GetMemoryUsage();
+            tree.CollapseWide(4);
+            return tree.GetMemoryUsage() - before + tree.PrecomputeLeafTriangles(true);
+        });
+
+        row("released", [](AABBTree &tree) {
+            tree.ReleaseBuildData();
+            return tree.GetNumNodes() * sizeof(BVHNode);
+        });
+
+        // only the compressed nodes are left, the smallest tree that still traces rays
+        row("quantized 8 only", [](AABBTree &tree) {
+            tree.ReleaseBuildData();
+            return tree.CompressNodes(8, false);
+        });
+    }
+
+    /**
+     * TraceBatch against a loop of TraceRay over the same rays, random and camera rays
+     */
+    void BenchBatch(const Mesh &mesh, const vector<Ray> &random, const vector<Ray> &camera)
+    {
+        printf("\n%s, batches of rays on the binned tree\n", mesh.mName.c_str());
+        printf("  rays      count     TraceRay ms   TraceBatch ms   all threads ms   mismatches\n");
+
+        unique_ptr<AABBTree> tree = BuildTree(mesh, AABBTree::BuildMode::BinnedSAH);
+
+        for (int c = 0; c < 2; ++c)
+        {
+            const vector<Ray> &rays = c == 0 ? random : camera;
+
+            vector<uint32_t> reference;
+            const double loopMs = Time([&]() { TraceAll(*tree, rays, reference); });
+
+            vector<RayHit> hits(rays.size());
+            const double batchMs = Time([&]() { tree->TraceBatch(rays.data(), unsigned(rays.size()), hits.data(), 1); });
+            const double threadedMs = Time([&]() { tree->TraceBatch(rays.data(), unsigned(rays.size()), hits.data(), 0); });
+
+            unsigned mismatches = 0;
+            for (size_t i = 0; i < rays.size(); ++i)
+                mismatches += (hits[i].mT == numeric_limits<float>::max() ? ~0U : hits[i].mFaceIndex) != reference[i];
+
+            printf("  %-8s %7zu %14.1f %15.1f %16.1f %12u\n", c == 0 ? "random" : "camera", rays.size(),
+                   loopMs, batchMs, threadedMs, mismatches);
+        }
+    }
+
+    /**
+     * SAH cost and throughput before and after the treelet pass, for every build mode
+     */
+    void BenchTreelets(const Mesh &mesh, const vector<Ray> &rays)
+    {
+        printf("\n%s, treelet restructuring\n", mesh.mName.c_str());
+        printf("  mode      SAH before   SAH after   change   Mrays/s before   after   optimize ms   mismatches\n");
+
+        for (AABBTree::BuildMode mode : {AABBTree::BuildMode::SAH, AABBTree::BuildMode::BinnedSAH,
+                                         AABBTree::BuildMode::LBVH, AABBTree::BuildMode::SBVH})
+        {
+            if (mode == AABBTree::BuildMode::SAH && mesh.GetNumFaces() > kMaxSortedBuildFaces)
+                continue;
+
+            unique_ptr<AABBTree> tree = BuildTree(mesh, mode);
+
+            vector<uint32_t> reference, faces;
+            const float before = tree->GetSAHCost();
+            const double rateBefore = GetRayRate(*tree, rays, reference);
+
+            const double start = Now();
+            const float after = tree->OptimizeTreelets();
+            const double ms = (Now() - start) * 1e3;
+
+            const double rateAfter = GetRayRate(*tree, rays, faces);
+
+            printf("  %-8s %11.2f %11.2f %7.1f%% %16.2f %7.2f %13.1f %12u\n", GetModeName(mode), before, after,
+                   100.0f * (after - before) / before, rateBefore, rateAfter, ms, CountMismatches(reference, faces));
+        }
+    }
+
+    // closest face of every ray traced in packets of N, the rays are a whole number of packets
+    template <int N>
+    double GetPacketRate(const AABBTree &tree, const vector<Ray> &rays, vector<uint32_t> &faces)
+    {
+        // the packets are filled before the timing, as by a caller that keeps its rays in packets
+        vector<RayPacket<N>> packets(rays.size() / N);
+        for (size_t p = 0; p < packets.size(); ++p)
+        {
+            for (int l = 0; l < N; ++l)
+            {
+                for (int a = 0; a < 3; ++a)
+                {
+                    packets[p].mStart[a][l] = rays[p * N + l].mStart[a];
+                    packets[p].mDir[a][l] = rays[p * N + l].mDir[a];
+                }
+                packets[p].mActive[l] = true;
+            }
+        }
+
+        vector<HitPacket<N>> hits(packets.size());
+        const double ms = Time([&]() {
+            for (size_t p = 0; p < packets.size(); ++p)
+                tree.TraceRays(packets[p], hits[p]);
+        });
+
+        faces.resize(packets.size() * N);
+        for (size_t p = 0; p < packets.size(); ++p)
+            for (int l = 0; l < N; ++l)
+                faces[p * N + l] = hits[p].mHit[l] ? hits[p].mFaceIndex[l] : ~0U;
+
+        return faces.size() / (ms * 1e3);
+    }
+
+    /**
+     * TraceRays in packets of 4, 8 and 16 against single rays, the rays along z are as coherent
+     * as the columns Voxelize traces, mismatches add up the faces of all three widths
+     */
+    void BenchPackets(const Mesh &mesh, const vector<Ray> &random, const vector<Ray> &columns)
+    {
+        printf("\n%s, ray packets on the binned tree, Mrays/s\n", mesh.mName.c_str());
+        printf("  rays     layout              scalar      N=4      N=8     N=16   mismatches\n");
+
+        // the layouts after the first trace their own packet paths, random rays only
+        const char *layouts[] = {"binary", "binary", "leaf triangles", "BVH4", "quantized 8 only"};
+
+        for (int c = 0; c < 5; ++c)
+        {
+            unique_ptr<AABBTree> tree = BuildTree(mesh, AABBTree::BuildMode::BinnedSAH);
+            if (c == 2)
+                tree->PrecomputeLeafTriangles(true);
+            else if (c == 3)
+                tree->CollapseWide(4);
+            else if (c == 4)
+            {
+                tree->ReleaseBuildData();
+                tree->CompressNodes(8, false);
+            }
+
+            // a whole number of packets of every width
+            vector<Ray> rays = c == 0 ? columns : random;
+            rays.resize(rays.size() / 16 * 16);
+
+            vector<uint32_t> reference, faces;
+            const double scalar = GetRayRate(*tree, rays, reference);
+
+            const double rate4 = GetPacketRate<4>(*tree, rays, faces);
+            unsigned mismatches = CountMismatches(reference, faces);
+            const double rate8 = GetPacketRate<8>(*tree, rays, faces);
+            mismatches += CountMismatches(reference, faces);
+            const double rate16 = GetPacketRate<16>(*tree, rays, faces);
+            mismatches += CountMismatches(reference, faces);
+
+            printf("  %-8s %-16s %9.2f %8.2f %8.2f %8.2f %12u\n", c == 0 ? "along z" : "random", layouts[c], scalar,
+                   rate4, rate8, rate16, mismatches);
+        }
+    }
+
+    /**
+     * a mesh bent further by a wave every frame, sized in the units of the teapot, refit alone,
+     * refit with rebuilds of the subtrees whose cost grew by 1.3 times and a full rebuild, the
+     * tree traces through BVH4 nodes as Refit has to collapse them again, distances are checked
+     * against brute force over the bent mesh
+     */
+    void BenchRefit(const Mesh &mesh)
+    {
+        const int kNumFrames = 8;
+
+        printf("\n%s, refit of a bending binned BVH4 tree\n", mesh.mName.c_str());
+        printf("  frame   refit ms   SAH cost   refit 1.3 ms   rebuilt   SAH cost   rebuild ms   SAH cost   mismatches\n");
+
+        Mesh bent = mesh;
+        unique_ptr<AABBTree> tree = BuildTree(bent, AABBTree::BuildMode::BinnedSAH);
+        tree->CollapseWide(4);
+
+        for (int frame = 1; frame <= kNumFrames; ++frame)
+        {
+            const float amplitude = 0.3f * frame;
+            for (size_t i = 0; i < bent.mVertices.size(); ++i)
+            {
+                const Vector3f &p = mesh.mVertices[i];
+                bent.mVertices[i] = p + Vector3f(sinf(3.0f * p[1] + frame) * amplitude, 0.0f, cosf(2.0f * p[0]) * 0.5f * amplitude);
+            }
+
+            // refitting the same positions again gives the same tree, rebuilding does not
+            const double refitMs = Time([&]() { tree->Refit(0.0f); });
+            const float refitCost = tree->GetSAHCost();
+
+            const double start = Now();
+            const unsigned rebuilt = tree->Refit(1.3f);
+            const double rebuildMs = (Now() - start) * 1e3;
+
+            unique_ptr<AABBTree> fresh;
+            const double freshMs = Time([&]() { fresh = BuildTree(bent, AABBTree::BuildMode::BinnedSAH); });
+
+            const TriangleTraits triangles = GetTriangles(bent);
+            const vector<Ray> rays = MakeRandomRays(bent, GetNumChecked(mesh));
+
+            vector<float> ts;
+            TraceDistances(*tree, rays, ts);
+
+            unsigned mismatches = 0;
+            for (size_t i = 0; i < rays.size(); ++i)
+                mismatches += !IsSameDistance(ts[i], TraceBruteForce(triangles, rays[i]));
+
+            printf("  %5d %10.2f %10.2f %14.2f %9u %10.2f %12.2f %10.2f %12u\n", frame, refitMs, refitCost, rebuildMs,
+                   rebuilt, tree->GetSAHCost(), freshMs, fresh->GetSAHCost(), mismatches);
+        }
+    }
+
+    // closest point on the triangle a, b, c to p, Ericson's Voronoi region test one region at a time
+    Vector3f GetClosestPointOnTriangle(const Vector3f &p, const Vector3f &a, const Vector3f &b, const Vector3f &c)
+    {
+        const Vector3f ab = b - a, ac = c - a, ap = p - a;
+        const float d1 = ab.dot(ap), d2 = ac.dot(ap);
+        if (d1 <= 0.0f && d2 <= 0.0f)
+            return a;
+
+        const Vector3f bp = p - b;
+        const float d3 = ab.dot(bp), d4 = ac.dot(bp);
+        if (d3 >= 0.0f && d4 <= d3)
+            return b;
+
+        const float vc = d1 * d4 - d3 * d2;
+        if (vc <= 0.0f && d1 >= 0.0f && d3 <= 0.0f)
+            return a + d1 / (d1 - d3) * ab;
+
+        const Vector3f cp = p - c;
+        const float d5 = ab.dot(cp), d6 = ac.dot(cp);
+        if (d6 >= 0.0f && d5 <= d6)
+            return c;
+
+        const float vb = d5 * d2 - d1 * d6;
+        if (vb <= 0.0f && d2 >= 0.0f && d6 <= 0.0f)
+            return a + d2 / (d2 - d6) * ac;
+
+        const float va = d3 * d6 - d5 * d4;
+        if (va <= 0.0f && d4 - d3 >= 0.0f && d5 - d6 >= 0.0f)
+            return b + (d4 - d3) / ((d4 - d3) + (d5 - d6)) * (c - b);
+
+        const float denom = 1.0f / (va + vb + vc);
+        return a + ab * (vb * denom) + ac * (vc * denom);
+    }
+
+    /**
+     * ClosestPoint and ClosestPoints for random points around the mesh against every face, and
+     * queries bounded to a twentieth of the mesh size against the unbounded distance
+     */
+    void BenchClosestPoint(const Mesh &mesh)
+    {
+        const unsigned kNumPoints = 20000;
+
+        Vector3f lower, upper;
+        GetBounds(mesh, lower, upper);
+        const Vector3f center = 0.5f * (lower + upper);
+        const float extent = (upper - lower).norm();
+
+        mt19937 rng(3);
+        uniform_real_distribution<float> unit(-1.0f, 1.0f);
+
+        vector<Vector3f> points(kNumPoints);
+        for (Vector3f &p : points)
+            p = center + 0.6f * extent * Vector3f(unit(rng), unit(rng), unit(rng));
+
+        unique_ptr<AABBTree> tree = BuildTree(mesh, AABBTree::BuildMode::BinnedSAH);
+
+        const float unbounded = numeric_limits<float>::max();
+        vector<ClosestPointHit> hits(kNumPoints);
+        const double ms = Time([&]() {
+            for (unsigned i = 0; i < kNumPoints; ++i)
+                tree->ClosestPoint(points[i], unbounded, hits[i]);
+        });
+        const double threadedMs = Time([&]() { tree->ClosestPoints(points.data(), kNumPoints, unbounded, hits.data(), 0); });
+
+        // every face for the first points only
+        const unsigned numChecked = GetNumChecked(mesh);
+        vector<float> bruteForce(numChecked);
+        const double bruteMs = Time([&]() {
+            for (unsigned i = 0; i < numChecked; ++i)
+            {
+                float best = numeric_limits<float>::max();
+                for (unsigned f = 0; f < mesh.GetNumFaces(); ++f)
+                {
+                    const Vector3f q = GetClosestPointOnTriangle(points[i], mesh.mVertices[mesh.mIndices[f*3+0]],
+                                                                 mesh.mVertices[mesh.mIndices[f*3+1]], mesh.mVertices[mesh.mIndices[f*3+2]]);
+                    best = min(best, (q - points[i]).squaredNorm());
+                }
+                bruteForce[i] = sqrtf(best);
+            }
+        }, 1);
+
+        const float bound = 0.05f * extent;
+
+        unsigned mismatches = 0, boundedMismatches = 0;
+        for (unsigned i = 0; i < numChecked; ++i)
+        {
+            mismatches += !hits[i].mHit || fabsf(hits[i].mDistance - bruteForce[i]) > 1e-4f * extent;
+
+            ClosestPointHit bounded;
+            tree->ClosestPoint(points[i], bound, bounded);
+            boundedMismatches += bounded.mHit != (hits[i].mDistance <= bound);
+        }
+
+        printf("\n%s, closest points on the binned tree, %u points\n", mesh.mName.c_str(), kNumPoints);
+        printf("  ClosestPoint   %8.2f us, ClosestPoints on all threads %.2f us, brute force %.1f us per point\n",
+               ms * 1e3 / kNumPoints, threadedMs * 1e3 / kNumPoints, bruteMs * 1e3 / numChecked);
+        printf("  %u of %u differ from brute force, %u of them bounded to %.3g\n", mismatches, numChecked,
+               boundedMismatches, bound);
+    }
+
+    // runs a pair query with a buffer grown until every pair fits, the buffer is left holding them
+    unsigned RunPairQuery(const function<unsigned(FacePair *, unsigned)> &query, vector<FacePair> &pairs)
+    {
+        unsigned numPairs = query(pairs.data(), unsigned(pairs.size()));
+        if (numPairs > pairs.size())
+        {
+            pairs.resize(numPairs);
+            numPairs = query(pairs.data(), numPairs);
+        }
+
+        pairs.resize(numPairs);
+        return numPairs;
+    }
+
+    /**
+     * SelfOverlap against every pair of faces that share no vertex, the tree has to find every
+     * pair whose bounds overlap
+     */
+    void BenchSelfOverlap(const Mesh &mesh)
+    {
+        if (mesh.GetNumFaces() > kMaxBruteForceFaces)
+            return;
+
+        unique_ptr<AABBTree> tree = BuildTree(mesh, AABBTree::BuildMode::BinnedSAH);
+
+        vector<FacePair> pairs;
+        auto query = [&](FacePair *p, unsigned maxPairs) { return tree->SelfOverlap(p, maxPairs); };
+        RunPairQuery(query, pairs);
+        const double ms = Time([&]() { query(pairs.data(), unsigned(pairs.size())); });
+
+        set<pair<unsigned, unsigned>> found;
+        for (const FacePair &p : pairs)
+            found.insert(minmax(p.mFaceA, p.mFaceB));
+
+        const TriangleTraits triangles = GetTriangles(mesh);
+        vector<BVHBounds> bounds(mesh.GetNumFaces());
+        for (unsigned f = 0; f < mesh.GetNumFaces(); ++f)
+            bounds[f] = triangles.GetBounds(f);
+
+        size_t bruteForce = 0, missed = 0;
+        const double bruteMs = Time([&]() {
+            bruteForce = missed = 0;
+            for (unsigned i = 0; i < mesh.GetNumFaces(); ++i)
+            {
+                for (unsigned j = i + 1; j < mesh.GetNumFaces(); ++j)
+                {
+                    if (!bounds[i].Overlaps(bounds[j]))
+                        continue;
+
+                    bool adjacent = false;
+                    for (int a = 0; a < 3; ++a)
+                        for (int b = 0; b < 3; ++b)
+                            adjacent |= mesh.mIndices[i*3+a] == mesh.mIndices[j*3+b];
+
+                    if (adjacent)
+                        continue;
+
+                    ++bruteForce;
+                    missed += !found.count({i, j});
+                }
+            }
+        }, 1);
+
+        printf("\n%s, overlapping faces on the binned tree\n", mesh.mName.c_str());
+        printf("  self overlap   %8.2f ms, %zu pairs, brute force %.0f ms, %zu pairs, %zu missed\n", ms, found.size(),
+               bruteMs, bruteForce, missed);
+    }
+
+    /**
+     * whether the box lower, upper and the box otherLower, otherUpper placed by rotation and translation
+     * are separated along none of the 15 axes, the test Overlap makes between a pair of nodes
+     */
+    bool OverlapOrientedBoxes(const Vector3f &lower, const Vector3f &upper, const Vector3f &otherLower,
+                              const Vector3f &otherUpper, const Matrix3f &rotation, const Vector3f &translation)
+    {
+        const Vector3f extents = 0.5f * (upper - lower);
+        const Vector3f otherExtents = 0.5f * (otherUpper - otherLower);
+        const Vector3f offset = rotation * (0.5f * (otherLower + otherUpper)) + translation - 0.5f * (lower + upper);
+
+        Vector3f axes[15];
+        for (int i = 0; i < 3; ++i)
+        {
+            axes[i] = Vector3f::Unit(i);
+            axes[3 + i] = rotation.col(i);
+            for (int j = 0; j < 3; ++j)
+                axes[6 + 3 * i + j] = Vector3f::Unit(i).cross(rotation.col(j));
+        }
+
+        for (const Vector3f &axis : axes)
+        {
+            if (axis.squaredNorm() < 1e-10f)
+                continue;
+
+            const float radius = axis.cwiseAbs().dot(extents);
+            const float otherRadius = (rotation.transpose() * axis).cwiseAbs().dot(otherExtents);
+            if (fabsf(offset.dot(axis)) > (radius + otherRadius) * (1.0f + 1e-5f))
+                return false;
+        }
+
+        return true;
+    }
+
+    /**
+     * Overlap of a mesh with another scaled to its size, rotated and pushed a fifth of the way
+     * off center, against every pair of faces whose bounds overlap in a's space and whose boxes
+     * also overlap as oriented boxes, the two tests Overlap makes
+     */
+    void BenchOverlap(const Mesh &a, const Mesh &b)
+    {
+        Vector3f lowerA, upperA, lowerB, upperB;
+        GetBounds(a, lowerA, upperA);
+        GetBounds(b, lowerB, upperB);
+
+        const Vector3f centerA = 0.5f * (lowerA + upperA), centerB = 0.5f * (lowerB + upperB);
+        const float sizeA = (upperA - lowerA).norm(), sizeB = (upperB - lowerB).norm();
+
+        Mesh scaled = b;
+        for (Vector3f &v : scaled.mVertices)
+            v = (v - centerB) * (sizeA / sizeB) + centerA;
+
+        const Matrix3f rotation = AngleAxisf(0.7f, Vector3f(1.0f, 2.0f, 3.0f).normalized()).toRotationMatrix();
+        const Vector3f translation = centerA - rotation * centerA + Vector3f(0.2f * sizeA, 0.0f, 0.0f);
+
+        unique_ptr<AABBTree> treeA = BuildTree(a, AABBTree::BuildMode::BinnedSAH);
+        unique_ptr<AABBTree> treeB = BuildTree(scaled, AABBTree::BuildMode::BinnedSAH);
+
+        vector<FacePair> pairs;
+        auto query = [&](FacePair *p, unsigned maxPairs) { return treeA->Overlap(*treeB, rotation, translation, p, maxPairs); };
+        RunPairQuery(query, pairs);
+        const double ms = Time([&]() { query(pairs.data(), unsigned(pairs.size())); });
+
+        set<pair<unsigned, unsigned>> found;
+        for (const FacePair &p : pairs)
+            found.insert({p.mFaceA, p.mFaceB});
+
+        const TriangleTraits trianglesA = GetTriangles(a), trianglesB = GetTriangles(scaled);
+
+        size_t bruteForce = 0, missed = 0;
+        const double bruteMs = Time([&]() {
+            vector<BVHBounds> placed(scaled.GetNumFaces());
+            for (unsigned j = 0; j < scaled.GetNumFaces(); ++j)
+            {
+                const Vector3f p0 = rotation * scaled.mVertices[scaled.mIndices[j*3+0]] + translation;
+                const Vector3f p1 = rotation * scaled.mVertices[scaled.mIndices[j*3+1]] + translation;
+                const Vector3f p2 = rotation * scaled.mVertices[scaled.mIndices[j*3+2]] + translation;
+                placed[j] = BVHBounds(p0.cwiseMin(p1).cwiseMin(p2), p0.cwiseMax(p1).cwiseMax(p2));
+            }
+
+            bruteForce = missed = 0;
+            for (unsigned i = 0; i < a.GetNumFaces(); ++i)
+            {
+                const BVHBounds bounds = trianglesA.GetBounds(i);
+                for (unsigned j = 0; j < scaled.GetNumFaces(); ++j)
+                {
+                    if (!bounds.Overlaps(placed[j]))
+                        continue;
+
+                    const BVHBounds own = trianglesB.GetBounds(j);
+                    if (!OverlapOrientedBoxes(bounds.mMin, bounds.mMax, own.mMin, own.mMax, rotation, translation))
+                        continue;
+
+                    ++bruteForce;
+                    missed += !found.count({i, j});
+                }
+            }
+        }, 1);
+
+        printf("\n%s against %s scaled to its size and rotated, binned trees\n", a.mName.c_str(), b.mName.c_str());
+        printf("  overlap        %8.2f ms, %zu pairs, brute force %.0f ms, %zu pairs pass both box tests, %zu missed\n",
+               ms, found.size(), bruteMs, bruteForce, missed);
+    }
+
+    /**
+     * a tree adopted from its serialized image against building it, the image is held in memory
+     * as a mapped file whose pages are resident would be, the sorted SAH tree is used where it builds
+     */
+    void BenchSerialize(const Mesh &mesh, const vector<Ray> &rays)
+    {
+        const AABBTree::BuildMode mode = mesh.GetNumFaces() > kMaxSortedBuildFaces ? AABBTree::BuildMode::BinnedSAH : AABBTree::BuildMode::SAH;
+
+        unique_ptr<AABBTree> tree;
+        const double buildMs = Time([&]() { tree = BuildTree(mesh, mode); });
+
+        vector<uint8_t> image;
+        tree->Serialize(image);
+
+        unique_ptr<AABBTree> loaded;
+        const double loadMs = Time([&]() {
+            loaded.reset(new AABBTree(mesh.mVertices.data(), mesh.GetNumVertices(), mesh.mIndices.data(), mesh.GetNumFaces(),
+                                      image.data(), image.size(), mode, 1));
+        });
+
+        uint64_t hash = 0;
+        const double hashMs = Time([&]() {
+            hash = AABBTree::HashMesh(mesh.mVertices.data(), mesh.GetNumVertices(), mesh.mIndices.data(), mesh.GetNumFaces());
+        });
+
+        vector<uint32_t> reference, faces;
+        TraceAll(*tree, rays, reference);
+        TraceAll(*loaded, rays, faces);
+
+        printf("\n%s, serialized %s tree, mesh hash %016llx\n", mesh.mName.c_str(), GetModeName(mode), (unsigned long long)hash);
+        printf("  build %8.2f ms, load %.2f ms of which %.2f ms hash the mesh, image %.0f KB, %s, %u of %zu rays differ\n",
+               buildMs, loadMs, hashMs, image.size() / 1024.0, loaded->IsLoaded() ? "loaded" : "rebuilt",
+               CountMismatches(reference, faces), rays.size());
+    }
+
+    // hits along the segment found by tracing again from just past each one, what Voxelize did before TraceRayAll
+    unsigned CountByRestarting(const AABBTree &tree, const Ray &ray, float maxT, float step)
+    {
+        unsigned numHits = 0;
+        for (float traveled = 0.0f;;)
+        {
+            float t, u, v, w, sign;
+            uint32_t face;
+            if (!tree.TraceRay(ray.mStart + traveled * ray.mDir, ray.mDir, t, u, v, w, sign, face) || traveled + t > maxT)
+                return numHits;
+
+            ++numHits;
+            traveled += t + step;
+        }
+    }
+
+    /**
+     * TraceRayAll against restarting TraceRay past every hit, TraceRayAny against the closest hit,
+     * the segments end at the middle of the mesh so some hits lie beyond them, and TraceRaysAll
+     * for packets of 8 rays from nearby origins against TraceRayAll for each lane
+     */
+    void BenchHitQueries(const Mesh &mesh, const vector<Ray> &rays)
+    {
+        const unsigned kMaxHits = 64;
+        const unsigned kNumPackets = 5000;
+
+        Vector3f lower, upper;
+        GetBounds(mesh, lower, upper);
+        const float extent = (upper - lower).norm();
+
+        // the rays start extent away from the middle of the mesh
+        const float maxT = extent;
+
+        unique_ptr<AABBTree> tree = BuildTree(mesh, AABBTree::BuildMode::BinnedSAH);
+
+        vector<RayHit> hits(kMaxHits);
+        vector<unsigned> counts(rays.size()), restarted(rays.size());
+        const double allMs = Time([&]() {
+            for (size_t i = 0; i < rays.size(); ++i)
+                counts[i] = tree->TraceRayAll(rays[i].mStart, rays[i].mDir, maxT, hits.data(), kMaxHits);
+        });
+        const double restartMs = Time([&]() {
+            for (size_t i = 0; i < rays.size(); ++i)
+                restarted[i] = CountByRestarting(*tree, rays[i], maxT, 1e-5f * extent);
+        });
+
+        vector<char> any(rays.size());
+        const double anyMs = Time([&]() {
+            for (size_t i = 0; i < rays.size(); ++i)
+                any[i] = tree->TraceRayAny(rays[i].mStart, rays[i].mDir, maxT);
+        });
+
+        vector<float> ts;
+        const double closestMs = Time([&]() { TraceDistances(*tree, rays, ts); });
+
+        unsigned countMismatches = 0, anyMismatches = 0;
+        for (size_t i = 0; i < rays.size(); ++i)
+        {
+            countMismatches += counts[i] != restarted[i];
+            anyMismatches += (any[i] != 0) != (ts[i] <= maxT);
+        }
+
+        // lanes of a packet share a direction and start within a fiftieth of the mesh of each other
+        mt19937 rng(9);
+        uniform_real_distribution<float> unit(-1.0f, 1.0f);
+
+        const unsigned numPackets = min(kNumPackets, unsigned(rays.size()));
+        vector<RayPacket<8>> packets(numPackets);
+        for (unsigned p = 0; p < numPackets; ++p)
+        {
+            for (int l = 0; l < 8; ++l)
+            {
+                const Vector3f start = rays[p].mStart + 0.02f * extent * Vector3f(unit(rng), unit(rng), unit(rng));
+                for (int a = 0; a < 3; ++a)
+                {
+                    packets[p].mStart[a][l] = start[a];
+                    packets[p].mDir[a][l] = rays[p].mDir[a];
+                }
+                packets[p].mActive[l] = true;
+            }
+        }
+
+        vector<RayHit> packetHits(size_t(numPackets) * 8 * kMaxHits), laneHits(packetHits.size());
+        vector<unsigned> packetCounts(size_t(numPackets) * 8), laneCounts(packetCounts.size());
+
+        const double packetMs = Time([&]() {
+            for (unsigned p = 0; p < numPackets; ++p)
+                tree->TraceRaysAll(packets[p], 2.0f * extent, &packetHits[size_t(p) * 8 * kMaxHits], kMaxHits, &packetCounts[p * 8]);
+        });
+        const double laneMs = Time([&]() {
+            for (unsigned p = 0; p < numPackets; ++p)
+            {
+                for (int l = 0; l < 8; ++l)
+                {
+                    const Vector3f start(packets[p].mStart[0][l], packets[p].mStart[1][l], packets[p].mStart[2][l]);
+                    laneCounts[p * 8 + l] = tree->TraceRayAll(start, rays[p].mDir, 2.0f * extent,
+                                                              &laneHits[(size_t(p) * 8 + l) * kMaxHits], kMaxHits);
+                }
+            }
+        });
+
+        unsigned laneMismatches = 0;
+        for (size_t i = 0; i < packetCounts.size(); ++i)
+        {
+            bool same = packetCounts[i] == laneCounts[i];
+            for (unsigned h = 0; same && h < min(packetCounts[i], kMaxHits); ++h)
+                same = IsSameDistance(packetHits[i * kMaxHits + h].mT, laneHits[i * kMaxHits + h].mT);
+
+            laneMismatches += !same;
+        }
+
+        printf("\n%s, all hits and any hit on the binned tree, %zu rays\n", mesh.mName.c_str(), rays.size());
+        printf("  TraceRayAll    %8.2f us, restarting TraceRay %.2f us per ray, hit counts differ on %u rays\n",
+               allMs * 1e3 / rays.size(), restartMs * 1e3 / rays.size(), countMismatches);
+        printf("  TraceRayAny    %8.2f us, closest hit %.2f us per ray, %u rays differ\n", anyMs * 1e3 / rays.size(),
+               closestMs * 1e3 / rays.size(), anyMismatches);
+        printf("  TraceRaysAll   %8.2f us, TraceRayAll %.2f us per 8 rays, %u of %zu lanes differ\n",
+               packetMs * 1e3 / numPackets, laneMs * 1e3 / numPackets, laneMismatches, packetCounts.size());
+    }
+
+    /**
+     * faces inserted into a tree of the rest of the mesh and then removed again in random order,
+     * against trees built from the same faces, the faces are shuffled first so the inserted ones
+     * lie all over the mesh, the removed faces go back in once more to the tree they left, released
+     * is the binned tree without its build data, mismatches compare hit distances with the rebuilt tree
+     */
+    void BenchEdits(const Mesh &mesh, const vector<Ray> &rays)
+    {
+        printf("\n%s, incremental edits against rebuilt trees\n", mesh.mName.c_str());
+        printf("  mode      edit   us/face   SAH edited   rebuilt   Mrays/s edited   rebuilt   mismatches\n");
+
+        const unsigned numFaces = mesh.GetNumFaces();
+        mt19937 rng(5);
+
+        for (int m = 0; m < 3; ++m)
+        {
+            const AABBTree::BuildMode mode = m == 1 ? AABBTree::BuildMode::SBVH : AABBTree::BuildMode::BinnedSAH;
+            const bool release = m == 2;
+            if (mode == AABBTree::BuildMode::SBVH && numFaces > kMaxSortedBuildFaces)
+                continue;
+
+            for (float fraction : {0.01f, 0.1f, 0.5f})
+            {
+                vector<unsigned> order(numFaces);
+                for (unsigned f = 0; f < numFaces; ++f)
+                    order[f] = f;
+                shuffle(order.begin(), order.end(), rng);
+
+                Mesh shuffled;
+                shuffled.mVertices = mesh.mVertices;
+                for (unsigned f : order)
+                    shuffled.mIndices.insert(shuffled.mIndices.end(), {mesh.mIndices[f*3+0], mesh.mIndices[f*3+1], mesh.mIndices[f*3+2]});
+
+                const unsigned numKept = unsigned(numFaces * (1.0f - fraction));
+                auto buildFirst = [&](unsigned n) {
+                    return unique_ptr<AABBTree>(new AABBTree(shuffled.mVertices.data(), shuffled.GetNumVertices(),
+                                                             shuffled.mIndices.data(), n, mode, 1));
+                };
+
+                vector<uint32_t> faces;
+                vector<float> edited, rebuilt;
+                // change is the fraction of faces inserted or removed, 0 for the removed faces put back
+                auto row = [&](float change, double ms, unsigned numEdited, const AABBTree &tree, const AABBTree &reference) {
+                    const double rate = GetRayRate(tree, rays, faces);
+                    const double referenceRate = GetRayRate(reference, rays, faces);
+
+                    TraceDistances(tree, rays, edited);
+                    TraceDistances(reference, rays, rebuilt);
+
+                    unsigned mismatches = 0;
+                    for (size_t i = 0; i < rays.size(); ++i)
+                        mismatches += !IsSameDistance(edited[i], rebuilt[i]);
+
+                    char edit[16] = "undo";
+                    if (change != 0.0f)
+                        snprintf(edit, sizeof(edit), "%+.0f%%", 100.0f * change);
+
+                    printf("  %-8s %6s %9.2f %12.2f %9.2f %16.2f %9.2f %12u\n", release ? "released" : GetModeName(mode), edit,
+                           ms * 1e3 / max(numEdited, 1U), tree.GetSAHCost(), reference.GetSAHCost(), rate, referenceRate,
+                           mismatches);
+                };
+
+                unique_ptr<AABBTree> tree = buildFirst(numKept);
+                if (release)
+                    tree->ReleaseBuildData();
+
+                double start = Now();
+                const unsigned numInserted = tree->InsertFaces(shuffled.mVertices.data(), shuffled.GetNumVertices(),
+                                                               shuffled.mIndices.data(), numFaces);
+                const double insertMs = (Now() - start) * 1e3;
+
+                row(fraction, insertMs, numInserted, *tree, *buildFirst(numFaces));
+
+                vector<unsigned> removed;
+                for (unsigned f = numKept; f < numFaces; ++f)
+                    removed.push_back(f);
+                shuffle(removed.begin(), removed.end(), rng);
+
+                start = Now();
+                const unsigned numRemoved = tree->RemoveFaces(removed.data(), unsigned(removed.size()));
+                const double removeMs = (Now() - start) * 1e3;
+
+                row(-fraction, removeMs, numRemoved, *tree, *buildFirst(numKept));
+
+                start = Now();
+                const unsigned numReinserted = tree->InsertFaces(removed.data(), unsigned(removed.size()));
+                const double reinsertMs = (Now() - start) * 1e3;
+
+                row(0.0f, reinsertMs, numReinserted, *tree, *buildFirst(numFaces));
+            }
+        }
+    }
+
+    // a render vertex with its position between other attributes, as a renderer hands its meshes over
+    struct RenderVertex
+    {
+        Vector3f mNormal;
+        Vector3f mPosition;
+        float mUV[2];
+    };
+
+    /**
+     * trees built from the same positions packed, interleaved in render vertices and in float arrays,
+     * every view has to give the same tree and the same mesh hash
+     */
+    void BenchVertexViews(const Mesh &mesh, const vector<Ray> &rays)
+    {
+        printf("\n%s, binned trees read through vertex views\n", mesh.mName.c_str());
+        printf("  vertices        build ms   SAH cost   Mrays/s   same hash   mismatches\n");
+
+        vector<RenderVertex> interleaved(mesh.GetNumVertices());
+        vector<array<float, 3>> arrays(mesh.GetNumVertices());
+        for (unsigned i = 0; i < mesh.GetNumVertices(); ++i)
+        {
+            interleaved[i] = {Vector3f::Zero(), mesh.mVertices[i], {0.0f, 0.0f}};
+            arrays[i] = {mesh.mVertices[i][0], mesh.mVertices[i][1], mesh.mVertices[i][2]};
+        }
+
+        const VertexView views[] = {mesh.mVertices.data(), VertexView(interleaved.data(), &RenderVertex::mPosition), arrays.data()};
+        const char *names[] = {"packed", "interleaved", "float arrays"};
+
+        uint64_t referenceHash = 0;
+        vector<uint32_t> reference, faces;
+        for (int v = 0; v < 3; ++v)
+        {
+            unique_ptr<AABBTree> tree;
+            const double ms = Time([&]() {
+                tree.reset(new AABBTree(views[v], mesh.GetNumVertices(), mesh.mIndices.data(), mesh.GetNumFaces(),
+                                        AABBTree::BuildMode::BinnedSAH, 1));
+            });
+
+            const uint64_t hash = AABBTree::HashMesh(views[v], mesh.GetNumVertices(), mesh.mIndices.data(), mesh.GetNumFaces());
+            const double rate = GetRayRate(*tree, rays, faces);
+            if (v == 0)
+            {
+                reference = faces;
+                referenceHash = hash;
+            }
+
+            printf("  %-14s %9.1f %10.2f %9.2f %11s %12u\n", names[v], ms, tree->GetSAHCost(), rate,
+                   hash == referenceHash ? "yes" : "no", CountMismatches(reference, faces));
+        }
+    }
+} // namespace
+
+int main(int argc, char **argv)
+{
+#ifdef PIRATEPHYSICS_DATA_DIR
+    string dataDir = PIRATEPHYSICS_DATA_DIR;
+#else
+    string dataDir = "data";
+#endif
+    if (argc > 1)
+        dataDir = argv[1];
+
+    const unsigned numRays = argc > 2 ? unsigned(atoi(argv[2])) : 200000;
+    const unsigned sphereFaces = argc > 3 ? unsigned(atoi(argv[3])) : 0;
+
+    vector<Mesh> meshes;
+    for (const char *name : {"teapot", "Dragon"})
+    {
+        Mesh mesh;
+        if (LoadMesh(dataDir + "/" + name + ".obj", name, mesh))
+            meshes.push_back(move(mesh));
+    }
+
+    if (sphereFaces)
+    {
+        meshes.emplace_back();
+        MakeSphere(sphereFaces, meshes.back());
+    }
+
+    if (meshes.empty())
+    {
+        fprintf(stderr, "no meshes found in %s\n", dataDir.c_str());
+        return EXIT_FAILURE;
+    }
+
+    printf("%u rays per table, times are the best of %d runs\n", numRays, kNumRuns);
+
+    for (const Mesh &mesh : meshes)
+    {
+        const vector<Ray> random = MakeRandomRays(mesh, numRays);
+        const vector<Ray> camera = MakeCameraRays(mesh, numRays);
+
+        const vector<Ray> queries = MakeRandomRays(mesh, min(numRays, kNumQueryRays));
+
+        BenchBuild(mesh, random);
+        BenchLayouts(mesh, random);
+        BenchPackets(mesh, random, MakeColumnRays(mesh, numRays));
+        BenchBatch(mesh, random, camera);
+        BenchTreelets(mesh, random);
+        BenchRefit(mesh);
+        BenchClosestPoint(mesh);
+        BenchSelfOverlap(mesh);
+        BenchSerialize(mesh, queries);
+        BenchHitQueries(mesh, queries);
+        BenchEdits(mesh, queries);
+        BenchVertexViews(mesh, queries);
+    }
+
+    // the first two meshes against each other, the teapot and the Dragon
+    if (meshes.size() > 1)
+        BenchOverlap(meshes[0], meshes[1]);
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,158 @@
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <random>
+#include <vector>
+#include <Eigen/Eigen>
+#include "PiratePhysics/BVHTraits.hpp"
+#include "PiratePhysics/CollisionShapes/BoxShape.hpp"
+#include "PiratePhysics/Voxelize.hpp"
+#include "BenchCommon.hpp"
+
+using namespace std;
+using namespace Eigen;
+using namespace PiratePhysics;
+using namespace Bench;
+
+/**
+ * BVH<Traits> over the primitives other than triangles, particle spheres, collision shape
+ * boxes and voxel bricks, every query is checked against brute force over all primitives
+ *
+ *   BVHBench [dataDir] [numPrimitives] [gridSize]
+ */
+namespace
+{
+    // brute force checks only look at this many rays
+    const unsigned kNumCheckedRays = 2000;
+
+    /**
+     * rays from the sphere around lower, upper toward random points inside, closest hits through
+     * the tree against the closest of all primitives, prints the rate and the disagreements
+     */
+    template <typename Traits>
+    void BenchRays(const BVH<Traits> &bvh, const Vector3f &lower, const Vector3f &upper, unsigned numRays)
+    {
+        Mesh box;
+        box.mVertices = {lower, upper};
+        const vector<Ray> rays = MakeRandomRays(box, numRays);
+
+        vector<float> ts(rays.size());
+        const double ms = Time([&]() {
+            for (size_t i = 0; i < rays.size(); ++i)
+            {
+                unsigned primitive;
+                bvh.TraceRay(rays[i].mStart, rays[i].mDir, ts[i], primitive);
+            }
+        });
+
+        const Traits &traits = bvh.GetTraits();
+
+        unsigned mismatches = 0;
+        for (size_t i = 0; i < min(size_t(kNumCheckedRays), rays.size()); ++i)
+        {
+            float t = numeric_limits<float>::max();
+            for (unsigned p = 0; p < traits.GetNumPrimitives(); ++p)
+                traits.IntersectRay(p, rays[i].mStart, rays[i].mDir, t);
+
+            mismatches += t != ts[i];
+        }
+
+        printf("  rays           %8.2f Mrays/s, %u of %u differ from brute force\n", rays.size() / (ms * 1e3), mismatches,
+               min(kNumCheckedRays, numRays));
+    }
+
+    // build and refit times, node count, SAH cost and the pairs SelfOverlap finds against brute force
+    template <typename Traits>
+    void BenchTree(const char *name, const Traits &traits)
+    {
+        unique_ptr<BVH<Traits>> bvh;
+        const double buildMs = Time([&]() { bvh.reset(new BVH<Traits>(traits, true, 4, 1)); });
+        const double refitMs = Time([&]() { bvh->Refit(); });
+
+        printf("\n%s, %u primitives\n", name, traits.GetNumPrimitives());
+        printf("  build          %8.2f ms, refit %.2f ms, %zu nodes, depth %u, SAH cost %.2f\n", buildMs, refitMs,
+               bvh->GetNumNodes(), bvh->GetTreeDepth(), bvh->GetSAHCost());
+
+        size_t numPairs = 0;
+        const double overlapMs = Time([&]() {
+            numPairs = 0;
+            bvh->SelfOverlap([&](unsigned, unsigned) { ++numPairs; });
+        });
+
+        size_t bruteForce = 0;
+        const double bruteMs = Time([&]() {
+            vector<BVHBounds> bounds(traits.GetNumPrimitives());
+            for (unsigned i = 0; i < traits.GetNumPrimitives(); ++i)
+                bounds[i] = traits.GetBounds(i);
+
+            bruteForce = 0;
+            for (unsigned i = 0; i < traits.GetNumPrimitives(); ++i)
+                for (unsigned j = i + 1; j < traits.GetNumPrimitives(); ++j)
+                    bruteForce += bounds[i].Overlaps(bounds[j]);
+        }, 1);
+
+        printf("  self overlap   %8.2f ms, %zu pairs, brute force %.1f ms, %zu pairs\n", overlapMs, numPairs, bruteMs, bruteForce);
+    }
+} // namespace
+
+int main(int argc, char **argv)
+{
+#ifdef PIRATEPHYSICS_DATA_DIR
+    string dataDir = PIRATEPHYSICS_DATA_DIR;
+#else
+    string dataDir = "data";
+#endif
+    if (argc > 1)
+        dataDir = argv[1];
+
+    const unsigned numPrimitives = argc > 2 ? unsigned(atoi(argv[2])) : 10000;
+    const unsigned gridSize = argc > 3 ? unsigned(atoi(argv[3])) : 256;
+    const unsigned numRays = 100000;
+
+    mt19937 rng(3);
+    uniform_real_distribution<float> unit(0.0f, 1.0f);
+
+    // particles in a unit cube with a handful of neighbours each
+    vector<Vector3f> centers(numPrimitives);
+    for (Vector3f &c : centers)
+        c = Vector3f(unit(rng), unit(rng), unit(rng));
+
+    const SphereTraits spheres{centers.data(), numPrimitives, 0.5f / cbrtf(float(numPrimitives))};
+    BenchTree("particle spheres", spheres);
+    BenchRays(BVH<SphereTraits>(spheres), Vector3f::Zero(), Vector3f::Ones(), numRays);
+
+    // rotated boxes of a broadphase
+    vector<unique_ptr<BoxShape>> boxes;
+    vector<const CollisionShape *> shapes;
+    for (unsigned i = 0; i < numPrimitives; ++i)
+    {
+        const Matrix3f rotation = AngleAxisf(2.0f * kPi * unit(rng), Vector3f(unit(rng), unit(rng), unit(rng)).normalized()).toRotationMatrix();
+        boxes.emplace_back(new BoxShape(Vector3f::Constant(0.4f / cbrtf(float(numPrimitives))), Vector3f(unit(rng), unit(rng), unit(rng)), rotation));
+        shapes.push_back(boxes.back().get());
+    }
+
+    BenchTree("collision shape boxes", ShapeTraits{shapes.data(), numPrimitives});
+
+    // the bricks of the Dragon voxelized into a sparse volume
+    Mesh dragon;
+    if (!LoadMesh(dataDir + "/Dragon.obj", "Dragon", dragon))
+    {
+        fprintf(stderr, "no Dragon.obj in %s\n", dataDir.c_str());
+        return EXIT_FAILURE;
+    }
+
+    Vector3f lower, upper;
+    GetBounds(dragon, lower, upper);
+    const Vector3f padding = 0.05f * (upper - lower);
+    lower -= padding;
+    upper += padding;
+
+    SparseVoxelVolume volume(gridSize, gridSize, gridSize);
+    Voxelize(dragon.mVertices.data(), dragon.GetNumVertices(), dragon.mIndices.data(), dragon.GetNumFaces(), volume, lower, upper);
+
+    const BrickTraits bricks(volume, lower, upper);
+    BenchTree("voxel bricks", bricks);
+    BenchRays(BVH<BrickTraits>(bricks), lower, upper, numRays);
+
+    return EXIT_SUCCESS;
+}
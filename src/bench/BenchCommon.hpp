@@ -0,0 +1,160 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <limits>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <Eigen/Eigen>
+#include "PiratePhysics/AABBTree.hpp"
+
+/**
+ * meshes, rays and timing shared by the benchmarks
+ */
+namespace Bench
+{
+    const int kNumRuns = 3;
+
+    const float kPi = 3.14159265358979f;
+
+    struct Mesh
+    {
+        std::string mName;
+        std::vector<Eigen::Vector3f> mVertices;
+        std::vector<unsigned> mIndices;
+
+        unsigned GetNumVertices() const { return static_cast<unsigned>(mVertices.size()); }
+        unsigned GetNumFaces() const { return static_cast<unsigned>(mIndices.size() / 3); }
+    };
+
+    inline double Now()
+    {
+        return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    // best time of kNumRuns calls in milliseconds
+    template <typename Body>
+    double Time(const Body &body, int numRuns = kNumRuns)
+    {
+        double best = 1e30;
+        for (int r = 0; r < numRuns; ++r)
+        {
+            const double start = Now();
+            body();
+            best = std::min(best, Now() - start);
+        }
+        return best * 1e3;
+    }
+
+    // positions and faces of an obj file, polygons are split into fans, the Dragon is made of quads
+    inline bool LoadMesh(const std::string &path, const std::string &name, Mesh &mesh)
+    {
+        std::ifstream file(path);
+        if (!file)
+            return false;
+
+        mesh.mName = name;
+
+        std::string line;
+        while (std::getline(file, line))
+        {
+            std::istringstream stream(line);
+            std::string type;
+            stream >> type;
+
+            if (type == "v")
+            {
+                Eigen::Vector3f v;
+                stream >> v[0] >> v[1] >> v[2];
+                mesh.mVertices.push_back(v);
+            }
+            else if (type == "f")
+            {
+                // v, v/vt or v/vt/vn, obj indices start at 1
+                std::vector<unsigned> polygon;
+                std::string corner;
+                while (stream >> corner)
+                    polygon.push_back(static_cast<unsigned>(std::stoi(corner) - 1));
+
+                for (size_t i = 2; i < polygon.size(); ++i)
+                    mesh.mIndices.insert(mesh.mIndices.end(), {polygon[0], polygon[i - 1], polygon[i]});
+            }
+        }
+
+        return !mesh.mIndices.empty();
+    }
+
+    // a latitude longitude sphere of about numFaces triangles, a mesh much larger than the caches
+    inline void MakeSphere(unsigned numFaces, Mesh &mesh)
+    {
+        const unsigned slices = std::max(unsigned(sqrtf(float(numFaces))), 3U);
+        const unsigned stacks = std::max(numFaces / (2 * slices), 2U);
+
+        mesh.mName = "sphere" + std::to_string(numFaces / 1000) + "k";
+
+        for (unsigned s = 0; s <= stacks; ++s)
+        {
+            const float theta = kPi * s / stacks;
+            for (unsigned l = 0; l < slices; ++l)
+            {
+                const float phi = 2.0f * kPi * l / slices;
+                mesh.mVertices.emplace_back(sinf(theta) * cosf(phi), cosf(theta), sinf(theta) * sinf(phi));
+            }
+        }
+
+        for (unsigned s = 0; s < stacks; ++s)
+        {
+            for (unsigned l = 0; l < slices; ++l)
+            {
+                const unsigned a = s * slices + l;
+                const unsigned b = s * slices + (l + 1) % slices;
+                const unsigned c = a + slices;
+                const unsigned d = b + slices;
+
+                mesh.mIndices.insert(mesh.mIndices.end(), {a, c, b, b, c, d});
+            }
+        }
+    }
+
+    inline void GetBounds(const Mesh &mesh, Eigen::Vector3f &lower, Eigen::Vector3f &upper)
+    {
+        lower = Eigen::Vector3f::Constant(std::numeric_limits<float>::max());
+        upper = -lower;
+
+        for (const Eigen::Vector3f &v : mesh.mVertices)
+        {
+            lower = lower.cwiseMin(v);
+            upper = upper.cwiseMax(v);
+        }
+    }
+
+    // rays from a sphere around the mesh toward random points inside its bounds, every one incoherent
+    inline std::vector<PiratePhysics::Ray> MakeRandomRays(const Mesh &mesh, unsigned numRays)
+    {
+        Eigen::Vector3f lower, upper;
+        GetBounds(mesh, lower, upper);
+
+        const Eigen::Vector3f center = 0.5f * (lower + upper);
+        const float radius = (upper - lower).norm();
+
+        std::mt19937 rng(7);
+        std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+        std::normal_distribution<float> normal;
+
+        std::vector<PiratePhysics::Ray> rays(numRays);
+        for (PiratePhysics::Ray &ray : rays)
+        {
+            const Eigen::Vector3f onSphere = Eigen::Vector3f(normal(rng), normal(rng), normal(rng)).normalized();
+            const Eigen::Vector3f target = lower + (upper - lower).cwiseProduct(Eigen::Vector3f(unit(rng), unit(rng), unit(rng)));
+
+            ray.mStart = center + radius * onSphere;
+            ray.mDir = (target - ray.mStart).normalized();
+        }
+
+        return rays;
+    }
+} // namespace Bench
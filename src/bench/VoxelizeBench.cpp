@@ -0,0 +1,488 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <random>
+#include <string>
+#include <utility>
+#include <vector>
+#include <Eigen/Eigen>
+#include "PiratePhysics/AABBTree.hpp"
+#include "PiratePhysics/Constraint.hpp"
+#include "PiratePhysics/PositionBasedDynamics.hpp"
+#include "PiratePhysics/SignedDistanceField.hpp"
+#include "PiratePhysics/Voxelize.hpp"
+#include "BenchCommon.hpp"
+
+using namespace std;
+using namespace Eigen;
+using namespace PiratePhysics;
+using namespace Bench;
+
+/**
+ * Voxelize into every kind of volume over the meshes in data, a grid whose top is cut off
+ * inside the mesh is checked against the same rows of the uncut grid, then the times and
+ * memory of the volumes, the raster voxelizer, slabs and signed distance fields, from 64^3
+ * up to gridSize and from 512^3 up to largeGridSize
+ *
+ *   VoxelizeBench [dataDir] [gridSize] [largeGridSize]
+ *
+ * exits with a failure when a cut off volume differs from the reference
+ */
+namespace
+{
+    // the cut off grids are checked at this size
+    const unsigned kClippedGridSize = 128;
+
+    // the cut grid keeps this fraction of the layers, so its top lies inside the mesh
+    const unsigned kClipNumerator = 3;
+    const unsigned kClipDenominator = 5;
+
+    /**
+     * every volume of a grid whose z range stops inside the mesh against the bottom layers of the
+     * full grid, the top layer of a grid is never filled so it is left out of the comparison
+     */
+    bool CheckClipped(const Mesh &mesh, const AABBTree &tree, unsigned size, const Vector3f &lower, const Vector3f &upper)
+    {
+        const unsigned depth = size * kClipNumerator / kClipDenominator;
+
+        // the cut grid has the cells of the full one, only fewer of them along z
+        Vector3f clippedUpper = upper;
+        clippedUpper[2] = lower[2] + (upper[2] - lower[2]) * depth / size;
+
+        vector<unsigned> full;
+        Voxelize(tree, size, size, size, full, lower, upper);
+
+        printf("\n%s, %u^3 grid cut off at %u layers\n", mesh.mName.c_str(), size, depth);
+        printf("  volume              solid voxels   reference   mismatches\n");
+
+        bool passed = true;
+        auto check = [&](const char *name, const function<bool(unsigned, unsigned, unsigned)> &get) {
+            size_t solid = 0, reference = 0, mismatches = 0;
+            for (unsigned z = 0; z + 1 < depth; ++z)
+            {
+                for (unsigned y = 0; y < size; ++y)
+                {
+                    for (unsigned x = 0; x < size; ++x)
+                    {
+                        const bool a = get(x, y, z);
+                        const bool b = full[(size_t(z) * size + y) * size + x] != 0;
+                        solid += a;
+                        reference += b;
+                        mismatches += a != b;
+                    }
+                }
+            }
+
+            printf("  %-18s %13zu %11zu %12zu\n", name, solid, reference, mismatches);
+            passed &= mismatches == 0;
+        };
+
+        vector<unsigned> clipped;
+        Voxelize(tree, size, size, depth, clipped, lower, clippedUpper);
+        check("unsigned", [&](unsigned x, unsigned y, unsigned z) { return clipped[(size_t(z) * size + y) * size + x] != 0; });
+
+        for (VoxelVolume::Layout layout : {VoxelVolume::Layout::Columns, VoxelVolume::Layout::Bricks})
+        {
+            VoxelVolume bits(size, size, depth, layout);
+            Voxelize(tree, bits, lower, clippedUpper);
+            check(layout == VoxelVolume::Layout::Columns ? "bits, columns" : "bits, bricks",
+                  [&](unsigned x, unsigned y, unsigned z) { return bits.Get(x, y, z); });
+        }
+
+        SparseVoxelVolume sparse(size, size, depth);
+        Voxelize(tree, sparse, lower, clippedUpper);
+        check("sparse", [&](unsigned x, unsigned y, unsigned z) { return sparse.Get(x, y, z); });
+
+        VoxelVolume slabs(size, size, depth);
+        VoxelizeSlabs(tree, size, size, depth, lower, clippedUpper, 32,
+                      [&](const VoxelVolume &slab, unsigned y0, size_t) {
+                          slab.ForEachSet([&](unsigned x, unsigned y, unsigned z) { slabs.Set(x, y0 + y, z); });
+                      });
+        check("slabs", [&](unsigned x, unsigned y, unsigned z) { return slabs.Get(x, y, z); });
+
+        return passed;
+    }
+
+    const double kMegabyte = 1024.0 * 1024.0;
+
+    // voxels of a volume that differ from the unsigned volume of the same cubic grid
+    template <typename Volume>
+    size_t CountMismatches(const Volume &volume, const vector<unsigned> &reference, unsigned size)
+    {
+        size_t mismatches = 0;
+        for (unsigned z = 0; z < size; ++z)
+            for (unsigned y = 0; y < size; ++y)
+                for (unsigned x = 0; x < size; ++x)
+                    mismatches += volume.Get(x, y, z) != (reference[(size_t(z) * size + y) * size + x] != 0);
+        return mismatches;
+    }
+
+    size_t CountMismatches(const vector<unsigned> &a, const vector<unsigned> &b)
+    {
+        size_t mismatches = 0;
+        for (size_t i = 0; i < a.size(); ++i)
+            mismatches += (a[i] != 0) != (b[i] != 0);
+        return mismatches;
+    }
+
+    /**
+     * the unsigned volume from the mesh, which builds a sorted SAH tree on every call, from a
+     * prebuilt tree and from that tree on every hardware thread, all three have to be the same
+     */
+    void BenchThreads(const Mesh &mesh, const AABBTree &tree, unsigned size, const Vector3f &lower, const Vector3f &upper)
+    {
+        vector<unsigned> fromMesh, prebuilt, threaded;
+        const double meshMs = Time([&]() {
+            Voxelize(mesh.mVertices.data(), int(mesh.GetNumVertices()), mesh.mIndices.data(), mesh.GetNumFaces(),
+                     size, size, size, fromMesh, lower, upper, 1);
+        });
+        const double prebuiltMs = Time([&]() { Voxelize(tree, size, size, size, prebuilt, lower, upper, 1); });
+        const double threadedMs = Time([&]() { Voxelize(tree, size, size, size, threaded, lower, upper, 0); });
+
+        printf("\n%s, %u^3 unsigned volume\n", mesh.mName.c_str(), size);
+        printf("  from the mesh  %8.1f ms, prebuilt tree %.1f ms, on all threads %.1f ms, %zu and %zu voxels differ\n",
+               meshMs, prebuiltMs, threadedMs, CountMismatches(fromMesh, prebuilt), CountMismatches(prebuilt, threaded));
+    }
+
+    /**
+     * the unsigned volume from prebuilt trees of every build mode on one thread, the sorted SAH
+     * tree Voxelize builds itself is the reference
+     */
+    void BenchBuildModes(const Mesh &mesh, unsigned size, const Vector3f &lower, const Vector3f &upper)
+    {
+        printf("\n%s, %u^3 unsigned volume from trees of every build mode on one thread\n", mesh.mName.c_str(), size);
+        printf("  mode      SAH cost   voxelize ms   mismatches\n");
+
+        const pair<AABBTree::BuildMode, const char *> modes[] = {
+            {AABBTree::BuildMode::SAH, "SAH"}, {AABBTree::BuildMode::BinnedSAH, "binned"},
+            {AABBTree::BuildMode::LBVH, "LBVH"}, {AABBTree::BuildMode::SBVH, "SBVH"}};
+
+        vector<unsigned> reference, voxels;
+        for (const auto &mode : modes)
+        {
+            const AABBTree tree(mesh.mVertices.data(), mesh.GetNumVertices(), mesh.mIndices.data(), mesh.GetNumFaces(),
+                                mode.first, 1);
+
+            const double ms = Time([&]() { Voxelize(tree, size, size, size, voxels, lower, upper, 1); });
+            if (reference.empty())
+                reference = voxels;
+
+            printf("  %-8s %9.2f %13.1f %12zu\n", mode.second, tree.GetSAHCost(), ms, CountMismatches(reference, voxels));
+        }
+    }
+
+    /**
+     * the unsigned volume against one bit per voxel in both layouts and the sparse bricks, all
+     * from the same tree on one thread, iterating visits every solid voxel, with a triple loop
+     * over the unsigned volume and ForEachSet over the others
+     */
+    void BenchVolumes(const Mesh &mesh, const AABBTree &tree, unsigned size, const Vector3f &lower, const Vector3f &upper)
+    {
+        printf("\n%s, %u^3 volumes from a prebuilt tree on one thread\n", mesh.mName.c_str(), size);
+        printf("  volume            voxelize ms   memory MB   iterate ms   solid voxels   mismatches\n");
+
+        auto row = [](const char *name, double ms, size_t bytes, double iterateMs, size_t solid, size_t mismatches) {
+            printf("  %-16s %12.1f %11.2f %12.1f %14zu %12zu\n", name, ms, bytes / kMegabyte, iterateMs, solid, mismatches);
+        };
+
+        vector<unsigned> reference;
+        const double ms = Time([&]() { Voxelize(tree, size, size, size, reference, lower, upper, 1); });
+
+        size_t solid = 0;
+        const double iterateMs = Time([&]() {
+            solid = 0;
+            for (unsigned z = 0; z < size; ++z)
+                for (unsigned y = 0; y < size; ++y)
+                    for (unsigned x = 0; x < size; ++x)
+                        solid += reference[(size_t(z) * size + y) * size + x] != 0;
+        });
+        row("unsigned", ms, reference.capacity() * sizeof(unsigned), iterateMs, solid, 0);
+
+        for (VoxelVolume::Layout layout : {VoxelVolume::Layout::Columns, VoxelVolume::Layout::Bricks})
+        {
+            VoxelVolume bits(size, size, size, layout);
+            const double bitsMs = Time([&]() { Voxelize(tree, bits, lower, upper, 1); });
+
+            size_t count = 0;
+            const double bitsIterateMs = Time([&]() {
+                count = 0;
+                bits.ForEachSet([&](unsigned, unsigned, unsigned) { ++count; });
+            });
+
+            row(layout == VoxelVolume::Layout::Columns ? "bits, columns" : "bits, bricks", bitsMs, bits.GetMemoryUsage(),
+                bitsIterateMs, count, CountMismatches(bits, reference, size));
+        }
+
+        SparseVoxelVolume sparse(size, size, size);
+        const double sparseMs = Time([&]() { Voxelize(tree, sparse, lower, upper, 1); });
+
+        size_t count = 0;
+        const double sparseIterateMs = Time([&]() {
+            count = 0;
+            sparse.ForEachSet([&](unsigned, unsigned, unsigned) { ++count; });
+        });
+        row("sparse", sparseMs, sparse.GetMemoryUsage(), sparseIterateMs, count, CountMismatches(sparse, reference, size));
+    }
+
+    /**
+     * memory of the sparse bricks against one bit per voxel for grids from 512^3 up, the dense
+     * bytes are worked out, not allocated
+     */
+    void BenchSparse(const Mesh &mesh, const AABBTree &tree, unsigned maxSize, const Vector3f &lower, const Vector3f &upper)
+    {
+        printf("\n%s, sparse volumes from a prebuilt tree on one thread\n", mesh.mName.c_str());
+        printf("  grid     voxelize ms   sparse MB   dense MB    bricks   nodes\n");
+
+        for (unsigned size = 512; size <= maxSize; size *= 2)
+        {
+            SparseVoxelVolume sparse(size, size, size);
+            const double ms = Time([&]() { Voxelize(tree, sparse, lower, upper, 1); }, 1);
+
+            printf("  %5u^3 %12.1f %11.1f %10.1f %9zu %7zu\n", size, ms, sparse.GetMemoryUsage() / kMegabyte,
+                   double(size) * size * size / 8.0 / kMegabyte, sparse.GetNumBricks(), sparse.GetNumNodes());
+        }
+    }
+
+    /**
+     * the parity volume against rasterizing the triangles, the parity path from a prebuilt tree and
+     * from the mesh, which builds its tree first, every parity voxel has to lie in the solid raster
+     * of a closed mesh and the thin shell inside the conservative one
+     */
+    void BenchRaster(const Mesh &mesh, const AABBTree &tree, unsigned maxSize, const Vector3f &lower, const Vector3f &upper)
+    {
+        printf("\n%s, parity against raster on one thread, ms\n", mesh.mName.c_str());
+        printf("  grid    parity   parity + tree build   raster solid   raster shell   parity outside solid   shell outside conservative\n");
+
+        for (unsigned size = 64; size <= maxSize; size *= 2)
+        {
+            VoxelVolume parity(size, size, size), solid(size, size, size), shell(size, size, size), conservative(size, size, size);
+
+            const double parityMs = Time([&]() { Voxelize(tree, parity, lower, upper, 1); });
+            const double buildMs = Time([&]() {
+                Voxelize(mesh.mVertices.data(), int(mesh.GetNumVertices()), mesh.mIndices.data(), mesh.GetNumFaces(),
+                         parity, lower, upper, 1);
+            });
+            const double solidMs = Time([&]() {
+                VoxelizeTriangles(mesh.mVertices.data(), int(mesh.GetNumVertices()), mesh.mIndices.data(), mesh.GetNumFaces(),
+                                  solid, lower, upper, false, true, 1);
+            });
+            const double shellMs = Time([&]() {
+                VoxelizeTriangles(mesh.mVertices.data(), int(mesh.GetNumVertices()), mesh.mIndices.data(), mesh.GetNumFaces(),
+                                  shell, lower, upper, false, false, 1);
+            });
+            VoxelizeTriangles(mesh.mVertices.data(), int(mesh.GetNumVertices()), mesh.mIndices.data(), mesh.GetNumFaces(),
+                              conservative, lower, upper, true, false, 1);
+
+            size_t outsideSolid = 0, outsideConservative = 0;
+            parity.ForEachSet([&](unsigned x, unsigned y, unsigned z) { outsideSolid += !solid.Get(x, y, z); });
+            shell.ForEachSet([&](unsigned x, unsigned y, unsigned z) { outsideConservative += !conservative.Get(x, y, z); });
+
+            printf("  %4u^3 %8.1f %21.1f %14.1f %14.1f %22zu %28zu\n", size, parityMs, buildMs, solidMs, shellMs,
+                   outsideSolid, outsideConservative);
+        }
+    }
+
+    /**
+     * the bit volume streamed out in slabs of rows against holding all of it, the sink compares every
+     * slab with the words of the whole volume, which costs about what copying them to a mapped file
+     * does, memory is what the slab holds, the tree not counted
+     */
+    void BenchSlabs(const Mesh &mesh, const AABBTree &tree, unsigned size, const Vector3f &lower, const Vector3f &upper)
+    {
+        VoxelVolume whole(size, size, size);
+        const double wholeMs = Time([&]() { Voxelize(tree, whole, lower, upper, 1); }, 1);
+
+        printf("\n%s, %u^3 bit volume in slabs of rows from a prebuilt tree on one thread\n", mesh.mName.c_str(), size);
+        printf("  slab rows   voxelize ms   memory MB   mismatched words\n");
+        printf("  %9s %13.1f %11.1f %18s\n", "whole", wholeMs, whole.GetMemoryUsage() / kMegabyte, "-");
+
+        for (unsigned slabHeight : {64U, 256U})
+        {
+            size_t slabBytes = 0, mismatches = 0;
+            const double ms = Time([&]() {
+                VoxelizeSlabs(tree, size, size, size, lower, upper, slabHeight,
+                              [&](const VoxelVolume &slab, unsigned, size_t firstWord) {
+                                  slabBytes = max(slabBytes, slab.GetMemoryUsage());
+                                  const vector<uint64_t> &words = slab.GetWords();
+                                  for (size_t i = 0; i < words.size(); ++i)
+                                      mismatches += words[i] != whole.GetWords()[firstWord + i];
+                              },
+                              VoxelVolume::Layout::Columns, 1);
+            }, 1);
+
+            printf("  %9u %13.1f %11.1f %18zu\n", slabHeight, ms, slabBytes / kMegabyte, mismatches);
+        }
+    }
+
+    /**
+     * signed distance fields against an exact distance, a closest point query signed by the majority
+     * of three parity rays, at random points in the grid, the mean error is in cells and flips count
+     * points more than two cells from the surface whose sign is wrong, the collision step pushes
+     * bodies at the first of the points out of the mesh through the field and through closest point
+     * queries, fields are floats so the grids stop at 256^3
+     */
+    void BenchSignedDistance(const Mesh &mesh, const AABBTree &tree, unsigned maxSize)
+    {
+        const unsigned kNumPoints = 100000;
+        const unsigned kNumBodies = 20000;
+
+        Vector3f lower, upper;
+        GetBounds(mesh, lower, upper);
+        const Vector3f padding = 0.1f * (upper - lower);
+        lower -= padding;
+        upper += padding;
+
+        mt19937 rng(3);
+        uniform_real_distribution<float> unit(0.0f, 1.0f);
+
+        vector<Vector3f> points(kNumPoints);
+        for (Vector3f &p : points)
+            p = lower + (upper - lower).cwiseProduct(Vector3f(unit(rng), unit(rng), unit(rng)));
+
+        const Vector3f directions[] = {Vector3f(0.31f, 0.57f, 0.76f).normalized(), Vector3f(-0.6f, 0.48f, -0.64f).normalized(),
+                                       Vector3f(0.7f, -0.7f, 0.14f).normalized()};
+        const float far = 2.0f * (upper - lower).norm();
+
+        vector<float> exact(kNumPoints);
+        const double exactMs = Time([&]() {
+            RayHit hits[256];
+            for (unsigned i = 0; i < kNumPoints; ++i)
+            {
+                ClosestPointHit hit;
+                tree.ClosestPoint(points[i], numeric_limits<float>::max(), hit);
+
+                unsigned inside = 0;
+                for (const Vector3f &dir : directions)
+                    inside += tree.TraceRayAll(points[i], dir, far, hits, 256) & 1;
+
+                exact[i] = inside >= 2 ? -hit.mDistance : hit.mDistance;
+            }
+        }, 1);
+
+        printf("\n%s, signed distance fields on one thread, exact distance %.2f us per point\n", mesh.mName.c_str(),
+               exactMs * 1e3 / kNumPoints);
+        printf("  grid    build ms   memory MB   lookup ns   mean error   flips   SDF step ms   mesh step ms\n");
+
+        for (unsigned size = 64; size <= min(maxSize, 256U); size *= 2)
+        {
+            auto sdf = make_shared<SignedDistanceField>();
+            const double buildMs = Time([&]() { sdf->Build(tree, size, size, size, lower, upper, SignedDistanceField::kDefaultNarrowBand, 1); }, 1);
+
+            float sum = 0.0f;
+            const double lookupMs = Time([&]() {
+                sum = 0.0f;
+                for (const Vector3f &p : points)
+                    sum += sdf->GetDistance(p);
+            });
+
+            const float cell = sdf->GetCellSize().maxCoeff();
+
+            double error = 0.0;
+            unsigned flips = 0;
+            for (unsigned i = 0; i < kNumPoints; ++i)
+            {
+                const float d = sdf->GetDistance(points[i]);
+                error += fabsf(d - exact[i]);
+                flips += fabsf(exact[i]) > 2.0f * cell && (d < 0.0f) != (exact[i] < 0.0f);
+            }
+
+            // bodies of half a cell at the first points, pushed out once
+            PositionBasedDynamics pbd;
+            pbd.dt = 1.0f / 60.0f;
+            vector<int> bodies;
+            for (unsigned i = 0; i < kNumBodies; ++i)
+            {
+                pbd.mRigiBodies.emplace_back(1.0f);
+                pbd.mRigiBodies.back().mInvMass = 1.0f;
+                pbd.mRigiBodies.back().mBaryCenter = points[i];
+                pbd.mRigiBodies.back().mVelocity.setZero();
+                bodies.push_back(int(i));
+            }
+
+            SDFCollision collision(pbd, sdf, bodies, 0.5f * cell);
+            double start = Now();
+            collision.solveConstraint();
+            const double sdfStepMs = (Now() - start) * 1e3;
+
+            // the same push from a closest point query per body, signed by the side of its face
+            vector<Vector3f> moved(points.begin(), points.begin() + kNumBodies);
+            start = Now();
+            for (Vector3f &p : moved)
+            {
+                ClosestPointHit hit;
+                tree.ClosestPoint(p, numeric_limits<float>::max(), hit);
+
+                const unsigned *face = &mesh.mIndices[hit.mFaceIndex * 3];
+                const Vector3f normal = (mesh.mVertices[face[1]] - mesh.mVertices[face[0]]).cross(mesh.mVertices[face[2]] - mesh.mVertices[face[0]]);
+                const float sign = (p - hit.mPoint).dot(normal) < 0.0f ? -1.0f : 1.0f;
+
+                const float d = sign * hit.mDistance - 0.5f * cell;
+                const Vector3f out = sign * (p - hit.mPoint);
+                if (d < 0.0f)
+                    p += out.norm() > 0.0f ? -d / out.norm() * out : -d * normal.normalized();
+            }
+            const double meshStepMs = (Now() - start) * 1e3;
+
+            printf("  %4u^3 %9.0f %11.1f %11.0f %12.3f %7u %13.2f %14.2f\n", size, buildMs, sdf->GetMemoryUsage() / kMegabyte,
+                   lookupMs * 1e6 / kNumPoints, error / kNumPoints / cell, flips, sdfStepMs, meshStepMs);
+        }
+    }
+} // namespace
+
+int main(int argc, char **argv)
+{
+#ifdef PIRATEPHYSICS_DATA_DIR
+    string dataDir = PIRATEPHYSICS_DATA_DIR;
+#else
+    string dataDir = "data";
+#endif
+    if (argc > 1)
+        dataDir = argv[1];
+
+    const unsigned gridSize = argc > 2 ? unsigned(atoi(argv[2])) : 256;
+    const unsigned largeGridSize = argc > 3 ? unsigned(atoi(argv[3])) : 1024;
+
+    bool passed = true;
+    unsigned numMeshes = 0;
+
+    for (const char *name : {"teapot", "Dragon"})
+    {
+        Mesh mesh;
+        if (!LoadMesh(dataDir + "/" + name + ".obj", name, mesh))
+            continue;
+
+        ++numMeshes;
+
+        // a margin of a few cells so no face lies on the boundary of the grid
+        Vector3f lower, upper;
+        GetBounds(mesh, lower, upper);
+        const Vector3f margin = 0.05f * (upper - lower);
+        lower -= margin;
+        upper += margin;
+
+        const AABBTree tree(mesh.mVertices.data(), mesh.GetNumVertices(), mesh.mIndices.data(), mesh.GetNumFaces(),
+                            AABBTree::BuildMode::SAH);
+
+        passed &= CheckClipped(mesh, tree, kClippedGridSize, lower, upper);
+
+        BenchThreads(mesh, tree, gridSize, lower, upper);
+        BenchBuildModes(mesh, gridSize, lower, upper);
+        BenchVolumes(mesh, tree, gridSize, lower, upper);
+        BenchSparse(mesh, tree, largeGridSize, lower, upper);
+        BenchRaster(mesh, tree, gridSize, lower, upper);
+        BenchSlabs(mesh, tree, largeGridSize, lower, upper);
+        BenchSignedDistance(mesh, tree, gridSize);
+    }
+
+    if (numMeshes == 0)
+    {
+        fprintf(stderr, "no meshes found in %s\n", dataDir.c_str());
+        return EXIT_FAILURE;
+    }
+
+    return passed ? EXIT_SUCCESS : EXIT_FAILURE;
+}